@@ -890,6 +890,88 @@ avl_destroy (struct avl_table *tree, avl_item_func *destroy)
   tree->avl_alloc->libavl_free (tree->avl_alloc, tree);
 }
 
+/* Frees nodes of subtree |node| built by |avl_build()|. */
+static void
+build_error_recovery (struct avl_table *tree, struct avl_node *node)
+{
+  if (node == NULL)
+    return;
+
+  build_error_recovery (tree, node->avl_link[0]);
+  build_error_recovery (tree, node->avl_link[1]);
+  tree->avl_alloc->libavl_free (tree->avl_alloc, node);
+}
+
+/* Builds balanced subtree of |count| items of |items|.
+   Stores its height in |*height|.
+   Returns the root, or |NULL| with |*height| set to -1
+   if memory allocation failed. */
+static struct avl_node *
+build_subtree (struct avl_table *tree, void **items, size_t count,
+               int *height)
+{
+  struct avl_node *node;
+  int left_height, right_height;
+  size_t middle = count / 2;
+
+  *height = 0;
+  if (count == 0)
+    return NULL;
+
+  node = (struct avl_node *)tree->avl_alloc->libavl_malloc (tree->avl_alloc,
+                                                        sizeof *node);
+  if (node == NULL)
+    {
+      *height = -1;
+      return NULL;
+    }
+
+  node->avl_data = items[middle];
+  node->avl_link[0] = build_subtree (tree, items, middle, &left_height);
+  node->avl_link[1] = build_subtree (tree, items + middle + 1,
+                                     count - middle - 1, &right_height);
+  if (left_height < 0 || right_height < 0)
+    {
+      build_error_recovery (tree, node->avl_link[0]);
+      build_error_recovery (tree, node->avl_link[1]);
+      tree->avl_alloc->libavl_free (tree->avl_alloc, node);
+      *height = -1;
+      return NULL;
+    }
+
+  /* Left subtree has the same or one more item, so heights
+     differ at most by one. */
+  node->avl_balance = right_height - left_height;
+  *height = (left_height > right_height ? left_height : right_height) + 1;
+
+  return node;
+}
+
+/* Fills empty |tree| with |count| items of |items|,
+   which must be sorted in order of |tree|'s comparison function
+   without duplicates. No comparisons are made.
+   Returns 0 on success, -1 if |tree| is not empty
+   or memory allocation failed. */
+int
+avl_build (struct avl_table *tree, void **items, size_t count)
+{
+  int height;
+
+  assert (tree != NULL && (items != NULL || count == 0));
+
+  if (tree->avl_root != NULL)
+    return -1;
+
+  tree->avl_root = build_subtree (tree, items, count, &height);
+  if (height < 0)
+    return -1;
+
+  tree->avl_count = count;
+  tree->avl_generation++;
+
+  return 0;
+}
+
 /* Allocates |size| bytes of space using |malloc()|.
    Returns a null pointer if allocation fails. */
 void *
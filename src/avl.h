@@ -94,6 +94,7 @@ struct avl_table *avl_create (avl_comparison_func *, void *,
 struct avl_table *avl_copy (const struct avl_table *, avl_copy_func *,
                             avl_item_func *, struct libavl_allocator *);
 void avl_destroy (struct avl_table *, avl_item_func *);
+int avl_build (struct avl_table *, void **, size_t);
 void **avl_probe (struct avl_table *, void *);
 void *avl_insert (struct avl_table *, void *);
 void *avl_replace (struct avl_table *, void *);
@@ -8,6 +8,7 @@
 #include <sys/un.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
 
 #include "common.h"
 #include "socket_operations.h"
@@ -17,6 +18,8 @@
 static int init_message(int argc, char *argv[],struct s_message *msg)
 {
         struct s_command *cmd = &msg->cmd;
+        const char *end = "";
+        uint32_t limit = 0;
 
         memset(msg, 0, sizeof(struct s_message));
 
@@ -34,6 +37,10 @@ static int init_message(int argc, char *argv[],struct s_message *msg)
                 cmd->type = DB_CMD_ERASE;
         else if (strcmp(argv[1], "list") == 0)
                 cmd->type = DB_CMD_LIST;
+        else if (strcmp(argv[1], "scan") == 0)
+                cmd->type = DB_CMD_SCAN;
+        else if (strcmp(argv[1], "reshard") == 0)
+                cmd->type = DB_CMD_RESHARD;
 
         if (cmd->type == -1) {
                 errno = EINVAL;
@@ -63,6 +70,31 @@ static int init_message(int argc, char *argv[],struct s_message *msg)
                 break;
         case DB_CMD_LIST:
                 break;
+        case DB_CMD_SCAN:
+                /* Bounds go without the terminating zero of keys */
+                if (argc < 3)
+                {
+                        errno = EINVAL;
+                        perror("Too few arguments");
+                        return -1;
+                }
+                if (argc > 3)
+                        end = argv[3];
+                if (argc > 4)
+                        limit = strtoul(argv[4], NULL, 10);
+                cmd->key_size = strlen(argv[2]);
+                cmd->val_size = DB_SCAN_LIMIT_SIZE + strlen(end);
+                break;
+        case DB_CMD_RESHARD:
+                if (argc < 3)
+                {
+                        errno = EINVAL;
+                        perror("Too few arguments");
+                        return -1;
+                }
+                limit = strtoul(argv[2], NULL, 10);
+                cmd->val_size = DB_RESHARD_SIZE;
+                break;
         default:
                 break;
         }
@@ -82,7 +114,15 @@ static int init_message(int argc, char *argv[],struct s_message *msg)
                 if (msg->val == NULL)
                         goto alloc_error;
 
-                memcpy(msg->val, argv[3], cmd->val_size);
+                if (cmd->type == DB_CMD_SCAN ||
+                                cmd->type == DB_CMD_RESHARD) {
+                        limit = htonl(limit);
+                        memcpy(msg->val, &limit, DB_SCAN_LIMIT_SIZE);
+                        memcpy(&msg->val[DB_SCAN_LIMIT_SIZE], end,
+                               cmd->val_size - DB_SCAN_LIMIT_SIZE);
+                } else {
+                        memcpy(msg->val, argv[3], cmd->val_size);
+                }
         }
 
         return 0;
@@ -115,7 +155,13 @@ static void process_response(struct s_message *resp, void *arg)
                 return;
 
         if (resp->cmd.val_size && resp->val) {
-                printf("%s\n", resp->val);
+                if (resp->key != NULL)
+                        printf("%.*s %.*s\n", (int)resp->cmd.key_size,
+                               resp->key, (int)resp->cmd.val_size, resp->val);
+                else
+                        printf("%s\n", resp->val);
+                free(resp->key);
+                resp->key = NULL;
                 free(resp->val);
                 resp->val = NULL;
         } else {
@@ -7,14 +7,34 @@
  * @brief Common structs for client and server.
  */
 
+#include "db_hash.h"
+
 enum DB_CMD_TYPE {
         DB_CMD_PUT,     /**< Put key value      */
         DB_CMD_GET,     /**< Get value by key   */
         DB_CMD_ERASE,   /**< Erase value by key */
         DB_CMD_LIST,    /**< Get list of all values */
-        DB_CMD_RESP     /**< Server resonse command */
+        DB_CMD_RESP,    /**< Server resonse command */
+        DB_CMD_SCAN,    /**< Get keys and values of the key range */
+        DB_CMD_RESHARD  /**< Change the count of node pairs */
 };
 
+/**
+ * SCAN key is the start of the range, empty to start from the first key.
+ * SCAN value is [u32 limit][end key], limit is big-endian, 0 for no limit.
+ * The end key is not included, empty to go up to the last key.
+ * Keys are in byte order, the shorter key goes first. Each pair is sent
+ * as the response with key and value, the empty response ends the scan.
+ */
+#define DB_SCAN_LIMIT_SIZE      sizeof(uint32_t)
+
+/**
+ * RESHARD has no key, its value is [u32 count], big-endian.
+ * The count is sent back as text, when resharding is started,
+ * otherwise the error text. The empty response ends the reply.
+ */
+#define DB_RESHARD_SIZE         sizeof(uint32_t)
+
 /**
  * @brief Command header for send.
  */
@@ -35,6 +55,8 @@ struct s_message {
         uint32_t key_len;       /**< Read key length            */
         uint32_t val_len;       /**< Read value length          */
         uint32_t cmd_len;       /**< Read cmd length            */
+        struct s_db_fp key_fp;  /**< Key fingerprint, for routing and lookup */
+        struct s_db_fp val_fp;  /**< PUT value fingerprint, hashed on read */
         int sd; /**< Socket descriptor */
 };
 
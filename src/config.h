@@ -9,13 +9,94 @@
 #define DB_SERVER_READERS_COUNT 4
 
 /**
-  * Count of writers thread.
+  * Count of writers thread, 0 for one writer per online CPU.
+  * Writers of different nodes do not wait for each other.
+  * Can be changed by -w option.
   */
-#define DB_SERVER_WRITERS_COUNT 2
+#define DB_SERVER_WRITERS_COUNT 0
 
 /**
-  * Count of database nodes.
+  * Count of database nodes of the new database, the stored count is kept.
+  * Can be changed by -n option.
   */
 #define DB_SERVER_NODES_COUNT   4
 
+/**
+  * Default durability mode, see enum DB_WAL_MODE.
+  * Can be changed by -d option.
+  */
+#define DB_SERVER_WAL_MODE      DB_WAL_INTERVAL
+
+/**
+  * Default WAL group commit interval in ms.
+  * Can be changed by -i option.
+  */
+#define DB_SERVER_WAL_INTERVAL_MS 10
+
+/**
+  * Default WAL size in MB, that triggers checkpoint.
+  * Can be changed by -c option.
+  */
+#define DB_SERVER_CHECKPOINT_MB 64
+
+/**
+  * Default node file backend, see enum DB_FILE_BACKEND.
+  * Can be changed by -b option.
+  */
+#define DB_SERVER_FILE_BACKEND  DB_FILE_BACKEND_PWRITE
+
+/**
+  * Default I/O budget of node file compaction in MB per second.
+  * Can be changed by -r option, 0 disables compaction.
+  */
+#define DB_SERVER_COMPACT_MB    8
+
+/**
+  * Default index of node file free space, see enum DB_FILE_ALLOCATOR.
+  * Can be changed by -a option.
+  */
+#define DB_SERVER_FILE_ALLOCATOR DB_FILE_ALLOCATOR_SEG
+
+/**
+  * Default max age of the WAL in seconds, that triggers checkpoint.
+  * Can be changed by -t option, 0 for checkpoint by size only.
+  */
+#define DB_SERVER_CHECKPOINT_SEC 60
+
+/**
+  * Write node snapshots for fast restart, 0 or 1.
+  * Can be changed by -s option.
+  */
+#define DB_SERVER_SNAPSHOT      1
+
+/**
+  * Default min size of value in KB, that is kept in the blob log.
+  * Can be changed by -v option, 0 to keep all values in the node files.
+  */
+#define DB_SERVER_BLOB_KB       64
+
+/**
+  * Default size of value in bytes, below which it is kept in the key record.
+  * Can be changed by -l option, 0 to keep all values in the value nodes.
+  */
+#define DB_SERVER_INLINE_SIZE   64
+
+/**
+  * Default memory budget of values of each node in MB.
+  * Can be changed by -m option, 0 to keep all values in memory.
+  */
+#define DB_SERVER_MEM_MB        0
+
+/**
+  * Default bits per key of the Bloom filter of each key node.
+  * Can be changed by -f option, 0 to look up missing keys under the lock.
+  */
+#define DB_SERVER_BLOOM_BITS    16
+
+/**
+  * Default count of threads of one LIST request.
+  * Can be changed by -p option, 1 to send all nodes by the reader thread.
+  */
+#define DB_SERVER_LIST_THREADS  4
+
 #endif /* CONFIG_H */
@@ -2,350 +2,3784 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 
 #include "db.h"
 #include "common.h"
 #include "db_node.h"
+#include "db_file.h"
+#include "db_wal.h"
+#include "db_epoch.h"
 #include "socket_operations.h"
 
+#define DB_WAL_FILE_NAME                "db_wal.txt"
+#define DB_DEFAULT_WAL_INTERVAL_MS      10
+#define DB_DEFAULT_CHECKPOINT_SIZE      (64 * 1024 * 1024)
+#define DB_DEFAULT_COMPACT_FREE_PCT     25
+#define DB_COMPACT_INTERVAL_MS          1000
+#define DB_COMPACT_STEP_MS              100
+#define DB_COMPACT_SCAN                 1024
+#define DB_COMPACT_RUN                  (4 * 1024)
+#define DB_COMPACT_RUN_ITEMS            256
+#define DB_DEFAULT_BLOB_SEGMENT_SIZE    (64 * 1024 * 1024)
+#define DB_DEFAULT_BLOB_GC_PCT          50
+#define DB_LIST_BUF_SIZE                (64 * 1024)
+#define DB_LIST_MAX_RUNNING             4
+#define DB_SHARDS_FILE_NAME             "db_shards.txt"
+#define DB_RESHARD_BATCH                64
+#define DB_RESHARD_SCAN                 1024
+
+struct s_db;
+
+/**
+ * @brief Shard map, keys and values are routed by it.
+ * The map is read without locks as one word.
+ */
+struct s_db_shards {
+        uint32_t version;       /**< Changed by each new map */
+        uint16_t count;         /**< Node pairs, where items go */
+        uint16_t old_count;     /**< Node pairs of the last map, keys are
+                                     looked up there, until they move */
+} __attribute__((aligned(8)));
+
+/**
+ * @brief Compactor of the one node pair.
+ */
+struct s_db_compact {
+        struct s_db *db;
+        uint32_t node_id;
+        int started;    /**< Thread was created */
+        pthread_t thread;
+};
+
+/**
+ * @brief The DB.
+ * Locks are taken in one order: snapshot_lock, nodes_lock, wal_lock,
+ * key nodes by id, value nodes by id. A value reference is dropped
+ * without the lock of the value node, see db_node_unref(), so PUT and
+ * ERASE hold at most one key node and one value node.
+ */
 struct s_db {
         void **key_nodes; /**< List of nodes for storing keys   */
         void **val_nodes; /**< List of nodes for storing values */
+        uint32_t node_count;      /**< Open node pairs, see db_reshard() */
+        struct s_db_shards shards;/**< Routing of keys and values */
+        pthread_rwlock_t nodes_lock; /**< LIST, SCAN - read,
+                                          change of node_count - write */
+        int nodes_lock_init;
+
+        struct s_db_options opts;
+        void *wal;                /**< Write-ahead log, NULL if disabled */
+        pthread_rwlock_t wal_lock;/**< Writers - read, checkpoint - write */
+        int wal_lock_init;
+
+        struct s_db_compact *compacts; /**< Compactor of each node */
+        pthread_mutex_t compact_lock;
+        pthread_cond_t  compact_cond;  /**< Wakes compactors to stop */
+        int compact_stop;
+
+        pid_t snapshot_pid;       /**< Snapshot writer process, 0 if none */
+        pthread_mutex_t snapshot_lock; /**< Taken before wal_lock */
+        int snapshot_lock_init;
+        int snapshot_loaded;      /**< Nodes were loaded from snapshots */
+
+        pthread_mutex_t reshard_lock;
+        pthread_cond_t reshard_cond; /**< Signals the end of resharding */
+        int reshard_lock_init;
+        int resharding;           /**< Keys or values are moved */
+        int reshard_stop;
+        uint32_t reshard_count;   /**< Node pairs of the new map */
+        uint32_t reshard_next;    /**< Node pairs of the next map, 0 if none */
+        int reshard_started;      /**< Thread was created */
+        pthread_t reshard_thread;
+
+        pthread_t *list_pool;     /**< Threads shared by LISTs */
+        uint32_t list_pool_count;
+        pthread_mutex_t list_lock;
+        pthread_cond_t list_cond; /**< Wakes pool threads and LISTs */
+        int list_lock_init;
+        struct s_db_list *list_queue; /**< LISTs, which take pool threads */
+        uint32_t list_running;    /**< LISTs at once, DB_LIST_MAX_RUNNING */
+        int list_stop;
+
+        int ready;                /**< Init is done */
+};
+
+/**
+ * @brief Key of the resharding batch.
+ */
+struct s_db_reshard_key {
+        uint8_t *data;
+        uint32_t size;
+        uint64_t fp[2];
+};
+
+/**
+ * @brief LIST request, its nodes are shared by threads.
+ */
+struct s_db_list {
+        struct s_db *db;
+        struct s_message *msg;
+        pthread_mutex_t send_lock; /**< Buffers go to the socket whole */
+        uint32_t next;             /**< Next node, value nodes go first */
+        struct s_db_list_part *parts; /**< The first one is the caller's */
+        uint32_t count;
+        uint32_t joined;           /**< Parts taken, under list_lock */
+        uint32_t active;           /**< Pool threads in it, under list_lock */
+        struct s_db_list *queue_next;
+};
+
+/**
+ * @brief Thread of the LIST, which buffers its responses.
+ */
+struct s_db_list_part {
+        struct s_db_list *list;
+        pthread_t thread;
+        uint8_t *buf;           /**< NULL, if each value is sent at once */
+        uint32_t len;
+};
+
+/**
+ * @brief Stored reference of the key item, resolved after loading.
+ */
+struct s_db_load_ref {
+        struct s_db_item *key_item;
+        uint32_t node_id;       /**< Value node id      */
+        uint64_t offset;        /**< Value file offset  */
+};
+
+/**
+ * @brief Load context of the one node.
+ */
+struct s_db_load {
+        void *node;
+        uint32_t node_id;
+        int is_key;
+        int snapshot;   /**< Load from the snapshot */
+        int rc;
+        int started;    /**< Thread was created */
+        pthread_t thread;
+        struct s_db_load_ref *refs;
+        uint32_t refs_count;
+        uint32_t refs_max;
+};
+
+/**
+ * @brief Snapshot index of the value item.
+ */
+struct s_db_snap_ref {
+        struct s_db_item *item;
+        uint64_t index;
+};
+
+/**
+ * @brief Value items of the one node, sorted by address.
+ */
+struct s_db_snap_map {
+        struct s_db_snap_ref *refs;
+        uint64_t count;
+        uint64_t max;           /**< Fixed before the write */
+        int overflow;           /**< Node has more values, than max */
+};
+
+/**
+ * @brief Snapshot write context, all is allocated before the write,
+ * so the child of fork() allocates nothing.
+ */
+struct s_db_snap {
+        struct s_db_snap_map *maps;
         uint32_t node_count;
+        char (*names)[64];      /**< Names of value nodes, then key nodes */
+        uint8_t *buf;           /**< Write buffer of nodes */
+};
+
+/**
+ * @brief Value of GET, copied out of the nodes.
+ */
+struct s_db_value {
+        uint8_t *data;  /**< Copy of the value, malloc'ed */
+        uint32_t size;
+        int send;       /**< Value response is sent */
 };
 
-static struct s_db *db = NULL;
+static struct s_db *db = NULL;
+
+/** Request of the thread is in the epoch, see db_process_message() */
+static __thread int db_request_epoch = 0;
+
+static int db_shards_load(uint32_t *count, uint32_t *old_count);
+static int db_shards_save(uint32_t count, uint32_t old_count);
+static struct s_db_shards db_shards_get(struct s_db *db);
+static int db_load(struct s_db *db);
+static uint64_t db_write_seq(struct s_db *db, void *node);
+static void db_request_leave(void);
+static void db_wait_writes(void *node, uint64_t seq);
+static int db_wal_open(struct s_db *db);
+static int db_compact_start(struct s_db *db);
+static void db_compact_stop(struct s_db *db);
+static int db_reshard_start(struct s_db *db, uint32_t count);
+static void db_reshard_stop(struct s_db *db);
+static void db_snapshot_start(struct s_db *db);
+static void db_snapshot_wait(struct s_db *db);
+static int db_snapshot_prepare(struct s_db *db, struct s_db_snap *snap);
+static void db_snapshot_free(struct s_db_snap *snap);
+static int db_snapshot_write(struct s_db *db, struct s_db_snap *snap);
+static void db_snapshot_drop(struct s_db *db);
+static int db_list_start(struct s_db *db);
+static void db_list_stop(struct s_db *db);
+
+void db_options_default(struct s_db_options *opts)
+{
+        if (opts == NULL)
+                return;
+
+        memset(opts, 0, sizeof(struct s_db_options));
+        opts->wal_mode = DB_WAL_NONE;
+        opts->wal_interval_ms = DB_DEFAULT_WAL_INTERVAL_MS;
+        opts->checkpoint_size = DB_DEFAULT_CHECKPOINT_SIZE;
+        opts->checkpoint_interval_ms = 0;
+        opts->snapshot = 0;
+        opts->file_backend = DB_FILE_BACKEND_PWRITE;
+        opts->map_chunk = DB_FILE_MAP_CHUNK;
+        opts->file_allocator = DB_FILE_ALLOCATOR_AVL;
+        opts->compact_rate = 0;
+        opts->compact_free_pct = DB_DEFAULT_COMPACT_FREE_PCT;
+        opts->blob_size = 0;
+        opts->blob_segment_size = DB_DEFAULT_BLOB_SEGMENT_SIZE;
+        opts->blob_gc_pct = DB_DEFAULT_BLOB_GC_PCT;
+        opts->inline_size = 0;
+        opts->mem_budget = 0;
+        opts->bloom_bits = 0;
+        opts->list_threads = 1;
+}
+
+int db_init(uint32_t node_count)
+{
+        return db_init_options(node_count, NULL);
+}
+
+/**
+ * @brief Value item the key item refers to, NULL if none.
+ */
+static struct s_db_item *db_ref_item(struct s_db *db,
+                                     struct s_db_item *key_item)
+{
+        if (key_item->ref == 0)
+                return NULL;
+
+        return db_node_item_of(db->val_nodes[key_item->ref_node_id],
+                               key_item->ref);
+}
+
+/**
+ * @brief Create key and value nodes of the given id.
+ */
+static int db_node_open(struct s_db *db, uint32_t i)
+{
+        char name[64];
+
+        sprintf(name, "db_key_node_%u.txt", i);
+        db->key_nodes[i] = db_node_init(name);
+
+        sprintf(name, "db_val_node_%u.txt", i);
+        db->val_nodes[i] = db_node_init(name);
+
+        if (db->key_nodes[i] == NULL || db->val_nodes[i] == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        /* Keys refer to values by node id and handle */
+        db_node_set_ref_nodes(db->key_nodes[i], db->val_nodes);
+
+        /* Log is opened anyway, values may be left there by last run */
+        sprintf(name, "db_blob_node_%u", i);
+        if (db_node_set_blob(db->val_nodes[i], name, db->opts.blob_size,
+                             db->opts.blob_segment_size) != 0)
+                return -1;
+
+        db_node_set_mem_budget(db->val_nodes[i], db->opts.mem_budget);
+
+        /* Values are looked up by fingerprint, data are seldom compared */
+        if (db_node_set_order(db->val_nodes[i], DB_NODE_ORDER_FP) != 0)
+                return -1;
+
+        /* Keys are in byte order for SCAN */
+        if (db_node_set_order(db->key_nodes[i], DB_NODE_ORDER_LEX) != 0)
+                return -1;
+
+        /* Missing keys are not looked up under the node lock */
+        if (db_node_set_bloom(db->key_nodes[i], db->opts.bloom_bits) != 0)
+                return -1;
+
+        if (db_node_set_backend(db->key_nodes[i], db->opts.file_backend,
+                                db->opts.map_chunk) != 0 ||
+                        db_node_set_backend(db->val_nodes[i],
+                                db->opts.file_backend,
+                                db->opts.map_chunk) != 0 ||
+                        db_node_set_allocator(db->key_nodes[i],
+                                db->opts.file_allocator) != 0 ||
+                        db_node_set_allocator(db->val_nodes[i],
+                                db->opts.file_allocator) != 0)
+                return -1;
+
+        return 0;
+}
+
+int db_init_options(uint32_t node_count, const struct s_db_options *opts)
+{
+        uint32_t count = 0;
+        uint32_t old_count = 0;
+        int i = 0;
+        if (node_count == 0 || node_count > DB_MAX_NODES) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (opts != NULL && (opts->wal_mode < DB_WAL_NONE ||
+                        opts->wal_mode > DB_WAL_SYNC ||
+                        opts->wal_interval_ms == 0 ||
+                        opts->compact_free_pct > 100 ||
+                        opts->blob_segment_size == 0 ||
+                        opts->blob_gc_pct > 100 ||
+                        (opts->file_backend != DB_FILE_BACKEND_PWRITE &&
+                         opts->file_backend != DB_FILE_BACKEND_MMAP &&
+                         opts->file_backend != DB_FILE_BACKEND_URING) ||
+                        (opts->file_allocator != DB_FILE_ALLOCATOR_AVL &&
+                         opts->file_allocator != DB_FILE_ALLOCATOR_SEG))) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        db = (struct s_db *)malloc(sizeof(struct s_db));
+        if (db == NULL) {
+                errno = ENOMEM;
+                goto exit_on_fail;
+        }
+
+        memset(db, 0, sizeof(struct s_db));
+
+        if (opts != NULL)
+                db->opts = *opts;
+        else
+                db_options_default(&db->opts);
+
+        /* Snapshot holds all values, evicted ones are out of it */
+        if (db->opts.mem_budget != 0)
+                db->opts.snapshot = 0;
+
+        if (pthread_rwlock_init(&db->wal_lock, NULL) != 0)
+                goto exit_on_fail;
+        db->wal_lock_init = 1;
+
+        if (pthread_mutex_init(&db->snapshot_lock, NULL) != 0)
+                goto exit_on_fail;
+        db->snapshot_lock_init = 1;
+
+        if (pthread_rwlock_init(&db->nodes_lock, NULL) != 0)
+                goto exit_on_fail;
+        db->nodes_lock_init = 1;
+
+        if (pthread_mutex_init(&db->reshard_lock, NULL) != 0)
+                goto exit_on_fail;
+        if (pthread_cond_init(&db->reshard_cond, NULL) != 0) {
+                pthread_mutex_destroy(&db->reshard_lock);
+                goto exit_on_fail;
+        }
+        db->reshard_lock_init = 1;
+
+        /* Stored map is loaded, the given count is taken in background */
+        if (db_shards_load(&count, &old_count) != 0) {
+                if (errno != ENOENT)
+                        goto exit_on_fail;
+
+                count = old_count = node_count;
+                if (db_shards_save(count, old_count) != 0)
+                        goto exit_on_fail;
+        }
+
+        db->shards.count = count;
+        db->shards.old_count = old_count;
+        db->node_count = (count > old_count) ? count : old_count;
+
+        /* Nodes are added in place, while requests are served */
+        db->key_nodes = (void **)calloc(DB_MAX_NODES, sizeof(void *));
+        db->val_nodes = (void **)calloc(DB_MAX_NODES, sizeof(void *));
+
+        if (db->key_nodes == NULL || db->val_nodes == NULL) {
+                errno = ENOMEM;
+                goto exit_on_fail;
+        }
+
+        for (i = 0; i < (int)db->node_count; i++) {
+                if (db_node_open(db, i) != 0)
+                        goto exit_on_fail;
+        }
+
+        if (db_load(db) != 0)
+                goto exit_on_fail;
+
+        if (db_wal_open(db) != 0)
+                goto exit_on_fail;
+
+        if (db_list_start(db) != 0)
+                goto exit_on_fail;
+
+        /* Interrupted resharding goes on, then the given count is taken */
+        if (count != old_count) {
+                db->reshard_count = count;
+                if (node_count != count)
+                        db->reshard_next = node_count;
+                if (db_reshard_start(db, 0) != 0)
+                        goto exit_on_fail;
+        } else if (node_count != count) {
+                if (db_reshard_start(db, node_count) != 0)
+                        goto exit_on_fail;
+        } else if (db_compact_start(db) != 0) {
+                goto exit_on_fail;
+        }
+
+        db->ready = 1;
+        return 0;
+
+exit_on_fail:
+        db_release();
+        return -1;
+}
+
+/**
+ * @brief Write items of all lazy nodes.
+ * Items moved by resharding are not logged, so nodes, where they go,
+ * are written before nodes, which they leave: values below the new
+ * count, then keys from the added nodes, then the other values.
+ */
+static int db_flush_nodes(struct s_db *db)
+{
+        struct s_db_shards shards = db_shards_get(db);
+        uint32_t start = 0;
+        uint32_t i = 0;
+
+        if (shards.count > shards.old_count)
+                start = shards.old_count;
+
+        for (i = 0; i < shards.count && i < db->node_count; i++) {
+                if (db_node_flush(db->val_nodes[i]) != 0)
+                        return -1;
+        }
+
+        for (i = 0; i < db->node_count; i++) {
+                if (db_node_flush(db->key_nodes[(start + i) %
+                                                db->node_count]) != 0)
+                        return -1;
+        }
+
+        for (i = shards.count; i < db->node_count; i++) {
+                if (db_node_flush(db->val_nodes[i]) != 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Write all nodes to the files and drop the log.
+ * Writers are blocked for the time of checkpoint, readers are not.
+ * Snapshots of the new node files are written by a child process.
+ */
+static int db_checkpoint_run(struct s_db *db)
+{
+        int rc = 0;
+
+        pthread_mutex_lock(&db->snapshot_lock);
+
+        /* Writers are not blocked, while the previous snapshot is written */
+        db_snapshot_wait(db);
+
+        pthread_rwlock_wrlock(&db->wal_lock);
+
+        /* Log must be complete, if checkpoint is interrupted by crash */
+        rc = db_wal_flush(db->wal);
+
+        /* Snapshot must not outlive the node files it describes */
+        if (rc == 0)
+                db_snapshot_drop(db);
+
+        if (rc == 0)
+                rc = db_flush_nodes(db);
+
+        if (rc == 0)
+                rc = db_wal_reset(db->wal);
+
+        if (rc == 0)
+                db_snapshot_start(db);
+        else
+                perror("DB checkpoint error");
+
+        pthread_rwlock_unlock(&db->wal_lock);
+        pthread_mutex_unlock(&db->snapshot_lock);
+
+        return rc;
+}
+
+static void db_checkpoint(void *arg)
+{
+        db_checkpoint_run((struct s_db *)arg);
+}
+
+/**
+ * @brief Print contention of node locks, summed over nodes.
+ */
+static void db_print_lock_stats(struct s_db *db)
+{
+        struct s_db_node_lock_stats total;
+        struct s_db_node_lock_stats stats;
+        uint32_t i = 0;
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < 2 * db->node_count; i++) {
+                db_node_get_lock_stats((i < db->node_count) ?
+                                       db->key_nodes[i] :
+                                       db->val_nodes[i - db->node_count],
+                                       &stats);
+                total.stripe_locks += stats.stripe_locks;
+                total.stripe_waits += stats.stripe_waits;
+                total.latch_locks += stats.latch_locks;
+                total.latch_waits += stats.latch_waits;
+        }
+
+        if (total.stripe_locks != 0)
+                printf("DB writers waited for %llu of %llu stripe locks, "
+                       "%llu of %llu latch locks\n",
+                       (unsigned long long)total.stripe_waits,
+                       (unsigned long long)total.stripe_locks,
+                       (unsigned long long)total.latch_waits,
+                       (unsigned long long)total.latch_locks);
+}
+
+void db_release(void)
+{
+        uint32_t i;
+
+        if (db == NULL)
+                return;
+
+        /* Stopped resharding is resumed on the next start */
+        db_reshard_stop(db);
+        db_compact_stop(db);
+        db_list_stop(db);
+
+        if (db->wal != NULL) {
+                db_checkpoint(db);
+                db_wal_release(db->wal);
+                db->wal = NULL;
+        } else if (db->ready && db->opts.snapshot) {
+                struct s_db_snap snap;
+
+                /* Nothing changes the nodes, write snapshots in place */
+                if (db_snapshot_prepare(db, &snap) != 0 ||
+                                db_snapshot_write(db, &snap) != 0)
+                        perror("DB snapshot error");
+                db_snapshot_free(&snap);
+        }
+
+        db_snapshot_wait(db);
+
+        if (db->snapshot_lock_init)
+                pthread_mutex_destroy(&db->snapshot_lock);
+
+        if (db->wal_lock_init)
+                pthread_rwlock_destroy(&db->wal_lock);
+
+        if (db->nodes_lock_init)
+                pthread_rwlock_destroy(&db->nodes_lock);
+
+        if (db->reshard_lock_init) {
+                pthread_cond_destroy(&db->reshard_cond);
+                pthread_mutex_destroy(&db->reshard_lock);
+        }
+
+        if (db->key_nodes != NULL && db->val_nodes != NULL) {
+                db_print_lock_stats(db);
+                for (i = 0; i < db->node_count; i++) {
+                        db_node_release(db->key_nodes[i]);
+                        db_node_release(db->val_nodes[i]);
+                }
+        }
+
+        if (db->key_nodes != NULL)
+                free(db->key_nodes);
+
+        if (db->val_nodes != NULL)
+                free(db->val_nodes);
+
+        free(db);
+        db = NULL;
+}
+
+static void db_snapshot_name(char *name, int is_key, uint32_t node_id)
+{
+        sprintf(name, "db_%s_node_%u.txt.snap", (is_key) ? "key" : "val", node_id);
+}
+
+/**
+ * @brief Keep snapshot index of the value item.
+ * Overflow is kept in the map and reported after the write.
+ */
+static uint64_t db_snapshot_val(void *arg, struct s_db_item *item,
+                                uint64_t index)
+{
+        struct s_db_snap_map *map = (struct s_db_snap_map *)arg;
+
+        if (map->count < map->max) {
+                map->refs[map->count].item = item;
+                map->refs[map->count].index = index;
+                map->count++;
+        } else {
+                map->overflow = 1;
+        }
+
+        return (uint64_t)__atomic_load_n(&item->ref_counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sift the ref down the heap of the given count.
+ */
+static void db_snapshot_sift(struct s_db_snap_ref *refs,
+                             uint64_t i, uint64_t count)
+{
+        struct s_db_snap_ref ref = refs[i];
+        uint64_t child = 0;
+
+        while ((child = 2 * i + 1) < count) {
+                if (child + 1 < count &&
+                                (uintptr_t)refs[child].item <
+                                (uintptr_t)refs[child + 1].item)
+                        child++;
+                if ((uintptr_t)refs[child].item <= (uintptr_t)ref.item)
+                        break;
+                refs[i] = refs[child];
+                i = child;
+        }
+
+        refs[i] = ref;
+}
+
+/**
+ * @brief Sort refs by item address in place, qsort() may allocate.
+ */
+static void db_snapshot_sort(struct s_db_snap_ref *refs, uint64_t count)
+{
+        struct s_db_snap_ref ref;
+        uint64_t i = count / 2;
+
+        while (i-- != 0)
+                db_snapshot_sift(refs, i, count);
+
+        for (i = count; i > 1; i--) {
+                ref = refs[0];
+                refs[0] = refs[i - 1];
+                refs[i - 1] = ref;
+                db_snapshot_sift(refs, 0, i - 1);
+        }
+}
+
+static int db_snapshot_ref_cmp(const void *a, const void *b)
+{
+        const struct s_db_snap_ref *ra = (const struct s_db_snap_ref *)a;
+        const struct s_db_snap_ref *rb = (const struct s_db_snap_ref *)b;
+
+        if ((uintptr_t)ra->item < (uintptr_t)rb->item) return -1;
+        if ((uintptr_t)ra->item > (uintptr_t)rb->item) return  1;
+
+        return 0;
+}
+
+/**
+ * @brief Store snapshot index of the value instead of its file offset.
+ */
+static uint64_t db_snapshot_key(void *arg, struct s_db_item *item,
+                                uint64_t index)
+{
+        struct s_db_snap *snap = (struct s_db_snap *)arg;
+        struct s_db_snap_ref key, *found = NULL;
+        (void)index;
+
+        if (item->ref_node_id >= snap->node_count)
+                return UINT64_MAX;
+
+        key.item = db_ref_item(db, item);
+        found = (struct s_db_snap_ref *)
+                bsearch(&key, snap->maps[item->ref_node_id].refs,
+                        snap->maps[item->ref_node_id].count,
+                        sizeof(key), db_snapshot_ref_cmp);
+
+        return (found != NULL) ? found->index : UINT64_MAX;
+}
+
+/**
+ * @brief Allocate all, what snapshots of the nodes need.
+ * Maps of values have room for the values of the node and some more,
+ * values may be added, until the write starts.
+ */
+static int db_snapshot_prepare(struct s_db *db, struct s_db_snap *snap)
+{
+        struct s_db_node_mem_stats stats;
+        uint64_t max = 0;
+        uint32_t i;
+
+        memset(snap, 0, sizeof(*snap));
+        snap->node_count = db->node_count;
+        snap->maps = (struct s_db_snap_map *)
+                calloc(db->node_count, sizeof(*snap->maps));
+        snap->names = (char (*)[64])calloc(2 * db->node_count,
+                                           sizeof(*snap->names));
+        snap->buf = (uint8_t *)malloc(DB_NODE_SNAP_BUF_SIZE);
+        if (snap->maps == NULL || snap->names == NULL || snap->buf == NULL)
+                goto exit_on_fail;
+
+        for (i = 0; i < db->node_count; i++) {
+                db_snapshot_name(snap->names[i], 0, i);
+                db_snapshot_name(snap->names[db->node_count + i], 1, i);
+
+                db_node_get_mem_stats(db->val_nodes[i], &stats);
+                max = stats.items + stats.items / 8 + 1024;
+                snap->maps[i].refs = (struct s_db_snap_ref *)
+                        malloc(max * sizeof(struct s_db_snap_ref));
+                if (snap->maps[i].refs == NULL)
+                        goto exit_on_fail;
+                snap->maps[i].max = max;
+        }
+
+        return 0;
+
+exit_on_fail:
+        errno = ENOMEM;
+        return -1;
+}
+
+static void db_snapshot_free(struct s_db_snap *snap)
+{
+        uint32_t i;
+
+        for (i = 0; snap->maps != NULL && i < snap->node_count; i++)
+                free(snap->maps[i].refs);
+        free(snap->maps);
+        free(snap->names);
+        free(snap->buf);
+        memset(snap, 0, sizeof(*snap));
+}
+
+/**
+ * @brief Write snapshots of all nodes.
+ * Value nodes go first, so keys refer to values by snapshot index.
+ * Nodes must not change, while snapshots are written. Nothing is
+ * allocated and no locks are taken, only files are written.
+ */
+static int db_snapshot_write(struct s_db *db, struct s_db_snap *snap)
+{
+        struct s_db_snap_map *map = NULL;
+        uint32_t i;
+        int rc = 0;
+
+        for (i = 0; rc == 0 && i < db->node_count; i++) {
+                map = &snap->maps[i];
+                rc = db_node_save_snapshot(db->val_nodes[i], snap->names[i],
+                                           db_snapshot_val, map, snap->buf);
+                if (rc == 0 && map->overflow) {
+                        errno = ENOMEM;
+                        rc = -1;
+                }
+
+                if (rc == 0)
+                        db_snapshot_sort(map->refs, map->count);
+        }
+
+        for (i = 0; rc == 0 && i < db->node_count; i++) {
+                rc = db_node_save_snapshot(db->key_nodes[i],
+                                           snap->names[db->node_count + i],
+                                           db_snapshot_key, snap, snap->buf);
+        }
+
+        return rc;
+}
+
+/**
+ * @brief Write snapshots by a child process.
+ * The child has a copy of the nodes at the moment of fork, so
+ * writers go on, while the snapshots are written. Other threads may hold
+ * locks of malloc or stdio at fork, so the child only walks nodes and
+ * calls write(), all is allocated by the parent.
+ * Called with wal_lock taken for writing, all nodes are flushed.
+ */
+static void db_snapshot_start(struct s_db *db)
+{
+        struct s_db_snap snap;
+        pid_t pid;
+
+        if (!db->opts.snapshot || db->snapshot_pid != 0)
+                return;
+
+        if (db_snapshot_prepare(db, &snap) != 0) {
+                perror("DB snapshot error");
+                db_snapshot_free(&snap);
+                return;
+        }
+
+        pid = fork();
+        if (pid == -1) {
+                perror("DB snapshot fork error");
+                db_snapshot_free(&snap);
+                return;
+        }
+
+        if (pid == 0)
+                _exit((db_snapshot_write(db, &snap) == 0) ? 0 : 1);
+
+        db_snapshot_free(&snap);
+        db->snapshot_pid = pid;
+}
+
+static void db_snapshot_wait(struct s_db *db)
+{
+        int status = 0;
+
+        if (db->snapshot_pid == 0)
+                return;
+
+        while (waitpid(db->snapshot_pid, &status, 0) == -1 && errno == EINTR);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                printf("%s: DB snapshot error\n", __FUNCTION__);
+
+        db->snapshot_pid = 0;
+}
+
+/**
+ * @brief Remove snapshots before the node files are changed.
+ * The directory is synced, so a crash does not bring them back.
+ */
+static void db_snapshot_drop(struct s_db *db)
+{
+        char name[64];
+        uint32_t i;
+        int dropped = 0;
+        int fd = -1;
+
+        for (i = 0; i < 2 * db->node_count; i++) {
+                db_snapshot_name(name, i < db->node_count, i % db->node_count);
+                if (unlink(name) == 0)
+                        dropped = 1;
+
+                strcat(name, ".new");
+                unlink(name);
+        }
+
+        if (!dropped)
+                return;
+
+        fd = open(".", O_RDONLY | O_DIRECTORY);
+        if (fd != -1) {
+                fsync(fd);
+                close(fd);
+        }
+}
+
+static int db_snapshot_exists(struct s_db *db)
+{
+        char name[64];
+        uint32_t i;
+
+        for (i = 0; i < 2 * db->node_count; i++) {
+                db_snapshot_name(name, i < db->node_count, i % db->node_count);
+                if (access(name, F_OK) != 0)
+                        return 0;
+        }
+
+        return 1;
+}
+
+/**
+ * @brief Get the node of the data by its fingerprint.
+ * Low bits of fp[0] pick the index slot, so fp[1] picks the node.
+ * Jump hash moves only the keys of added or removed nodes.
+ */
+static uint32_t db_get_node_id(uint32_t count, const uint64_t fp[2])
+{
+        return db_hash_jump(fp[1], count);
+}
+
+/**
+ * @brief Read the shard map left by previous run.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set, ENOENT for new database.
+ */
+static int db_shards_load(uint32_t *count, uint32_t *old_count)
+{
+        FILE *f = fopen(DB_SHARDS_FILE_NAME, "r");
+        int rc = 0;
+
+        if (f == NULL)
+                return -1;
+
+        if (fscanf(f, "%u %u", count, old_count) != 2 ||
+                        *count == 0 || *count > DB_MAX_NODES ||
+                        *old_count == 0 || *old_count > DB_MAX_NODES) {
+                printf("%s: DB shard map is broken\n", __FUNCTION__);
+                errno = EINVAL;
+                rc = -1;
+        }
+
+        fclose(f);
+        return rc;
+}
+
+/**
+ * @brief Store the shard map.
+ * The file is written under temporary name, synced and renamed.
+ */
+static int db_shards_save(uint32_t count, uint32_t old_count)
+{
+        char name[64];
+        char buf[32];
+        int len = sprintf(buf, "%u %u\n", count, old_count);
+        int fd = -1;
+
+        sprintf(name, "%s.new", DB_SHARDS_FILE_NAME);
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+        if (fd == -1)
+                return -1;
+
+        if (write(fd, buf, len) != len || fsync(fd) != 0) {
+                close(fd);
+                unlink(name);
+                return -1;
+        }
+        close(fd);
+
+        if (rename(name, DB_SHARDS_FILE_NAME) != 0) {
+                unlink(name);
+                return -1;
+        }
+
+        fd = open(".", O_RDONLY | O_DIRECTORY);
+        if (fd != -1) {
+                fsync(fd);
+                close(fd);
+        }
+
+        return 0;
+}
+
+static struct s_db_shards db_shards_get(struct s_db *db)
+{
+        struct s_db_shards shards;
+
+        __atomic_load(&db->shards, &shards, __ATOMIC_ACQUIRE);
+        return shards;
+}
+
+/**
+ * @brief Route requests by the new map.
+ * Returns after the grace period, so no request is routed by the
+ * previous map.
+ */
+static void db_shards_publish(struct s_db *db, uint32_t count,
+                              uint32_t old_count)
+{
+        struct s_db_shards shards = db_shards_get(db);
+        uint64_t tag = 0;
+
+        shards.version++;
+        shards.count = count;
+        shards.old_count = old_count;
+        __atomic_store(&db->shards, &shards, __ATOMIC_RELEASE);
+
+        tag = db_epoch_advance();
+        while (db_epoch_safe() <= tag)
+                usleep(1000);
+}
+
+static int db_load_ref(void *arg,
+                       struct s_db_item *item,
+                       uint32_t ref_node_id,
+                       uint64_t ref_offset)
+{
+        struct s_db_load *load = (struct s_db_load *)arg;
+        struct s_db_load_ref *ref = NULL;
+
+        if (load->refs_count == load->refs_max) {
+                uint32_t max = (load->refs_max) ? 2 * load->refs_max : 1024;
+                ref = (struct s_db_load_ref *)
+                        realloc(load->refs, max * sizeof(*ref));
+                if (ref == NULL) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+                load->refs = ref;
+                load->refs_max = max;
+        }
+
+        ref = &load->refs[load->refs_count++];
+        ref->key_item = item;
+        ref->node_id  = ref_node_id;
+        ref->offset   = ref_offset;
+
+        return 0;
+}
+
+/**
+ * @brief Keep offset of the duplicate value record.
+ * Keys may still refer to it, if compaction was interrupted.
+ */
+static int db_load_dup(void *arg, struct s_db_item *item, uint64_t offset)
+{
+        return db_load_ref(arg, item, 0, offset);
+}
+
+static void *db_load_thread(void *arg)
+{
+        struct s_db_load *load = (struct s_db_load *)arg;
+        char name[64];
+
+        /* Values are kept in order of the snapshot, keys refer to index */
+        if (load->snapshot) {
+                db_snapshot_name(name, load->is_key, load->node_id);
+                load->rc = db_node_load_snapshot(load->node, name,
+                                                 db_load_ref, load);
+                return NULL;
+        }
+
+        load->rc = db_node_load(load->node,
+                                (load->is_key) ? db_load_ref : NULL,
+                                (load->is_key) ? NULL : db_load_dup,
+                                load);
+        return NULL;
+}
+
+static int db_load_offset_cmp(const void *key, const void *elem)
+{
+        uint64_t offset = *(const uint64_t *)key;
+        const struct s_db_item *item = *(struct s_db_item * const *)elem;
+
+        if (offset < item->f_offset) return -1;
+        if (offset > item->f_offset) return  1;
+
+        return 0;
+}
+
+static int db_load_dup_cmp(const void *key, const void *elem)
+{
+        uint64_t offset = *(const uint64_t *)key;
+        const struct s_db_load_ref *dup = (const struct s_db_load_ref *)elem;
+
+        if (offset < dup->offset) return -1;
+        if (offset > dup->offset) return  1;
+
+        return 0;
+}
+
+/**
+ * @brief Link loaded keys with values.
+ * Value nodes are loaded in order of file offset, so the item
+ * with stored offset is found by binary search.
+ * Keys, which refer to a duplicate value record, are updated.
+ * Keys with broken reference and values without keys are removed.
+ */
+static int db_load_link(struct s_db *db, struct s_db_load *loads)
+{
+        struct s_db_item ***vals = NULL;
+        uint32_t *vals_count = NULL;
+        struct s_db_item *item = NULL;
+        struct s_db_item **found = NULL;
+        struct s_db_node_iterator iter;
+        void *it = NULL;
+        uint32_t i, j;
+        int rc = -1;
+
+        vals = (struct s_db_item ***)calloc(db->node_count, sizeof(*vals));
+        vals_count = (uint32_t *)calloc(db->node_count, sizeof(uint32_t));
+        if (vals == NULL || vals_count == NULL)
+                goto exit;
+
+        for (i = 0; i < db->node_count; i++) {
+                uint32_t count = 0;
+
+                it = db_node_get_iterator(db->val_nodes[i], &iter);
+                while (db_node_iterator_has_next(it)) {
+                        db_node_get_next(db->val_nodes[i], it);
+                        count++;
+                }
+
+                vals[i] = (struct s_db_item **)malloc((count + 1) * sizeof(**vals));
+                if (vals[i] == NULL)
+                        goto exit;
+
+                it = db_node_get_iterator(db->val_nodes[i], &iter);
+                while (db_node_iterator_has_next(it))
+                        vals[i][vals_count[i]++] =
+                                db_node_get_next(db->val_nodes[i], it);
+        }
+
+        for (i = 0; i < db->node_count; i++) {
+                struct s_db_load *load = &loads[i];
+
+                for (j = 0; j < load->refs_count; j++) {
+                        struct s_db_load_ref *ref = &load->refs[j];
+                        struct s_db_load *val_load = NULL;
+                        struct s_db_load_ref *dup = NULL;
+
+                        found = NULL;
+                        if (ref->node_id < db->node_count)
+                                found = (struct s_db_item **)
+                                        bsearch(&ref->offset,
+                                                vals[ref->node_id],
+                                                vals_count[ref->node_id],
+                                                sizeof(**vals),
+                                                db_load_offset_cmp);
+
+                        /* Duplicates are found in order of file offset too */
+                        if (found == NULL && ref->node_id < db->node_count) {
+                                val_load = &loads[db->node_count + ref->node_id];
+                                dup = (struct s_db_load_ref *)
+                                        bsearch(&ref->offset,
+                                                val_load->refs,
+                                                val_load->refs_count,
+                                                sizeof(*dup),
+                                                db_load_dup_cmp);
+                        }
+
+                        if (found == NULL && dup == NULL) {
+                                db_node_remove_item(load->node, ref->key_item);
+                                continue;
+                        }
+
+                        item = (found != NULL) ? *found : dup->key_item;
+                        db_node_set_ref(ref->key_item, ref->node_id, item);
+                        item->ref_counter++;
+
+                        if (dup != NULL && !db_node_need_rewrite(load->node))
+                                db_node_update_ref(load->node, ref->key_item);
+                }
+        }
+
+        for (i = 0; i < db->node_count; i++) {
+                for (j = 0; j < vals_count[i]; j++) {
+                        item = vals[i][j];
+                        if (item->ref_counter == 0)
+                                db_node_remove_item(db->val_nodes[i], item);
+                }
+        }
+
+        rc = 0;
+exit:
+        if (vals != NULL) {
+                for (i = 0; i < db->node_count; i++)
+                        free(vals[i]);
+                free(vals);
+        }
+        free(vals_count);
+
+        if (rc != 0)
+                errno = ENOMEM;
+
+        return rc;
+}
+
+/**
+ * @brief Link keys with values loaded from snapshots.
+ * Stored reference is the index of the value in its snapshot.
+ * Snapshot may keep values, whose last reference was dropped before
+ * their node was written again, they are removed.
+ */
+static int db_load_link_snapshot(struct s_db *db, struct s_db_load *loads)
+{
+        struct s_db_load *val_load = NULL;
+        struct s_db_load_ref *ref = NULL;
+        struct s_db_item *item = NULL;
+        uint32_t i, j;
+
+        for (i = 0; i < db->node_count; i++) {
+                for (j = 0; j < loads[i].refs_count; j++) {
+                        ref = &loads[i].refs[j];
+                        if (ref->node_id >= db->node_count)
+                                goto exit_on_fail;
+
+                        val_load = &loads[db->node_count + ref->node_id];
+                        if (ref->offset >= val_load->refs_count)
+                                goto exit_on_fail;
+
+                        item = val_load->refs[ref->offset].key_item;
+                        db_node_set_ref(ref->key_item, ref->node_id, item);
+                        item->ref_counter++;
+                }
+        }
+
+        for (i = 0; i < db->node_count; i++) {
+                val_load = &loads[db->node_count + i];
+                for (j = 0; j < val_load->refs_count; j++) {
+                        item = val_load->refs[j].key_item;
+                        if (item->ref_counter == 0)
+                                db_node_remove_item(val_load->node, item);
+                }
+        }
+
+        return 0;
+
+exit_on_fail:
+        errno = EINVAL;
+        return -1;
+}
+
+/**
+ * @brief Rewrite node files of the old format.
+ * Values get new offsets first, then keys are written with them.
+ * Each old file is kept until all new files are on the disk.
+ */
+static int db_load_upgrade(struct s_db *db)
+{
+        uint32_t i;
+        int need = 0;
+
+        for (i = 0; i < db->node_count; i++) {
+                if (db_node_need_rewrite(db->key_nodes[i]) ||
+                                db_node_need_rewrite(db->val_nodes[i]))
+                        need = 1;
+        }
+
+        if (!need)
+                return 0;
+
+        printf("DB upgrade node files to version %d\n", DB_FILE_VERSION);
+
+        for (i = 0; i < db->node_count; i++) {
+                if (db_node_rewrite(db->val_nodes[i]) != 0)
+                        return -1;
+        }
+
+        for (i = 0; i < db->node_count; i++) {
+                if (db_node_rewrite(db->key_nodes[i]) != 0)
+                        return -1;
+        }
+
+        for (i = 0; i < db->node_count; i++) {
+                if (db_node_rewrite_end(db->val_nodes[i]) != 0 ||
+                                db_node_rewrite_end(db->key_nodes[i]) != 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Restore nodes from snapshots or existing files.
+ * Each node is loaded by its own thread.
+ */
+static int db_load_nodes(struct s_db *db, int snapshot)
+{
+        struct s_db_load *loads = NULL;
+        struct timespec start, end;
+        uint64_t bytes = 0;
+        uint32_t count = 2 * db->node_count;
+        uint32_t i;
+        long ms = 0;
+        int rc = 0;
+
+        loads = (struct s_db_load *)calloc(count, sizeof(struct s_db_load));
+        if (loads == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* First half for key nodes, second half for value nodes */
+        for (i = 0; i < count; i++) {
+                struct s_db_load *load = &loads[i];
+                uint32_t node_id = i % db->node_count;
+
+                load->is_key = (i < db->node_count);
+                load->node = (load->is_key) ? db->key_nodes[node_id] :
+                                              db->val_nodes[node_id];
+                load->node_id = node_id;
+                load->snapshot = snapshot;
+                load->rc = -1;
+
+                if (pthread_create(&load->thread, NULL,
+                                   db_load_thread, load) == 0)
+                        load->started = 1;
+                else
+                        db_load_thread(load); /* Load in place */
+        }
+
+        for (i = 0; i < count; i++) {
+                if (loads[i].started)
+                        pthread_join(loads[i].thread, NULL);
+
+                if (loads[i].rc != 0)
+                        rc = -1;
+        }
+
+        if (rc == 0 && snapshot)
+                rc = db_load_link_snapshot(db, loads);
+        else if (rc == 0)
+                rc = db_load_link(db, loads);
+
+        if (rc == 0 && !snapshot)
+                rc = db_load_upgrade(db);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (i = 0; i < count; i++) {
+                struct s_db_node_iterator it;
+                char name[64];
+                struct stat st;
+
+                free(loads[i].refs);
+
+                /* Empty files have headers only */
+                if (!db_node_iterator_has_next(
+                                db_node_get_iterator(loads[i].node, &it)))
+                        continue;
+
+                sprintf(name, "db_%s_node_%u.txt%s",
+                        (loads[i].is_key) ? "key" : "val",
+                        i % db->node_count, (snapshot) ? ".snap" : "");
+                if (stat(name, &st) == 0)
+                        bytes += st.st_size;
+        }
+
+        free(loads);
+
+        ms  = (end.tv_sec - start.tv_sec) * 1000;
+        ms += (end.tv_nsec - start.tv_nsec) / 1000000;
+
+        if (rc != 0)
+                printf("%s: DB load error\n", __FUNCTION__);
+        else if (bytes != 0)
+                printf("DB loaded %llu bytes%s in %ld ms (%.1f s per GB)\n",
+                       (unsigned long long)bytes,
+                       (snapshot) ? " from snapshot" : "", ms,
+                       (ms / 1000.0) * (1 << 30) / bytes);
+
+        return rc;
+}
+
+/**
+ * @brief Drop the key item and its reference to the value.
+ */
+static void db_drop_key(struct s_db *db, void *key_node,
+                        struct s_db_item *key_item)
+{
+        struct s_db_item *val_item = db_ref_item(db, key_item);
+        uint32_t val_node_id = key_item->ref_node_id;
+
+        db_node_remove_item(key_node, key_item);
+        if (val_item != NULL)
+                db_node_unref(db->val_nodes[val_node_id], val_item);
+}
+
+/**
+ * @brief Move the key item to other key node, with its inline value
+ * or reference. The key is saved to the new node before it is removed
+ * from the old one, so it is never lost.
+ * Both nodes must be locked for write, unless the DB is loaded.
+ */
+static int db_move_key(struct s_db *db, uint32_t from, uint32_t to,
+                       struct s_db_item *key_item)
+{
+        void *from_node = db->key_nodes[from];
+        void *to_node = db->key_nodes[to];
+        struct s_db_item *item = NULL;
+        uint32_t size = key_item->size + key_item->inline_size;
+        uint8_t *data = NULL;
+
+        data = (uint8_t *)malloc(size);
+        if (data == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        /* Key items are not evicted */
+        memcpy(data, key_item->data, size);
+
+        /* Move was broken by crash, the saved copy is kept */
+        item = db_node_get_item_fp(to_node, data, key_item->size,
+                                   key_item->fp);
+        if (item != NULL) {
+                free(data);
+                db_drop_key(db, from_node, key_item);
+                return 0;
+        }
+
+        item = db_node_put_item_inline(to_node, data, key_item->size,
+                                       key_item->inline_size, key_item->fp);
+        if (item == NULL) {
+                free(data);
+                return -1;
+        }
+
+        db_node_set_ref(item, key_item->ref_node_id,
+                        db_ref_item(db, key_item));
+        db_node_save(to_node, item);
+        db_wait_writes(to_node, db_write_seq(db, to_node));
+
+        db_node_remove_item(from_node, key_item);
+        return 0;
+}
+
+/**
+ * @brief Move keys to the nodes, where they are routed now.
+ * Files of the old routing or of the interrupted resharding have keys in
+ * other nodes. Values stay, they are found by reference.
+ */
+static int db_load_rehome(struct s_db *db)
+{
+        struct s_db_node_iterator iter;
+        struct s_db_item *item = NULL;
+        uint32_t moved = 0;
+        uint32_t to = 0;
+        uint32_t i = 0;
+        void *it = NULL;
+
+        for (i = 0; i < db->node_count; i++) {
+                it = db_node_get_iterator(db->key_nodes[i], &iter);
+                while (db_node_iterator_has_next(it)) {
+                        item = db_node_get_next(db->key_nodes[i], it);
+                        to = db_get_node_id(db->shards.count, item->fp);
+                        if (to == i)
+                                continue;
+
+                        if (db_move_key(db, i, to, item) != 0)
+                                return -1;
+                        moved++;
+                }
+        }
+
+        if (moved == 0)
+                return 0;
+
+        /* Snapshots have the old places */
+        db_snapshot_drop(db);
+        db->snapshot_loaded = 0;
+
+        printf("DB moved %u keys to their nodes\n", moved);
+        return 0;
+}
+
+/**
+ * @brief Restore nodes.
+ * Snapshots are used, if all of them exist. If some snapshot is
+ * broken, the nodes are created again and node files are scanned.
+ */
+static int db_load(struct s_db *db)
+{
+        uint32_t i;
+
+        if (db->opts.snapshot && db_snapshot_exists(db)) {
+                if (db_load_nodes(db, 1) == 0) {
+                        db->snapshot_loaded = 1;
+                        return db_load_rehome(db);
+                }
+
+                printf("%s: DB snapshot is not used\n", __FUNCTION__);
+
+                for (i = 0; i < db->node_count; i++) {
+                        db_node_release(db->key_nodes[i]);
+                        db_node_release(db->val_nodes[i]);
+                        db->key_nodes[i] = NULL;
+                        db->val_nodes[i] = NULL;
+
+                        if (db_node_open(db, i) != 0)
+                                return -1;
+                }
+        }
+
+        /* Scan may fix the node files, snapshots get stale */
+        db_snapshot_drop(db);
+
+        if (db_load_nodes(db, 0) != 0)
+                return -1;
+
+        return db_load_rehome(db);
+}
+
+static void db_wal_replay_msg(void *arg,
+                              uint32_t type,
+                              const uint8_t *key,
+                              uint32_t key_size,
+                              const uint8_t *val,
+                              uint32_t val_size)
+{
+        struct s_message msg;
+        (void)arg;
+
+        if ((type != DB_CMD_PUT && type != DB_CMD_ERASE) || key_size == 0)
+                return;
+
+        if (type == DB_CMD_PUT && val_size == 0)
+                return;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.sd = -1;
+        msg.cmd.type = type;
+        msg.cmd.key_size = key_size;
+        msg.cmd.val_size = val_size;
+        msg.cmd.len = sizeof(msg.cmd) + key_size + val_size;
+
+        msg.key = (uint8_t *)malloc(key_size);
+        msg.val = (val_size) ? (uint8_t *)malloc(val_size) : NULL;
+        if (msg.key == NULL || (val_size && msg.val == NULL)) {
+                free(msg.key);
+                free(msg.val);
+                return;
+        }
+
+        memcpy(msg.key, key, key_size);
+        if (val_size)
+                memcpy(msg.val, val, val_size);
+
+        db_process_message(&msg);
+}
+
+/**
+ * @brief Replay log left by previous run and start logging.
+ * Replayed commands are written to the node files and the log is dropped.
+ */
+static int db_wal_open(struct s_db *db)
+{
+        void *wal = NULL;
+        uint32_t i = 0;
+        int count = 0;
+
+        /* db->wal is set later, so replayed commands are not logged again */
+        wal = db_wal_init(DB_WAL_FILE_NAME);
+        if (wal == NULL)
+                return -1;
+
+        /* Replayed commands change the node files */
+        if (db_wal_get_size(wal) != 0) {
+                db_snapshot_drop(db);
+                db->snapshot_loaded = 0;
+        }
+
+        count = db_wal_replay(wal, db_wal_replay_msg, db);
+        if (count < 0)
+                goto exit_on_fail;
+
+        if (db_flush_nodes(db) != 0)
+                goto exit_on_fail;
+
+        if (db_wal_reset(wal) != 0)
+                goto exit_on_fail;
+
+        if (count > 0)
+                printf("DB replayed %d WAL records\n", count);
+
+        if (db->opts.wal_mode == DB_WAL_NONE) {
+                /* Each command changes the node files, snapshots are
+                 * written on release */
+                db_snapshot_drop(db);
+                db_wal_release(wal);
+                unlink(DB_WAL_FILE_NAME);
+                return 0;
+        }
+
+        /* Nodes match the files, until the log thread is started */
+        if (!db->snapshot_loaded)
+                db_snapshot_start(db);
+
+        for (i = 0; i < db->node_count; i++) {
+                db_node_set_lazy(db->key_nodes[i], 1);
+                db_node_set_lazy(db->val_nodes[i], 1);
+        }
+
+        db->wal = wal;
+        if (db_wal_start(db->wal, db->opts.wal_mode,
+                         db->opts.wal_interval_ms,
+                         db->opts.checkpoint_size,
+                         db->opts.checkpoint_interval_ms,
+                         db_checkpoint, db) != 0) {
+                db->wal = NULL;
+                goto exit_on_fail;
+        }
+
+        return 0;
+
+exit_on_fail:
+        perror("DB WAL open error");
+        db_wal_release(wal);
+        return -1;
+}
+
+static uint64_t db_wal_log(struct s_db *db, struct s_message *msg)
+{
+        uint64_t lsn = 0;
+
+        if (db->wal == NULL)
+                return 0;
+
+        lsn = db_wal_append(db->wal, msg->cmd.type,
+                            msg->key, msg->cmd.key_size,
+                            msg->val, msg->cmd.val_size);
+        if (lsn == 0)
+                perror("DB WAL append error");
+
+        return lsn;
+}
+
+static void db_wal_lock(struct s_db *db)
+{
+        if (db->wal != NULL)
+                pthread_rwlock_rdlock(&db->wal_lock);
+}
+
+/**
+ * @brief Block writers, e.g. for the change of node count.
+ */
+static void db_wal_lock_write(struct s_db *db)
+{
+        if (db->wal != NULL)
+                pthread_rwlock_wrlock(&db->wal_lock);
+}
+
+static void db_wal_unlock_write(struct s_db *db)
+{
+        if (db->wal != NULL)
+                pthread_rwlock_unlock(&db->wal_lock);
+}
+
+static void db_wal_unlock(struct s_db *db)
+{
+        if (db->wal != NULL)
+                pthread_rwlock_unlock(&db->wal_lock);
+}
+
+/**
+ * @brief Wait for the log commit of the command, before the response.
+ * Called out of the WAL lock and out of the epoch of the request.
+ */
+static void db_wal_sync(struct s_db *db, uint64_t lsn)
+{
+        if (db->wal != NULL && lsn != 0 &&
+                        db_wal_commit(db->wal, lsn) != 0)
+                perror("DB WAL commit error");
+}
+
+/**
+ * @brief Get sequence number of the node writes to wait before response.
+ * Without WAL the command is acked after its node writes are done,
+ * with WAL the log commit is enough.
+ */
+static uint64_t db_write_seq(struct s_db *db, void *node)
+{
+        if (db->wal != NULL)
+                return 0;
+
+        return db_node_get_write_seq(node);
+}
+
+static void db_wait_writes(void *node, uint64_t seq)
+{
+        if (seq != 0 && db_node_wait_writes(node, seq) != 0)
+                perror("DB node write error");
+}
+
+/**
+ * @brief Sleep, until timeout or stop of compaction.
+ * @return Non-zero value, if compaction is stopped.
+ */
+static int db_compact_wait(struct s_db *db, uint64_t ns)
+{
+        struct timespec ts;
+        int stop = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ns += ts.tv_nsec;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+
+        pthread_mutex_lock(&db->compact_lock);
+        if (!db->compact_stop)
+                pthread_cond_timedwait(&db->compact_cond,
+                                       &db->compact_lock, &ts);
+        stop = db->compact_stop;
+        pthread_mutex_unlock(&db->compact_lock);
+
+        return stop;
+}
+
+/**
+ * @brief Keep keys, which refer to the values of the compaction pass.
+ * Key nodes are walked by short runs under the read lock, so writers
+ * wait for a run only. Keys changed meanwhile are kept by writers,
+ * see db_ref_value().
+ */
+static void db_compact_scan_refs(struct s_db *db, void *val_node,
+                                 uint32_t val_node_id)
+{
+        void *key_node = NULL;
+        uint32_t pos = 0;
+        uint32_t i = 0;
+
+        for (i = 0; i < db->node_count; i++) {
+                key_node = db->key_nodes[i];
+                pos = UINT32_MAX;
+
+                do {
+                        db_node_rdlock(key_node);
+                        db_node_compact_scan(key_node, val_node, val_node_id,
+                                             &pos, DB_COMPACT_SCAN);
+                        db_node_unlock(key_node);
+                } while (pos != 0);
+        }
+}
+
+static int db_compact_ref_cmp(const void *a, const void *b)
+{
+        const struct s_db_node_referrer *r1 =
+                (const struct s_db_node_referrer *)a;
+        const struct s_db_node_referrer *r2 =
+                (const struct s_db_node_referrer *)b;
+
+        if ((uintptr_t)r1->node < (uintptr_t)r2->node) return -1;
+        if ((uintptr_t)r1->node > (uintptr_t)r2->node) return  1;
+
+        return 0;
+}
+
+/**
+ * @brief Update key records, which refer to values moved by compaction.
+ * Moved values are pinned, so only stripes of their keys are locked,
+ * without the value node lock.
+ */
+static void db_compact_update_refs(struct s_db *db, void *val_node)
+{
+        struct s_db_node_referrer *refs = NULL;
+        struct s_db_item *key_item = NULL;
+        void *key_node = NULL;
+        uint64_t seq = 0;
+        uint32_t count = 0;
+        uint32_t i = 0;
+
+        /* New value records go first */
+        db_node_rdlock(val_node);
+        seq = db_write_seq(db, val_node);
+        db_node_unlock(val_node);
+        db_wait_writes(val_node, seq);
+
+        count = db_node_compact_take_refs(val_node, &refs);
+        qsort(refs, count, sizeof(*refs), db_compact_ref_cmp);
+
+        for (i = 0; i < count; i++) {
+                key_node = refs[i].node;
+
+                db_wal_lock(db);
+                db_node_wrlock_fp(key_node, refs[i].fp);
+
+                /* Key may be removed or refer to another value meanwhile */
+                key_item = db_node_find_item(key_node, refs[i].key,
+                                             refs[i].fp);
+                if (key_item != NULL &&
+                    db_ref_item(db, key_item) == refs[i].item)
+                        db_node_update_ref(key_node, key_item);
+
+                seq = db_write_seq(db, key_node);
+                db_node_unlock_fp(key_node, refs[i].fp);
+                db_wal_unlock(db);
+
+                /* Old value records are freed after the keys are written */
+                if (i + 1 == count || refs[i + 1].node != key_node)
+                        db_wait_writes(key_node, seq);
+        }
+}
+
+/**
+ * @brief Move records of the one step by short runs under the node lock,
+ * so small records do not keep writers waiting for the whole step.
+ * Moved values stay pinned until the end of the step.
+ * @return Count of moved bytes, zero at the end of the pass.
+ */
+static uint64_t db_compact_step(struct s_db *db, void *node, int is_val,
+                                uint64_t budget)
+{
+        uint64_t bytes = 0;
+        uint64_t run = 0;
+
+        do {
+                db_wal_lock(db);
+                db_node_wrlock(node);
+                run = db_node_compact_step(node,
+                                           (budget - bytes < DB_COMPACT_RUN) ?
+                                           budget - bytes : DB_COMPACT_RUN,
+                                           is_val);
+                db_node_unlock(node);
+                db_wal_unlock(db);
+
+                bytes += run;
+        } while (run != 0 && bytes < budget);
+
+        return bytes;
+}
+
+/**
+ * @brief Run compaction pass of the one node file.
+ * Records are moved by steps, each step is followed by sleep
+ * to keep writes within the I/O budget.
+ * @return Non-zero value, if compaction is stopped.
+ */
+static int db_compact_node(struct s_db *db, void *node, uint32_t node_id,
+                           int is_val)
+{
+        struct timespec start, end;
+        uint64_t budget = db->opts.compact_rate * DB_COMPACT_STEP_MS / 1000;
+        uint64_t total = 0;
+        uint64_t bytes = 0;
+        uint64_t ns = 0;
+        uint64_t spent = 0;
+        uint32_t left = 0;
+        int count = 0;
+        int stop = 0;
+
+        db_wal_lock(db);
+        db_node_wrlock(node);
+        count = db_node_compact_begin(node, db->opts.compact_free_pct);
+        db_node_unlock(node);
+        db_wal_unlock(db);
+
+        if (count <= 0)
+                return 0;
+
+        if (is_val)
+                db_compact_scan_refs(db, node, node_id);
+
+        if (budget == 0)
+                budget = 1;
+
+        do {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+
+                bytes = db_compact_step(db, node, is_val, budget);
+
+                if (is_val && bytes != 0) {
+                        db_compact_update_refs(db, node);
+
+                        do {
+                                db_wal_lock(db);
+                                db_node_wrlock(node);
+                                left = db_node_compact_release(node,
+                                                DB_COMPACT_RUN_ITEMS);
+                                db_node_unlock(node);
+                                db_wal_unlock(db);
+                        } while (left != 0);
+                }
+
+                total += bytes;
+
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                spent  = (end.tv_sec - start.tv_sec) * 1000000000ULL;
+                spent += end.tv_nsec - start.tv_nsec;
+
+                ns = bytes * 1000000000ULL / db->opts.compact_rate;
+                ns = (ns > spent) ? ns - spent : 0;
+
+                stop = db_compact_wait(db, ns);
+        } while (bytes != 0 && !stop);
+
+        db_wal_lock(db);
+        db_node_wrlock(node);
+        db_node_compact_end(node);
+        db_node_unlock(node);
+        db_wal_unlock(db);
+
+        if (total != 0)
+                printf("DB compaction moved %llu bytes of %s node\n",
+                       (unsigned long long)total, (is_val) ? "value" : "key");
+
+        return stop;
+}
+
+/**
+ * @brief Delete blob log segments without live values.
+ * With the log it is done by checkpoint, after the node files are written.
+ */
+static void db_blob_collect(struct s_db *db, void *node)
+{
+        uint64_t seq = 0;
+
+        if (db->wal != NULL)
+                return;
+
+        db_node_rdlock(node);
+        seq = db_write_seq(db, node);
+        db_node_unlock(node);
+        db_wait_writes(node, seq);
+
+        db_node_wrlock(node);
+        db_node_blob_collect(node);
+        db_node_unlock(node);
+}
+
+/**
+ * @brief Move live values out of sparse blob log segments.
+ * Moves are limited by the compaction I/O budget.
+ * @return Non-zero value, if compaction is stopped.
+ */
+static int db_blob_gc_node(struct s_db *db, void *node)
+{
+        struct timespec start, end;
+        uint64_t budget = db->opts.compact_rate * DB_COMPACT_STEP_MS / 1000;
+        uint64_t total = 0;
+        uint64_t bytes = 0;
+        uint64_t seq = 0;
+        uint64_t ns = 0;
+        uint64_t spent = 0;
+        int stop = 0;
+
+        if (budget == 0)
+                budget = 1;
+
+        do {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+
+                db_wal_lock(db);
+                db_node_wrlock(node);
+                bytes = db_node_blob_gc(node, budget, db->opts.blob_gc_pct);
+                seq = db_write_seq(db, node);
+                db_node_unlock(node);
+                db_wal_unlock(db);
+
+                /* Records are written in place, then old segment may go */
+                db_wait_writes(node, seq);
+                db_blob_collect(db, node);
+
+                total += bytes;
+
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                spent  = (end.tv_sec - start.tv_sec) * 1000000000ULL;
+                spent += end.tv_nsec - start.tv_nsec;
+
+                ns = bytes * 1000000000ULL / db->opts.compact_rate;
+                ns = (ns > spent) ? ns - spent : 0;
+
+                stop = db_compact_wait(db, ns);
+        } while (bytes != 0 && !stop);
+
+        if (total != 0)
+                printf("DB blob GC moved %llu bytes\n",
+                       (unsigned long long)total);
+
+        return stop;
+}
+
+static void *db_compact_thread(void *arg)
+{
+        struct s_db_compact *compact = (struct s_db_compact *)arg;
+        struct s_db *db = compact->db;
+        uint32_t id = compact->node_id;
+
+        do {
+                if (db_compact_node(db, db->key_nodes[id], id, 0) ||
+                                db_compact_node(db, db->val_nodes[id],
+                                                id, 1) ||
+                                db_blob_gc_node(db, db->val_nodes[id]))
+                        break;
+        } while (!db_compact_wait(db, DB_COMPACT_INTERVAL_MS * 1000000ULL));
+
+        return NULL;
+}
+
+/**
+ * @brief Start compactor thread for each node.
+ * Compaction is disabled by zero I/O budget.
+ */
+static int db_compact_start(struct s_db *db)
+{
+        pthread_condattr_t attr;
+        uint32_t i = 0;
+
+        if (db->opts.compact_rate == 0)
+                return 0;
+
+        db->compact_stop = 0;
+        db->compacts = (struct s_db_compact *)
+                calloc(db->node_count, sizeof(struct s_db_compact));
+        if (db->compacts == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        pthread_mutex_init(&db->compact_lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&db->compact_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        for (i = 0; i < db->node_count; i++) {
+                struct s_db_compact *compact = &db->compacts[i];
+
+                compact->db = db;
+                compact->node_id = i;
+                if (pthread_create(&compact->thread, NULL,
+                                   db_compact_thread, compact) != 0)
+                        return -1;
+                compact->started = 1;
+        }
+
+        return 0;
+}
+
+static void db_compact_stop(struct s_db *db)
+{
+        uint32_t i = 0;
+
+        if (db->compacts == NULL)
+                return;
+
+        pthread_mutex_lock(&db->compact_lock);
+        db->compact_stop = 1;
+        pthread_cond_broadcast(&db->compact_cond);
+        pthread_mutex_unlock(&db->compact_lock);
+
+        for (i = 0; i < db->node_count; i++) {
+                if (db->compacts[i].started)
+                        pthread_join(db->compacts[i].thread, NULL);
+        }
+
+        pthread_cond_destroy(&db->compact_cond);
+        pthread_mutex_destroy(&db->compact_lock);
+        free(db->compacts);
+        db->compacts = NULL;
+}
+
+static void db_send_pair(struct s_message *msg,
+                         uint8_t *key, uint32_t key_size,
+                         uint8_t *data, uint32_t size)
+{
+        struct s_message resp;
+        memset(&resp, 0, sizeof(resp));
+
+        if (msg->sd < 0)
+                return;
+
+        resp.cmd.type = DB_CMD_RESP;
+        resp.sd = msg->sd;
+        resp.key = key;
+        resp.cmd.key_size = key_size;
+        resp.val = data;
+        resp.cmd.val_size = size;
+
+        resp.cmd.len  = sizeof(resp.cmd);
+        resp.cmd.len += resp.cmd.key_size;
+        resp.cmd.len += resp.cmd.val_size;
+
+        if (socket_write(&resp) != (int)resp.cmd.len)
+                perror("Send response error");
+}
+
+static void db_send_data(struct s_message *msg, uint8_t *data, uint32_t size)
+{
+        db_send_pair(msg, NULL, 0, data, size);
+}
+
+/**
+ * @brief Copy the value data out of the node.
+ * @return On success, return zero, otherwise -1 is returned.
+ */
+static int db_value_copy(struct s_db_value *val,
+                         const uint8_t *data, uint32_t size)
+{
+        val->data = (uint8_t *)malloc((size) ? size : 1);
+        if (val->data == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        memcpy(val->data, data, size);
+        val->size = size;
+        val->send = 1;
+        return 0;
+}
+
+static void db_copy_response(struct s_db_value *val,
+                             void *val_node,
+                             struct s_db_item *val_item)
+{
+        uint8_t *data = NULL;
+        int is_copy = 0;
+
+        if (val_item == NULL) {
+                val->send = 1;
+                return;
+        }
+
+        /* Evicted value is read back */
+        data = db_node_get_data(val_node, val_item, &is_copy);
+        if (data == NULL) {
+                perror("DB value read error");
+                return;
+        }
+
+        if (!is_copy) {
+                if (db_value_copy(val, data, val_item->size) != 0)
+                        perror("DB value copy error");
+                return;
+        }
+
+        val->data = data;
+        val->size = val_item->size;
+        val->send = 1;
+}
+
+/**
+ * @brief Copy value of the key item, inline or referred.
+ * Node of the referred value must be locked for read.
+ */
+static void db_copy_value(struct s_db *db,
+                          struct s_db_value *val,
+                          struct s_db_item *key_item)
+{
+        if (key_item->inline_size != 0) {
+                if (db_value_copy(val, &key_item->data[key_item->size],
+                                  key_item->inline_size) != 0)
+                        perror("DB value copy error");
+        } else {
+                db_copy_response(val, db->val_nodes[key_item->ref_node_id],
+                                 db_ref_item(db, key_item));
+        }
+}
+
+/**
+ * @brief Copy value of the key without locks, in the epoch of the thread.
+ * @return 1 if the value is copied, 0 if there is no key, otherwise -1,
+ * the value is read under locks.
+ */
+static int db_get_value_unlocked(struct s_message *msg, void *key_node,
+                                 const uint64_t fp[2],
+                                 struct s_db_value *val)
+{
+        struct s_db_item *key_item = NULL;
+        uint8_t *data = NULL;
+        uint32_t size = 0;
+        int rc = -1;
+
+        if (db_epoch_enter() != 0)
+                return -1;
+
+        key_item = db_node_get_item_fp(key_node, msg->key, msg->cmd.key_size,
+                                       fp);
+        if (key_item == NULL)
+                rc = 0;
+        else if (db_node_peek_value(key_node, key_item, &data, &size) == 0)
+                rc = 1;
+
+        /* Retired data is not freed until the copy is done */
+        if (data != NULL && db_value_copy(val, data, size) != 0)
+                rc = -1;
+
+        db_epoch_exit();
+        return rc;
+}
+
+/**
+ * @brief Copy value of the key from the one key node.
+ * @return Non-zero value, if the key is found.
+ */
+static int db_get_node_value(struct s_db *db, struct s_message *msg,
+                             void *key_node, struct s_db_value *val)
+{
+        struct s_db_item *key_item = NULL;
+        void *val_node = NULL;
+        uint64_t *fp = msg->key_fp.h;
+        int rc = 0;
+
+        if (!db_node_may_have(key_node, fp))
+                return 0;
+
+        rc = db_get_value_unlocked(msg, key_node, fp, val);
+        if (rc >= 0)
+                return rc;
+
+        db_node_rdlock(key_node);
+
+        key_item = db_node_get_item_fp(key_node, msg->key, msg->cmd.key_size,
+                                       fp);
+
+        /* Value data may be dropped by writers of its node */
+        if (key_item != NULL && key_item->ref != 0) {
+                val_node = db->val_nodes[key_item->ref_node_id];
+                db_node_rdlock(val_node);
+        }
+
+        if (key_item != NULL)
+                db_copy_value(db, val, key_item);
+
+        if (val_node != NULL)
+                db_node_unlock(val_node);
+
+        db_node_unlock(key_node);
+
+        return key_item != NULL;
+}
+
+/**
+ * @brief Send value of the key.
+ * Key, which is not moved yet by resharding, is in its old node. Keys are
+ * saved to the new node before they leave the old one, so the old node
+ * is looked up first. The value is copied, so it is sent out of the epoch.
+ * @param old_node Key node of the previous shard map, NULL if the same.
+ */
+static void db_get_value(struct s_db *db, struct s_message *msg,
+                         void *key_node, void *old_node)
+{
+        struct s_db_value val;
+
+        memset(&val, 0, sizeof(val));
+
+        if (old_node == NULL || !db_get_node_value(db, msg, old_node, &val))
+                db_get_node_value(db, msg, key_node, &val);
+
+        db_request_leave();
+
+        if (val.send)
+                db_send_data(msg, val.data, val.size);
+        free(val.data);
+
+        free(msg->key);
+        msg->key = NULL;
+
+        db_send_data(msg, NULL, 0);
+}
+
+/**
+ * @brief Write all data, the socket may be non-blocking.
+ */
+static int db_write_all(int sd, const uint8_t *data, uint32_t size)
+{
+        struct pollfd pfd;
+        ssize_t n = 0;
+
+        pfd.fd = sd;
+        pfd.events = POLLOUT;
+
+        while (size != 0) {
+                n = write(sd, data, size);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        poll(&pfd, 1, -1);
+                        continue;
+                }
+                if (n <= 0)
+                        return -1;
+
+                data += n;
+                size -= n;
+        }
+
+        return 0;
+}
+
+static void db_list_flush(struct s_db_list_part *part)
+{
+        struct s_db_list *list = part->list;
+
+        if (part->len == 0)
+                return;
+
+        pthread_mutex_lock(&list->send_lock);
+        if (db_write_all(list->msg->sd, part->buf, part->len) != 0)
+                perror("Send response error");
+        pthread_mutex_unlock(&list->send_lock);
+
+        part->len = 0;
+}
+
+/**
+ * @brief Add the value response to the buffer of the thread.
+ * Larger values are sent by themselves.
+ */
+static void db_list_send(struct s_db_list_part *part,
+                         uint8_t *data, uint32_t size)
+{
+        struct s_db_list *list = part->list;
+        struct s_command cmd;
+
+        if (list->msg->sd < 0)
+                return;
+
+        if (part->len + sizeof(cmd) + size > DB_LIST_BUF_SIZE)
+                db_list_flush(part);
+
+        if (part->buf == NULL || sizeof(cmd) + size > DB_LIST_BUF_SIZE) {
+                pthread_mutex_lock(&list->send_lock);
+                db_send_data(list->msg, data, size);
+                pthread_mutex_unlock(&list->send_lock);
+                return;
+        }
+
+        cmd.type = DB_CMD_RESP;
+        cmd.len = sizeof(cmd) + size;
+        cmd.key_size = 0;
+        cmd.val_size = size;
+
+        memcpy(&part->buf[part->len], &cmd, sizeof(cmd));
+        memcpy(&part->buf[part->len + sizeof(cmd)], data, size);
+        part->len += sizeof(cmd) + size;
+}
+
+/**
+ * @brief Send values of the node, value nodes are given by ids below
+ * the node count, key nodes above it.
+ */
+static void db_list_node(struct s_db_list_part *part, uint32_t id)
+{
+        struct s_db *db = part->list->db;
+        struct s_db_node_iterator iter;
+        struct s_db_item *item = NULL;
+        uint8_t *data = NULL;
+        void *node = NULL;
+        void *it = NULL;
+        int is_key = (id >= db->node_count);
+        int is_copy = 0;
+
+        node = (is_key) ? db->key_nodes[id - db->node_count] :
+                          db->val_nodes[id];
+
+        db_node_rdlock(node);
+        it = db_node_get_iterator(node, &iter);
+        while (db_node_iterator_has_next(it)) {
+                item = db_node_get_next(node, it);
+
+                /* Inline values are not shared, each key sends its own */
+                if (is_key) {
+                        if (item->inline_size != 0)
+                                db_list_send(part, &item->data[item->size],
+                                             item->inline_size);
+                        continue;
+                }
+
+                /* Unreferenced value waits for the next node writer */
+                if (__atomic_load_n(&item->ref_counter, __ATOMIC_RELAXED) == 0)
+                        continue;
+
+                /* Evicted value is read back */
+                data = db_node_get_data(node, item, &is_copy);
+                if (data == NULL) {
+                        perror("DB value read error");
+                        continue;
+                }
+
+                db_list_send(part, data, item->size);
+                if (is_copy)
+                        free(data);
+        }
+        db_node_unlock(node);
+}
+
+static void *db_list_thread(void *arg)
+{
+        struct s_db_list_part *part = (struct s_db_list_part *)arg;
+        struct s_db_list *list = part->list;
+        uint32_t id = 0;
+
+        for (;;) {
+                id = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+                if (id >= 2 * list->db->node_count)
+                        break;
+                db_list_node(part, id);
+        }
+
+        db_list_flush(part);
+        return NULL;
+}
+
+/**
+ * @brief Thread of the pool, it takes parts of queued LISTs.
+ */
+static void *db_list_pool_thread(void *arg)
+{
+        struct s_db *db = (struct s_db *)arg;
+        struct s_db_list *list = NULL;
+        struct s_db_list_part *part = NULL;
+
+        pthread_mutex_lock(&db->list_lock);
+        for (;;) {
+                while (!db->list_stop && db->list_queue == NULL)
+                        pthread_cond_wait(&db->list_cond, &db->list_lock);
+                if (db->list_stop)
+                        break;
+
+                list = db->list_queue;
+                part = &list->parts[list->joined++];
+                list->active++;
+                if (list->joined == list->count)
+                        db->list_queue = list->queue_next;
+                pthread_mutex_unlock(&db->list_lock);
+
+                db_list_thread(part);
+
+                pthread_mutex_lock(&db->list_lock);
+                if (--list->active == 0)
+                        pthread_cond_broadcast(&db->list_cond);
+        }
+        pthread_mutex_unlock(&db->list_lock);
+
+        return NULL;
+}
+
+/**
+ * @brief Start list_threads - 1 threads, which are shared by all LISTs.
+ */
+static int db_list_start(struct s_db *db)
+{
+        uint32_t count = db->opts.list_threads;
+        int rc = 0;
+
+        if (pthread_mutex_init(&db->list_lock, NULL) != 0)
+                return -1;
+        if (pthread_cond_init(&db->list_cond, NULL) != 0) {
+                pthread_mutex_destroy(&db->list_lock);
+                return -1;
+        }
+        db->list_lock_init = 1;
+
+        if (count <= 1)
+                return 0;
+
+        db->list_pool = (pthread_t *)calloc(count - 1, sizeof(pthread_t));
+        if (db->list_pool == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        for (db->list_pool_count = 0; db->list_pool_count < count - 1;
+                        db->list_pool_count++) {
+                rc = pthread_create(&db->list_pool[db->list_pool_count], NULL,
+                                    db_list_pool_thread, db);
+                if (rc != 0) {
+                        errno = rc;
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static void db_list_stop(struct s_db *db)
+{
+        uint32_t i = 0;
+
+        if (!db->list_lock_init)
+                return;
+
+        pthread_mutex_lock(&db->list_lock);
+        db->list_stop = 1;
+        pthread_cond_broadcast(&db->list_cond);
+        pthread_mutex_unlock(&db->list_lock);
+
+        for (i = 0; i < db->list_pool_count; i++)
+                pthread_join(db->list_pool[i], NULL);
+
+        free(db->list_pool);
+        db->list_pool = NULL;
+        db->list_pool_count = 0;
+
+        pthread_cond_destroy(&db->list_cond);
+        pthread_mutex_destroy(&db->list_lock);
+        db->list_lock_init = 0;
+}
+
+/**
+ * @brief Take the LIST out of the queue of the pool.
+ * The list lock must be held.
+ */
+static void db_list_dequeue(struct s_db *db, struct s_db_list *list)
+{
+        struct s_db_list **p = &db->list_queue;
+
+        while (*p != NULL && *p != list)
+                p = &(*p)->queue_next;
+        if (*p != NULL)
+                *p = list->queue_next;
+}
+
+/**
+ * @brief Send all values.
+ * Nodes are shared by the caller and threads of the pool, up to
+ * list_threads in all. Each thread buffers its responses, so buffers of
+ * threads are merged into the socket and values of nodes come in no fixed
+ * order. At most DB_LIST_MAX_RUNNING LISTs run at once, others wait.
+ * Resharding does not move items, while the nodes are listed.
+ */
+static void db_get_all_values(struct s_db *db, struct s_message *msg)
+{
+        struct s_db_list list;
+        struct s_db_list **tail = NULL;
+        struct s_db_list_part one;
+        struct s_db_list_part *parts = NULL;
+        uint32_t count = db->list_pool_count + 1;
+        uint32_t i = 0;
+
+        pthread_mutex_lock(&db->list_lock);
+        while (db->list_running >= DB_LIST_MAX_RUNNING)
+                pthread_cond_wait(&db->list_cond, &db->list_lock);
+        db->list_running++;
+        pthread_mutex_unlock(&db->list_lock);
+
+        pthread_rwlock_rdlock(&db->nodes_lock);
+
+        if (count > 2 * db->node_count)
+                count = 2 * db->node_count;
+        if (count == 0)
+                count = 1;
+
+        memset(&list, 0, sizeof(list));
+        list.db = db;
+        list.msg = msg;
+        pthread_mutex_init(&list.send_lock, NULL);
+
+        parts = (struct s_db_list_part *)calloc(count, sizeof(*parts));
+        if (parts == NULL) {
+                memset(&one, 0, sizeof(one));
+                parts = &one;
+                count = 1;
+        }
+
+        for (i = 0; i < count; i++) {
+                parts[i].list = &list;
+                if (msg->sd >= 0)
+                        parts[i].buf = (uint8_t *)malloc(DB_LIST_BUF_SIZE);
+        }
+
+        list.parts = parts;
+        list.count = count;
+        list.joined = 1;
+
+        pthread_mutex_lock(&db->list_lock);
+        if (count > 1) {
+                for (tail = &db->list_queue; *tail != NULL;
+                                tail = &(*tail)->queue_next);
+                *tail = &list;
+                pthread_cond_broadcast(&db->list_cond);
+        }
+        pthread_mutex_unlock(&db->list_lock);
+
+        db_list_thread(&parts[0]);
+
+        /* Nodes are taken, threads, which have not joined, are not needed */
+        pthread_mutex_lock(&db->list_lock);
+        db_list_dequeue(db, &list);
+        while (list.active != 0)
+                pthread_cond_wait(&db->list_cond, &db->list_lock);
+        db->list_running--;
+        pthread_cond_broadcast(&db->list_cond);
+        pthread_mutex_unlock(&db->list_lock);
+
+        for (i = 0; i < count; i++)
+                free(parts[i].buf);
+        if (parts != &one)
+                free(parts);
+        pthread_mutex_destroy(&list.send_lock);
+
+        pthread_rwlock_unlock(&db->nodes_lock);
+
+        db_send_data(msg, NULL, 0);
+}
+
+/**
+ * @brief Forget inline value of the key item, the key data is kept.
+ * Readers without locks may still read the old data, it is retired.
+ */
+static void db_put_drop_inline(void *key_node, struct s_db_item *key_item)
+{
+        uint8_t *data = NULL;
+
+        key_item->inline_size = 0;
+
+        /* Arena data keeps its size class, embed has no other place */
+        if (key_item->flags & (DB_ITEM_ARENA | DB_ITEM_EMBED))
+                return;
+
+        data = (uint8_t *)malloc(key_item->size);
+        if (data == NULL)
+                return;
+
+        memcpy(data, key_item->data, key_item->size);
+        if (db_node_set_data(key_node, key_item, data) != 0)
+                free(data);
+}
+
+/**
+ * @brief Drop the reference to the value, its node is not locked.
+ * @param fp Fingerprint of the value, to lock its stripe.
+ * @return Node of the value, if no references are left, else NULL.
+ */
+static void *db_unref_value(struct s_db *db, uint32_t node_id,
+                            struct s_db_item *val_item, uint64_t fp[2])
+{
+        void *val_node = db->val_nodes[node_id];
+
+        if (val_item == NULL)
+                return NULL;
+
+        /* Item may be removed by other writer after the last reference */
+        fp[0] = val_item->fp[0];
+        fp[1] = val_item->fp[1];
+        if (db_node_unref(val_node, val_item) != 0)
+                return NULL;
+
+        return val_node;
+}
+
+/**
+ * @brief Remove values of the stripe left without references.
+ * Called by the writer, which dropped the last reference, after its key
+ * node is unlocked, so one node lock is held at once. The value may be
+ * removed already by another writer of the stripe.
+ */
+static void db_reclaim_value(struct s_db *db, void *val_node,
+                             const uint64_t fp[2])
+{
+        uint64_t seq = 0;
+
+        if (val_node == NULL)
+                return;
+
+        db_node_wrlock_fp(val_node, fp);
+        seq = db_write_seq(db, val_node);
+        db_node_unlock_fp(val_node, fp);
+
+        db_wait_writes(val_node, seq);
+}
+
+/**
+ * @brief Put value below the inline size.
+ * The value is kept after the key data, only the key node is written.
+ * Value item, which the key referred to, is released.
+ */
+static void db_put_inline(struct s_db *db,
+                          struct s_message *msg,
+                          void *key_node)
+{
+        struct s_db_item *key_item = NULL;
+        struct s_db_item *cur_val_item = NULL;
+        struct s_command *cmd = &msg->cmd;
+        void *cur_val_node = NULL;
+        uint8_t *data = NULL;
+        uint32_t cur_val_node_id = 0;
+        uint64_t cur_val_fp[2] = {0, 0};
+        uint64_t key_seq = 0;
+        uint64_t lsn = 0;
+
+        /* Failed PUT is not logged, so it is not replayed */
+        data = (uint8_t *)realloc(msg->key, cmd->key_size + cmd->val_size);
+        if (data == NULL)
+                goto reply;
+
+        msg->key = data;
+        memcpy(&data[cmd->key_size], msg->val, cmd->val_size);
+
+        db_wal_lock(db);
+        db_node_wrlock_fp(key_node, msg->key_fp.h);
+
+        key_item = db_node_get_item_fp(key_node, data, cmd->key_size,
+                                       msg->key_fp.h);
+        if (key_item == NULL) {
+                key_item = db_node_put_item_inline(key_node, data,
+                                                   cmd->key_size,
+                                                   cmd->val_size,
+                                                   msg->key_fp.h);
+                if (key_item != NULL) {
+                        /* Embedded data is freed by the put, log the copy */
+                        msg->key = key_item->data;
+                        lsn = db_wal_log(db, msg);
+                        msg->key = NULL;
+                        db_node_save(key_node, key_item);
+                }
+        } else if (key_item->inline_size != cmd->val_size ||
+                        memcmp(&key_item->data[key_item->size], msg->val,
+                               cmd->val_size) != 0) {
+                cur_val_item = db_ref_item(db, key_item);
+                cur_val_node_id = key_item->ref_node_id;
+
+                /* The same key data with the new value */
+                db_node_change_begin(key_item);
+                if (db_node_set_data(key_node, key_item, data) == 0) {
+                        lsn = db_wal_log(db, msg);
+                        db_node_set_ref(key_item, 0, NULL);
+                        key_item->inline_size = cmd->val_size;
+                        msg->key = NULL;
+                }
+                db_node_change_end(key_item);
+                if (msg->key != NULL)
+                        goto exit;
+
+                db_node_update(key_node, key_item);
+
+                cur_val_node = db_unref_value(db, cur_val_node_id,
+                                              cur_val_item, cur_val_fp);
+        }
+
+exit:
+        key_seq = db_write_seq(db, key_node);
+        db_node_unlock_fp(key_node, msg->key_fp.h);
+
+        db_reclaim_value(db, cur_val_node, cur_val_fp);
+        db_wal_unlock(db);
+
+        db_wait_writes(key_node, key_seq);
+reply:
+        db_request_leave();
+        db_wal_sync(db, lsn);
+
+        db_send_data(msg, NULL, 0);
+
+        free(msg->key);
+        msg->key = NULL;
+        free(msg->val);
+        msg->val = NULL;
+}
+
+/**
+ * @brief Take the reference of the key to the value.
+ * Compaction of the value node keeps the key, so only its record is
+ * updated, when the value is moved. Stripes of both must be locked.
+ */
+static void db_ref_value(void *key_node, struct s_db_item *key_item,
+                         void *val_node, struct s_db_item *val_item)
+{
+        db_node_ref(val_item);
+        db_node_compact_track(val_node, val_item, key_node, key_item);
+}
+
+/**
+ * @brief Point the key to another shared value.
+ * Key and new value nodes must be locked for write. The node of the old
+ * value is not locked, its reference is dropped atomically.
+ * @param fp Fingerprint of the old value.
+ * @return Node of the old value to reclaim, or NULL.
+ */
+static void *db_put_repoint(struct s_db *db,
+                           void *key_node,
+                           struct s_db_item *key_item,
+                           void *val_node,
+                           struct s_db_item *val_item,
+                           uint32_t val_node_id,
+                           uint64_t fp[2])
+{
+        struct s_db_item *cur_val_item = db_ref_item(db, key_item);
+        uint32_t cur_val_node_id = key_item->ref_node_id;
+
+        db_node_change_begin(key_item);
+        db_node_set_ref(key_item, val_node_id, val_item);
+        db_node_change_end(key_item);
+        db_ref_value(key_node, key_item, val_node, val_item);
+        db_node_update_ref(key_node, key_item);
+
+        return db_unref_value(db, cur_val_node_id, cur_val_item, fp);
+}
+
+static void db_put_value(struct s_db *db,
+                         struct s_message *msg,
+                         void *key_node,
+                         void *val_node,
+                         uint32_t val_node_id)
+{
+        struct s_db_item *key_item = NULL;
+        struct s_db_item *val_item = NULL;
+        struct s_command *cmd = &msg->cmd;
+        void *cur_val_node = NULL;
+        uint64_t cur_val_fp[2] = {0, 0};
+        uint64_t key_seq = 0;
+        uint64_t val_seq = 0;
+        uint64_t lsn = 0;
+
+        int free_msg_key = 0;
+        int free_msg_val = 0;
+
+        db_wal_lock(db);
+        db_node_wrlock_fp(key_node, msg->key_fp.h);
+        db_node_wrlock_fp(val_node, msg->val_fp.h);
+
+        lsn = db_wal_log(db, msg);
+
+        key_item = db_node_get_item_fp(key_node, msg->key, cmd->key_size,
+                                       msg->key_fp.h);
+        val_item = db_node_get_item_fp(val_node, msg->val, cmd->val_size,
+                                       msg->val_fp.h);
+
+        /*
+         * Three cases:
+         * 1. Key and value exist.
+         * 2. Key does NOT exist AND value does NOT exist.
+         * 3. Key exists AND value does NOT exist. Key refer to old value.
+         * 4. Key does NOT exist AND value exists.
+         * Key with inline value drops it for the shared one.
+         */
+
+        if (key_item != NULL && key_item->inline_size != 0) {
+                if (val_item == NULL) {
+                        val_item = db_node_put_item_fp(val_node, msg->val,
+                                                       cmd->val_size,
+                                                       msg->val_fp.h);
+                        if (val_item != NULL)
+                                db_node_save(val_node, val_item);
+                        else
+                                free_msg_val = 1;
+                } else {
+                        free_msg_val = 1;
+                }
+
+                if (val_item != NULL) {
+                        db_node_change_begin(key_item);
+                        db_put_drop_inline(key_node, key_item);
+                        db_node_set_ref(key_item, val_node_id, val_item);
+                        db_node_change_end(key_item);
+                        db_ref_value(key_node, key_item, val_node, val_item);
+                        db_node_update(key_node, key_item);
+                }
+                free_msg_key = 1;
+        } else if (key_item != NULL && val_item != NULL) {
+                if (db_ref_item(db, key_item) != val_item)
+                        cur_val_node = db_put_repoint(db, key_node, key_item,
+                                                      val_node, val_item,
+                                                      val_node_id,
+                                                      cur_val_fp);
+                free_msg_key = 1;
+                free_msg_val = 1;
+        } else  if (key_item == NULL && val_item == NULL) {
+                key_item = db_node_put_item_fp(key_node, msg->key,
+                                               cmd->key_size, msg->key_fp.h);
+                val_item = db_node_put_item_fp(val_node, msg->val,
+                                               cmd->val_size, msg->val_fp.h);
+
+                if (key_item != NULL && val_item != NULL) {
+                        db_node_change_begin(key_item);
+                        db_node_set_ref(key_item, val_node_id, val_item);
+                        db_node_change_end(key_item);
+                        db_ref_value(key_node, key_item, val_node, val_item);
+
+                        db_node_save(val_node, val_item);
+                        db_node_save(key_node, key_item);
+                } else {
+
+                        if (key_item != NULL)
+                                db_node_remove_item(key_node, key_item);
+                        else
+                                free_msg_key = 1;
+
+                        if (val_item != NULL)
+                                db_node_remove_item(val_node, val_item);
+                        else
+                                free_msg_val = 1;
+                }
+        } else if (key_item != NULL && val_item == NULL) {
+                val_item = db_node_put_item_fp(val_node, msg->val,
+                                               cmd->val_size, msg->val_fp.h);
+                if (val_item) {
+                        db_node_save(val_node, val_item);
+                        cur_val_node = db_put_repoint(db, key_node, key_item,
+                                                      val_node, val_item,
+                                                      val_node_id,
+                                                      cur_val_fp);
+                } else {
+                        free_msg_val = 1;
+                }
+                free_msg_key = 1;
+        } else if (key_item == NULL && val_item != NULL) {
+                key_item = db_node_put_item_fp(key_node, msg->key,
+                                               cmd->key_size, msg->key_fp.h);
+                if (key_item != NULL) {
+                        db_node_change_begin(key_item);
+                        db_node_set_ref(key_item, val_node_id, val_item);
+                        db_node_change_end(key_item);
+                        db_ref_value(key_node, key_item, val_node, val_item);
+                        db_node_save(key_node, key_item);
+                } else {
+                        free_msg_key = 1;
+                }
+                free_msg_val = 1;
+        }
+
+        val_seq = db_write_seq(db, val_node);
+        key_seq = db_write_seq(db, key_node);
+
+        db_node_unlock_fp(val_node, msg->val_fp.h);
+        db_node_unlock_fp(key_node, msg->key_fp.h);
+
+        db_reclaim_value(db, cur_val_node, cur_val_fp);
+        db_wal_unlock(db);
+
+        /* Node locks are not held while writes are in flight */
+        db_wait_writes(val_node, val_seq);
+        db_wait_writes(key_node, key_seq);
+
+        db_request_leave();
+        db_wal_sync(db, lsn);
+
+        db_send_data(msg, NULL, 0);
+
+        if (free_msg_key) {
+                free(msg->key);
+                msg->key = NULL;
+        }
+
+        if (free_msg_val) {
+                free(msg->val);
+                msg->val = NULL;
+        }
+}
+
+static void db_erase_value(struct s_db *db,
+                           struct s_message *msg,
+                           void *key_node)
+{
+        struct s_command *cmd = &msg->cmd;
+        struct s_db_item *key_item = NULL;
+        struct s_db_item *val_item = NULL;
+        void *val_node = NULL;
+        uint32_t val_node_id = 0;
+        uint64_t val_fp[2] = {0, 0};
+        uint64_t key_seq = 0;
+        uint64_t lsn = 0;
+        uint64_t *fp = msg->key_fp.h;
+
+        /* Nothing to erase, nothing to log */
+        if (!db_node_may_have(key_node, fp))
+                goto exit;
+
+        db_wal_lock(db);
+        db_node_wrlock_fp(key_node, fp);
+
+        lsn = db_wal_log(db, msg);
+
+        key_item = db_node_get_item_fp(key_node, msg->key, cmd->key_size, fp);
+        if (key_item != NULL && key_item->inline_size != 0) {
+                /* Inline value goes with the key */
+                db_node_remove_item(key_node, key_item);
+        } else if (key_item != NULL && key_item->ref != 0) {
+                /* Value node is not locked with the key node */
+                val_item = db_ref_item(db, key_item);
+                val_node_id = key_item->ref_node_id;
+
+                db_node_remove_item(key_node, key_item);
+                val_node = db_unref_value(db, val_node_id, val_item, val_fp);
+        }
+
+        key_seq = db_write_seq(db, key_node);
+        db_node_unlock_fp(key_node, fp);
+
+        db_reclaim_value(db, val_node, val_fp);
+        db_wal_unlock(db);
+
+        db_wait_writes(key_node, key_seq);
+exit:
+        db_request_leave();
+        db_wal_sync(db, lsn);
+
+        db_send_data(msg, NULL, 0);
+
+        free(msg->key);
+        msg->key = NULL;
+}
+
+/**
+ * @brief Send the key with its value.
+ * The key node must be locked for read.
+ */
+static void db_send_key_value(struct s_db *db,
+                              struct s_message *msg,
+                              struct s_db_item *key_item)
+{
+        struct s_db_item *val_item = NULL;
+        void *val_node = NULL;
+        uint8_t *data = NULL;
+        int is_copy = 0;
+
+        if (key_item->inline_size != 0) {
+                db_send_pair(msg, key_item->data, key_item->size,
+                             &key_item->data[key_item->size],
+                             key_item->inline_size);
+                return;
+        }
 
-int db_init(uint32_t node_count)
+        val_item = db_ref_item(db, key_item);
+        if (val_item == NULL)
+                return;
+
+        val_node = db->val_nodes[key_item->ref_node_id];
+        db_node_rdlock(val_node);
+
+        data = db_node_get_data(val_node, val_item, &is_copy);
+        if (data != NULL)
+                db_send_pair(msg, key_item->data, key_item->size,
+                             data, val_item->size);
+        else
+                perror("DB value read error");
+
+        db_node_unlock(val_node);
+
+        if (is_copy)
+                free(data);
+}
+
+static int db_scan_cmp(struct s_db_item *item, uint8_t *data, int size)
 {
-        int i = 0;
-        if (node_count == 0) {
-                errno = EINVAL;
-                return -1;
+        int min = (item->size < size) ? item->size : size;
+        int rc = memcmp(item->data, data, min);
+
+        if (rc != 0) return rc;
+        if (item->size < size) return -1;
+        if (item->size > size) return  1;
+
+        return 0;
+}
+
+/**
+ * @brief Send keys of the range with their values, in byte order.
+ * Keys are spread over nodes by hash, so the nodes are merged: each node
+ * keeps its next key of the range, the least of them is sent.
+ * Key nodes are locked in order of id, writers lock only one of them.
+ */
+static void db_scan(struct s_db *db, struct s_message *msg)
+{
+        struct s_command *cmd = &msg->cmd;
+        struct s_db_item **heads = NULL;
+        struct s_db_item *item = NULL;
+        uint8_t *end = NULL;
+        int end_size = 0;
+        uint32_t limit = 0;
+        uint32_t count = 0;
+        uint32_t min = 0;
+        uint32_t i = 0;
+
+        if (cmd->val_size < DB_SCAN_LIMIT_SIZE || msg->val == NULL)
+                goto exit;
+
+        memcpy(&limit, msg->val, sizeof(limit));
+        limit = ntohl(limit);
+        end = &msg->val[DB_SCAN_LIMIT_SIZE];
+        end_size = cmd->val_size - DB_SCAN_LIMIT_SIZE;
+
+        pthread_rwlock_rdlock(&db->nodes_lock);
+
+        heads = (struct s_db_item **)malloc(db->node_count * sizeof(*heads));
+        if (heads == NULL) {
+                pthread_rwlock_unlock(&db->nodes_lock);
+                perror("DB scan error");
+                goto exit;
         }
 
-        db = (struct s_db *)malloc(sizeof(struct s_db));
-        if (db == NULL) {
-                errno = ENOMEM;
-                goto exit_on_fail;
+        for (i = 0; i < db->node_count; i++) {
+                db_node_rdlock(db->key_nodes[i]);
+                heads[i] = db_node_seek(db->key_nodes[i],
+                                        (cmd->key_size) ? msg->key : NULL,
+                                        cmd->key_size);
         }
 
-        memset(db, 0, sizeof(struct s_db));
+        while (limit == 0 || count < limit) {
+                item = NULL;
+                for (i = 0; i < db->node_count; i++) {
+                        if (heads[i] == NULL)
+                                continue;
+                        if (item == NULL || db_scan_cmp(heads[i], item->data,
+                                                        item->size) < 0) {
+                                item = heads[i];
+                                min = i;
+                        }
+                }
 
-        db->node_count = node_count;
-        db->key_nodes = (void **)malloc(sizeof(void *) * db->node_count);
-        db->val_nodes = (void **)malloc(sizeof(void *) * db->node_count);
+                if (item == NULL || (end_size != 0 &&
+                                db_scan_cmp(item, end, end_size) >= 0))
+                        break;
 
-        if (db->key_nodes == NULL || db->val_nodes == NULL) {
-                errno = ENOMEM;
-                goto exit_on_fail;
+                db_send_key_value(db, msg, item);
+                heads[min] = db_node_get_successor(db->key_nodes[min], item);
+                count++;
         }
 
-        memset(db->key_nodes, 0, sizeof(void *) * db->node_count);
-        memset(db->val_nodes, 0, sizeof(void *) * db->node_count);
+        for (i = 0; i < db->node_count; i++)
+                db_node_unlock(db->key_nodes[i]);
 
-        for (i = 0; i < (int)db->node_count; i++) {
-                char name[64];
+        pthread_rwlock_unlock(&db->nodes_lock);
+exit:
+        free(heads);
+        free(msg->key);
+        msg->key = NULL;
+        free(msg->val);
+        msg->val = NULL;
 
-                sprintf(name, "db_key_node_%d.txt", i);
-                db->key_nodes[i] = db_node_init(name);
+        db_send_data(msg, NULL, 0);
+}
 
-                sprintf(name, "db_val_node_%d.txt", i);
-                db->val_nodes[i] = db_node_init(name);
+/**
+ * @brief Remove files of the node, left by the node count of the past.
+ */
+static void db_node_unlink(uint32_t node_id)
+{
+        struct dirent *entry = NULL;
+        char name[64];
+        DIR *dir = NULL;
+        int len = 0;
+        int i = 0;
 
-                if (db->key_nodes[i] == NULL || db->val_nodes[i] == NULL) {
-                        errno = ENOMEM;
-                        goto exit_on_fail;
-                }
+        for (i = 0; i < 2; i++) {
+                sprintf(name, "db_%s_node_%u.txt", (i) ? "key" : "val",
+                        node_id);
+                unlink(name);
+                db_snapshot_name(name, i, node_id);
+                unlink(name);
+                strcat(name, ".new");
+                unlink(name);
         }
-        return 0;
 
-exit_on_fail:
-        db_release();
-        return -1;
+        len = sprintf(name, "db_blob_node_%u.", node_id);
+        dir = opendir(".");
+        if (dir == NULL)
+                return;
+
+        while ((entry = readdir(dir)) != NULL) {
+                if (strncmp(entry->d_name, name, len) == 0)
+                        unlink(entry->d_name);
+        }
+        closedir(dir);
 }
 
+/**
+ * @brief Move the key to the node of the new map.
+ * Called by resharding and by writers of the key, before they change it.
+ */
+static int db_reshard_key(struct s_db *db, uint8_t *data, uint32_t size,
+                          const uint64_t fp[2], uint32_t from, uint32_t to)
+{
+        struct s_db_item *key_item = NULL;
+        void *from_node = db->key_nodes[from];
+        void *to_node = db->key_nodes[to];
+        uint64_t seq = 0;
+        int rc = 0;
+
+        if (!db_node_may_have(from_node, fp))
+                return 0;
+
+        /* Key nodes are locked in order of id */
+        db_wal_lock(db);
+        db_node_wrlock((from < to) ? from_node : to_node);
+        db_node_wrlock((from < to) ? to_node : from_node);
+
+        key_item = db_node_get_item_fp(from_node, data, size, fp);
+        if (key_item != NULL)
+                rc = db_move_key(db, from, to, key_item);
+
+        seq = db_write_seq(db, from_node);
+        db_node_unlock(to_node);
+        db_node_unlock(from_node);
+        db_wal_unlock(db);
+
+        db_wait_writes(from_node, seq);
+        return rc;
+}
 
-void db_release(void)
+/**
+ * @brief Move the value of the key from the removed node.
+ * The copy is saved before the key refers to it, and the key is saved
+ * before the old value is dropped, as by PUT.
+ */
+static int db_reshard_value(struct s_db *db, uint32_t node_id,
+                            struct s_db_reshard_key *key, uint32_t count)
 {
-        uint32_t i;
+        struct s_db_item *key_item = NULL;
+        struct s_db_item *old_item = NULL;
+        struct s_db_item *val_item = NULL;
+        void *key_node = db->key_nodes[node_id];
+        void *from_node = NULL;
+        void *to_node = NULL;
+        void *old_node = NULL;
+        uint8_t *data = NULL;
+        uint64_t old_fp[2] = {0, 0};
+        uint32_t from = 0;
+        uint32_t to = 0;
+        int is_copy = 0;
+        int rc = 0;
+
+        db_wal_lock(db);
+        db_node_wrlock(key_node);
 
-        if (db == NULL)
-                return;
-        if (db->key_nodes != NULL && db->val_nodes != NULL) {
-                for (i = 0; i < db->node_count; i++) {
-                        db_node_release(db->key_nodes[i]);
-                        db_node_release(db->val_nodes[i]);
+        key_item = db_node_get_item_fp(key_node, key->data, key->size,
+                                       key->fp);
+        if (key_item == NULL || key_item->ref == 0 ||
+                        key_item->ref_node_id < count)
+                goto exit;
+
+        old_item = db_ref_item(db, key_item);
+        from = key_item->ref_node_id;
+        from_node = db->val_nodes[from];
+        to = db_get_node_id(count, old_item->fp);
+        to_node = db->val_nodes[to];
+
+        /* Nodes by id, the old one is only read */
+        db_node_wrlock(to_node);
+        db_node_rdlock(from_node);
+
+        data = db_node_get_data(from_node, old_item, &is_copy);
+        if (data == NULL) {
+                rc = -1;
+                goto exit_unlock;
+        }
+
+        val_item = db_node_get_item_fp(to_node, data, old_item->size,
+                                       old_item->fp);
+        if (val_item == NULL) {
+                if (!is_copy) {
+                        uint8_t *copy = (uint8_t *)malloc(old_item->size);
+                        if (copy == NULL) {
+                                errno = ENOMEM;
+                                rc = -1;
+                                goto exit_unlock;
+                        }
+                        memcpy(copy, data, old_item->size);
+                        data = copy;
+                        is_copy = 1;
                 }
+
+                val_item = db_node_put_item_fp(to_node, data, old_item->size,
+                                               old_item->fp);
+                if (val_item == NULL) {
+                        rc = -1;
+                        goto exit_unlock;
+                }
+                is_copy = 0;
+
+                db_node_save(to_node, val_item);
+                db_wait_writes(to_node, db_write_seq(db, to_node));
         }
 
-        if (db->key_nodes != NULL)
-                free(db->key_nodes);
+        db_node_change_begin(key_item);
+        db_node_set_ref(key_item, to, val_item);
+        db_node_change_end(key_item);
+        db_node_ref(val_item);
+        db_node_update_ref(key_node, key_item);
+        db_wait_writes(key_node, db_write_seq(db, key_node));
+
+        old_node = db_unref_value(db, from, old_item, old_fp);
+
+exit_unlock:
+        if (is_copy)
+                free(data);
+        db_node_unlock(from_node);
+        db_node_unlock(to_node);
+exit:
+        db_node_unlock(key_node);
 
-        if (db->val_nodes != NULL)
-                free(db->val_nodes);
+        db_reclaim_value(db, old_node, old_fp);
+        db_wal_unlock(db);
 
-        free(db);
-        db = NULL;
+        return rc;
 }
 
-static uint32_t db_get_node_id(int max, uint8_t *data, uint32_t size)
+/**
+ * @brief Take the next keys of the node, which are to be moved, or whose
+ * values are to be moved.
+ * The number of items read is bounded, so the node lock is held for
+ * short time.
+ * @param next Key to start from, NULL data to start from the first key.
+ * It is set to the key of the next batch.
+ * @param done Set, if there are no more keys.
+ * @return Count of keys. On error, -1 is returned, and errno is set.
+ */
+static int db_reshard_batch(struct s_db *db, uint32_t node_id,
+                            uint32_t count,
+                            struct s_db_reshard_key *keys,
+                            struct s_db_reshard_key *next, int *done)
 {
-        uint8_t first = data[0];
-        uint8_t last  = (size > 2) ? data[size - 2] : first;
+        struct s_db_item *item = NULL;
+        void *node = db->key_nodes[node_id];
+        uint32_t scanned = 0;
+        int n = 0;
+
+        db_node_rdlock(node);
+
+        item = db_node_seek(node, next->data, next->size);
+        free(next->data);
+        next->data = NULL;
+
+        for (; item != NULL && n < DB_RESHARD_BATCH &&
+                        scanned < DB_RESHARD_SCAN; scanned++) {
+                if (db_get_node_id(count, item->fp) == node_id &&
+                                (item->ref == 0 ||
+                                 item->ref_node_id < count)) {
+                        item = db_node_get_successor(node, item);
+                        continue;
+                }
+
+                /* Key items are not evicted */
+                keys[n].data = (uint8_t *)malloc(item->size);
+                if (keys[n].data == NULL)
+                        break;
+
+                memcpy(keys[n].data, item->data, item->size);
+                keys[n].size = item->size;
+                keys[n].fp[0] = item->fp[0];
+                keys[n].fp[1] = item->fp[1];
+                n++;
+
+                item = db_node_get_successor(node, item);
+        }
+
+        *done = (item == NULL);
+        if (item != NULL) {
+                next->data = (uint8_t *)malloc(item->size);
+                if (next->data != NULL) {
+                        memcpy(next->data, item->data, item->size);
+                        next->size = item->size;
+                }
+        }
+
+        db_node_unlock(node);
+
+        if (!*done && next->data == NULL) {
+                while (n > 0)
+                        free(keys[--n].data);
+                errno = ENOMEM;
+                return -1;
+        }
 
-        return (first^last) % max;
+        return n;
 }
 
-static void db_send_response(struct s_message *msg, struct s_db_item *val_item)
+/**
+ * @brief Move keys of the node to the nodes of the new map, and values
+ * of its keys out of removed nodes.
+ * Batches are moved under the nodes lock, so LIST and SCAN see each
+ * item once. Writers wait for one key at most.
+ * @return On success, return zero, 1 if resharding is stopped.
+ * On error, -1 is returned, and errno is set.
+ */
+static int db_reshard_node(struct s_db *db, uint32_t node_id, uint32_t count)
 {
-        struct s_message resp;
-        memset(&resp, 0, sizeof(resp));
+        struct s_db_reshard_key keys[DB_RESHARD_BATCH];
+        struct s_db_reshard_key next;
+        uint32_t to = 0;
+        int done = 0;
+        int rc = 0;
+        int n = 0;
+        int i = 0;
 
-        if (msg->sd < 0)
-                return;
+        memset(&next, 0, sizeof(next));
 
-        resp.cmd.type = DB_CMD_RESP;
-        resp.sd = msg->sd;
-        resp.val = (val_item) ? val_item->data : NULL;
-        resp.cmd.val_size = (val_item) ? val_item->size : 0;
+        while (rc == 0 && !done) {
+                if (__atomic_load_n(&db->reshard_stop, __ATOMIC_RELAXED)) {
+                        rc = 1;
+                        break;
+                }
 
-        resp.cmd.len  = sizeof(resp.cmd);
-        resp.cmd.len += resp.cmd.val_size;
+                n = db_reshard_batch(db, node_id, count, keys, &next, &done);
+                if (n < 0)
+                        return -1;
+
+                pthread_rwlock_wrlock(&db->nodes_lock);
+                for (i = 0; i < n; i++) {
+                        to = db_get_node_id(count, keys[i].fp);
+                        if (rc == 0 && to != node_id)
+                                rc = db_reshard_key(db, keys[i].data,
+                                                    keys[i].size, keys[i].fp,
+                                                    node_id, to);
+                        if (rc == 0)
+                                rc = db_reshard_value(db, to, &keys[i],
+                                                      count);
+                        free(keys[i].data);
+                }
+                pthread_rwlock_unlock(&db->nodes_lock);
+        }
 
-        if (socket_write(&resp) != (int)resp.cmd.len)
-                perror("Send response error");
+        free(next.data);
+        return rc;
 }
 
-static void db_get_value(struct s_message *msg, void *key_node)
+/**
+ * @brief Open nodes of the new map and store it.
+ * Nodes of ids, which were used by the larger count, are created again.
+ */
+static int db_reshard_begin(struct s_db *db, uint32_t count)
 {
-        struct s_db_item *key_item = NULL;
-        struct s_db_item *val_item = NULL;
+        uint32_t cur = db->shards.count;
+        uint32_t i = 0;
 
-        db_node_rdlock(key_node);
+        for (i = cur; i < count; i++) {
+                db_node_unlink(i);
+                if (db_node_open(db, i) != 0 ||
+                                db_node_load(db->key_nodes[i],
+                                             NULL, NULL, NULL) != 0 ||
+                                db_node_load(db->val_nodes[i],
+                                             NULL, NULL, NULL) != 0)
+                        goto exit_on_fail;
+
+                if (db->wal != NULL) {
+                        db_node_set_lazy(db->key_nodes[i], 1);
+                        db_node_set_lazy(db->val_nodes[i], 1);
+                }
+        }
 
-        key_item = db_node_get_item(key_node, msg->key, msg->cmd.key_size);
+        if (db_shards_save(count, cur) != 0)
+                goto exit_on_fail;
 
-        if (key_item != NULL) {
-                val_item = key_item->ref_item;
-                db_send_response(msg, val_item);
+        if (count > cur) {
+                pthread_mutex_lock(&db->snapshot_lock);
+                pthread_rwlock_wrlock(&db->nodes_lock);
+                db_wal_lock_write(db);
+                db->node_count = count;
+                db_wal_unlock_write(db);
+                pthread_rwlock_unlock(&db->nodes_lock);
+                pthread_mutex_unlock(&db->snapshot_lock);
         }
 
-        db_node_unlock(key_node);
-        free(msg->key);
-        msg->key = NULL;
+        return 0;
 
-        db_send_response(msg, NULL);
+exit_on_fail:
+        for (i = cur; i < count; i++) {
+                db_node_release(db->key_nodes[i]);
+                db_node_release(db->val_nodes[i]);
+                db->key_nodes[i] = NULL;
+                db->val_nodes[i] = NULL;
+                db_node_unlink(i);
+        }
+        return -1;
 }
 
-static void db_get_all_values(struct s_db *db, struct s_message *msg)
+/**
+ * @brief Route by the new map only and remove the nodes out of it.
+ * With the log, moved items are written by checkpoint, before the map
+ * is stored.
+ */
+static int db_reshard_end(struct s_db *db, uint32_t count)
 {
+        uint32_t old_count = db->node_count;
         uint32_t i = 0;
-        void *val_node = NULL;
-        void *it = NULL;
-        struct s_db_item *val_item = NULL;
 
-        for (i = 0; i < db->node_count; i++) {
-                val_node = db->val_nodes[i];
+        db_shards_publish(db, count, count);
 
-                db_node_rdlock(val_node);
-                it = db_node_get_iterator(val_node);
-                while (db_node_iterator_has_next(it)) {
-                        val_item = db_node_get_next(val_node, it);
-                        db_send_response(msg, val_item);
-                }
-                db_node_unlock(val_node);
+        if (db->wal != NULL && db_checkpoint_run(db) != 0)
+                return -1;
+
+        if (db_shards_save(count, count) != 0)
+                return -1;
+
+        if (count >= old_count)
+                return 0;
+
+        /* Snapshots have the removed nodes */
+        pthread_mutex_lock(&db->snapshot_lock);
+        db_snapshot_wait(db);
+        pthread_rwlock_wrlock(&db->nodes_lock);
+        db_wal_lock_write(db);
+        db_snapshot_drop(db);
+        db->node_count = count;
+        db_wal_unlock_write(db);
+        pthread_rwlock_unlock(&db->nodes_lock);
+        pthread_mutex_unlock(&db->snapshot_lock);
+
+        for (i = count; i < old_count; i++) {
+                db_node_release(db->key_nodes[i]);
+                db_node_release(db->val_nodes[i]);
+                db->key_nodes[i] = NULL;
+                db->val_nodes[i] = NULL;
+                db_node_unlink(i);
         }
-        db_send_response(msg, NULL);
+
+        return 0;
 }
 
-static void db_put_value(struct s_db *db,
-                         struct s_message *msg,
-                         void *key_node,
-                         void *val_node,
-                         uint32_t val_node_id)
+/**
+ * @brief Move items to the nodes of the map, which is stored already.
+ * @return On success, return zero, 1 if resharding is stopped.
+ * On error, -1 is returned, and errno is set.
+ */
+static int db_reshard_run(struct s_db *db, uint32_t count)
 {
-        struct s_db_item *key_item = NULL;
-        struct s_db_item *val_item = NULL;
-        struct s_command *cmd = &msg->cmd;
-
-        int free_msg_key = 0;
-        int free_msg_val = 0;
+        struct timespec start, end;
+        uint32_t old_count = db->shards.old_count;
+        uint32_t i = 0;
+        long ms = 0;
+        int rc = 0;
 
-        db_node_wrlock(key_node);
-        db_node_wrlock(val_node);
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-        key_item = db_node_get_item(key_node, msg->key, cmd->key_size);
-        val_item = db_node_get_item(val_node, msg->val, cmd->val_size);
+        /* Writers of the old map are gone, when nodes are read */
+        db_shards_publish(db, count, old_count);
 
-        /*
-         * Three cases:
-         * 1. Key and value exist.
-         * 2. Key does NOT exist AND value does NOT exist.
-         * 3. Key exists AND value does NOT exist. Key refer to old value.
-         * 4. Key does NOT exist AND value exists.
-         */
+        for (i = 0; rc == 0 && i < db->node_count; i++)
+                rc = db_reshard_node(db, i, count);
 
-        if (key_item != NULL && val_item != NULL) {
-                free_msg_key = 1;
-                free_msg_val = 1;
-        } else  if (key_item == NULL && val_item == NULL) {
-                key_item = db_node_put_item(key_node, msg->key, cmd->key_size);
-                val_item = db_node_put_item(val_node, msg->val, cmd->val_size);
+        if (rc == 0)
+                rc = db_reshard_end(db, count);
 
-                if (key_item != NULL && val_item != NULL) {
-                        key_item->ref_item = val_item;
-                        val_item->ref_counter = 1;
+        if (rc != 0)
+                return rc;
 
-                        db_node_save(val_node, val_item, 0);
-                        db_node_save(key_node, key_item, val_node_id);
-                } else {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ms  = (end.tv_sec - start.tv_sec) * 1000;
+        ms += (end.tv_nsec - start.tv_nsec) / 1000000;
 
-                        if (key_item != NULL)
-                                db_node_remove_item(key_node, key_item);
-                        else
-                                free_msg_key = 1;
+        printf("DB resharded from %u to %u nodes in %ld ms\n",
+               old_count, count, ms);
+        return 0;
+}
 
-                        if (val_item != NULL)
-                                db_node_remove_item(val_node, val_item);
-                        else
-                                free_msg_val = 1;
+static void *db_reshard_thread(void *arg)
+{
+        struct s_db *db = (struct s_db *)arg;
+        uint32_t count = db->reshard_count;
+        int rc = 0;
+
+        for (;;) {
+                rc = db_reshard_run(db, count);
+                if (rc < 0)
+                        perror("DB resharding error");
+                if (rc != 0)
+                        break;
+
+                pthread_mutex_lock(&db->reshard_lock);
+                count = db->reshard_next;
+                db->reshard_next = 0;
+                pthread_mutex_unlock(&db->reshard_lock);
+
+                if (count == 0 || count == db->shards.count)
+                        break;
+
+                if (db_reshard_begin(db, count) != 0) {
+                        perror("DB resharding error");
+                        break;
                 }
-        } else if (key_item != NULL && val_item == NULL) {
-                struct s_db_item *cur_val_item = key_item->ref_item;
-                uint32_t node_id = db_get_node_id(db->node_count,
-                                                  cur_val_item->data,
-                                                  cur_val_item->size);
+                db->reshard_count = count;
+        }
 
-                void *cur_val_node = db->val_nodes[node_id];
-                int need_lock = (cur_val_node != val_node);
+        /* Compaction of the nodes is paused for the time of resharding */
+        if (rc == 0 && db_compact_start(db) != 0)
+                perror("DB compaction start error");
 
-                val_item = db_node_put_item(val_node, msg->val, cmd->val_size);
-                if (val_item) {
-                        if (need_lock)
-                                db_node_wrlock(cur_val_node);
+        pthread_mutex_lock(&db->reshard_lock);
+        db->resharding = 0;
+        pthread_cond_broadcast(&db->reshard_cond);
+        pthread_mutex_unlock(&db->reshard_lock);
 
-                        if (cur_val_item->ref_counter > 1)
-                                cur_val_item->ref_counter--;
-                        else
-                                db_node_remove_item(cur_val_node, cur_val_item);
+        return NULL;
+}
 
-                        if (need_lock)
-                                db_node_unlock(cur_val_node);
+/**
+ * @brief Start resharding thread.
+ * Compaction must be stopped.
+ * @param count New count of node pairs, zero to resume resharding
+ * to reshard_count.
+ */
+static int db_reshard_start(struct s_db *db, uint32_t count)
+{
+        if (db->reshard_started) {
+                pthread_join(db->reshard_thread, NULL);
+                db->reshard_started = 0;
+        }
 
-                        key_item->ref_item = val_item;
-                        val_item->ref_counter = 1;
+        if (count != 0) {
+                if (db_reshard_begin(db, count) != 0)
+                        return -1;
+                db->reshard_count = count;
+        }
 
-                        db_node_save(val_node, val_item, 0);
-                        db_node_update_ref(key_node, key_item, val_node_id);
-                } else {
-                        free_msg_val = 1;
-                }
-                free_msg_key = 1;
-        } else if (key_item == NULL && val_item != NULL) {
-                key_item = db_node_put_item(key_node, msg->key, cmd->key_size);
-                if (key_item != NULL) {
-                        key_item->ref_item = val_item;
-                        val_item->ref_counter++;
-                        db_node_save(key_node, key_item, val_node_id);
-                } else {
-                        free_msg_key = 1;
-                }
-                free_msg_val = 1;
+        db->resharding = 1;
+        db->reshard_stop = 0;
+        if (pthread_create(&db->reshard_thread, NULL,
+                           db_reshard_thread, db) != 0) {
+                db->resharding = 0;
+                errno = EAGAIN;
+                return -1;
         }
+        db->reshard_started = 1;
 
-        db_node_unlock(val_node);
-        db_node_unlock(key_node);
+        return 0;
+}
+
+static void db_reshard_stop(struct s_db *db)
+{
+        if (!db->reshard_started)
+                return;
 
-        db_send_response(msg, NULL);
+        __atomic_store_n(&db->reshard_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(db->reshard_thread, NULL);
+        db->reshard_started = 0;
+}
 
-        if (free_msg_key) {
-                free(msg->key);
-                msg->key = NULL;
+int db_reshard(uint32_t node_count)
+{
+        int rc = 0;
+
+        if (db == NULL || node_count == 0 || node_count > DB_MAX_NODES) {
+                errno = EINVAL;
+                return -1;
         }
 
-        if (free_msg_val) {
-                free(msg->val);
-                msg->val = NULL;
+        pthread_mutex_lock(&db->reshard_lock);
+
+        if (db->resharding) {
+                pthread_mutex_unlock(&db->reshard_lock);
+                errno = EBUSY;
+                return -1;
+        }
+
+        if (node_count != db->shards.count) {
+                db_compact_stop(db);
+                rc = db_reshard_start(db, node_count);
+                if (rc != 0 && db_compact_start(db) != 0)
+                        perror("DB compaction start error");
         }
+
+        pthread_mutex_unlock(&db->reshard_lock);
+        return rc;
 }
 
-static void db_erase_value(struct s_db *db,
-                           struct s_message *msg,
-                           void *key_node)
+uint32_t db_reshard_wait(void)
 {
-        struct s_command *cmd = &msg->cmd;
-        struct s_db_item *key_item = NULL;
-        struct s_db_item *val_item = NULL;
-        void * val_node = NULL;
+        uint32_t count = 0;
 
-        db_node_wrlock(key_node);
+        if (db == NULL)
+                return 0;
 
-        key_item = db_node_get_item(key_node, msg->key, cmd->key_size);
-        if (key_item != NULL) {
-                uint32_t node_id = 0;
-                val_item = key_item->ref_item;
-                if (val_item != NULL) {
-                        node_id = db_get_node_id(db->node_count,
-                                                 val_item->data,
-                                                 val_item->size);
-                        val_node = db->val_nodes[node_id];
-                }
-        }
+        pthread_mutex_lock(&db->reshard_lock);
+        while (db->resharding)
+                pthread_cond_wait(&db->reshard_cond, &db->reshard_lock);
+        count = db->shards.count;
+        pthread_mutex_unlock(&db->reshard_lock);
 
-        if (val_node != NULL) {
-                db_node_wrlock(val_node);
+        return count;
+}
 
-                db_node_remove_item(key_node, key_item);
-                if (val_item->ref_counter > 1)
-                        val_item->ref_counter--;
-                else
-                        db_node_remove_item(val_node, val_item);
+int db_get_stored_node_count(uint32_t *node_count)
+{
+        uint32_t old_count = 0;
 
-                db_node_unlock(val_node);
+        if (node_count == NULL) {
+                errno = EINVAL;
+                return -1;
         }
 
-        db_node_unlock(key_node);
+        return db_shards_load(node_count, &old_count);
+}
+
+/**
+ * @brief Start resharding by the request.
+ * The count is sent back on success, otherwise the error text.
+ */
+static void db_reshard_msg(struct s_db *db, struct s_message *msg)
+{
+        uint32_t count = 0;
+        char text[64];
+        int len = 0;
+        (void)db;
+
+        if (msg->cmd.val_size == DB_RESHARD_SIZE && msg->val != NULL) {
+                memcpy(&count, msg->val, sizeof(count));
+                count = ntohl(count);
+        }
+
+        if (db_reshard(count) == 0)
+                len = sprintf(text, "%u", count);
+        else
+                len = snprintf(text, sizeof(text), "%s", strerror(errno));
 
-        db_send_response(msg, NULL);
+        db_send_data(msg, (uint8_t *)text, len + 1);
+        db_send_data(msg, NULL, 0);
 
         free(msg->key);
         msg->key = NULL;
+        free(msg->val);
+        msg->val = NULL;
+}
+
+/**
+ * @brief Leave the epoch of the request, when its nodes are not read
+ * any more. The log commit and the response do not hold off reclamation.
+ */
+static void db_request_leave(void)
+{
+        if (!db_request_epoch)
+                return;
+
+        db_request_epoch = 0;
+        db_epoch_exit();
 }
 
 void db_process_message(struct s_message *msg)
 {
         struct s_command *cmd = NULL;
+        struct s_db_shards shards;
         void *key_node = NULL;
+        void *old_node = NULL;
         void *val_node = NULL;
         uint32_t val_node_id = 0;
+        uint32_t node_id = 0;
+        uint32_t old_id = 0;
 
         if (msg == NULL)
                 return;
 
         cmd = &msg->cmd;
 
-        if (cmd->type != DB_CMD_LIST) {
-                uint32_t node_id = db_get_node_id(db->node_count,
-                                                  msg->key,
-                                                  cmd->key_size);
+        if (cmd->type == DB_CMD_GET || cmd->type == DB_CMD_PUT ||
+                        cmd->type == DB_CMD_ERASE) {
+                /* Map is not changed under the request, see
+                 * db_shards_publish() */
+                db_request_epoch = (db_epoch_enter() == 0);
+                shards = db_shards_get(db);
+
+                /* Key is hashed once, for the node and for its index */
+                if (!msg->key_fp.ready) {
+                        db_fp_bytes(msg->key, cmd->key_size, msg->key_fp.h);
+                        msg->key_fp.ready = 1;
+                }
+
+                node_id = db_get_node_id(shards.count, msg->key_fp.h);
                 key_node = db->key_nodes[node_id];
 
+                /* Key may be not moved yet by resharding */
+                if (shards.old_count != shards.count) {
+                        old_id = db_get_node_id(shards.old_count,
+                                                msg->key_fp.h);
+                        if (old_id != node_id)
+                                old_node = db->key_nodes[old_id];
+                }
+
                 if (cmd->type == DB_CMD_PUT) {
-                        node_id = db_get_node_id(db->node_count,
-                                                 msg->val,
-                                                 cmd->val_size);
-                        val_node = db->val_nodes[node_id];
-                        val_node_id = node_id;
+                        /* Not read from the socket, e.g. WAL replay */
+                        if (!msg->val_fp.ready)
+                                db_fp_bytes(msg->val, cmd->val_size,
+                                            msg->val_fp.h);
+
+                        val_node_id = db_get_node_id(shards.count,
+                                                     msg->val_fp.h);
+                        val_node = db->val_nodes[val_node_id];
                 }
+
+                /* Writer moves the key itself, before it is changed */
+                if (cmd->type != DB_CMD_GET && old_node != NULL &&
+                                db_reshard_key(db, msg->key, cmd->key_size,
+                                               msg->key_fp.h, old_id,
+                                               node_id) != 0)
+                        perror("DB key move error");
         }
 
         switch(cmd->type) {
         case DB_CMD_GET:
-                db_get_value(msg, key_node);
+                db_get_value(db, msg, key_node, old_node);
                 break;
         case DB_CMD_PUT:
-                db_put_value(db, msg, key_node, val_node, val_node_id);
+                if (cmd->val_size != 0 &&
+                                cmd->val_size < db->opts.inline_size)
+                        db_put_inline(db, msg, key_node);
+                else
+                        db_put_value(db, msg, key_node, val_node, val_node_id);
                 break;
         case DB_CMD_ERASE:
                 db_erase_value(db, msg, key_node);
@@ -353,5 +3787,13 @@ void db_process_message(struct s_message *msg)
         case DB_CMD_LIST:
                 db_get_all_values(db, msg);
                 break;
+        case DB_CMD_SCAN:
+                db_scan(db, msg);
+                break;
+        case DB_CMD_RESHARD:
+                db_reshard_msg(db, msg);
+                break;
         }
+
+        db_request_leave();
 }
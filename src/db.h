@@ -20,15 +20,109 @@ extern "C" {
 
 struct s_message;
 
+/**
+ * Max count of node pairs.
+ */
+#define DB_MAX_NODES            256
+
+/**
+ * @brief Database options.
+ */
+struct s_db_options {
+        int wal_mode;             /**< enum DB_WAL_MODE, see db_wal.h     */
+        uint32_t wal_interval_ms; /**< Group commit interval              */
+        uint64_t checkpoint_size; /**< Log size, that triggers checkpoint */
+        uint32_t checkpoint_interval_ms; /**< Age of the log, that triggers
+                                              checkpoint, 0 to disable   */
+        int snapshot;             /**< Write node snapshots for fast restart */
+        int file_backend;         /**< enum DB_FILE_BACKEND, see db_file.h */
+        uint64_t map_chunk;       /**< Growth step of mapped node files   */
+        int file_allocator;       /**< enum DB_FILE_ALLOCATOR, see db_file.h */
+        uint64_t compact_rate;    /**< Compaction I/O budget in bytes per
+                                       second, 0 disables compaction     */
+        uint32_t compact_free_pct;/**< Percent of lacunes in node file,
+                                       that starts compaction            */
+        uint32_t blob_size;       /**< Min size of value, that is kept in
+                                       the blob log, 0 to disable        */
+        uint64_t blob_segment_size;/**< Size of the blob log segment     */
+        uint32_t blob_gc_pct;     /**< Percent of live values in the blob
+                                       log segment, that starts its GC   */
+        uint32_t inline_size;     /**< Values below this size are kept in
+                                       the key record, 0 to disable      */
+        uint64_t mem_budget;      /**< Max size of values in memory of
+                                       each value node, 0 for no limit.
+                                       Disables snapshots               */
+        uint32_t bloom_bits;      /**< Bits per key of the Bloom filter of
+                                       each key node, 0 to disable       */
+        uint32_t list_threads;    /**< Threads of one LIST, which share its
+                                       nodes: the caller and threads of
+                                       the pool of the DB, which all LISTs
+                                       share. 0 or 1 for the caller only */
+};
+
+/**
+ * @brief Fill options with default values.
+ * By default WAL is disabled, node files are written at once
+ * by pwrite() and are not compacted, snapshots are not written,
+ * all values are kept in the value node files and in memory,
+ * key nodes have no Bloom filters, LIST is sent by the calling thread.
+ * @param opts Options.
+ */
+void db_options_default(struct s_db_options *opts);
+
 /**
  * @brief Initialize databse.
- * Creates node_count pair nodes for key and value.
+ * Creates node_count pair nodes for key and value with default options.
  * @param node_count Database node count.
  * @return On success, return zero.
  * On error, -1 is returned, and errno is set.
  */
 int db_init(uint32_t node_count);
 
+/**
+ * @brief Initialize databse.
+ * Creates node_count pair nodes for key and value.
+ * Restores data from node files and replays WAL left by previous run.
+ * Database of the other node count is loaded with its nodes and resharded
+ * to node_count in background, as by db_reshard(), so the given count
+ * wins over the stored one (see db_get_stored_node_count()).
+ * Interrupted resharding is resumed.
+ * @param node_count Database node count.
+ * @param opts Options. NULL for defaults.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_init_options(uint32_t node_count, const struct s_db_options *opts);
+
+/**
+ * @brief Change the count of node pairs, while requests are served.
+ * Nodes are added at once, then keys move to their nodes in background.
+ * When nodes are removed, their values move too, then the nodes and their
+ * files are removed. Until keys are moved, requests look them up by both
+ * shard maps. Node compaction is paused for the time of resharding.
+ * @param node_count New count of node pairs.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set: EINVAL for bad count,
+ * EBUSY if resharding is in progress.
+ */
+int db_reshard(uint32_t node_count);
+
+/**
+ * @brief Wait for the end of resharding.
+ * @return Count of node pairs.
+ */
+uint32_t db_reshard_wait(void);
+
+/**
+ * @brief Get the node count of the database left by previous run,
+ * the target count, if resharding was interrupted.
+ * May be called before db_init_options().
+ * @param node_count Node count.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set, ENOENT for new database.
+ */
+int db_get_stored_node_count(uint32_t *node_count);
+
 /**
  * @brief Release the database resources.
  */
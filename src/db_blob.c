@@ -0,0 +1,549 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "db_blob.h"
+
+#define DB_BLOB_MAGIC           0x4442424C /* "DBBL" */
+#define DB_BLOB_VERSION         1
+#define DB_BLOB_HEADER_SIZE     (2 * sizeof(uint32_t))
+#define DB_BLOB_LEN_SIZE        sizeof(uint64_t)
+#define DB_BLOB_MAX_NAME_LEN    256
+
+/**
+ * @brief Segment file.
+ */
+struct s_db_blob_segment {
+        uint32_t id;
+        int fd;
+        uint64_t size;          /**< File size          */
+        uint64_t live_size;     /**< Size of live records */
+        int dirty;              /**< Appended after the last sync */
+};
+
+struct s_db_blob {
+        char name[DB_BLOB_MAX_NAME_LEN]; /**< Name prefix of segments */
+        char dir[DB_BLOB_MAX_NAME_LEN];  /**< Directory of segments   */
+        uint64_t segment_size;
+        struct s_db_blob_segment *segments; /**< Sorted by id */
+        uint32_t count;
+        uint32_t max;
+        int active;             /**< Index of the active segment, -1 if none */
+        int dir_dirty;          /**< Segment was created after the last sync */
+};
+
+static int db_blob_segment_cmp(const void *a, const void *b)
+{
+        const struct s_db_blob_segment *s1 = (const struct s_db_blob_segment *)a;
+        const struct s_db_blob_segment *s2 = (const struct s_db_blob_segment *)b;
+
+        if (s1->id < s2->id) return -1;
+        if (s1->id > s2->id) return  1;
+
+        return 0;
+}
+
+static struct s_db_blob_segment *db_blob_find(struct s_db_blob *blob,
+                                              uint32_t id)
+{
+        struct s_db_blob_segment key;
+
+        key.id = id;
+        return (struct s_db_blob_segment *)
+                bsearch(&key, blob->segments, blob->count,
+                        sizeof(key), db_blob_segment_cmp);
+}
+
+/**
+ * @brief Add segment to the end of the array.
+ */
+static struct s_db_blob_segment *db_blob_add(struct s_db_blob *blob,
+                                             uint32_t id,
+                                             int fd,
+                                             uint64_t size)
+{
+        struct s_db_blob_segment *seg = NULL;
+
+        if (blob->count == blob->max) {
+                uint32_t max = (blob->max) ? 2 * blob->max : 16;
+                seg = (struct s_db_blob_segment *)
+                        realloc(blob->segments, max * sizeof(*seg));
+                if (seg == NULL) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+                blob->segments = seg;
+                blob->max = max;
+        }
+
+        seg = &blob->segments[blob->count++];
+        memset(seg, 0, sizeof(*seg));
+        seg->id = id;
+        seg->fd = fd;
+        seg->size = size;
+
+        return seg;
+}
+
+static int db_blob_pwrite(int fd, const uint8_t *data, uint64_t size,
+                          uint64_t offset)
+{
+        ssize_t rc = 0;
+
+        while (size != 0) {
+                rc = pwrite(fd, data, size, offset);
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc <= 0)
+                        return -1;
+
+                data   += rc;
+                size   -= rc;
+                offset += rc;
+        }
+
+        return 0;
+}
+
+static int db_blob_pread(int fd, uint8_t *data, uint64_t size, uint64_t offset)
+{
+        ssize_t rc = 0;
+
+        while (size != 0) {
+                rc = pread(fd, data, size, offset);
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc < 0)
+                        return -1;
+                if (rc == 0) {
+                        errno = EINVAL;
+                        return -1;
+                }
+
+                data   += rc;
+                size   -= rc;
+                offset += rc;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Get segment id from the file name.
+ * @return Non-zero value, if the file is a segment of the log.
+ */
+static int db_blob_parse_name(struct s_db_blob *blob,
+                              const char *file_name,
+                              uint32_t *id)
+{
+        const char *base = strrchr(blob->name, '/');
+        unsigned long val = 0;
+        size_t len = 0;
+        char *end = NULL;
+
+        base = (base != NULL) ? base + 1 : blob->name;
+        len = strlen(base);
+
+        if (strncmp(file_name, base, len) != 0 || file_name[len] != '.' ||
+                        file_name[len + 1] < '0' || file_name[len + 1] > '9')
+                return 0;
+
+        errno = 0;
+        val = strtoul(&file_name[len + 1], &end, 10);
+        if (errno != 0 || *end != '\0' || val == 0 || val > UINT32_MAX)
+                return 0;
+
+        *id = (uint32_t)val;
+        return 1;
+}
+
+/**
+ * @brief Open existing segments of the log.
+ */
+static int db_blob_open_segments(struct s_db_blob *blob)
+{
+        struct dirent *entry = NULL;
+        struct stat st;
+        char path[2 * DB_BLOB_MAX_NAME_LEN];
+        DIR *dir = NULL;
+        uint32_t id = 0;
+        int fd = -1;
+        int rc = 0;
+
+        dir = opendir(blob->dir);
+        if (dir == NULL)
+                return -1;
+
+        while (rc == 0 && (entry = readdir(dir)) != NULL) {
+                if (!db_blob_parse_name(blob, entry->d_name, &id))
+                        continue;
+
+                snprintf(path, sizeof(path), "%s.%u", blob->name, id);
+                fd = open(path, O_RDWR);
+                if (fd == -1 || fstat(fd, &st) != 0) {
+                        rc = -1;
+                        break;
+                }
+
+                if (db_blob_add(blob, id, fd, st.st_size) == NULL) {
+                        rc = -1;
+                        break;
+                }
+                fd = -1;
+        }
+
+        if (fd != -1)
+                close(fd);
+
+        closedir(dir);
+
+        if (blob->count != 0)
+                qsort(blob->segments, blob->count,
+                      sizeof(*blob->segments), db_blob_segment_cmp);
+
+        return rc;
+}
+
+void *db_blob_init(const char *name, uint64_t segment_size)
+{
+        struct s_db_blob *blob = NULL;
+        char *slash = NULL;
+
+        if (name == NULL || strlen(name) >= DB_BLOB_MAX_NAME_LEN ||
+                        segment_size == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        blob = (struct s_db_blob *)malloc(sizeof(struct s_db_blob));
+        if (blob == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        memset(blob, 0, sizeof(struct s_db_blob));
+        strcpy(blob->name, name);
+        blob->segment_size = segment_size;
+        blob->active = -1;
+
+        strcpy(blob->dir, name);
+        slash = strrchr(blob->dir, '/');
+        if (slash != NULL)
+                slash[(slash == blob->dir) ? 1 : 0] = '\0';
+        else
+                strcpy(blob->dir, ".");
+
+        if (db_blob_open_segments(blob) != 0) {
+                db_blob_release(blob);
+                return NULL;
+        }
+
+        return blob;
+}
+
+void db_blob_release(void *blob_ptr)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        uint32_t i = 0;
+
+        if (blob == NULL)
+                return;
+
+        for (i = 0; i < blob->count; i++)
+                close(blob->segments[i].fd);
+
+        free(blob->segments);
+        free(blob);
+}
+
+/**
+ * @brief Create the next segment and make it active.
+ * Each start gets a new segment, so torn tail of the last run
+ * is never written over.
+ */
+static struct s_db_blob_segment *db_blob_start_segment(struct s_db_blob *blob)
+{
+        struct s_db_blob_segment *seg = NULL;
+        char path[2 * DB_BLOB_MAX_NAME_LEN];
+        uint32_t hdr[2];
+        uint32_t id = 1;
+        int fd = -1;
+
+        if (blob->count != 0)
+                id = blob->segments[blob->count - 1].id + 1;
+
+        snprintf(path, sizeof(path), "%s.%u", blob->name, id);
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0640);
+        if (fd == -1)
+                return NULL;
+
+        hdr[0] = htobe32(DB_BLOB_MAGIC);
+        hdr[1] = htobe32(DB_BLOB_VERSION);
+        if (db_blob_pwrite(fd, (uint8_t *)hdr, sizeof(hdr), 0) != 0)
+                goto exit_on_fail;
+
+        seg = db_blob_add(blob, id, fd, DB_BLOB_HEADER_SIZE);
+        if (seg == NULL)
+                goto exit_on_fail;
+
+        seg->dirty = 1;
+        blob->active = blob->count - 1;
+        blob->dir_dirty = 1;
+
+        return seg;
+
+exit_on_fail:
+        close(fd);
+        unlink(path);
+        return NULL;
+}
+
+int db_blob_append(void *blob_ptr,
+                   const uint8_t *data,
+                   uint32_t size,
+                   struct s_db_blob_ref *ref)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        struct s_db_blob_segment *seg = NULL;
+        uint64_t len = 0;
+
+        if (blob == NULL || data == NULL || size == 0 || ref == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (blob->active != -1)
+                seg = &blob->segments[blob->active];
+
+        if (seg == NULL || seg->size >= blob->segment_size) {
+                seg = db_blob_start_segment(blob);
+                if (seg == NULL)
+                        return -1;
+        }
+
+        len = htobe64(size);
+        if (db_blob_pwrite(seg->fd, (uint8_t *)&len, sizeof(len),
+                           seg->size) != 0 ||
+                        db_blob_pwrite(seg->fd, data, size,
+                                       seg->size + DB_BLOB_LEN_SIZE) != 0)
+                return -1;
+
+        ref->segment = seg->id;
+        ref->size = size;
+        ref->offset = seg->size;
+
+        seg->size += DB_BLOB_LEN_SIZE + size;
+        seg->live_size += DB_BLOB_LEN_SIZE + size;
+        seg->dirty = 1;
+
+        return 0;
+}
+
+/**
+ * @brief Find segment of the record and check its bounds.
+ */
+static struct s_db_blob_segment *db_blob_check(struct s_db_blob *blob,
+                                               const struct s_db_blob_ref *ref)
+{
+        struct s_db_blob_segment *seg = NULL;
+
+        if (blob == NULL || ref == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        seg = db_blob_find(blob, ref->segment);
+        if (seg == NULL || ref->offset < DB_BLOB_HEADER_SIZE ||
+                        ref->offset > seg->size ||
+                        seg->size - ref->offset <
+                        DB_BLOB_LEN_SIZE + (uint64_t)ref->size) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        return seg;
+}
+
+int db_blob_read(void *blob_ptr, const struct s_db_blob_ref *ref, uint8_t *data)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        struct s_db_blob_segment *seg = NULL;
+        uint64_t len = 0;
+
+        seg = db_blob_check(blob, ref);
+        if (seg == NULL || data == NULL)
+                return -1;
+
+        if (db_blob_pread(seg->fd, (uint8_t *)&len, sizeof(len),
+                          ref->offset) != 0)
+                return -1;
+
+        if (be64toh(len) != ref->size) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return db_blob_pread(seg->fd, data, ref->size,
+                             ref->offset + DB_BLOB_LEN_SIZE);
+}
+
+int db_blob_use(void *blob_ptr, const struct s_db_blob_ref *ref)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        struct s_db_blob_segment *seg = NULL;
+
+        seg = db_blob_check(blob, ref);
+        if (seg == NULL)
+                return -1;
+
+        seg->live_size += DB_BLOB_LEN_SIZE + ref->size;
+        return 0;
+}
+
+void db_blob_free(void *blob_ptr, const struct s_db_blob_ref *ref)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        struct s_db_blob_segment *seg = NULL;
+        uint64_t size = 0;
+
+        if (blob == NULL || ref == NULL)
+                return;
+
+        seg = db_blob_find(blob, ref->segment);
+        if (seg == NULL)
+                return;
+
+        size = DB_BLOB_LEN_SIZE + ref->size;
+        seg->live_size = (seg->live_size > size) ? seg->live_size - size : 0;
+}
+
+int db_blob_sync(void *blob_ptr)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        uint32_t i = 0;
+        int rc = 0;
+        int fd = -1;
+
+        if (blob == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i = 0; i < blob->count; i++) {
+                if (!blob->segments[i].dirty)
+                        continue;
+
+                if (fdatasync(blob->segments[i].fd) != 0)
+                        rc = -1;
+                else
+                        blob->segments[i].dirty = 0;
+        }
+
+        /* New segments must be found after crash */
+        if (blob->dir_dirty) {
+                fd = open(blob->dir, O_RDONLY | O_DIRECTORY);
+                if (fd == -1 || fsync(fd) != 0)
+                        rc = -1;
+                else
+                        blob->dir_dirty = 0;
+
+                if (fd != -1)
+                        close(fd);
+        }
+
+        return rc;
+}
+
+int db_blob_collect(void *blob_ptr)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        struct s_db_blob_segment *seg = NULL;
+        char path[2 * DB_BLOB_MAX_NAME_LEN];
+        uint32_t i = 0;
+        uint32_t j = 0;
+        int count = 0;
+
+        if (blob == NULL)
+                return 0;
+
+        for (i = 0; i < blob->count; i++) {
+                seg = &blob->segments[i];
+
+                if ((int)i == blob->active || seg->live_size != 0) {
+                        if ((int)i == blob->active)
+                                blob->active = j;
+                        blob->segments[j++] = *seg;
+                        continue;
+                }
+
+                snprintf(path, sizeof(path), "%s.%u", blob->name, seg->id);
+                close(seg->fd);
+                unlink(path);
+                count++;
+        }
+
+        blob->count = j;
+
+        return count;
+}
+
+int db_blob_get_victim(void *blob_ptr, uint32_t max_live_pct, uint32_t *segment)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        struct s_db_blob_segment *seg = NULL;
+        uint64_t best_live = 0;
+        uint64_t best_size = 0;
+        uint64_t data = 0;
+        uint32_t i = 0;
+        int found = 0;
+
+        if (blob == NULL || segment == NULL)
+                return 0;
+
+        for (i = 0; i < blob->count; i++) {
+                seg = &blob->segments[i];
+                if ((int)i == blob->active || seg->live_size == 0 ||
+                                seg->size <= DB_BLOB_HEADER_SIZE)
+                        continue;
+
+                data = seg->size - DB_BLOB_HEADER_SIZE;
+                if (seg->live_size * 100 >= data * max_live_pct)
+                        continue;
+
+                /* live / data < best_live / best_size */
+                if (!found || seg->live_size * best_size <
+                                best_live * data) {
+                        best_live = seg->live_size;
+                        best_size = data;
+                        *segment = seg->id;
+                        found = 1;
+                }
+        }
+
+        return found;
+}
+
+void db_blob_get_stats(void *blob_ptr, struct s_db_blob_stats *stats)
+{
+        struct s_db_blob *blob = (struct s_db_blob *)blob_ptr;
+        uint32_t i = 0;
+
+        if (stats == NULL)
+                return;
+
+        memset(stats, 0, sizeof(*stats));
+        if (blob == NULL)
+                return;
+
+        stats->segments = blob->count;
+        for (i = 0; i < blob->count; i++) {
+                stats->size += blob->segments[i].size;
+                stats->live_size += blob->segments[i].live_size;
+        }
+}
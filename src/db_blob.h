@@ -0,0 +1,137 @@
+#ifndef DB_BLOB_H
+#define DB_BLOB_H
+
+/**
+ * @file db_blob.h
+ * @author Sviatoslav
+ * @brief Append-only log of large values of the one node.
+ *
+ * The log is a set of segment files <name>.<id>, each segment starts
+ * with [u32 magic "DBBL"][u32 version] and holds records [u64 size][data].
+ * Records are only appended to the last (active) segment, a new segment
+ * is started, when the active one grows over the segment size and
+ * on each start. Live size of each segment is counted by the owner:
+ * db_blob_use() on load, db_blob_free() when the value is removed.
+ * Segments without live records are deleted by db_blob_collect().
+ * All numbers are big-endian.
+ *
+ * The log has no locks, calls must be serialized by the owner.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Location of the value in the log.
+ */
+struct s_db_blob_ref {
+        uint32_t segment;       /**< Segment id             */
+        uint32_t size;          /**< Size of value data     */
+        uint64_t offset;        /**< Offset of the record   */
+};
+
+/**
+ * @brief Log statistics.
+ */
+struct s_db_blob_stats {
+        uint32_t segments;      /**< Count of segments          */
+        uint64_t size;          /**< Total size of segments     */
+        uint64_t live_size;     /**< Size of live records       */
+};
+
+/**
+ * @brief Open the log, existing segments are found by the name.
+ * @param name Name prefix of segment files.
+ * @param segment_size Size of the segment, that starts the next one.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_blob_init(const char *name, uint64_t segment_size);
+
+/**
+ * @brief Close segment files and free the log.
+ * @param blob Blob log.
+ */
+void db_blob_release(void *blob);
+
+/**
+ * @brief Append value to the active segment.
+ * @param blob Blob log.
+ * @param data Value data.
+ * @param size Value size.
+ * @param ref Location of the appended value.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_blob_append(void *blob,
+                   const uint8_t *data,
+                   uint32_t size,
+                   struct s_db_blob_ref *ref);
+
+/**
+ * @brief Read value by the location.
+ * @param blob Blob log.
+ * @param ref Location of the value.
+ * @param data Buffer of ref->size bytes.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_blob_read(void *blob, const struct s_db_blob_ref *ref, uint8_t *data);
+
+/**
+ * @brief Count the record of loaded value as live.
+ * @param blob Blob log.
+ * @param ref Location of the value.
+ * @return On success, return zero. If the record is out of segments,
+ * -1 is returned, and errno is set to EINVAL.
+ */
+int db_blob_use(void *blob, const struct s_db_blob_ref *ref);
+
+/**
+ * @brief Count the record of removed value as garbage.
+ * @param blob Blob log.
+ * @param ref Location of the value.
+ */
+void db_blob_free(void *blob, const struct s_db_blob_ref *ref);
+
+/**
+ * @brief Sync appended records to the disk.
+ * @param blob Blob log.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_blob_sync(void *blob);
+
+/**
+ * @brief Delete segments without live records, except the active one.
+ * Call it only after the node file does not refer to them.
+ * @param blob Blob log.
+ * @return Count of deleted segments.
+ */
+int db_blob_collect(void *blob);
+
+/**
+ * @brief Find the segment with the least live part, which is below
+ * the given percent. The active segment is not selected.
+ * @param blob Blob log.
+ * @param max_live_pct Percent of live records.
+ * @param segment Found segment id.
+ * @return Non-zero value, if the segment is found.
+ */
+int db_blob_get_victim(void *blob, uint32_t max_live_pct, uint32_t *segment);
+
+/**
+ * @brief Get log statistics.
+ * @param blob Blob log.
+ * @param stats Statistics.
+ */
+void db_blob_get_stats(void *blob, struct s_db_blob_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_BLOB_H */
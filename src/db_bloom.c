@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "db_bloom.h"
+
+#define DB_BLOOM_WORDS          (DB_BLOOM_BLOCK_SIZE / sizeof(uint64_t))
+
+struct s_db_bloom {
+        uint64_t *words;        /**< Blocks of DB_BLOOM_WORDS words */
+        uint64_t mask;          /**< Count of blocks - 1 */
+        uint64_t capacity;      /**< Expected count of keys */
+        struct s_db_bloom *prev; /**< Replaced filter */
+};
+
+/* Odd multipliers of the split block Bloom filter, one per word */
+static const uint32_t db_bloom_salts[DB_BLOOM_WORDS] = {
+        0x47B6137BU, 0x44974D91U, 0x8824AD5BU, 0xA2B7289DU,
+        0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U
+};
+
+void *db_bloom_create(uint64_t count, uint32_t bits, void *prev)
+{
+        struct s_db_bloom *bloom = NULL;
+        void *words = NULL;
+        uint64_t blocks = 1;
+        uint64_t need = 0;
+
+        if (bits == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (count < DB_BLOOM_MIN_COUNT)
+                count = DB_BLOOM_MIN_COUNT;
+
+        need = (count * bits + DB_BLOOM_BLOCK_SIZE * 8 - 1) /
+               (DB_BLOOM_BLOCK_SIZE * 8);
+        while (blocks < need)
+                blocks <<= 1;
+
+        bloom = (struct s_db_bloom *)malloc(sizeof(struct s_db_bloom));
+        if (bloom == NULL ||
+                        posix_memalign(&words, DB_BLOOM_BLOCK_SIZE,
+                                       blocks * DB_BLOOM_BLOCK_SIZE) != 0) {
+                free(bloom);
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        memset(words, 0, blocks * DB_BLOOM_BLOCK_SIZE);
+        bloom->words = (uint64_t *)words;
+        bloom->mask = blocks - 1;
+        bloom->capacity = count;
+        bloom->prev = (struct s_db_bloom *)prev;
+
+        return bloom;
+}
+
+void db_bloom_destroy(void *bloom)
+{
+        struct s_db_bloom *b = (struct s_db_bloom *)bloom;
+        struct s_db_bloom *prev = NULL;
+
+        for (; b != NULL; b = prev) {
+                prev = b->prev;
+                free(b->words);
+                free(b);
+        }
+}
+
+static inline uint64_t *db_bloom_block(struct s_db_bloom *b,
+                                       const uint64_t fp[2])
+{
+        return &b->words[(fp[1] & b->mask) * DB_BLOOM_WORDS];
+}
+
+static inline uint64_t db_bloom_bit(const uint64_t fp[2], uint32_t i)
+{
+        uint32_t h = (uint32_t)(fp[0] >> 32);
+
+        return 1ULL << ((h * db_bloom_salts[i]) >> 26);
+}
+
+void db_bloom_add(void *bloom, const uint64_t fp[2])
+{
+        struct s_db_bloom *b = (struct s_db_bloom *)bloom;
+        uint64_t *block = NULL;
+        uint64_t word = 0;
+        uint32_t i = 0;
+
+        if (b == NULL || fp == NULL)
+                return;
+
+        /* The only writer, no need of the locked OR */
+        block = db_bloom_block(b, fp);
+        for (i = 0; i < DB_BLOOM_WORDS; i++) {
+                word = __atomic_load_n(&block[i], __ATOMIC_RELAXED);
+                __atomic_store_n(&block[i], word | db_bloom_bit(fp, i),
+                                 __ATOMIC_RELAXED);
+        }
+}
+
+int db_bloom_check(void *bloom, const uint64_t fp[2])
+{
+        struct s_db_bloom *b = (struct s_db_bloom *)bloom;
+        uint64_t *block = NULL;
+        uint64_t miss = 0;
+        uint32_t i = 0;
+
+        if (b == NULL || fp == NULL)
+                return 1;
+
+        block = db_bloom_block(b, fp);
+        for (i = 0; i < DB_BLOOM_WORDS; i++) {
+                uint64_t bit = db_bloom_bit(fp, i);
+                miss |= ~__atomic_load_n(&block[i], __ATOMIC_RELAXED) & bit;
+        }
+
+        return miss == 0;
+}
+
+uint64_t db_bloom_capacity(void *bloom)
+{
+        struct s_db_bloom *b = (struct s_db_bloom *)bloom;
+
+        return (b != NULL) ? b->capacity : 0;
+}
+
+int db_bloom_copy(void *bloom, void *src)
+{
+        struct s_db_bloom *b = (struct s_db_bloom *)bloom;
+        struct s_db_bloom *s = (struct s_db_bloom *)src;
+        uint64_t count = 0;
+        uint64_t i = 0;
+
+        if (b == NULL || s == NULL || b->mask != s->mask) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        count = (b->mask + 1) * DB_BLOOM_WORDS;
+        for (i = 0; i < count; i++)
+                __atomic_store_n(&b->words[i], s->words[i], __ATOMIC_RELAXED);
+
+        return 0;
+}
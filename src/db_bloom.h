@@ -0,0 +1,85 @@
+#ifndef DB_BLOOM_H
+#define DB_BLOOM_H
+
+/**
+ * @file db_bloom.h
+ * @author Sviatoslav
+ * @brief Blocked Bloom filter of item fingerprints.
+ *
+ * Each key sets 8 bits in one block of the cache line size, one bit in
+ * each 64-bit word of the block, so the check reads one cache line.
+ * The block is picked by fp[1], the bits by the high word of fp[0]
+ * (see db_fp_bytes() in db_hash.h), so the key is not hashed again.
+ *
+ * Keys are added by one writer at a time, while the filter is checked
+ * without locks: bits are set and read by atomic word stores and loads.
+ * The filter has no deletes, it is rebuilt by db_bloom_copy(): each word
+ * is replaced at once and bits of live keys are in both the old and the
+ * new word, so the concurrent check never misses a live key.
+ *
+ * The filter may keep the replaced one, which is still checked by
+ * readers without locks, and frees it with itself.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DB_BLOOM_BLOCK_SIZE     64
+#define DB_BLOOM_MIN_COUNT      1024
+
+/**
+ * @brief Create empty filter.
+ * @param count Expected count of keys, at least DB_BLOOM_MIN_COUNT.
+ * @param bits Bits per key, the filter is rounded up to power of two blocks.
+ * @param prev Replaced filter to free with this one, may be NULL.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_bloom_create(uint64_t count, uint32_t bits, void *prev);
+
+/**
+ * @brief Free the filter and all filters replaced by it.
+ * @param bloom Bloom filter, may be NULL.
+ */
+void db_bloom_destroy(void *bloom);
+
+/**
+ * @brief Add the key. Calls are serialized by the owner.
+ * @param bloom Bloom filter.
+ * @param fp Fingerprint of the key.
+ */
+void db_bloom_add(void *bloom, const uint64_t fp[2]);
+
+/**
+ * @brief Check the key, may be called without locks.
+ * @param bloom Bloom filter.
+ * @param fp Fingerprint of the key.
+ * @return Zero, if the key was never added, otherwise non-zero value.
+ */
+int db_bloom_check(void *bloom, const uint64_t fp[2]);
+
+/**
+ * @brief Get count of keys, which the filter was created for.
+ * @param bloom Bloom filter.
+ * @return Count of keys.
+ */
+uint64_t db_bloom_capacity(void *bloom);
+
+/**
+ * @brief Replace bits of the filter with bits of the filter of the same
+ * size. Calls are serialized with db_bloom_add() by the owner.
+ * @param bloom Bloom filter.
+ * @param src Source filter.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_bloom_copy(void *bloom, void *src);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_BLOOM_H */
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "db_epoch.h"
+
+#define DB_EPOCH_LINE_SIZE      64
+
+/**
+ * @brief Slot of the thread, zero epoch is out of readers.
+ */
+struct s_db_epoch_slot {
+        uint64_t epoch;         /**< Epoch entered, zero if none */
+        uint32_t depth;         /**< Count of nested enters */
+        uint32_t in_use;        /**< Slot is owned by the thread */
+} __attribute__((aligned(DB_EPOCH_LINE_SIZE)));
+
+static struct s_db_epoch_slot db_epoch_slots[DB_EPOCH_MAX_THREADS];
+static uint64_t db_epoch_global = 1;
+static uint32_t db_epoch_used = 0;      /**< Slots ever taken */
+
+static pthread_key_t db_epoch_key;
+static pthread_once_t db_epoch_once = PTHREAD_ONCE_INIT;
+static __thread struct s_db_epoch_slot *db_epoch_self = NULL;
+
+/**
+ * @brief Release the slot, when the thread exits.
+ */
+static void db_epoch_release(void *ptr)
+{
+        struct s_db_epoch_slot *slot = (struct s_db_epoch_slot *)ptr;
+
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+        slot->depth = 0;
+        __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void db_epoch_init(void)
+{
+        pthread_key_create(&db_epoch_key, db_epoch_release);
+}
+
+/**
+ * @brief Take the free slot for the calling thread.
+ */
+static struct s_db_epoch_slot *db_epoch_register(void)
+{
+        uint32_t expected = 0;
+        uint32_t i = 0;
+
+        pthread_once(&db_epoch_once, db_epoch_init);
+
+        for (i = 0; i < DB_EPOCH_MAX_THREADS; i++) {
+                expected = 0;
+                if (!__atomic_compare_exchange_n(&db_epoch_slots[i].in_use,
+                                                 &expected, 1, 0,
+                                                 __ATOMIC_ACQ_REL,
+                                                 __ATOMIC_RELAXED))
+                        continue;
+
+                /* Scans stop at the highest slot ever taken */
+                expected = __atomic_load_n(&db_epoch_used, __ATOMIC_RELAXED);
+                while (expected < i + 1 &&
+                       !__atomic_compare_exchange_n(&db_epoch_used, &expected,
+                                                    i + 1, 0, __ATOMIC_ACQ_REL,
+                                                    __ATOMIC_RELAXED));
+
+                pthread_setspecific(db_epoch_key, &db_epoch_slots[i]);
+                db_epoch_self = &db_epoch_slots[i];
+                return db_epoch_self;
+        }
+
+        return NULL;
+}
+
+int db_epoch_enter(void)
+{
+        struct s_db_epoch_slot *slot = db_epoch_self;
+
+        if (slot == NULL)
+                slot = db_epoch_register();
+        if (slot == NULL)
+                return -1;
+
+        if (slot->depth++ != 0)
+                return 0;
+
+        /* The epoch is seen by writers before the reader loads items */
+        __atomic_store_n(&slot->epoch,
+                         __atomic_load_n(&db_epoch_global, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        return 0;
+}
+
+void db_epoch_exit(void)
+{
+        struct s_db_epoch_slot *slot = db_epoch_self;
+
+        if (slot == NULL || slot->depth == 0)
+                return;
+
+        if (--slot->depth == 0)
+                __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t db_epoch_advance(void)
+{
+        return __atomic_fetch_add(&db_epoch_global, 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t db_epoch_safe(void)
+{
+        uint64_t safe = 0;
+        uint64_t epoch = 0;
+        uint32_t used = 0;
+        uint32_t i = 0;
+
+        /* Pairs with the fence of db_epoch_enter() */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        safe = __atomic_load_n(&db_epoch_global, __ATOMIC_SEQ_CST);
+        used = __atomic_load_n(&db_epoch_used, __ATOMIC_ACQUIRE);
+        for (i = 0; i < used; i++) {
+                epoch = __atomic_load_n(&db_epoch_slots[i].epoch,
+                                        __ATOMIC_ACQUIRE);
+                if (epoch != 0 && epoch < safe)
+                        safe = epoch;
+        }
+
+        return safe;
+}
@@ -0,0 +1,55 @@
+#ifndef DB_EPOCH_H
+#define DB_EPOCH_H
+
+/**
+ * @file db_epoch.h
+ * @author Sviatoslav
+ * @brief Epoch based reclamation for readers without locks.
+ *
+ * The reader enters the epoch before it reads shared items without locks
+ * and exits it after the last access. Each thread has its own slot, one
+ * cache line, so readers write no shared memory.
+ *
+ * The writer unlinks the object and tags it with db_epoch_advance().
+ * The object may be freed, when its tag is less than db_epoch_safe():
+ * all readers, which could have seen it, have exited.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DB_EPOCH_MAX_THREADS    1024
+
+/**
+ * @brief Enter the epoch of the calling thread, calls may be nested.
+ * @return On success, return zero.
+ * On error, -1 is returned, if all slots are taken by other threads.
+ * Then the caller takes locks.
+ */
+int db_epoch_enter(void);
+
+/**
+ * @brief Exit the epoch entered by db_epoch_enter().
+ */
+void db_epoch_exit(void);
+
+/**
+ * @brief Start the new epoch.
+ * @return Tag of objects unlinked before the call.
+ */
+uint64_t db_epoch_advance(void);
+
+/**
+ * @brief Get the oldest epoch, which readers may be in.
+ * @return Objects of lower tags may be freed.
+ */
+uint64_t db_epoch_safe(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_EPOCH_H */
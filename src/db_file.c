@@ -1,26 +1,59 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* mremap() */
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 
 
 #include "db_file.h"
+#include "db_uring.h"
 #include "avl.h"
 #include "list.h"
 
 #define DB_FILE_MAX_NAME_LEN    64
-#define DB_FILE_EMPTY_BLOCK_BIT 0x10000000
+#define DB_FILE_MAGIC           0x44424E46 /* "DBNF" */
+#define DB_FILE_EMPTY_BLOCK_BIT (1ULL << 63)
+#define DB_FILE_HEADER_SIZE     sizeof(uint64_t)
+
+/* Max lacunes checked by db_file_get_space_below() */
+#define DB_FILE_MAX_SCAN        256
+
+/* Segregated fit: size classes by power of two, split to 16 classes */
+#define DB_FILE_SEG_SL_BITS     4
+#define DB_FILE_SEG_SL_COUNT    (1 << DB_FILE_SEG_SL_BITS)
+#define DB_FILE_SEG_FL_COUNT    64
+/* Max blocks of the own size class checked for the best fit */
+#define DB_FILE_SEG_SCAN        8
+#define DB_FILE_TAG_BUCKETS     1024
+
+/* Max count of free block structs kept for reuse */
+#define DB_FILE_BLOCK_CACHE     4096
+
+enum DB_FILE_TAG {
+        DB_FILE_TAG_BEGIN,      /**< Start offset of the block  */
+        DB_FILE_TAG_END,        /**< End offset of the block    */
+        DB_FILE_TAG_COUNT
+};
+
+/* Version 1: no file header, 4 byte length, empty mark in bit 28 */
+#define DB_FILE_V1_EMPTY_BLOCK_BIT 0x10000000
+#define DB_FILE_V1_HEADER_SIZE     sizeof(uint32_t)
 
 /**
  * @brief Structure for build index of free space by size.
  */
 struct db_file_space {
-        uint32_t size;  /**< Size of free space */
+        uint64_t size;  /**< Size of free space */
         struct s_list blocks; /**< List of blocks with same free space size */
 };
 
@@ -28,10 +61,31 @@ struct db_file_space {
  * @brief Structre for build index of free space by offset.
  */
 struct db_file_block {
-        uint32_t offset;        /**< Start offset of free space */
-        uint32_t size;          /**< Size of free space         */
-        struct s_list_item blocks_item; /**< Item of db_file_space::blocks */
+        uint64_t offset;        /**< Start offset of free space */
+        uint64_t size;          /**< Size of free space         */
+        struct s_list_item blocks_item; /**< Item of db_file_space::blocks
+                                             or of the size class list */
         struct db_file_space *f_space;  /**< Pointer to db_file_space */
+        struct db_file_block *tag_next[DB_FILE_TAG_COUNT]; /**< Next block
+                                             in the bucket of tag hash */
+        uint32_t fl;    /**< Size class, see db_file_seg_mapping() */
+        uint32_t sl;
+        int dirty;      /**< Header is not written yet, see db_file::lazy */
+};
+
+/**
+ * @brief Segregated fit index of free space.
+ * Non-empty size classes are marked in bitmaps, so a class with
+ * blocks big enough is found by a couple of bit scans.
+ * Blocks are found by start and end offsets (boundary tags)
+ * in hash tables for merge with neighbours.
+ */
+struct db_file_seg {
+        uint64_t fl_bitmap;                     /**< Non-empty power classes */
+        uint32_t sl_bitmap[DB_FILE_SEG_FL_COUNT];/**< Non-empty classes */
+        struct s_list lists[DB_FILE_SEG_FL_COUNT][DB_FILE_SEG_SL_COUNT];
+        struct db_file_block **tags[DB_FILE_TAG_COUNT]; /**< Tag hashes */
+        uint64_t tag_mask;                      /**< Count of buckets - 1 */
 };
 
 struct db_file {
@@ -41,7 +95,22 @@ struct db_file {
 
         char file_name[DB_FILE_MAX_NAME_LEN];
         int fd;                         /**< File decriptor             */
-        uint32_t last_offset;           /**< Most of issued offset      */
+        uint64_t last_offset;           /**< Most of issued offset      */
+        uint64_t free_size;             /**< Total size of lacunes      */
+        uint64_t free_count;            /**< Count of lacunes           */
+        int version;                    /**< On-disk format version     */
+        int lazy;       /**< Defer headers and truncate to db_file_flush() */
+        int backend;    /**< enum DB_FILE_BACKEND                       */
+        uint64_t map_chunk;     /**< Growth step of the file mapping    */
+        uint8_t *map;           /**< File mapping, NULL if not mapped   */
+        uint64_t map_size;      /**< Size of the mapping and the file   */
+        void *uring;            /**< Write-back queue, see db_uring.h   */
+        struct db_file_block *pending; /**< Split block, its header goes
+                                            with the next record write */
+        struct db_file_seg *seg;        /**< Segregated fit index, NULL
+                                             for AVL index */
+        struct db_file_block *cache;    /**< Free block structs */
+        uint32_t cache_count;
 };
 
 static int avl_begin_block_cmp(const void *avl_a, const void *avl_b, void *avl_param)
@@ -61,8 +130,8 @@ static int avl_end_block_cmp(const void *avl_a, const void *avl_b, void *avl_par
         (void)avl_param;
         struct db_file_block *item1 = (struct db_file_block *)avl_a;
         struct db_file_block *item2 = (struct db_file_block *)avl_b;
-        uint32_t off1 = item1->offset + item1->size;
-        uint32_t off2 = item2->offset + item2->size;
+        uint64_t off1 = item1->offset + item1->size;
+        uint64_t off2 = item2->offset + item2->size;
 
         if (off1 < off2) return -1;
         if (off1 > off2) return  1;
@@ -82,24 +151,482 @@ static int avl_space_cmp(const void *avl_a, const void *avl_b, void *avl_param)
         return 0;
 }
 
-static void avl_free_block_item(void *avl_item, void *avl_param)
+static void avl_free_space_item(void *avl_item, void *avl_param)
 {
         (void)avl_param;
-        struct db_file_block *block = (struct db_file_block *)avl_item;
+        struct db_file_space *space = (struct db_file_space *)avl_item;
+
+        if (space)
+                free(space);
+}
+
+static struct db_file_block *db_file_new_block(struct db_file *db_f,
+                                               uint64_t offset,
+                                               uint64_t size)
+{
+        struct db_file_block *block = db_f->cache;
+
+        if (block != NULL) {
+                db_f->cache = block->tag_next[0];
+                db_f->cache_count--;
+        } else {
+                block = (struct db_file_block *)
+                        malloc(sizeof(struct db_file_block));
+                if (block == NULL)
+                        return NULL;
+        }
+
+        memset(block, 0, sizeof(struct db_file_block));
+
+        block->blocks_item.item = block;
+        block->size   = size;
+        block->offset = offset;
+
+        return block;
+}
 
-        if (block)
+static void db_file_free_block(struct db_file *db_f,
+                               struct db_file_block *block)
+{
+        if (db_f->cache_count == DB_FILE_BLOCK_CACHE) {
                 free(block);
+                return;
+        }
+
+        block->tag_next[0] = db_f->cache;
+        db_f->cache = block;
+        db_f->cache_count++;
 }
 
-static void avl_free_space_item(void *avl_item, void *avl_param)
+/**
+ * @brief Get size class of the block size.
+ * Sizes below 16 have own classes, the others go to one of 16
+ * classes of their power of two.
+ */
+static void db_file_seg_mapping(uint64_t size, uint32_t *fl, uint32_t *sl)
 {
-        (void)avl_param;
-        struct db_file_space *space = (struct db_file_space *)avl_item;
+        uint32_t bit = 0;
 
-        if (space)
-                free(space);
+        if (size < DB_FILE_SEG_SL_COUNT) {
+                *fl = 0;
+                *sl = (uint32_t)size;
+                return;
+        }
+
+        bit = 63 - __builtin_clzll(size);
+        *sl = (uint32_t)(size >> (bit - DB_FILE_SEG_SL_BITS)) ^
+              DB_FILE_SEG_SL_COUNT;
+        *fl = bit - DB_FILE_SEG_SL_BITS + 1;
+}
+
+/**
+ * @brief Find the first non-empty size class starting from the given one.
+ * @return Zero if found, -1 otherwise.
+ */
+static int db_file_seg_next_class(struct db_file_seg *seg,
+                                  uint32_t *fl, uint32_t *sl)
+{
+        uint32_t sl_map = 0;
+        uint64_t fl_map = 0;
+
+        if (*fl >= DB_FILE_SEG_FL_COUNT)
+                return -1;
+
+        sl_map = (*sl < DB_FILE_SEG_SL_COUNT) ?
+                 seg->sl_bitmap[*fl] & (~0U << *sl) : 0;
+        if (sl_map == 0) {
+                if (*fl + 1 >= DB_FILE_SEG_FL_COUNT)
+                        return -1;
+                fl_map = seg->fl_bitmap & (~0ULL << (*fl + 1));
+                if (fl_map == 0)
+                        return -1;
+
+                *fl = __builtin_ctzll(fl_map);
+                sl_map = seg->sl_bitmap[*fl];
+        }
+
+        *sl = __builtin_ctz(sl_map);
+        return 0;
+}
+
+static uint64_t db_file_tag_key(struct db_file_block *block, int tag)
+{
+        return (tag == DB_FILE_TAG_BEGIN) ? block->offset :
+                                            block->offset + block->size;
+}
+
+static uint64_t db_file_tag_hash(struct db_file_seg *seg, uint64_t key)
+{
+        key *= 0x9E3779B97F4A7C15ULL;
+        return (key ^ (key >> 29)) & seg->tag_mask;
+}
+
+static void db_file_tag_insert(struct db_file_seg *seg,
+                               struct db_file_block *block)
+{
+        uint64_t h = 0;
+        int tag = 0;
+
+        for (tag = 0; tag < DB_FILE_TAG_COUNT; tag++) {
+                h = db_file_tag_hash(seg, db_file_tag_key(block, tag));
+                block->tag_next[tag] = seg->tags[tag][h];
+                seg->tags[tag][h] = block;
+        }
+}
+
+static void db_file_tag_remove(struct db_file_seg *seg,
+                               struct db_file_block *block)
+{
+        struct db_file_block **pb = NULL;
+        uint64_t h = 0;
+        int tag = 0;
+
+        for (tag = 0; tag < DB_FILE_TAG_COUNT; tag++) {
+                h = db_file_tag_hash(seg, db_file_tag_key(block, tag));
+                pb = &seg->tags[tag][h];
+                while (*pb != NULL && *pb != block)
+                        pb = &(*pb)->tag_next[tag];
+                if (*pb != NULL)
+                        *pb = block->tag_next[tag];
+        }
+}
+
+static struct db_file_block *db_file_tag_find(struct db_file_seg *seg,
+                                              int tag,
+                                              uint64_t key)
+{
+        struct db_file_block *block = NULL;
+
+        block = seg->tags[tag][db_file_tag_hash(seg, key)];
+        while (block != NULL && db_file_tag_key(block, tag) != key)
+                block = block->tag_next[tag];
+
+        return block;
+}
+
+/**
+ * @brief Double tag hashes, when blocks outnumber buckets.
+ */
+static int db_file_tag_grow(struct db_file_seg *seg, uint64_t count)
+{
+        struct db_file_block **old = seg->tags[DB_FILE_TAG_BEGIN];
+        struct db_file_block **begin = NULL;
+        struct db_file_block **end = NULL;
+        struct db_file_block *block = NULL;
+        struct db_file_block *next = NULL;
+        uint64_t buckets = seg->tag_mask + 1;
+        uint64_t i = 0;
+
+        if (count <= buckets)
+                return 0;
+
+        begin = (struct db_file_block **)
+                calloc(2 * buckets, sizeof(struct db_file_block *));
+        end = (struct db_file_block **)
+                calloc(2 * buckets, sizeof(struct db_file_block *));
+        if (begin == NULL || end == NULL) {
+                free(begin);
+                free(end);
+                return -1;
+        }
+
+        free(seg->tags[DB_FILE_TAG_END]);
+        seg->tags[DB_FILE_TAG_BEGIN] = begin;
+        seg->tags[DB_FILE_TAG_END] = end;
+        seg->tag_mask = 2 * buckets - 1;
+
+        for (i = 0; i < buckets; i++) {
+                for (block = old[i]; block != NULL; block = next) {
+                        next = block->tag_next[DB_FILE_TAG_BEGIN];
+                        db_file_tag_insert(seg, block);
+                }
+        }
+
+        free(old);
+        return 0;
+}
+
+static struct db_file_seg *db_file_seg_create(void)
+{
+        struct db_file_seg *seg = NULL;
+        int tag = 0;
+
+        seg = (struct db_file_seg *)calloc(1, sizeof(struct db_file_seg));
+        if (seg == NULL)
+                return NULL;
+
+        seg->tag_mask = DB_FILE_TAG_BUCKETS - 1;
+        for (tag = 0; tag < DB_FILE_TAG_COUNT; tag++) {
+                seg->tags[tag] = (struct db_file_block **)
+                        calloc(DB_FILE_TAG_BUCKETS,
+                               sizeof(struct db_file_block *));
+                if (seg->tags[tag] == NULL)
+                        goto exit_on_fail;
+        }
+
+        return seg;
+
+exit_on_fail:
+        free(seg->tags[DB_FILE_TAG_BEGIN]);
+        free(seg->tags[DB_FILE_TAG_END]);
+        free(seg);
+        return NULL;
+}
+
+static void db_file_seg_destroy(struct db_file_seg *seg)
+{
+        if (seg == NULL)
+                return;
+
+        free(seg->tags[DB_FILE_TAG_BEGIN]);
+        free(seg->tags[DB_FILE_TAG_END]);
+        free(seg);
+}
+
+static void db_file_seg_insert(struct db_file *db_f,
+                              struct db_file_block *block)
+{
+        struct db_file_seg *seg = db_f->seg;
+
+        /* Without memory for growth hash chains are just longer */
+        db_file_tag_grow(seg, db_f->free_count + 1);
+
+        db_file_seg_mapping(block->size, &block->fl, &block->sl);
+        list_append(&seg->lists[block->fl][block->sl], &block->blocks_item);
+        seg->sl_bitmap[block->fl] |= 1U << block->sl;
+        seg->fl_bitmap |= 1ULL << block->fl;
+
+        db_file_tag_insert(seg, block);
+}
+
+static void db_file_seg_remove(struct db_file *db_f,
+                               struct db_file_block *block)
+{
+        struct db_file_seg *seg = db_f->seg;
+        struct s_list *list = &seg->lists[block->fl][block->sl];
+
+        list_remove(list, &block->blocks_item);
+        if (list->first == NULL) {
+                seg->sl_bitmap[block->fl] &= ~(1U << block->sl);
+                if (seg->sl_bitmap[block->fl] == 0)
+                        seg->fl_bitmap &= ~(1ULL << block->fl);
+        }
+
+        db_file_tag_remove(seg, block);
+}
+
+/**
+ * @brief Check if the record fits the block.
+ * Rest of the split block must be able to hold its own header,
+ * otherwise the header overwrites the next record.
+ */
+static int db_file_block_fits(struct db_file_block *block, uint64_t size)
+{
+        return block->size == size ||
+               block->size >= size + DB_FILE_HEADER_SIZE;
+}
+
+/**
+ * @brief Find a block for the record in the segregated fit index.
+ * A few blocks of the own size class are checked for the best fit,
+ * otherwise any block of the next class with big enough blocks is used.
+ */
+static struct db_file_block *db_file_seg_find(struct db_file_seg *seg,
+                                              uint64_t size)
+{
+        struct db_file_block *block = NULL;
+        struct s_list_item *item = NULL;
+        uint64_t round = 0;
+        uint32_t fl = 0;
+        uint32_t sl = 0;
+        int i = 0;
+
+        db_file_seg_mapping(size, &fl, &sl);
+        item = seg->lists[fl][sl].first;
+        for (i = 0; item != NULL && i < DB_FILE_SEG_SCAN; i++) {
+                block = (struct db_file_block *)list_get_item(item);
+                if (db_file_block_fits(block, size))
+                        return block;
+                item = item->next;
+        }
+
+        /* Round up to the class, where all blocks fit */
+        round = size + DB_FILE_HEADER_SIZE;
+        if (round >= DB_FILE_SEG_SL_COUNT)
+                round += (1ULL << (63 - __builtin_clzll(round) -
+                                   DB_FILE_SEG_SL_BITS)) - 1;
+
+        db_file_seg_mapping(round, &fl, &sl);
+        if (db_file_seg_next_class(seg, &fl, &sl) != 0)
+                return NULL;
+
+        return (struct db_file_block *)list_get_item(seg->lists[fl][sl].first);
+}
+
+/**
+ * @brief Grow the file and its mapping to hold data up to the end offset.
+ * The file is extended by whole chunks, so most writes are only memcpy.
+ */
+static int db_file_map_reserve(struct db_file *db_f, uint64_t end)
+{
+        uint64_t size = 0;
+        void *map = NULL;
+
+        if (end <= db_f->map_size)
+                return 0;
+
+        size = (end + db_f->map_chunk - 1) / db_f->map_chunk * db_f->map_chunk;
+        if (ftruncate(db_f->fd, size) != 0)
+                return -1;
+
+        if (db_f->map == NULL)
+                map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, db_f->fd, 0);
+        else
+                map = mremap(db_f->map, db_f->map_size, size, MREMAP_MAYMOVE);
+
+        if (map == MAP_FAILED)
+                return -1;
+
+        db_f->map = (uint8_t *)map;
+        db_f->map_size = size;
+
+        return 0;
+}
+
+/**
+ * @brief Zero length word after the last record.
+ * The mapped file is longer than the data, db_file_load() stops on it
+ * instead of loading stale records left after the end.
+ */
+static void db_file_map_mark_end(struct db_file *db_f)
+{
+        if (db_f->map && db_f->last_offset + DB_FILE_HEADER_SIZE <= db_f->map_size)
+                memset(&db_f->map[db_f->last_offset], 0, DB_FILE_HEADER_SIZE);
+}
+
+/**
+ * @brief Drop data after the last offset.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+static int db_file_cut(struct db_file *db_f)
+{
+        if (db_f->uring != NULL)
+                return (db_uring_truncate(db_f->uring,
+                                          db_f->last_offset) != 0) ? 0 : -1;
+
+        if (db_f->map != NULL) {
+                db_file_map_mark_end(db_f);
+                return 0;
+        }
+
+        return ftruncate(db_f->fd, db_f->last_offset);
+}
+
+/**
+ * @brief Unmap the file and cut it to the data size.
+ */
+static void db_file_unmap(struct db_file *db_f)
+{
+        if (db_f->map == NULL)
+                return;
+
+        munmap(db_f->map, db_f->map_size);
+        db_f->map = NULL;
+        db_f->map_size = 0;
+
+        if (ftruncate(db_f->fd, db_f->last_offset) != 0)
+                perror("DB file truncate error");
+}
+
+static int db_file_write_header(struct db_file *db_f,
+                                struct db_file_block *block)
+{
+        uint64_t size = htobe64(block->size | DB_FILE_EMPTY_BLOCK_BIT);
+
+        block->dirty = 0;
+
+        /* Old format file is read only until db_file_rewrite_begin() */
+        if (db_f->version != DB_FILE_VERSION)
+                return 0;
+
+        if (db_f->backend == DB_FILE_BACKEND_MMAP) {
+                if (db_file_map_reserve(db_f, block->offset + sizeof(size)) != 0)
+                        return -1;
+                memcpy(&db_f->map[block->offset], &size, sizeof(size));
+                return 0;
+        }
+
+        if (db_f->uring != NULL) {
+                struct iovec iov;
+
+                iov.iov_base = &size;
+                iov.iov_len  = sizeof(size);
+                if (db_uring_write(db_f->uring, block->offset, &iov, 1) == 0)
+                        return -1;
+                return 0;
+        }
+
+        if (pwrite(db_f->fd, (uint8_t *)&size,
+                   sizeof(uint64_t), block->offset) < 0)
+                return -1;
+
+        return 0;
+}
+
+/**
+ * @brief Detect format version of existing file, write header to new file.
+ */
+static int db_file_open_version(struct db_file *db_f)
+{
+        uint32_t hdr[2];
+        off_t size = lseek(db_f->fd, 0, SEEK_END);
+
+        if (size < 0)
+                return -1;
+
+        if (size == 0) {
+                hdr[0] = htonl(DB_FILE_MAGIC);
+                hdr[1] = htonl(DB_FILE_VERSION);
+                if (pwrite(db_f->fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+                        return -1;
+
+                db_f->version = DB_FILE_VERSION;
+                db_f->last_offset = DB_FILE_DATA_OFFSET;
+                return 0;
+        }
+
+        /* Never overwrite existing data until db_file_load() is called */
+        db_f->last_offset = size;
+        db_f->version = 1;
+
+        if (size >= (off_t)sizeof(hdr) &&
+                        pread(db_f->fd, hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                        ntohl(hdr[0]) == DB_FILE_MAGIC) {
+                db_f->version = ntohl(hdr[1]);
+                if (db_f->version != DB_FILE_VERSION) {
+                        errno = EPROTO;
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static void db_file_write_pending(struct db_file *db_f)
+{
+        if (db_f->pending == NULL)
+                return;
+
+        if (db_f->pending->dirty && !db_f->lazy)
+                db_file_write_header(db_f, db_f->pending);
+
+        db_f->pending = NULL;
 }
 
+static void db_file_clear_blocks(struct db_file *db_f);
+
 void *db_file_init(const char *file_name)
 {
         struct db_file *db_f = NULL;
@@ -126,6 +653,11 @@ void *db_file_init(const char *file_name)
                 goto exit_on_fail;
         }
 
+        if (db_file_open_version(db_f) != 0) {
+                perror("DB file version error");
+                goto exit_on_fail;
+        }
+
         db_f->begin_block_table = avl_create(avl_begin_block_cmp, NULL, NULL);
         db_f->end_block_table   = avl_create(avl_end_block_cmp, NULL, NULL);
         db_f->free_space_table  = avl_create(avl_space_cmp, NULL, NULL);
@@ -147,17 +679,22 @@ exit_on_fail:
 
 void db_file_release(void *db_file)
 {
+        struct db_file_block *block = NULL;
         struct db_file *db_f = (struct db_file *)db_file;
         if (db_f == NULL)
                 return;
 
         if (db_f->fd >= 0) {
+                db_file_write_pending(db_f);
+                db_uring_release(db_f->uring);
+                db_file_unmap(db_f);
                 close(db_f->fd);
-                unlink(db_f->file_name);
         }
 
+        db_file_clear_blocks(db_f);
+
         if (db_f->begin_block_table != NULL)
-                avl_destroy(db_f->begin_block_table, avl_free_block_item);
+                avl_destroy(db_f->begin_block_table, NULL);
 
         if (db_f->end_block_table != NULL)
                 avl_destroy(db_f->end_block_table, NULL);
@@ -165,16 +702,28 @@ void db_file_release(void *db_file)
         if (db_f->free_space_table != NULL)
                 avl_destroy(db_f->free_space_table, avl_free_space_item);
 
+        db_file_seg_destroy(db_f->seg);
+
+        while (db_f->cache != NULL) {
+                block = db_f->cache;
+                db_f->cache = block->tag_next[0];
+                free(block);
+        }
 
         free(db_f);
 }
 
 static int db_file_add_block(struct db_file *db_f,
-                             struct db_file_block *block)
+                             struct db_file_block *block,
+                             int write_header)
 {
         struct db_file_space space;
         struct db_file_space *f_space = NULL;
-        uint32_t size = 0;
+
+        if (db_f->seg != NULL) {
+                db_file_seg_insert(db_f, block);
+                goto added;
+        }
 
         space.size = block->size;
 
@@ -202,10 +751,19 @@ static int db_file_add_block(struct db_file *db_f,
         avl_probe(db_f->begin_block_table, block);
         avl_probe(db_f->end_block_table, block);
 
-        size = block->size;
-        size |= DB_FILE_EMPTY_BLOCK_BIT;
-        size = htonl(size);
-        pwrite(db_f->fd, (uint8_t *)&size, sizeof(uint32_t), block->offset);
+added:
+        db_f->free_size += block->size;
+        db_f->free_count++;
+
+        if (!write_header)
+                return 0;
+
+        if (db_f->lazy) {
+                block->dirty = 1;
+                return 0;
+        }
+
+        db_file_write_header(db_f, block);
 
         return 0;
 }
@@ -215,6 +773,17 @@ static void db_file_remove_block(struct db_file *db_f,
 {
         struct db_file_space *f_space = block->f_space;
 
+        if (db_f->pending == block)
+                db_f->pending = NULL;
+
+        db_f->free_size -= block->size;
+        db_f->free_count--;
+
+        if (db_f->seg != NULL) {
+                db_file_seg_remove(db_f, block);
+                return;
+        }
+
         avl_delete(db_f->begin_block_table, block);
         avl_delete(db_f->end_block_table, block);
 
@@ -226,121 +795,870 @@ static void db_file_remove_block(struct db_file *db_f,
         }
 }
 
-static struct db_file_block * db_file_get_block(struct db_file *db_f,
-                                                struct db_file_space *f_space)
+/**
+ * @brief Drop index of free space.
+ */
+static void db_file_clear_blocks(struct db_file *db_f)
 {
+        struct avl_traverser trav;
         struct db_file_block *block = NULL;
+        uint64_t fl_map = 0;
+        uint32_t fl = 0;
+
+        if (db_f->seg != NULL) {
+                while ((fl_map = db_f->seg->fl_bitmap) != 0) {
+                        fl = __builtin_ctzll(fl_map);
+                        block = (struct db_file_block *)list_get_item(
+                                db_f->seg->lists[fl][__builtin_ctz(
+                                        db_f->seg->sl_bitmap[fl])].first);
+                        db_file_remove_block(db_f, block);
+                        db_file_free_block(db_f, block);
+                }
+                return;
+        }
+
+        if (db_f->begin_block_table == NULL)
+                return;
+
+        while ((block = (struct db_file_block *)
+                        avl_t_first(&trav, db_f->begin_block_table)) != NULL) {
+                db_file_remove_block(db_f, block);
+                db_file_free_block(db_f, block);
+        }
+}
+
+/**
+ * @brief Take space for a record from the start of the free block.
+ * @return Offset of the space.
+ */
+static uint64_t db_file_take_block(struct db_file *db_f,
+                                   struct db_file_block *block,
+                                   uint64_t size)
+{
+        uint64_t offset = block->offset;
 
-        block = (struct db_file_block *)list_get_item(f_space->blocks.first);
         db_file_remove_block(db_f, block);
 
-        return block;
+        if (block->size > size) {
+                block->offset += size;
+                block->size   -= size;
+
+                /* Header is written with the record at offset */
+                db_file_add_block(db_f, block, 0);
+                block->dirty = 1;
+                if (!db_f->lazy)
+                        db_f->pending = block;
+        } else {
+                db_file_free_block(db_f, block);
+        }
+
+        return offset;
 }
 
 
-uint32_t db_file_get_space(void *db_file, uint32_t size)
+uint64_t db_file_get_space(void *db_file, uint64_t size)
 {
         struct avl_traverser trav;
         struct db_file_space space;
         struct db_file_space *f_space = NULL;
         struct db_file_block *block = NULL;
         struct db_file *db_f = (struct db_file *)db_file;
-        uint32_t offset = 0;
+        uint64_t offset = 0;
         if (db_f == NULL)
                 return -1;
 
+        db_file_write_pending(db_f);
+
+        if (db_f->seg != NULL) {
+                block = db_file_seg_find(db_f->seg, size);
+                if (block != NULL)
+                        return db_file_take_block(db_f, block, size);
+                goto append;
+        }
+
         space.size = size;
 
         avl_t_init(&trav, db_f->free_space_table);
         f_space = (struct db_file_space *)
                         avl_t_find_near(&trav, db_f->free_space_table, &space);
 
-        if (f_space && f_space->size < size)
+        /*
+         * Rest of the split block must be able to hold its own header,
+         * otherwise the header overwrites the next record.
+         */
+        while (f_space && f_space->size != size &&
+               f_space->size < size + DB_FILE_HEADER_SIZE)
                 f_space = (struct db_file_space *)avl_t_next(&trav);
 
         if (f_space && f_space->size >= size) {
-                block = db_file_get_block(db_f, f_space);
-                f_space = NULL;
-
-                offset = block->offset;
-                if (block->size > size) {
-                        block->offset += size;
-                        block->size   -= size;
-
-                        db_file_add_block(db_f, block);
-                } else {
-                        free(block);
-                }
-
-                return offset;
+                block = (struct db_file_block *)
+                                list_get_item(f_space->blocks.first);
+                return db_file_take_block(db_f, block, size);
         }
 
+append:
         offset = db_f->last_offset;
         db_f->last_offset += size;
 
         return offset;
 }
 
-void db_file_put_space(void *db_file, uint32_t offset, uint32_t size)
+static uint64_t db_file_seg_get_below(struct db_file *db_f,
+                                      uint64_t size,
+                                      uint64_t limit)
+{
+        struct db_file_seg *seg = db_f->seg;
+        struct db_file_block *block = NULL;
+        struct s_list_item *item = NULL;
+        uint32_t scan = 0;
+        uint32_t fl = 0;
+        uint32_t sl = 0;
+
+        db_file_seg_mapping(size, &fl, &sl);
+
+        while (scan < DB_FILE_MAX_SCAN &&
+                        db_file_seg_next_class(seg, &fl, &sl) == 0) {
+                item = seg->lists[fl][sl].first;
+                while (item != NULL && scan < DB_FILE_MAX_SCAN) {
+                        block = (struct db_file_block *)list_get_item(item);
+                        if (db_file_block_fits(block, size) &&
+                                        block->offset + size <= limit)
+                                return db_file_take_block(db_f, block, size);
+                        item = item->next;
+                        scan++;
+                }
+                sl++;
+        }
+
+        return 0;
+}
+
+uint64_t db_file_get_space_below(void *db_file, uint64_t size, uint64_t limit)
+{
+        struct avl_traverser trav;
+        struct db_file_space space;
+        struct db_file_space *f_space = NULL;
+        struct db_file_block *block = NULL;
+        struct s_list_item *item = NULL;
+        struct db_file *db_f = (struct db_file *)db_file;
+        uint32_t scan = 0;
+        if (db_f == NULL || size == 0)
+                return 0;
+
+        db_file_write_pending(db_f);
+
+        if (db_f->seg != NULL)
+                return db_file_seg_get_below(db_f, size, limit);
+
+        space.size = size;
+
+        avl_t_init(&trav, db_f->free_space_table);
+        f_space = (struct db_file_space *)
+                        avl_t_find_near(&trav, db_f->free_space_table, &space);
+
+        while (f_space && scan < DB_FILE_MAX_SCAN) {
+                /* Same rule for the rest of the split block */
+                if (f_space->size != size &&
+                                f_space->size < size + DB_FILE_HEADER_SIZE) {
+                        f_space = (struct db_file_space *)avl_t_next(&trav);
+                        continue;
+                }
+
+                item = f_space->blocks.first;
+                while (item != NULL && scan < DB_FILE_MAX_SCAN) {
+                        block = (struct db_file_block *)list_get_item(item);
+                        if (block->offset + size <= limit)
+                                return db_file_take_block(db_f, block, size);
+                        item = item->next;
+                        scan++;
+                }
+
+                f_space = (struct db_file_space *)avl_t_next(&trav);
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Find free block by start or end offset.
+ */
+static struct db_file_block *db_file_find_block(struct db_file *db_f,
+                                                int tag,
+                                                uint64_t offset)
 {
         struct db_file_block tmp_block;
+
+        if (db_f->seg != NULL)
+                return db_file_tag_find(db_f->seg, tag, offset);
+
+        tmp_block.offset = offset;
+        tmp_block.size = 0;
+
+        return (struct db_file_block *)
+                avl_find((tag == DB_FILE_TAG_BEGIN) ? db_f->begin_block_table :
+                                                      db_f->end_block_table,
+                         &tmp_block);
+}
+
+void db_file_put_space(void *db_file, uint64_t offset, uint64_t size)
+{
         struct db_file_block *block = NULL;
         struct db_file *db_f = (struct db_file *)db_file;
         if (db_f == NULL)
                 return;
 
-        tmp_block.size = 0;
+        db_file_write_pending(db_f);
 
         /*
+         * Merge with both neighbours:
          * 1. Search block with start_off = offset + size;
          * 2. Search block with end_off = offset.
          */
-        tmp_block.offset = offset + size;
-        block = (struct db_file_block *)
-                        avl_find(db_f->begin_block_table, &tmp_block);
-        if (block == NULL) {
-                tmp_block.offset = offset;
-                block = (struct db_file_block *)
-                                avl_find(db_f->end_block_table, &tmp_block);
+        block = db_file_find_block(db_f, DB_FILE_TAG_BEGIN, offset + size);
+        if (block != NULL) {
+                db_file_remove_block(db_f, block);
+                size += block->size;
+                db_file_free_block(db_f, block);
         }
 
+        block = db_file_find_block(db_f, DB_FILE_TAG_END, offset);
         if (block != NULL) {
                 db_file_remove_block(db_f, block);
                 block->size += size;
-                if (block->offset > offset)
-                        block->offset = offset;
         } else {
-                block = (struct db_file_block *)
-                                malloc(sizeof(struct db_file_block));
+                block = db_file_new_block(db_f, offset, size);
                 if (block == NULL)
                         return;
-
-                memset(block, 0, sizeof(struct db_file_block));
-
-                block->blocks_item.item = block;
-                block->size   = size;
-                block->offset = offset;
         }
 
         if (block->offset + block->size == db_f->last_offset) {
                 db_f->last_offset -= block->size;
-                ftruncate(db_f->fd, db_f->last_offset);
-                free(block);
+                if (!db_f->lazy && db_f->version == DB_FILE_VERSION)
+                        db_file_cut(db_f);
+                db_file_free_block(db_f, block);
                 return;
-        } else {
-                db_file_add_block(db_f, block);
+        } else if (db_file_add_block(db_f, block, 1) != 0) {
+                /* Space is lost until the next load */
+                db_file_free_block(db_f, block);
         }
 }
 
 
 int db_file_write_data(void *db_file,
-                       uint32_t offset,
+                       uint64_t offset,
                        uint8_t *data,
                        uint32_t size)
 {
-        struct db_file *db_f = (struct db_file *)db_file;
+        struct iovec iov;
         if (db_file == NULL || data == NULL || size == 0)
                 return -1;
 
-        return (int)pwrite(db_f->fd, data, size, (off_t)offset);
+        iov.iov_base = data;
+        iov.iov_len  = size;
+
+        return db_file_write_vec(db_file, offset, &iov, 1);
+}
+
+static int db_file_map_write(struct db_file *db_f,
+                             uint64_t offset,
+                             const struct iovec *vec,
+                             int cnt,
+                             ssize_t size)
+{
+        uint8_t *dst = NULL;
+        uint64_t end = offset;
+        int i = 0;
+
+        for (i = 0; i < cnt; i++)
+                end += vec[i].iov_len;
+
+        if (db_file_map_reserve(db_f, end) != 0)
+                return -1;
+
+        dst = &db_f->map[offset];
+        for (i = 0; i < cnt; i++) {
+                memcpy(dst, vec[i].iov_base, vec[i].iov_len);
+                dst += vec[i].iov_len;
+        }
+
+        if (!db_f->lazy && end >= db_f->last_offset)
+                db_file_map_mark_end(db_f);
+
+        return (int)size;
+}
+
+int db_file_write_vec(void *db_file,
+                      uint64_t offset,
+                      const struct iovec *iov,
+                      int iovcnt)
+{
+        struct iovec vec[DB_FILE_MAX_IOV];
+        struct db_file *db_f = (struct db_file *)db_file;
+        struct db_file_block *pending = NULL;
+        uint64_t header = 0;
+        ssize_t size = 0;
+        ssize_t total = 0;
+        ssize_t iwrite = 0;
+        int cnt = iovcnt;
+        int i = 0;
+
+        if (db_f == NULL || iov == NULL || iovcnt <= 0 || iovcnt >= DB_FILE_MAX_IOV) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i = 0; i < iovcnt; i++) {
+                vec[i] = iov[i];
+                size += iov[i].iov_len;
+        }
+
+        /* Lacune header right after the record goes by the same syscall */
+        pending = db_f->pending;
+        if (pending && pending->dirty && offset + size == pending->offset) {
+                header = htobe64(pending->size | DB_FILE_EMPTY_BLOCK_BIT);
+                vec[cnt].iov_base = &header;
+                vec[cnt].iov_len  = sizeof(uint64_t);
+                cnt++;
+
+                pending->dirty = 0;
+                db_f->pending = NULL;
+        } else {
+                db_file_write_pending(db_f);
+        }
+
+        if (db_f->backend == DB_FILE_BACKEND_MMAP)
+                return db_file_map_write(db_f, offset, vec, cnt, size);
+
+        /* Data is copied to the queue, the I/O thread writes it */
+        if (db_f->uring != NULL)
+                return (db_uring_write(db_f->uring, offset, vec, cnt) != 0) ?
+                       (int)size : -1;
+
+        i = 0;
+        while (i < cnt) {
+                iwrite = pwritev(db_f->fd, &vec[i], cnt - i,
+                                 (off_t)(offset + total));
+                if (iwrite < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                total += iwrite;
+
+                /* Skip written parts after short write */
+                while (i < cnt && (size_t)iwrite >= vec[i].iov_len) {
+                        iwrite -= vec[i].iov_len;
+                        i++;
+                }
+
+                if (i < cnt) {
+                        vec[i].iov_base = (uint8_t *)vec[i].iov_base + iwrite;
+                        vec[i].iov_len -= iwrite;
+                }
+        }
+
+        return (int)size;
+}
+
+void db_file_set_lazy(void *db_file, int lazy)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        if (db_f == NULL)
+                return;
+
+        db_file_write_pending(db_f);
+        db_f->lazy = lazy;
+}
+
+int db_file_flush(void *db_file)
+{
+        struct avl_traverser trav;
+        struct db_file_block *block = NULL;
+        struct db_file *db_f = (struct db_file *)db_file;
+        uint64_t i = 0;
+        int rc = 0;
+
+        if (db_f == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        db_f->pending = NULL;
+
+        if (db_f->seg != NULL) {
+                for (i = 0; i <= db_f->seg->tag_mask; i++) {
+                        block = db_f->seg->tags[DB_FILE_TAG_BEGIN][i];
+                        for (; block != NULL;
+                                        block = block->tag_next[DB_FILE_TAG_BEGIN])
+                                if (block->dirty &&
+                                    db_file_write_header(db_f, block) != 0)
+                                        rc = -1;
+                }
+                goto cut;
+        }
+
+        block = (struct db_file_block *)
+                        avl_t_first(&trav, db_f->begin_block_table);
+        while (block != NULL) {
+                if (block->dirty && db_file_write_header(db_f, block) != 0)
+                        rc = -1;
+                block = (struct db_file_block *)avl_t_next(&trav);
+        }
+
+cut:
+        if (db_file_cut(db_f) != 0)
+                rc = -1;
+
+        return rc;
+}
+
+int db_file_sync(void *db_file)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        if (db_f == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (db_f->map && msync(db_f->map, db_f->map_size, MS_SYNC) != 0)
+                return -1;
+
+        if (db_f->uring && db_uring_wait(db_f->uring,
+                                         db_uring_get_seq(db_f->uring)) != 0)
+                return -1;
+
+        return fdatasync(db_f->fd);
+}
+
+uint64_t db_file_get_write_seq(void *db_file)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        if (db_f == NULL || db_f->uring == NULL)
+                return 0;
+
+        return db_uring_get_seq(db_f->uring);
+}
+
+int db_file_wait_writes(void *db_file, uint64_t seq)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        if (db_f == NULL || db_f->uring == NULL || seq == 0)
+                return 0;
+
+        return db_uring_wait(db_f->uring, seq);
+}
+
+int db_file_set_backend(void *db_file, int backend, uint64_t map_chunk)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        long page = sysconf(_SC_PAGESIZE);
+
+        if (db_f == NULL || (backend != DB_FILE_BACKEND_PWRITE &&
+                             backend != DB_FILE_BACKEND_MMAP &&
+                             backend != DB_FILE_BACKEND_URING)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        db_file_write_pending(db_f);
+        db_file_unmap(db_f);
+        db_uring_release(db_f->uring);
+        db_f->uring = NULL;
+
+        if (backend == DB_FILE_BACKEND_URING) {
+                db_f->uring = db_uring_init(db_f->fd);
+                if (db_f->uring == NULL)
+                        return -1;
+        }
+
+        if (map_chunk == 0)
+                map_chunk = DB_FILE_MAP_CHUNK;
+
+        /* Round up to the page size */
+        db_f->map_chunk = (map_chunk + page - 1) / page * page;
+        db_f->backend = backend;
+
+        return 0;
+}
+
+int db_file_set_allocator(void *db_file, int allocator)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+
+        if (db_f == NULL || (allocator != DB_FILE_ALLOCATOR_AVL &&
+                             allocator != DB_FILE_ALLOCATOR_SEG)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (db_f->free_count != 0) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        if (allocator == DB_FILE_ALLOCATOR_AVL) {
+                db_file_seg_destroy(db_f->seg);
+                db_f->seg = NULL;
+        } else if (db_f->seg == NULL) {
+                db_f->seg = db_file_seg_create();
+                if (db_f->seg == NULL) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+int db_file_read_data(void *db_file,
+                      uint64_t offset,
+                      uint8_t *data,
+                      uint32_t size)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        ssize_t iread = 0;
+        uint32_t total = 0;
+
+        if (db_f == NULL || data == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (db_f->map && offset + size <= db_f->map_size) {
+                memcpy(data, &db_f->map[offset], size);
+                return (int)size;
+        }
+
+        if (db_f->uring && db_uring_wait(db_f->uring,
+                                         db_uring_get_seq(db_f->uring)) != 0)
+                return -1;
+
+        while (total < size) {
+                iread = pread(db_f->fd, &data[total], size - total,
+                              (off_t)(offset + total));
+                if (iread < 0 && errno == EINTR)
+                        continue;
+                if (iread < 0)
+                        return -1;
+                if (iread == 0)
+                        break;
+                total += iread;
+        }
+
+        return (int)total;
+}
+
+static int db_file_lacune_cmp(const void *a, const void *b)
+{
+        const struct s_db_file_lacune *l1 = (const struct s_db_file_lacune *)a;
+        const struct s_db_file_lacune *l2 = (const struct s_db_file_lacune *)b;
+
+        if (l1->offset < l2->offset) return -1;
+        if (l1->offset > l2->offset) return  1;
+
+        return 0;
+}
+
+int db_file_restore(void *db_file,
+                    uint64_t size,
+                    struct s_db_file_lacune *lacunes,
+                    uint64_t count)
+{
+        struct stat st;
+        struct db_file_block *block = NULL;
+        struct db_file *db_f = (struct db_file *)db_file;
+        uint64_t end = DB_FILE_DATA_OFFSET;
+        uint64_t i = 0;
+
+        if (db_f == NULL || (lacunes == NULL && count != 0) ||
+                        db_f->version != DB_FILE_VERSION ||
+                        db_f->free_count != 0 || size < DB_FILE_DATA_OFFSET) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (fstat(db_f->fd, &st) != 0)
+                return -1;
+
+        /* Mapped file may be bigger by the growth step */
+        if ((uint64_t)st.st_size < size) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        qsort(lacunes, count, sizeof(*lacunes), db_file_lacune_cmp);
+
+        for (i = 0; i < count; i++) {
+                if (lacunes[i].offset < end || lacunes[i].size == 0 ||
+                                lacunes[i].size > size - lacunes[i].offset)
+                        goto exit_on_fail;
+
+                /* Adjacent lacunes are merged as by db_file_load() */
+                if (block != NULL && block->offset + block->size ==
+                                lacunes[i].offset) {
+                        db_file_remove_block(db_f, block);
+                        block->size += lacunes[i].size;
+                } else {
+                        block = db_file_new_block(db_f, lacunes[i].offset,
+                                                  lacunes[i].size);
+                        if (block == NULL) {
+                                errno = ENOMEM;
+                                goto exit_on_fail;
+                        }
+                }
+
+                db_file_add_block(db_f, block, 0);
+                end = lacunes[i].offset + lacunes[i].size;
+        }
+
+        /* The file must not end with a lacune, see db_file_put_space() */
+        if (block != NULL && block->offset + block->size == size) {
+                db_file_remove_block(db_f, block);
+                size = block->offset;
+                db_file_free_block(db_f, block);
+        }
+
+        db_f->last_offset = size;
+        if ((uint64_t)st.st_size != size && ftruncate(db_f->fd, size) != 0)
+                return -1;
+
+        return 0;
+
+exit_on_fail:
+        if (errno != ENOMEM)
+                errno = EINVAL;
+        db_file_clear_blocks(db_f);
+        return -1;
+}
+
+int db_file_walk_lacunes(void *db_file,
+                         f_db_file_lacune_handler handler,
+                         void *arg)
+{
+        struct avl_traverser trav;
+        struct db_file_block *block = NULL;
+        struct db_file *db_f = (struct db_file *)db_file;
+        uint64_t i = 0;
+
+        if (db_f == NULL || handler == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (db_f->seg != NULL) {
+                for (i = 0; i <= db_f->seg->tag_mask; i++) {
+                        block = db_f->seg->tags[DB_FILE_TAG_BEGIN][i];
+                        for (; block != NULL;
+                                        block = block->tag_next[DB_FILE_TAG_BEGIN])
+                                if (handler(arg, block->offset,
+                                            block->size) != 0)
+                                        return -1;
+                }
+                return 0;
+        }
+
+        block = (struct db_file_block *)
+                        avl_t_first(&trav, db_f->begin_block_table);
+        while (block != NULL) {
+                if (handler(arg, block->offset, block->size) != 0)
+                        return -1;
+                block = (struct db_file_block *)avl_t_next(&trav);
+        }
+
+        return 0;
+}
+
+void db_file_get_stats(void *db_file, struct s_db_file_stats *stats)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        if (db_f == NULL || stats == NULL)
+                return;
+
+        stats->size = db_f->last_offset;
+        stats->free_size = db_f->free_size;
+        stats->free_count = db_f->free_count;
+}
+
+int db_file_get_version(void *db_file)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        if (db_f == NULL)
+                return -1;
+
+        return db_f->version;
+}
+
+int db_file_rewrite_begin(void *db_file)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        char name[DB_FILE_MAX_NAME_LEN + 8];
+        int fd = -1;
+
+        if (db_f == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        snprintf(name, sizeof(name), "%s.new", db_f->file_name);
+        fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0640);
+        if (fd == -1)
+                return -1;
+
+        db_uring_release(db_f->uring);
+        db_f->uring = NULL;
+        db_file_unmap(db_f);
+        close(db_f->fd);
+        db_f->fd = fd;
+
+        if (db_f->backend == DB_FILE_BACKEND_URING) {
+                db_f->uring = db_uring_init(db_f->fd);
+                if (db_f->uring == NULL)
+                        return -1;
+        }
+        db_f->pending = NULL;
+
+        db_file_clear_blocks(db_f);
+
+        return db_file_open_version(db_f);
+}
+
+int db_file_rewrite_end(void *db_file)
+{
+        struct db_file *db_f = (struct db_file *)db_file;
+        char name[DB_FILE_MAX_NAME_LEN + 8];
+
+        if (db_f == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        db_file_write_pending(db_f);
+        db_file_unmap(db_f);
+        if (db_file_sync(db_f) != 0)
+                return -1;
+
+        snprintf(name, sizeof(name), "%s.new", db_f->file_name);
+
+        return rename(name, db_f->file_name);
+}
+
+int db_file_load(void *db_file, f_db_file_record_handler handler, void *arg)
+{
+        struct stat st;
+        struct db_file_block *block = NULL;
+        struct db_file_block *last_block = NULL;
+        struct db_file *db_f = (struct db_file *)db_file;
+        uint8_t *map = NULL;
+        uint64_t file_size = 0;
+        uint64_t offset = 0;
+        uint64_t len = 0;
+        uint64_t size = 0;
+        uint64_t empty_bit = DB_FILE_EMPTY_BLOCK_BIT;
+        uint32_t hdr_size = DB_FILE_HEADER_SIZE;
+        uint32_t len32 = 0;
+        int rc = 0;
+
+        if (db_f == NULL || handler == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (fstat(db_f->fd, &st) != 0)
+                return -1;
+
+        file_size = st.st_size;
+        if (file_size != 0) {
+                map = (uint8_t *)mmap(NULL, file_size, PROT_READ,
+                                      MAP_PRIVATE, db_f->fd, 0);
+                if (map == MAP_FAILED)
+                        return -1;
+
+                madvise(map, file_size, MADV_SEQUENTIAL);
+        }
+
+        if (db_f->version == 1) {
+                empty_bit = DB_FILE_V1_EMPTY_BLOCK_BIT;
+                hdr_size  = DB_FILE_V1_HEADER_SIZE;
+        } else {
+                offset = DB_FILE_DATA_OFFSET;
+        }
+
+        while (offset + hdr_size <= file_size) {
+                if (db_f->version == 1) {
+                        memcpy(&len32, &map[offset], sizeof(uint32_t));
+                        len = ntohl(len32);
+                } else {
+                        memcpy(&len, &map[offset], sizeof(uint64_t));
+                        len = be64toh(len);
+                }
+                size = len & ~empty_bit;
+                if (db_f->version != 1)
+                        size &= ~DB_FILE_RECORD_FLAG;
+
+                /* Torn tail after crash, drop the rest of the file */
+                if (size < hdr_size || size > file_size - offset)
+                        break;
+
+                rc = 1;
+                if (!(len & empty_bit))
+                        rc = handler(arg, offset, &map[offset], size);
+
+                if (rc < 0)
+                        break;
+
+                /* Old format file is rewritten without lacunes */
+                if (rc > 0 && db_f->version != DB_FILE_VERSION) {
+                        rc = 0;
+                } else if (rc > 0 && last_block != NULL &&
+                           last_block->offset + last_block->size == offset) {
+                        /* Merge with the previous lacune */
+                        db_file_remove_block(db_f, last_block);
+                        last_block->size += size;
+                        if (db_file_add_block(db_f, last_block, 1) != 0) {
+                                db_file_free_block(db_f, last_block);
+                                rc = -1;
+                                break;
+                        }
+                        rc = 0;
+                } else if (rc > 0) {
+                        block = db_file_new_block(db_f, offset, size);
+                        if (block == NULL ||
+                                        db_file_add_block(db_f, block,
+                                                !(len & empty_bit)) != 0) {
+                                if (block != NULL)
+                                        db_file_free_block(db_f, block);
+                                rc = -1;
+                                break;
+                        }
+                        last_block = block;
+                        rc = 0;
+                }
+
+                offset += size;
+        }
+
+        if (map != NULL)
+                munmap(map, file_size);
+
+        if (rc != 0)
+                return rc;
+
+        if (db_f->version == 1) {
+                db_f->last_offset = file_size;
+                return 0;
+        }
+
+        /* The file must not end with a lacune, see db_file_put_space() */
+        if (last_block && last_block->offset + last_block->size == offset) {
+                db_file_remove_block(db_f, last_block);
+                offset = last_block->offset;
+                db_file_free_block(db_f, last_block);
+        }
+
+        db_f->last_offset = offset;
+        if (offset != file_size && ftruncate(db_f->fd, offset) != 0)
+                return -1;
+
+        return 0;
 }
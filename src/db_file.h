@@ -9,16 +9,121 @@
  * Provide access to the one file.
  * Manage free space (lacune) after removing data.
  *
- * Each data in the file starts with 4 byte with total length.
- * If space not used, then one bit in lenght used for mark it.
+ * The file starts with 4 byte magic and 4 byte format version.
+ * Each data in the file starts with 8 byte with total length.
+ * If space not used, then the high bit in lenght used for mark it.
+ * The next bit (DB_FILE_RECORD_FLAG) is left to the owner of the record.
+ *
+ * Files of version 1 (no file header, 4 byte length) are only read
+ * and must be rewritten by db_file_rewrite_begin() before any write.
+ *
+ * The file is kept on release, so the free space index can be
+ * restored by db_file_load() on the next start.
+ *
+ * With DB_FILE_BACKEND_MMAP the file is mapped to the memory and grown
+ * by large chunks, writes are memcpy to the mapping. The mapped file is
+ * cut to the data size on release.
+ *
+ * With DB_FILE_BACKEND_URING writes are copied to the queue and written
+ * by the I/O thread of the file, see db_uring.h.
+ *
+ * Lacunes are indexed by DB_FILE_ALLOCATOR_AVL (best fit over AVL trees,
+ * O(log n)) or by DB_FILE_ALLOCATOR_SEG (segregated fit over size classes
+ * with bitmaps and boundary tag hashes, O(1)).
  */
 
 #include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Max count of record parts in db_file_write_vec(), same as Linux IOV_MAX.
+ */
+#define DB_FILE_MAX_IOV 1024
+
+/**
+ * Current format version of the file.
+ */
+#define DB_FILE_VERSION 2
+
+/**
+ * Offset of the first record, right after the file header.
+ */
+#define DB_FILE_DATA_OFFSET 8
+
+/**
+ * Bit of the record length, which is kept for the owner of the record.
+ * It is not a part of the record size.
+ */
+#define DB_FILE_RECORD_FLAG (1ULL << 62)
+
+/**
+ * Default growth step of the mapped file.
+ */
+#define DB_FILE_MAP_CHUNK (16 * 1024 * 1024)
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief File access backend.
+ */
+enum DB_FILE_BACKEND {
+        DB_FILE_BACKEND_PWRITE, /**< pwrite() and pwritev() syscalls    */
+        DB_FILE_BACKEND_MMAP,   /**< memcpy to the shared file mapping  */
+        DB_FILE_BACKEND_URING   /**< Write-back queue and io_uring      */
+};
+
+/**
+ * @brief Index of free space.
+ */
+enum DB_FILE_ALLOCATOR {
+        DB_FILE_ALLOCATOR_AVL,  /**< Best fit, AVL trees by size and offset */
+        DB_FILE_ALLOCATOR_SEG   /**< Segregated fit, size class lists       */
+};
+
+/**
+ * @brief Free space statistics.
+ */
+struct s_db_file_stats {
+        uint64_t size;          /**< File size up to the last record    */
+        uint64_t free_size;     /**< Total size of lacunes              */
+        uint64_t free_count;    /**< Count of lacunes                   */
+};
+
+/**
+ * @brief Lacune position, see db_file_walk_lacunes() and db_file_restore().
+ */
+struct s_db_file_lacune {
+        uint64_t offset;        /**< Start offset of the lacune */
+        uint64_t size;          /**< Size of the lacune         */
+};
+
+/**
+ * db_file_walk_lacunes() call this function for each lacune.
+ * @param arg Handler arg.
+ * @param offset Lacune offset.
+ * @param size Lacune size.
+ * @return Zero to continue, -1 to stop.
+ */
+typedef int (*f_db_file_lacune_handler)(void *arg,
+                                        uint64_t offset,
+                                        uint64_t size);
+
+/**
+ * db_file_load() call this function for each used record.
+ * @param arg Handler arg.
+ * @param offset Record offset.
+ * @param data Record data, starts with total length field.
+ * @param size Record size.
+ * @return Zero to keep the record, 1 to turn it into a lacune,
+ * -1 to stop loading.
+ */
+typedef int (*f_db_file_record_handler)(void *arg,
+                                        uint64_t offset,
+                                        const uint8_t *data,
+                                        uint64_t size);
+
 /**
  * @brief Initialize DB file.
  * @param file_name Unique file name.
@@ -28,7 +133,7 @@ extern "C" {
 void *db_file_init(const char *file_name);
 
 /**
- * @brief Release all resources.
+ * @brief Release all resources. The file itself is not removed.
  * @param db_file DB file.
  */
 void db_file_release(void *db_file);
@@ -39,15 +144,27 @@ void db_file_release(void *db_file);
  * @param size Requested size.
  * @return File offset.
  */
-uint32_t db_file_get_space(void *db_file, uint32_t size);
+uint64_t db_file_get_space(void *db_file, uint64_t size);
+
+/**
+ * @brief Get start offset of the lacune space, which ends below the limit.
+ * Used to move records closer to the file start. The file never grows.
+ * @param db_file DB file.
+ * @param size Requested size.
+ * @param limit Space must end at or below this offset.
+ * @return File offset, or 0 if no lacune fits.
+ */
+uint64_t db_file_get_space_below(void *db_file, uint64_t size, uint64_t limit);
 
 /**
  * @brief Put unused space.
+ * Space is merged with free neighbours, the file is cut,
+ * if the space ends at the file tail.
  * @param db_file DB file.
  * @param offset Offset of unused space.
  * @param size Size of unused space.
  */
-void db_file_put_space(void *db_file, uint32_t offset, uint32_t size);
+void db_file_put_space(void *db_file, uint64_t offset, uint64_t size);
 
 /**
  * @brief Write data to the file.
@@ -59,10 +176,178 @@ void db_file_put_space(void *db_file, uint32_t offset, uint32_t size);
  * On error, -1 is returned, and errno is set.
  */
 int db_file_write_data(void *db_file,
-                       uint32_t offset,
+                       uint64_t offset,
                        uint8_t *data,
                        uint32_t size);
 
+/**
+ * @brief Write the whole record by one syscall.
+ * If space for the record was split from a lacune, the header of
+ * the rest of lacune is written by the same syscall.
+ * @param db_file DB file.
+ * @param offset Write offset.
+ * @param iov Record parts.
+ * @param iovcnt Count of parts, less than DB_FILE_MAX_IOV.
+ * @return On success, the number of record bytes written is returned.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_write_vec(void *db_file,
+                      uint64_t offset,
+                      const struct iovec *iov,
+                      int iovcnt);
+
+/**
+ * @brief Read data from the file.
+ * Mapped data is copied without syscall.
+ * @param db_file DB file.
+ * @param offset Read offset.
+ * @param data Buffer.
+ * @param size Size of data.
+ * @return On success, the number of bytes read is returned.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_read_data(void *db_file,
+                      uint64_t offset,
+                      uint8_t *data,
+                      uint32_t size);
+
+/**
+ * @brief Select file access backend.
+ * Must be called before the first write.
+ * @param db_file DB file.
+ * @param backend DB_FILE_BACKEND_PWRITE or DB_FILE_BACKEND_MMAP.
+ * @param map_chunk Growth step of the mapped file, 0 for default.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_set_backend(void *db_file, int backend, uint64_t map_chunk);
+
+/**
+ * @brief Select index of free space.
+ * Must be called before db_file_load() and the first db_file_put_space().
+ * @param db_file DB file.
+ * @param allocator DB_FILE_ALLOCATOR_AVL or DB_FILE_ALLOCATOR_SEG.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set
+ * (EBUSY if the file already has lacunes).
+ */
+int db_file_set_allocator(void *db_file, int allocator);
+
+/**
+ * @brief Get sequence number of the last queued write.
+ * @param db_file DB file.
+ * @return Sequence number for db_file_wait_writes(),
+ * 0 if the backend writes at once.
+ */
+uint64_t db_file_get_write_seq(void *db_file);
+
+/**
+ * @brief Wait until queued writes up to given sequence number are done.
+ * @param db_file DB file.
+ * @param seq Sequence number from db_file_get_write_seq().
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_wait_writes(void *db_file, uint64_t seq);
+
+/**
+ * @brief Set lazy mode.
+ * In lazy mode lacune headers and file truncate are deferred
+ * until db_file_flush().
+ * @param db_file DB file.
+ * @param lazy Non-zero value to enable.
+ */
+void db_file_set_lazy(void *db_file, int lazy);
+
+/**
+ * @brief Write deferred lacune headers and truncate the file.
+ * @param db_file DB file.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_flush(void *db_file);
+
+/**
+ * @brief Sync file data to the disk, msync() for the mapped file.
+ * @param db_file DB file.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_sync(void *db_file);
+
+/**
+ * @brief Scan existing file content.
+ * Rebuilds free space index from the lacune headers, calls handler
+ * for each used record and cuts off a torn tail of the file.
+ * @param db_file DB file.
+ * @param handler Record handler.
+ * @param arg Handler arg.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_load(void *db_file, f_db_file_record_handler handler, void *arg);
+
+/**
+ * @brief Restore free space index without scan of the file.
+ * Used instead of db_file_load(), if the index was saved elsewhere,
+ * e.g. in node snapshot. Lacune headers must be in the file already.
+ * @param db_file DB file.
+ * @param size File size up to the last record.
+ * @param lacunes Lacunes in any order, sorted by offset on return.
+ * @param count Count of lacunes.
+ * @return On success, return zero.
+ * On error (lacunes overlap or go out of the file), -1 is returned,
+ * and errno is set.
+ */
+int db_file_restore(void *db_file,
+                    uint64_t size,
+                    struct s_db_file_lacune *lacunes,
+                    uint64_t count);
+
+/**
+ * @brief Call handler for each lacune in the free space index.
+ * Order of lacunes depends on the index.
+ * @param db_file DB file.
+ * @param handler Lacune handler.
+ * @param arg Handler arg.
+ * @return On success, return zero, -1 if the handler stopped the walk.
+ */
+int db_file_walk_lacunes(void *db_file,
+                         f_db_file_lacune_handler handler,
+                         void *arg);
+
+/**
+ * @brief Get free space statistics.
+ * @param db_file DB file.
+ * @param stats Statistics.
+ */
+void db_file_get_stats(void *db_file, struct s_db_file_stats *stats);
+
+/**
+ * @brief Get format version of the file.
+ * @param db_file DB file.
+ * @return Version, or -1 on error.
+ */
+int db_file_get_version(void *db_file);
+
+/**
+ * @brief Start rewrite of the file in the current format.
+ * Following writes go to the new empty file, free space index is dropped.
+ * The old file is kept until db_file_rewrite_end().
+ * @param db_file DB file.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_rewrite_begin(void *db_file);
+
+/**
+ * @brief Sync the new file and replace the old one.
+ * @param db_file DB file.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_file_rewrite_end(void *db_file);
+
 #ifdef __cplusplus
 }
 #endif
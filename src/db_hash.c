@@ -0,0 +1,587 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "db_hash.h"
+
+#define DB_HASH_GROUP_SIZE      16
+#define DB_HASH_EMPTY           0x80
+#define DB_HASH_DELETED         0xFE
+#define DB_HASH_H2_MASK         0x7F
+#define DB_HASH_SEED            0x9E3779B97F4A7C15ULL
+
+/**
+ * @brief Slot array, one block: the header, control bytes and items.
+ */
+struct s_db_hash_table {
+        uint8_t *ctrl;          /**< Control byte of each slot */
+        void **slots;           /**< Items */
+        uint64_t groups;        /**< Count of groups, power of two */
+} __attribute__((aligned(DB_HASH_GROUP_SIZE)));
+
+struct s_db_hash {
+        struct s_db_hash_table *table; /**< Slot array, lookups load it once */
+        uint64_t count;         /**< Count of items */
+        uint64_t growth_left;   /**< Empty slots to fill before the growth */
+        f_db_hash_func hash;
+        f_db_hash_equal equal;
+        f_db_hash_retire retire; /**< Frees the replaced slot array */
+        void *retire_arg;
+};
+
+/**
+ * @brief Bit mask of the group slots, whose control byte is given.
+ */
+static inline uint32_t db_hash_match(const uint8_t *ctrl, uint8_t byte)
+{
+#ifdef __SSE2__
+        __m128i group = _mm_load_si128((const __m128i *)ctrl);
+        __m128i match = _mm_set1_epi8((char)byte);
+
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, match));
+#else
+        uint32_t mask = 0;
+        int i = 0;
+
+        for (i = 0; i < DB_HASH_GROUP_SIZE; i++) {
+                if (__atomic_load_n(&ctrl[i], __ATOMIC_RELAXED) == byte)
+                        mask |= 1U << i;
+        }
+
+        return mask;
+#endif
+}
+
+/**
+ * @brief Bit mask of the empty or deleted group slots.
+ */
+static inline uint32_t db_hash_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+        __m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+        return (uint32_t)_mm_movemask_epi8(group);
+#else
+        uint32_t mask = 0;
+        int i = 0;
+
+        for (i = 0; i < DB_HASH_GROUP_SIZE; i++) {
+                if (ctrl[i] & DB_HASH_EMPTY)
+                        mask |= 1U << i;
+        }
+
+        return mask;
+#endif
+}
+
+/**
+ * @brief Max count of items, 7/8 of slots.
+ */
+static uint64_t db_hash_max_count(uint64_t groups)
+{
+        return groups * DB_HASH_GROUP_SIZE / 8 * 7;
+}
+
+static struct s_db_hash_table *db_hash_alloc(uint64_t groups)
+{
+        struct s_db_hash_table *table = NULL;
+        uint64_t slots = groups * DB_HASH_GROUP_SIZE;
+        void *block = NULL;
+
+        /* Groups are loaded by aligned reads */
+        if (posix_memalign(&block, DB_HASH_GROUP_SIZE, sizeof(*table) +
+                           slots + slots * sizeof(void *)) != 0) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        table = (struct s_db_hash_table *)block;
+        table->ctrl = (uint8_t *)&table[1];
+        table->slots = (void **)&table->ctrl[slots];
+        table->groups = groups;
+        memset(table->ctrl, DB_HASH_EMPTY, slots);
+
+        return table;
+}
+
+/**
+ * @brief Find the free slot of the hash.
+ * @return Slot index.
+ */
+static uint64_t db_hash_find_free(struct s_db_hash_table *table, uint64_t h)
+{
+        uint64_t mask = table->groups - 1;
+        uint64_t g = (h >> 7) & mask;
+        uint64_t step = 0;
+        uint32_t bits = 0;
+
+        /* Index is never full, the free slot is there */
+        for (;;) {
+                bits = db_hash_match_free(&table->ctrl[g * DB_HASH_GROUP_SIZE]);
+                if (bits != 0)
+                        return g * DB_HASH_GROUP_SIZE + __builtin_ctz(bits);
+
+                step++;
+                g = (g + step) & mask;
+        }
+}
+
+/**
+ * @brief Fill the slot, lookups see the item before the control byte.
+ */
+static inline void db_hash_fill(struct s_db_hash_table *table, uint64_t slot,
+                                void *item, uint64_t h)
+{
+        __atomic_store_n(&table->slots[slot], item, __ATOMIC_RELAXED);
+        __atomic_store_n(&table->ctrl[slot], (uint8_t)(h & DB_HASH_H2_MASK),
+                         __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Move items to the new slot array, deleted slots are dropped.
+ */
+static int db_hash_resize(struct s_db_hash *t, uint64_t groups)
+{
+        struct s_db_hash_table *old = t->table;
+        struct s_db_hash_table *table = NULL;
+        uint64_t i = 0;
+        uint64_t slot = 0;
+        uint64_t h = 0;
+
+        table = db_hash_alloc(groups);
+        if (table == NULL)
+                return -1;
+
+        for (i = 0; i < old->groups * DB_HASH_GROUP_SIZE; i++) {
+                if (old->ctrl[i] & DB_HASH_EMPTY)
+                        continue;
+
+                h = t->hash(old->slots[i]);
+                slot = db_hash_find_free(table, h);
+                table->ctrl[slot] = h & DB_HASH_H2_MASK;
+                table->slots[slot] = old->slots[i];
+        }
+
+        t->growth_left = db_hash_max_count(groups) - t->count;
+
+        /* Lookups may still read the old array */
+        __atomic_store_n(&t->table, table, __ATOMIC_RELEASE);
+        if (t->retire != NULL)
+                t->retire(t->retire_arg, old);
+        else
+                free(old);
+
+        return 0;
+}
+
+void *db_hash_create(f_db_hash_func hash, f_db_hash_equal equal)
+{
+        struct s_db_hash *t = NULL;
+
+        if (hash == NULL || equal == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        t = (struct s_db_hash *)malloc(sizeof(struct s_db_hash));
+        if (t == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        memset(t, 0, sizeof(struct s_db_hash));
+        t->hash = hash;
+        t->equal = equal;
+
+        t->table = db_hash_alloc(1);
+        if (t->table == NULL) {
+                free(t);
+                return NULL;
+        }
+        t->growth_left = db_hash_max_count(1);
+
+        return t;
+}
+
+void db_hash_destroy(void *hash)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        if (t == NULL)
+                return;
+
+        free(t->table);
+        free(t);
+}
+
+void db_hash_set_retire(void *hash, f_db_hash_retire retire, void *arg)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        if (t == NULL)
+                return;
+
+        t->retire = retire;
+        t->retire_arg = arg;
+}
+
+int db_hash_reserve(void *hash, uint64_t count)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        uint64_t groups = 0;
+
+        if (t == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        groups = t->table->groups;
+        while (db_hash_max_count(groups) < count)
+                groups *= 2;
+
+        if (groups == t->table->groups)
+                return 0;
+
+        return db_hash_resize(t, groups);
+}
+
+int db_hash_insert(void *hash, void *item)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        uint64_t slot = 0;
+        uint64_t h = 0;
+
+        if (t == NULL || item == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* Grow, unless most of used slots are deleted ones */
+        if (t->growth_left == 0) {
+                uint64_t groups = t->table->groups;
+
+                if (t->count >= db_hash_max_count(groups) / 2)
+                        groups *= 2;
+                if (db_hash_resize(t, groups) != 0)
+                        return -1;
+        }
+
+        h = t->hash(item);
+        slot = db_hash_find_free(t->table, h);
+
+        if (t->table->ctrl[slot] == DB_HASH_EMPTY)
+                t->growth_left--;
+
+        db_hash_fill(t->table, slot, item, h);
+        t->count++;
+
+        return 0;
+}
+
+void *db_hash_find(void *hash, const void *key)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+
+        if (t == NULL)
+                return NULL;
+
+        return db_hash_find_by(hash, key, t->equal);
+}
+
+void *db_hash_find_by(void *hash, const void *key, f_db_hash_equal equal)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        struct s_db_hash_table *table = NULL;
+        const uint8_t *ctrl = NULL;
+        uint64_t mask = 0;
+        uint64_t step = 0;
+        uint64_t g = 0;
+        uint64_t h = 0;
+        uint32_t bits = 0;
+        void *item = NULL;
+
+        if (t == NULL || key == NULL)
+                return NULL;
+
+        h = t->hash(key);
+        table = __atomic_load_n(&t->table, __ATOMIC_ACQUIRE);
+        mask = table->groups - 1;
+        g = (h >> 7) & mask;
+
+        for (step = 0; step <= mask; step++) {
+                ctrl = &table->ctrl[g * DB_HASH_GROUP_SIZE];
+
+                /* Pairs with the release store of the control byte */
+                bits = db_hash_match(ctrl, h & DB_HASH_H2_MASK);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                while (bits != 0) {
+                        item = __atomic_load_n(&table->slots[g *
+                                               DB_HASH_GROUP_SIZE +
+                                               __builtin_ctz(bits)],
+                                               __ATOMIC_RELAXED);
+                        if (equal(item, key))
+                                return item;
+                        bits &= bits - 1;
+                }
+
+                if (db_hash_match(ctrl, DB_HASH_EMPTY) != 0)
+                        return NULL;
+
+                g = (g + step + 1) & mask;
+        }
+
+        return NULL;
+}
+
+int db_hash_delete(void *hash, const void *item)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        uint8_t *ctrl = NULL;
+        uint64_t mask = 0;
+        uint64_t step = 0;
+        uint64_t slot = 0;
+        uint64_t g = 0;
+        uint64_t h = 0;
+        uint32_t bits = 0;
+
+        if (t == NULL || item == NULL)
+                return -1;
+
+        h = t->hash(item);
+        mask = t->table->groups - 1;
+        g = (h >> 7) & mask;
+
+        for (step = 0; step <= mask; step++) {
+                ctrl = &t->table->ctrl[g * DB_HASH_GROUP_SIZE];
+
+                bits = db_hash_match(ctrl, h & DB_HASH_H2_MASK);
+                while (bits != 0) {
+                        slot = g * DB_HASH_GROUP_SIZE + __builtin_ctz(bits);
+                        if (t->table->slots[slot] == item)
+                                goto found;
+                        bits &= bits - 1;
+                }
+
+                if (db_hash_match(ctrl, DB_HASH_EMPTY) != 0)
+                        return -1;
+
+                g = (g + step + 1) & mask;
+        }
+
+        return -1;
+
+found:
+        /* Lookups stop at this group anyway, if it has an empty slot */
+        if (db_hash_match(ctrl, DB_HASH_EMPTY) != 0) {
+                __atomic_store_n(&t->table->ctrl[slot], DB_HASH_EMPTY,
+                                 __ATOMIC_RELAXED);
+                t->growth_left++;
+        } else {
+                __atomic_store_n(&t->table->ctrl[slot], DB_HASH_DELETED,
+                                 __ATOMIC_RELAXED);
+        }
+
+        t->count--;
+        return 0;
+}
+
+uint64_t db_hash_count(void *hash)
+{
+        struct s_db_hash *t = (struct s_db_hash *)hash;
+        if (t == NULL)
+                return 0;
+
+        return t->count;
+}
+
+uint64_t db_hash_bytes(const uint8_t *data, uint32_t size)
+{
+        const uint64_t m = 0xC6A4A7935BD1E995ULL;
+        const int r = 47;
+        uint64_t h = DB_HASH_SEED ^ (size * m);
+        uint64_t k = 0;
+        uint32_t i = 0;
+
+        for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+                memcpy(&k, &data[i], sizeof(uint64_t));
+
+                k *= m;
+                k ^= k >> r;
+                k *= m;
+
+                h ^= k;
+                h *= m;
+        }
+
+        if (i < size) {
+                k = 0;
+                memcpy(&k, &data[i], size - i);
+                h ^= k;
+                h *= m;
+        }
+
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+
+        return h;
+}
+
+#define DB_FP_C1                0x87C37B91114253D5ULL
+#define DB_FP_C2                0x4CF5AD432745937FULL
+
+static inline uint64_t db_fp_rotl(uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t db_fp_mix(uint64_t k)
+{
+        k ^= k >> 33;
+        k *= 0xFF51AFD7ED558CCDULL;
+        k ^= k >> 33;
+        k *= 0xC4CEB9FE1A85EC53ULL;
+        k ^= k >> 33;
+
+        return k;
+}
+
+static inline void db_fp_block(struct s_db_fp *fp, const uint8_t *block)
+{
+        uint64_t k1 = 0;
+        uint64_t k2 = 0;
+
+        memcpy(&k1, &block[0], sizeof(uint64_t));
+        memcpy(&k2, &block[8], sizeof(uint64_t));
+
+        k1 *= DB_FP_C1;
+        k1  = db_fp_rotl(k1, 31);
+        k1 *= DB_FP_C2;
+        fp->h[0] ^= k1;
+
+        fp->h[0]  = db_fp_rotl(fp->h[0], 27);
+        fp->h[0] += fp->h[1];
+        fp->h[0]  = fp->h[0] * 5 + 0x52DCE729;
+
+        k2 *= DB_FP_C2;
+        k2  = db_fp_rotl(k2, 33);
+        k2 *= DB_FP_C1;
+        fp->h[1] ^= k2;
+
+        fp->h[1]  = db_fp_rotl(fp->h[1], 31);
+        fp->h[1] += fp->h[0];
+        fp->h[1]  = fp->h[1] * 5 + 0x38495AB5;
+}
+
+void db_fp_init(struct s_db_fp *fp)
+{
+        memset(fp, 0, sizeof(struct s_db_fp));
+        fp->h[0] = DB_HASH_SEED;
+        fp->h[1] = DB_HASH_SEED;
+}
+
+void db_fp_update(struct s_db_fp *fp, const uint8_t *data, uint32_t size)
+{
+        uint32_t i = 0;
+        uint32_t cp = 0;
+
+        fp->len += size;
+
+        /* Block split between parts */
+        if (fp->tail_len != 0) {
+                cp = DB_HASH_FP_BLOCK - fp->tail_len;
+                if (cp > size)
+                        cp = size;
+
+                memcpy(&fp->tail[fp->tail_len], data, cp);
+                fp->tail_len += cp;
+                i = cp;
+
+                if (fp->tail_len < DB_HASH_FP_BLOCK)
+                        return;
+
+                db_fp_block(fp, fp->tail);
+                fp->tail_len = 0;
+        }
+
+        for (; i + DB_HASH_FP_BLOCK <= size; i += DB_HASH_FP_BLOCK)
+                db_fp_block(fp, &data[i]);
+
+        if (i < size) {
+                memcpy(fp->tail, &data[i], size - i);
+                fp->tail_len = size - i;
+        }
+}
+
+void db_fp_final(struct s_db_fp *fp)
+{
+        uint64_t k1 = 0;
+        uint64_t k2 = 0;
+
+        if (fp->ready)
+                return;
+
+        if (fp->tail_len > sizeof(uint64_t)) {
+                memcpy(&k2, &fp->tail[8], fp->tail_len - sizeof(uint64_t));
+                k2 *= DB_FP_C2;
+                k2  = db_fp_rotl(k2, 33);
+                k2 *= DB_FP_C1;
+                fp->h[1] ^= k2;
+        }
+
+        if (fp->tail_len != 0) {
+                memcpy(&k1, fp->tail, (fp->tail_len > sizeof(uint64_t)) ?
+                                      sizeof(uint64_t) : fp->tail_len);
+                k1 *= DB_FP_C1;
+                k1  = db_fp_rotl(k1, 31);
+                k1 *= DB_FP_C2;
+                fp->h[0] ^= k1;
+        }
+
+        fp->h[0] ^= fp->len;
+        fp->h[1] ^= fp->len;
+
+        fp->h[0] += fp->h[1];
+        fp->h[1] += fp->h[0];
+
+        fp->h[0] = db_fp_mix(fp->h[0]);
+        fp->h[1] = db_fp_mix(fp->h[1]);
+
+        fp->h[0] += fp->h[1];
+        fp->h[1] += fp->h[0];
+
+        fp->ready = 1;
+}
+
+void db_fp_bytes(const uint8_t *data, uint32_t size, uint64_t h[2])
+{
+        struct s_db_fp fp;
+
+        db_fp_init(&fp);
+        db_fp_update(&fp, data, size);
+        db_fp_final(&fp);
+
+        h[0] = fp.h[0];
+        h[1] = fp.h[1];
+}
+
+uint32_t db_hash_jump(uint64_t key, uint32_t buckets)
+{
+        int64_t b = -1;
+        int64_t j = 0;
+
+        if (buckets == 0)
+                return 0;
+
+        /* Lamping and Veach, the key jumps forward to its last bucket */
+        while (j < (int64_t)buckets) {
+                b = j;
+                key = key * 2862933555777941757ULL + 1;
+                j = (int64_t)((b + 1) * ((double)(1LL << 31) /
+                                         (double)((key >> 33) + 1)));
+        }
+
+        return (uint32_t)b;
+}
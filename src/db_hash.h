@@ -0,0 +1,197 @@
+#ifndef DB_HASH_H
+#define DB_HASH_H
+
+/**
+ * @file db_hash.h
+ * @author Sviatoslav
+ * @brief Open addressing hash index of items.
+ *
+ * Slots are split into groups of 16. Each slot has a control byte:
+ * empty, deleted or the low 7 bits of the item hash. The group of
+ * control bytes is compared with the hash bits by one SSE2 instruction,
+ * so items are touched only on a likely match. Groups are probed
+ * by triangular steps, lookup stops at the group with an empty slot.
+ *
+ * The index keeps pointers only, the hash of each item is given by
+ * the owner, so it may be cached in the item. The index has no locks.
+ * Lookups may run beside one writer: the item is stored before its
+ * control byte, and the grown slot array is published by one pointer.
+ * The replaced array is given to the retire function, so the owner frees
+ * it after lookups, which may read it, are over.
+ *
+ * Content fingerprint is the 128-bit MurmurHash3 (x64) of data. It may be
+ * computed by parts, while the data is read, so large values are hashed
+ * once while they are still in cache.
+ *
+ * Keys and values are spread between nodes by the jump consistent hash
+ * of their fingerprint, so few of them move, when nodes are added.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DB_HASH_FP_BLOCK        16
+
+/**
+ * @brief State of the content fingerprint.
+ */
+struct s_db_fp {
+        uint64_t h[2];          /**< Fingerprint, after db_fp_final() */
+        uint64_t len;           /**< Size of hashed data */
+        uint8_t tail[DB_HASH_FP_BLOCK]; /**< Data after the last block */
+        uint32_t tail_len;
+        int ready;              /**< Fingerprint is final */
+};
+
+/**
+ * @brief Get hash of the item or of the lookup key.
+ * @param item Item.
+ * @return Hash.
+ */
+typedef uint64_t (*f_db_hash_func)(const void *item);
+
+/**
+ * @brief Compare the item with the lookup key of the same hash.
+ * @param item Item of the index.
+ * @param key Lookup key.
+ * @return Non-zero value, if they are equal.
+ */
+typedef int (*f_db_hash_equal)(const void *item, const void *key);
+
+/**
+ * @brief Free the replaced slot array by free(), when lookups are over.
+ * @param arg Argument given to db_hash_set_retire().
+ * @param ptr Slot array.
+ */
+typedef void (*f_db_hash_retire)(void *arg, void *ptr);
+
+/**
+ * @brief Create empty index.
+ * @param hash Hash function.
+ * @param equal Equality function.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_hash_create(f_db_hash_func hash, f_db_hash_equal equal);
+
+/**
+ * @brief Free the index, items are not freed.
+ * @param hash Hash index.
+ */
+void db_hash_destroy(void *hash);
+
+/**
+ * @brief Set the function, which frees replaced slot arrays.
+ * Without it they are freed at once.
+ * @param hash Hash index.
+ * @param retire Retire function, may be NULL.
+ * @param arg Argument of the function.
+ */
+void db_hash_set_retire(void *hash, f_db_hash_retire retire, void *arg);
+
+/**
+ * @brief Grow the index to hold the given count of items.
+ * @param hash Hash index.
+ * @param count Count of items.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_hash_reserve(void *hash, uint64_t count);
+
+/**
+ * @brief Insert the item.
+ * Caller makes sure, that the equal item is not there.
+ * @param hash Hash index.
+ * @param item Item.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_hash_insert(void *hash, void *item);
+
+/**
+ * @brief Find the item equal to the key.
+ * May be called beside the writer, see db_hash_set_retire().
+ * @param hash Hash index.
+ * @param key Lookup key.
+ * @return Found item, NULL if there is no such item.
+ */
+void *db_hash_find(void *hash, const void *key);
+
+/**
+ * @brief Find the item by the given equality, e.g. by pointer.
+ * Hash of the key is got by the hash function of the index.
+ * @param hash Hash index.
+ * @param key Lookup key.
+ * @param equal Equality function.
+ * @return Found item, NULL if there is no such item.
+ */
+void *db_hash_find_by(void *hash, const void *key, f_db_hash_equal equal);
+
+/**
+ * @brief Delete the item, it is found by pointer.
+ * @param hash Hash index.
+ * @param item Item.
+ * @return On success, return zero, -1 if the item is not there.
+ */
+int db_hash_delete(void *hash, const void *item);
+
+/**
+ * @brief Get count of items.
+ * @param hash Hash index.
+ * @return Count of items.
+ */
+uint64_t db_hash_count(void *hash);
+
+/**
+ * @brief Hash of the byte string, 64-bit MurmurHash2.
+ * @param data Data.
+ * @param size Size of data.
+ * @return Hash.
+ */
+uint64_t db_hash_bytes(const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Jump consistent hash of the key to one of buckets.
+ * When buckets are added, only keys, which go to the new buckets, move.
+ * @param key Hash of the key, e.g. a word of its fingerprint.
+ * @param buckets Count of buckets.
+ * @return Bucket in range [0, buckets), 0 if there are no buckets.
+ */
+uint32_t db_hash_jump(uint64_t key, uint32_t buckets);
+
+/**
+ * @brief Start the fingerprint.
+ * @param fp Fingerprint state.
+ */
+void db_fp_init(struct s_db_fp *fp);
+
+/**
+ * @brief Add the next part of data to the fingerprint.
+ * @param fp Fingerprint state.
+ * @param data Data.
+ * @param size Size of data.
+ */
+void db_fp_update(struct s_db_fp *fp, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Finish the fingerprint, it is set to fp->h.
+ * @param fp Fingerprint state.
+ */
+void db_fp_final(struct s_db_fp *fp);
+
+/**
+ * @brief Fingerprint of the whole data.
+ * @param data Data.
+ * @param size Size of data.
+ * @param h Fingerprint.
+ */
+void db_fp_bytes(const uint8_t *data, uint32_t size, uint64_t h[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_HASH_H */
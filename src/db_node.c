@@ -2,26 +2,205 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <errno.h>
 
 #include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "db_node.h"
 #include "db_file.h"
-#include "list.h"
+#include "db_blob.h"
+#include "db_hash.h"
+#include "db_slab.h"
+#include "db_bloom.h"
+#include "db_epoch.h"
 #include "avl.h"
 
-struct s_db_node_iterator {
-        struct s_db_item *current;
+/* Total length, value node id, value offset */
+#define DB_NODE_LEN_SIZE        sizeof(uint64_t)
+#define DB_NODE_REF_SIZE        (sizeof(uint32_t) + sizeof(uint64_t))
+/* Key size of the inline record */
+#define DB_NODE_INLINE_SIZE     sizeof(uint32_t)
+/* Blob log segment, value size, blob log offset */
+#define DB_NODE_BLOB_SIZE       (2 * sizeof(uint32_t) + sizeof(uint64_t))
+#define DB_NODE_MAX_HEADER_SIZE (DB_NODE_LEN_SIZE + DB_NODE_BLOB_SIZE)
+
+/* Version 1 record: 4 byte length, 4 byte node id, 4 byte offset */
+#define DB_NODE_V1_LEN_SIZE     sizeof(uint32_t)
+#define DB_NODE_V1_REF_SIZE     (2 * sizeof(uint32_t))
+
+/* Snapshot file, see db_node.h */
+#define DB_NODE_SNAP_MAGIC      0x44424E53 /* "DBNS" */
+#define DB_NODE_SNAP_VERSION    3 /* Version 1 had no byte order tables,
+                                     version 2 had no fingerprint order */
+#define DB_NODE_SNAP_HDR_SIZE   32
+#define DB_NODE_SNAP_LACUNE_SIZE 16
+#define DB_NODE_SNAP_ITEM_SIZE  32
+#define DB_NODE_SNAP_BLOB_BIT   0x80000000
+#define DB_NODE_SNAP_INLINE_ID  UINT32_MAX
+
+/* Size classes of data in the node arena, larger data is malloc'ed */
+static const uint32_t db_node_data_classes[] = {
+        16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+#define DB_NODE_DATA_CLASSES \
+        (sizeof(db_node_data_classes) / sizeof(db_node_data_classes[0]))
+
+/* Retired objects, freed after readers without locks leave */
+#define DB_NODE_LIMBO_MIN       64
+#define DB_NODE_RETIRED_ITEM    0 /* Item and its data */
+#define DB_NODE_RETIRED_ARENA   1 /* Data of the node arena */
+#define DB_NODE_RETIRED_HEAP    2 /* Data or hash slots by malloc */
+
+/* Initial size of the item vector */
+#define DB_NODE_ITEMS_MIN       1024
+/* Items to look ahead, while the item vector is walked */
+#define DB_NODE_PREFETCH        8
+
+/* Stripes of the node lock, a power of two, see db_node_wrlock_fp() */
+#define DB_NODE_STRIPES         16
+#define DB_NODE_LINE_SIZE       64
+
+struct s_db_node_load {
+        struct s_db_node *db_node;
+        int version;    /**< Format version of the node file */
+        f_db_node_ref_handler ref_handler;
+        f_db_node_dup_handler dup_handler;
+        void *arg;
+};
+
+/**
+ * @brief Buffered writer of the snapshot.
+ */
+struct s_db_node_snap {
+        int fd;
+        uint8_t *buf;
+        uint32_t len;
+        uint64_t lacunes;       /**< Count of written lacunes */
+        int rc;
+};
+
+/**
+ * @brief Record of the compaction pass, to move or moved, which keeps
+ * its old file space.
+ */
+struct s_db_node_moved {
+        struct s_db_item *item;
+        uint64_t f_offset;      /**< Old offset in file */
+        uint64_t f_size;        /**< Old used space size */
+};
+
+/**
+ * @brief Item with the tail, see DB_ITEM_TAIL.
+ * Data up to DB_ITEM_EMBED_SIZE is never kept in the blob log,
+ * so the tail holds one of them.
+ */
+struct s_db_item_tail {
+        struct s_db_item item;
+        union {
+                uint8_t embed[DB_ITEM_EMBED_SIZE]; /**< DB_ITEM_EMBED */
+                struct {
+                        uint64_t offset;        /**< Blob log offset */
+                        uint32_t segment;       /**< Blob log segment */
+                } blob;                         /**< DB_ITEM_BLOB */
+        } u;
 };
 
+/**
+ * @brief Object unlinked from readers, see db_epoch.h.
+ */
+struct s_db_node_retired {
+        void *ptr;
+        uint64_t epoch;         /**< Tag of db_epoch_advance() */
+        int kind;               /**< DB_NODE_RETIRED_... */
+};
+
+/**
+ * @brief Retired objects of the node, kept until db_epoch_safe() passes.
+ */
+struct s_db_node_limbo {
+        struct s_db_node_retired *items;
+        uint32_t count;
+        uint32_t size;
+};
+
+/**
+ * @brief State of the compaction pass.
+ */
+struct s_db_node_compact {
+        struct s_db_node_moved *items; /**< Records to move, sorted by
+                                            offset. Removed items are set
+                                            to NULL, offsets are kept */
+        uint32_t count;           /**< Count of records left to move  */
+        struct s_db_node_moved *moved; /**< Pinned items, sorted by pointer */
+        uint32_t moved_count;
+        uint32_t moved_max;
+        uint64_t target;          /**< Records from it may be moved */
+        int tracking;             /**< Keys of the records are kept */
+        int track_failed;         /**< Some key is lost, no more moves */
+        struct s_db_node_referrer *refs; /**< Keys, added under the latch */
+        struct s_db_node_referrer *taken; /**< Keys of moved items,
+                                               room for refs */
+        uint32_t ref_count;
+        uint32_t ref_max;
+};
+
+/**
+ * @brief Stripe of the node lock.
+ * Items of the stripe are changed by its writer only. Counters are
+ * changed under the write lock of the stripe.
+ */
+struct s_db_node_stripe {
+        pthread_rwlock_t lock;
+        pthread_mutex_t unref_lock; /**< Leaf lock of the unref queue */
+        struct s_db_item **unref; /**< Items without references, removed
+                                       by the next writer */
+        uint32_t unref_count;
+        uint32_t unref_max;
+        uint64_t locks;         /**< Count of write locks of the stripe */
+        uint64_t waits;         /**< Count of them, which waited */
+} __attribute__((aligned(DB_NODE_LINE_SIZE)));
+
 struct s_db_node {
         void * db_file; /**< Pointer to DB file */
-        struct s_db_node_iterator iterator; /**< Items iterator */
         struct avl_table * table; /**< Table contains all items */
-        struct s_list      list;  /**< List for itarate all items */
-        pthread_rwlock_t   rw_lock;
+        void *index;              /**< Hash index of table items */
+        struct s_db_item **items; /**< All items, removed one is replaced
+                                       by the last, see db_node_unlink() */
+        uint32_t item_count;
+        uint32_t item_max;
+        struct s_db_node_stripe stripes[DB_NODE_STRIPES];
+        pthread_mutex_t latch;  /**< Shared state beside stripe writers */
+        uint64_t latch_locks;   /**< Count of latch locks */
+        uint64_t latch_waits;   /**< Count of them, which waited */
+        int lazy;               /**< Defer writes to db_node_flush() */
+        uint32_t dirty_count;   /**< Count of DB_ITEM_DIRTY items */
+        struct s_db_node_compact compact; /**< Compaction pass */
+        void *blob;             /**< Blob log, NULL if not opened */
+        uint32_t blob_size;     /**< Min size of value in the blob log */
+        uint64_t mem_budget;    /**< Max size of item data, 0 - no limit */
+        uint64_t mem_size;      /**< Size of item data in memory,
+                                     readers change it atomically */
+        uint64_t evicted_count; /**< Count of DB_ITEM_EVICTED items */
+        uint64_t read_count;    /**< Count of data reads on demand */
+        uint32_t clock_hand;    /**< Next item to check by CLOCK */
+        void *item_slab;        /**< Slab cache of items */
+        void *tail_slab;        /**< Slab cache of items with the tail,
+                                     shares the page table of item_slab */
+        void *avl_slab;         /**< Slab cache of AVL nodes */
+        void *data_slabs[DB_NODE_DATA_CLASSES]; /**< Arena of item data */
+        struct libavl_allocator avl_alloc; /**< AVL nodes from avl_slab */
+        void *bloom;            /**< Filter of items, checked without locks */
+        uint32_t bloom_bits;    /**< Bits per item, 0 - no filter */
+        struct s_db_node_limbo limbo; /**< Retired items and data */
+        void **ref_nodes;       /**< Nodes of referred items, by id */
 };
 
 int avl_compare(const void *avl_a, const void *avl_b, void *avl_param)
@@ -53,37 +232,447 @@ int avl_compare(const void *avl_a, const void *avl_b, void *avl_param)
         return 0;
 }
 
+static int avl_compare_lex(const void *avl_a, const void *avl_b,
+                           void *avl_param)
+{
+        (void)avl_param;
+        const struct s_db_item *item1 = (const struct s_db_item *)avl_a;
+        const struct s_db_item *item2 = (const struct s_db_item *)avl_b;
+        int size = (item1->size < item2->size) ? item1->size : item2->size;
+        int rc = memcmp(item1->data, item2->data, size);
+
+        if (rc != 0) return rc;
+        if (item1->size < item2->size) return -1;
+        if (item1->size > item2->size) return  1;
+
+        return 0;
+}
+
+static int avl_compare_fp(const void *avl_a, const void *avl_b,
+                          void *avl_param)
+{
+        (void)avl_param;
+        const struct s_db_item *item1 = (const struct s_db_item *)avl_a;
+        const struct s_db_item *item2 = (const struct s_db_item *)avl_b;
+
+        if (item1->size < item2->size) return -1;
+        if (item1->size > item2->size) return  1;
+        if (item1->fp[0] < item2->fp[0]) return -1;
+        if (item1->fp[0] > item2->fp[0]) return  1;
+        if (item1->fp[1] < item2->fp[1]) return -1;
+        if (item1->fp[1] > item2->fp[1]) return  1;
+
+        return memcmp(item1->data, item2->data, item1->size);
+}
+
+static uint64_t db_node_item_hash(const void *item)
+{
+        return ((const struct s_db_item *)item)->fp[0];
+}
+
+static int db_node_item_equal(const void *item, const void *key)
+{
+        const struct s_db_item *item1 = (const struct s_db_item *)item;
+        const struct s_db_item *item2 = (const struct s_db_item *)key;
+        const uint8_t *data = NULL;
+
+        if (item1->fp[0] != item2->fp[0] || item1->fp[1] != item2->fp[1] ||
+                        item1->size != item2->size)
+                return 0;
+
+        /* Readers without locks may race with the eviction */
+        data = __atomic_load_n(&item1->data, __ATOMIC_ACQUIRE);
+        return data != NULL && memcmp(data, item2->data, item1->size) == 0;
+}
+
+static struct s_db_node *db_node_of_alloc(struct libavl_allocator *alloc)
+{
+        return (struct s_db_node *)((uint8_t *)alloc -
+                                    offsetof(struct s_db_node, avl_alloc));
+}
+
+static void *db_node_avl_malloc(struct libavl_allocator *alloc, size_t size)
+{
+        struct s_db_node *db_node = db_node_of_alloc(alloc);
+
+        /* The table itself is the only allocation of the other size */
+        if (size != sizeof(struct avl_node))
+                return malloc(size);
+
+        return db_slab_alloc(db_node->avl_slab);
+}
+
+static void db_node_avl_free(struct libavl_allocator *alloc, void *block)
+{
+        struct s_db_node *db_node = db_node_of_alloc(alloc);
+
+        if (block == db_node->table)
+                free(block);
+        else
+                db_slab_free(block);
+}
+
+/**
+ * @brief Make room for count more items in the item vector.
+ */
+static int db_node_reserve(struct s_db_node *db_node, uint32_t count)
+{
+        struct s_db_item **items = NULL;
+        uint64_t max = db_node->item_max;
+
+        if ((uint64_t)db_node->item_count + count <= max)
+                return 0;
+
+        if (max == 0)
+                max = DB_NODE_ITEMS_MIN;
+        while (max < (uint64_t)db_node->item_count + count)
+                max *= 2;
+        if (max > UINT32_MAX) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        items = (struct s_db_item **)realloc(db_node->items,
+                                             max * sizeof(*items));
+        if (items == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        db_node->items = items;
+        db_node->item_max = max;
+        return 0;
+}
+
+/**
+ * @brief Append the item to the item vector, room is reserved.
+ */
+static void db_node_link(struct s_db_node *db_node, struct s_db_item *item)
+{
+        item->pos = db_node->item_count;
+        db_node->items[db_node->item_count++] = item;
+}
+
+/**
+ * @brief Remove the item from the item vector, the last item takes
+ * its place.
+ */
+static void db_node_unlink(struct s_db_node *db_node, struct s_db_item *item)
+{
+        struct s_db_item *last = db_node->items[--db_node->item_count];
+
+        db_node->items[item->pos] = last;
+        last->pos = item->pos;
+}
+
+static struct s_db_item_tail *db_node_tail(struct s_db_item *item)
+{
+        return (struct s_db_item_tail *)item;
+}
+
+/**
+ * @brief Check if the item of the size goes to the blob log on save.
+ */
+static int db_node_is_blob_size(struct s_db_node *db_node, uint64_t size)
+{
+        return db_node->blob_size != 0 && size >= db_node->blob_size &&
+               size > DB_ITEM_EMBED_SIZE;
+}
+
+/**
+ * @brief Allocate the zeroed item, which gets the tail, if it has small
+ * data or may go to the blob log. Small data is to be copied to data.
+ * @param size Size of data, with the inline value.
+ * @param is_blob Data is in the blob log already, it is not copied.
+ */
+static struct s_db_item *db_node_alloc_item(struct s_db_node *db_node,
+                                            uint64_t size, int is_blob)
+{
+        struct s_db_item *item = NULL;
+        int is_embed = (!is_blob && size <= DB_ITEM_EMBED_SIZE);
+
+        if (is_embed || is_blob || db_node_is_blob_size(db_node, size)) {
+                item = (struct s_db_item *)db_slab_alloc(db_node->tail_slab);
+                if (item == NULL)
+                        return NULL;
+
+                memset(item, 0, sizeof(struct s_db_item_tail));
+                item->flags = DB_ITEM_TAIL;
+        } else {
+                item = (struct s_db_item *)db_slab_alloc(db_node->item_slab);
+                if (item == NULL)
+                        return NULL;
+
+                memset(item, 0, sizeof(struct s_db_item));
+        }
+
+        if (is_embed) {
+                item->data = db_node_tail(item)->u.embed;
+                item->flags |= DB_ITEM_EMBED;
+        }
+
+        return item;
+}
+
+/**
+ * @brief Allocate item data, small data comes from the node arena.
+ * @param is_arena Set to 1, if data is in the arena.
+ */
+static uint8_t *db_node_alloc_data(struct s_db_node *db_node,
+                                   uint64_t size, int *is_arena)
+{
+        uint8_t *data = NULL;
+        uint32_t i = 0;
+
+        *is_arena = 0;
+
+        for (i = 0; i < DB_NODE_DATA_CLASSES; i++) {
+                if (size <= db_node_data_classes[i]) {
+                        data = (uint8_t *)db_slab_alloc(db_node->data_slabs[i]);
+                        *is_arena = (data != NULL);
+                        return data;
+                }
+        }
+
+        data = (uint8_t *)malloc(size);
+        if (data == NULL)
+                errno = ENOMEM;
+
+        return data;
+}
+
+static void db_node_free_bytes(uint8_t *data, int is_arena)
+{
+        if (is_arena)
+                db_slab_free(data);
+        else
+                free(data);
+}
+
+/**
+ * @brief Free data of the item, where it has come from.
+ */
+static void db_node_free_data(struct s_db_item *item)
+{
+        if (!(item->flags & DB_ITEM_EMBED))
+                db_node_free_bytes(item->data, item->flags & DB_ITEM_ARENA);
+        item->data = NULL;
+        item->flags &= ~(DB_ITEM_ARENA | DB_ITEM_EMBED);
+}
+
 static void avl_free_item(void *avl_item, void *avl_param)
 {
         (void)avl_param;
         struct s_db_item *item = (struct s_db_item *)avl_item;
 
-        if (item && item->data != NULL) {
-                free(item->data);
-                item->data = NULL;
+        if (item == NULL)
+                return;
+
+        db_node_free_data(item);
+        db_slab_free(item);
+}
+
+static void db_node_free_retired(struct s_db_node_retired *retired)
+{
+        switch (retired->kind) {
+        case DB_NODE_RETIRED_ITEM:
+                avl_free_item(retired->ptr, NULL);
+                break;
+        case DB_NODE_RETIRED_ARENA:
+                db_slab_free(retired->ptr);
+                break;
+        default:
+                free(retired->ptr);
+                break;
+        }
+}
+
+/**
+ * @brief Free retired objects of tags below the safe epoch.
+ */
+static void db_node_reclaim_below(struct s_db_node *db_node, uint64_t safe)
+{
+        struct s_db_node_limbo *limbo = &db_node->limbo;
+        uint32_t i = 0;
+        uint32_t n = 0;
+
+        for (i = 0; i < limbo->count; i++) {
+                if (limbo->items[i].epoch < safe)
+                        db_node_free_retired(&limbo->items[i]);
+                else
+                        limbo->items[n++] = limbo->items[i];
+        }
+
+        limbo->count = n;
+}
+
+/**
+ * @brief Make room in the limbo for objects, before they are unlinked.
+ * Retire can not wait for readers: the writer is in the epoch itself.
+ * @return On success, return zero, otherwise -1 and errno is set.
+ */
+static int db_node_limbo_reserve(struct s_db_node *db_node, uint32_t n)
+{
+        struct s_db_node_limbo *limbo = &db_node->limbo;
+        struct s_db_node_retired *items = NULL;
+        uint32_t size = 0;
+
+        if (limbo->count + n <= limbo->size / 2)
+                return 0;
+
+        /* Full limbo is reclaimed first, it grows, if readers hold most */
+        if (limbo->count + n > limbo->size)
+                db_node_reclaim_below(db_node, db_epoch_safe());
+        if (limbo->count + n <= limbo->size / 2)
+                return 0;
+
+        size = (limbo->size) ? 2 * limbo->size : DB_NODE_LIMBO_MIN;
+        while (size < limbo->count + n)
+                size *= 2;
+
+        items = (struct s_db_node_retired *)
+                realloc(limbo->items, size * sizeof(*items));
+        if (items != NULL) {
+                limbo->items = items;
+                limbo->size = size;
+        }
+
+        if (limbo->count + n > limbo->size) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Free the object, when readers without locks are out of it.
+ * It must be unlinked already, the room is reserved by
+ * db_node_limbo_reserve(). Node must be locked for write.
+ */
+static void db_node_retire(struct s_db_node *db_node, void *ptr, int kind)
+{
+        struct s_db_node_limbo *limbo = &db_node->limbo;
+        struct s_db_node_retired retired;
+
+        retired.ptr = ptr;
+        retired.kind = kind;
+        retired.epoch = db_epoch_advance();
+
+        if (db_node_limbo_reserve(db_node, 1) != 0) {
+                /* Readers may be in it, the object is kept */
+                printf("%s: DB node limbo is full\n", __FUNCTION__);
+                return;
+        }
+
+        limbo->items[limbo->count++] = retired;
+}
+
+/**
+ * @brief Unlink data of the item and retire it.
+ */
+static void db_node_retire_data(struct s_db_node *db_node,
+                                struct s_db_item *item, uint8_t *data)
+{
+        uint8_t *old = item->data;
+        int kind = (item->flags & DB_ITEM_ARENA) ? DB_NODE_RETIRED_ARENA :
+                                                   DB_NODE_RETIRED_HEAP;
+
+        /* Embed is left as is, it goes with the item */
+        if (item->flags & DB_ITEM_EMBED)
+                old = NULL;
+
+        __atomic_store_n(&item->data, data, __ATOMIC_RELEASE);
+        item->flags &= ~(DB_ITEM_ARENA | DB_ITEM_EMBED);
+
+        if (old != NULL)
+                db_node_retire(db_node, old, kind);
+}
+
+/**
+ * @brief Take the latch of the state shared by stripes: the table,
+ * the index, the item order, the arena, the limbo and the node file.
+ * It is held inside one call only, no node lock is taken under it.
+ */
+static void db_node_latch(struct s_db_node *db_node)
+{
+        if (pthread_mutex_trylock(&db_node->latch) != 0) {
+                pthread_mutex_lock(&db_node->latch);
+                db_node->latch_waits++;
         }
+        db_node->latch_locks++;
+}
+
+static void db_node_unlatch(struct s_db_node *db_node)
+{
+        pthread_mutex_unlock(&db_node->latch);
+}
+
+void db_node_reclaim(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return;
+
+        db_node_latch(db_node);
+        if (db_node->limbo.count != 0)
+                db_node_reclaim_below(db_node, db_epoch_safe());
+        db_node_unlatch(db_node);
+}
 
-        if (item)
-                free(item);
+static void db_node_hash_retire(void *arg, void *ptr)
+{
+        db_node_retire((struct s_db_node *)arg, ptr, DB_NODE_RETIRED_HEAP);
 }
 
 void *db_node_init(const char *node_name)
 {
-        struct s_db_node *db_node = (struct s_db_node *)
-                        malloc(sizeof(struct s_db_node));
-        if (db_node == NULL) {
+        uint32_t i = 0;
+        struct s_db_node *db_node = NULL;
+
+        /* Stripes take a cache line each */
+        if (posix_memalign((void **)&db_node, DB_NODE_LINE_SIZE,
+                           sizeof(struct s_db_node)) != 0) {
                 printf("%s: DB node allocation memory error.\n", __FUNCTION__);
                 return NULL;
         }
 
         memset(db_node, 0, sizeof(struct s_db_node));
 
+        pthread_mutex_init(&db_node->latch, NULL);
+        for (i = 0; i < DB_NODE_STRIPES; i++) {
+                pthread_rwlock_init(&db_node->stripes[i].lock, NULL);
+                pthread_mutex_init(&db_node->stripes[i].unref_lock, NULL);
+        }
+
         db_node->db_file = db_file_init(node_name);
         if (db_node->db_file == NULL)
                 goto exit_on_fail;
 
 
-        db_node->table = avl_create(avl_compare, NULL, NULL);
+        /* Both kinds of items are named by handles of one page table */
+        db_node->item_slab = db_slab_create(sizeof(struct s_db_item));
+        db_node->tail_slab = db_slab_create_shared(
+                sizeof(struct s_db_item_tail), db_node->item_slab);
+        db_node->avl_slab = db_slab_create(sizeof(struct avl_node));
+        if (db_node->item_slab == NULL || db_node->tail_slab == NULL ||
+                        db_node->avl_slab == NULL) {
+                printf("%s:Cannot create slab cache\n", __FUNCTION__);
+                goto exit_on_fail;
+        }
+
+        for (i = 0; i < DB_NODE_DATA_CLASSES; i++) {
+                db_node->data_slabs[i] =
+                        db_slab_create(db_node_data_classes[i]);
+                if (db_node->data_slabs[i] == NULL) {
+                        printf("%s:Cannot create data arena\n", __FUNCTION__);
+                        goto exit_on_fail;
+                }
+        }
+
+        db_node->avl_alloc.libavl_malloc = db_node_avl_malloc;
+        db_node->avl_alloc.libavl_free = db_node_avl_free;
+        db_node->table = avl_create(avl_compare, NULL, &db_node->avl_alloc);
 
         if (db_node->table == NULL) {
                 errno = ENOMEM;
@@ -91,7 +680,13 @@ void *db_node_init(const char *node_name)
                 goto exit_on_fail;
         }
 
-        pthread_rwlock_init(&db_node->rw_lock, NULL);
+        db_node->index = db_hash_create(db_node_item_hash,
+                                        db_node_item_equal);
+        if (db_node->index == NULL) {
+                printf("%s:Cannot create hash index\n", __FUNCTION__);
+                goto exit_on_fail;
+        }
+        db_hash_set_retire(db_node->index, db_node_hash_retire, db_node);
 
         return db_node;
 
@@ -103,217 +698,2565 @@ exit_on_fail:
 void db_node_release(void *node)
 {
         struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_item *item = NULL;
+        uint32_t i = 0;
+
         if (db_node == NULL)
                 return;
 
+        /* Evicted items are not freed with the table */
+        for (i = 0; i < db_node->item_count &&
+                        db_node->evicted_count != 0; i++) {
+                item = db_node->items[i];
+                if (item->flags & DB_ITEM_EVICTED) {
+                        db_node->evicted_count--;
+                        avl_free_item(item, NULL);
+                }
+        }
+
         if (db_node->db_file != NULL)
                 db_file_release(db_node->db_file);
 
+        db_blob_release(db_node->blob);
 
         if (db_node->table != NULL)
                 avl_destroy(db_node->table, avl_free_item);
 
+        db_hash_destroy(db_node->index);
+        db_bloom_destroy(db_node->bloom);
+
+        /* No readers are left, when the node is released */
+        db_node_reclaim_below(db_node, UINT64_MAX);
+        free(db_node->limbo.items);
+        free(db_node->items);
+
+        for (i = 0; i < DB_NODE_STRIPES; i++) {
+                free(db_node->stripes[i].unref);
+                pthread_rwlock_destroy(&db_node->stripes[i].lock);
+                pthread_mutex_destroy(&db_node->stripes[i].unref_lock);
+        }
+        pthread_mutex_destroy(&db_node->latch);
+
+        /* Pages go after the table, as AVL nodes are freed to them */
+        db_slab_destroy(db_node->item_slab);
+        db_slab_destroy(db_node->tail_slab);
+        db_slab_destroy(db_node->avl_slab);
+        for (i = 0; i < DB_NODE_DATA_CLASSES; i++)
+                db_slab_destroy(db_node->data_slabs[i]);
+
+        free(db_node->compact.items);
+        free(db_node->compact.moved);
+        free(db_node->compact.refs);
+        free(db_node->compact.taken);
         free(db_node);
 }
 
+static int db_node_remove(struct s_db_node *db_node, struct s_db_item *item);
+
+static struct s_db_node_stripe *db_node_stripe(struct s_db_node *db_node,
+                                               const uint64_t fp[2])
+{
+        /* Low bits of fp[0] are taken by the hash index */
+        return &db_node->stripes[(fp[1] >> 32) & (DB_NODE_STRIPES - 1)];
+}
+
 void db_node_rdlock(void *node)
 {
         struct s_db_node *db_node = (struct s_db_node *)node;
+        uint32_t i = 0;
         if (db_node == NULL)
                 return;
 
-        pthread_rwlock_rdlock(&db_node->rw_lock);
+        for (i = 0; i < DB_NODE_STRIPES; i++)
+                pthread_rwlock_rdlock(&db_node->stripes[i].lock);
 }
 
-void db_node_wrlock(void *node)
+static int db_node_ptr_cmp(const void *a, const void *b)
 {
-        struct s_db_node *db_node = (struct s_db_node *)node;
-        if (db_node == NULL)
-                return;
+        uintptr_t pa = (uintptr_t)*(struct s_db_item * const *)a;
+        uintptr_t pb = (uintptr_t)*(struct s_db_item * const *)b;
 
-        pthread_rwlock_wrlock(&db_node->rw_lock);
+        return (pa > pb) - (pa < pb);
 }
 
-
-void db_node_unlock(void *node)
+/**
+ * @brief Remove queued items of the stripe, which are left without
+ * references. The item may be queued twice, if it got a reference and
+ * lost it again, so the queue is sorted.
+ * Stripe must be locked for write.
+ */
+static void db_node_unref_collect(struct s_db_node *db_node,
+                                  struct s_db_node_stripe *stripe)
 {
-        struct s_db_node *db_node = (struct s_db_node *)node;
-        if (db_node == NULL)
+        struct s_db_item **items = NULL;
+        uint32_t count = 0;
+        uint32_t i = 0;
+
+        if (__atomic_load_n(&stripe->unref_count, __ATOMIC_ACQUIRE) == 0)
                 return;
 
-        pthread_rwlock_unlock(&db_node->rw_lock);
+        /* Removal may wait for readers, the queue is not held meanwhile */
+        pthread_mutex_lock(&stripe->unref_lock);
+        items = stripe->unref;
+        count = stripe->unref_count;
+        stripe->unref = NULL;
+        stripe->unref_count = 0;
+        stripe->unref_max = 0;
+        pthread_mutex_unlock(&stripe->unref_lock);
+
+        qsort(items, count, sizeof(*items), db_node_ptr_cmp);
+
+        db_node_latch(db_node);
+        for (i = 0; i < count; i++) {
+                if (i != 0 && items[i] == items[i - 1])
+                        continue;
+                if (__atomic_load_n(&items[i]->ref_counter,
+                                    __ATOMIC_ACQUIRE) == 0)
+                        db_node_remove(db_node, items[i]);
+        }
+        db_node_unlatch(db_node);
+
+        free(items);
 }
 
-struct s_db_item *db_node_get_item(void *node, uint8_t *data, int size)
+void db_node_wrlock(void *node)
 {
-        struct s_db_item item;
         struct s_db_node *db_node = (struct s_db_node *)node;
-        if (db_node == NULL || data == NULL || size == 0)
-                return NULL;
+        uint32_t i = 0;
+        if (db_node == NULL)
+                return;
 
-        item.data = data;
-        item.size = size;
-        return (struct s_db_item *)avl_find(db_node->table, &item);
+        for (i = 0; i < DB_NODE_STRIPES; i++)
+                pthread_rwlock_wrlock(&db_node->stripes[i].lock);
+
+        for (i = 0; i < DB_NODE_STRIPES; i++)
+                db_node_unref_collect(db_node, &db_node->stripes[i]);
 }
 
-struct s_db_item *db_node_put_item(void *node, uint8_t *data, int size)
+void db_node_wrlock_fp(void *node, const uint64_t fp[2])
 {
-        struct s_db_item *db_item = NULL;
         struct s_db_node *db_node = (struct s_db_node *)node;
-        if (db_node == NULL || data == NULL || size == 0)
-                return NULL;
-
-        db_item = (struct s_db_item *)malloc(sizeof(struct s_db_item));
-        if (db_item == NULL)
-                return NULL;
-
-        memset(db_item, 0, sizeof(struct s_db_item));
-        db_item->data = data;
-        db_item->size = size;
-        db_item->list_item.item = db_item;
+        struct s_db_node_stripe *stripe = NULL;
+        if (db_node == NULL || fp == NULL)
+                return;
 
-        if (avl_probe(db_node->table, db_item) != NULL) {
-                list_append(&db_node->list, &db_item->list_item);
-                return db_item;
+        stripe = db_node_stripe(db_node, fp);
+        if (pthread_rwlock_trywrlock(&stripe->lock) != 0) {
+                pthread_rwlock_wrlock(&stripe->lock);
+                stripe->waits++;
         }
+        stripe->locks++;
 
-        return NULL;
+        /* Items and index slots retired by other stripes stay readable */
+        db_epoch_enter();
+        db_node_unref_collect(db_node, stripe);
 }
 
-int db_node_remove_item(void *node, struct s_db_item *item)
+void db_node_ref(struct s_db_item *item)
+{
+        if (item != NULL)
+                __atomic_add_fetch(&item->ref_counter, 1, __ATOMIC_RELAXED);
+}
+
+int db_node_unref(void *node, struct s_db_item *item)
 {
         struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_stripe *stripe = NULL;
+        struct s_db_item **items = NULL;
+        uint32_t max = 0;
+        int left = 0;
+
         if (db_node == NULL || item == NULL)
                 return -1;
 
-        item = (struct s_db_item *)avl_delete(db_node->table, item);
-        if (item != NULL) {
-                if (item->f_size) {
-                        void *db_f = db_node->db_file;
-                        db_file_put_space(db_f, item->f_offset, item->f_size);
+        stripe = db_node_stripe(db_node, item->fp);
+
+        /* Last reference and its queue entry go at once for the writer */
+        pthread_mutex_lock(&stripe->unref_lock);
+
+        left = __atomic_sub_fetch(&item->ref_counter, 1, __ATOMIC_ACQ_REL);
+        if (left == 0 && stripe->unref_count == stripe->unref_max) {
+                max = (stripe->unref_max) ? 2 * stripe->unref_max :
+                                            DB_NODE_LIMBO_MIN;
+                items = (struct s_db_item **)
+                        realloc(stripe->unref, max * sizeof(*items));
+                if (items != NULL) {
+                        stripe->unref = items;
+                        stripe->unref_max = max;
                 }
-                list_remove(&db_node->list, &item->list_item);
-                free(item->data);
-                free(item);
-                return 0;
         }
 
-        return -1;
+        /* Item out of the queue is removed by the next load */
+        if (left == 0 && stripe->unref_count < stripe->unref_max) {
+                stripe->unref[stripe->unref_count] = item;
+                __atomic_store_n(&stripe->unref_count,
+                                 stripe->unref_count + 1, __ATOMIC_RELEASE);
+        } else if (left == 0) {
+                printf("%s: DB node unref queue is full\n", __FUNCTION__);
+        }
+
+        pthread_mutex_unlock(&stripe->unref_lock);
+
+        return left;
 }
 
-void *db_node_get_iterator(void *node)
+
+void db_node_unlock(void *node)
 {
         struct s_db_node *db_node = (struct s_db_node *)node;
-        struct s_db_node_iterator *it = NULL;
-
+        uint32_t i = DB_NODE_STRIPES;
         if (db_node == NULL)
-                return NULL;
+                return;
 
-        it = &db_node->iterator;
-        it->current = (struct s_db_item *)list_get_item(db_node->list.first);
-        return it;
+        while (i-- != 0)
+                pthread_rwlock_unlock(&db_node->stripes[i].lock);
 }
 
-
-int db_node_iterator_has_next(void *iterator)
+void db_node_unlock_fp(void *node, const uint64_t fp[2])
 {
-        struct s_db_node_iterator *it = (struct s_db_node_iterator *)iterator;
-
-        if (it == NULL)
-                return 0;
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL || fp == NULL)
+                return;
 
-        return (it->current != NULL) ? 1 : 0;
+        db_epoch_exit();
+        pthread_rwlock_unlock(&db_node_stripe(db_node, fp)->lock);
 }
 
-struct s_db_item *db_node_get_next(void *node, void *iterator)
+void db_node_get_lock_stats(void *node, struct s_db_node_lock_stats *stats)
 {
-        struct s_db_item *item = NULL;
         struct s_db_node *db_node = (struct s_db_node *)node;
-        struct s_db_node_iterator *it = (struct s_db_node_iterator *)iterator;
-
-        if (db_node == NULL || it == NULL)
-                return NULL;
+        uint32_t i = 0;
+        if (stats == NULL)
+                return;
+
+        memset(stats, 0, sizeof(*stats));
+        if (db_node == NULL)
+                return;
+
+        for (i = 0; i < DB_NODE_STRIPES; i++) {
+                stats->stripe_locks += __atomic_load_n(
+                        &db_node->stripes[i].locks, __ATOMIC_RELAXED);
+                stats->stripe_waits += __atomic_load_n(
+                        &db_node->stripes[i].waits, __ATOMIC_RELAXED);
+        }
+        stats->latch_locks = __atomic_load_n(&db_node->latch_locks,
+                                             __ATOMIC_RELAXED);
+        stats->latch_waits = __atomic_load_n(&db_node->latch_waits,
+                                             __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Check if data of the item may be dropped.
+ * Data must be in the file, key items are not evicted.
+ */
+static int db_node_can_evict(struct s_db_item *item)
+{
+        return item->data != NULL && item->f_size != 0 &&
+               !(item->flags & DB_ITEM_DIRTY) &&
+               item->ref == 0 && item->inline_size == 0;
+}
+
+/**
+ * @brief Drop data of the item, the item leaves the table.
+ */
+static void db_node_drop_data(struct s_db_node *db_node,
+                              struct s_db_item *item)
+{
+        if (!(item->flags & DB_ITEM_EVICTED)) {
+                avl_delete(db_node->table, item);
+                db_hash_delete(db_node->index, item);
+                item->flags |= DB_ITEM_EVICTED;
+                db_node->evicted_count++;
+        }
+
+        db_node_retire_data(db_node, item, NULL);
+        db_node->mem_size -= item->size;
+}
+
+/**
+ * @brief Drop data of cold items, until the node fits the budget.
+ * The hand goes round the items in order, referenced items get the second
+ * chance. Each item is checked twice at most, so dirty items do not
+ * make it loop.
+ * Node must be locked for write.
+ */
+static void db_node_evict(struct s_db_node *db_node)
+{
+        struct s_db_item *item = NULL;
+        uint32_t hand = db_node->clock_hand;
+        uint64_t left = 0;
+
+        if (db_node->mem_budget == 0 ||
+                        db_node->mem_size <= db_node->mem_budget ||
+                        db_file_get_version(db_node->db_file) !=
+                        DB_FILE_VERSION)
+                return;
+
+        left = 2 * (avl_count(db_node->table) + db_node->evicted_count);
+        while (db_node->mem_size > db_node->mem_budget && left-- != 0) {
+                if (hand >= db_node->item_count)
+                        hand = 0;
+                if (db_node->item_count == 0)
+                        break;
+
+                item = db_node->items[hand++];
+                if (item->flags & DB_ITEM_REFERENCED)
+                        item->flags &= ~DB_ITEM_REFERENCED;
+                else if (db_node_can_evict(item) &&
+                                db_node_limbo_reserve(db_node, 1) == 0)
+                        db_node_drop_data(db_node, item);
+        }
+
+        db_node->clock_hand = hand;
+}
+
+/**
+ * @brief Build the filter of all items again.
+ * The filter grows twice over the item count, when it is full. The grown
+ * one is published for readers, the old one is freed with it. Otherwise
+ * bits are replaced in place, so removed items are dropped.
+ * Node must be locked for write.
+ */
+static int db_node_bloom_rebuild(struct s_db_node *db_node)
+{
+        uint64_t count = 0;
+        uint64_t capacity = 0;
+        void *bloom = NULL;
+        uint32_t i = 0;
+        int grow = 0;
+
+        if (db_node->bloom == NULL)
+                return 0;
+
+        count = avl_count(db_node->table) + db_node->evicted_count;
+        capacity = db_bloom_capacity(db_node->bloom);
+        grow = (count > capacity);
+
+        bloom = db_bloom_create((grow) ? 2 * count : capacity,
+                                db_node->bloom_bits,
+                                (grow) ? db_node->bloom : NULL);
+        if (bloom == NULL)
+                return -1;
+
+        for (i = 0; i < db_node->item_count; i++)
+                db_bloom_add(bloom, db_node->items[i]->fp);
+
+        if (grow) {
+                __atomic_store_n(&db_node->bloom, bloom, __ATOMIC_RELEASE);
+                return 0;
+        }
+
+        db_bloom_copy(db_node->bloom, bloom);
+        db_bloom_destroy(bloom);
+        return 0;
+}
+
+struct s_db_item *db_node_get_item(void *node, uint8_t *data, int size)
+{
+        uint64_t fp[2];
+        if (data == NULL)
+                return NULL;
+
+        db_fp_bytes(data, size, fp);
+        return db_node_get_item_fp(node, data, size, fp);
+}
+
+struct s_db_item *db_node_get_item_fp(void *node, uint8_t *data, int size,
+                                      const uint64_t fp[2])
+{
+        struct s_db_item item;
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL || data == NULL || size == 0 || fp == NULL)
+                return NULL;
+
+        item.data = data;
+        item.size = size;
+        item.fp[0] = fp[0];
+        item.fp[1] = fp[1];
+        return (struct s_db_item *)db_hash_find(db_node->index, &item);
+}
+
+static int db_node_item_same(const void *item, const void *key)
+{
+        const struct s_db_item *item1 = (const struct s_db_item *)item;
+        const struct s_db_item *item2 = (const struct s_db_item *)key;
+
+        /* Pointer may be reused by another item of other stripe */
+        return item1 == (const struct s_db_item *)item2->data &&
+               item1->fp[0] == item2->fp[0] && item1->fp[1] == item2->fp[1];
+}
+
+struct s_db_item *db_node_find_item(void *node, struct s_db_item *item,
+                                    const uint64_t fp[2])
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_item key;
+
+        if (db_node == NULL || item == NULL || fp == NULL)
+                return NULL;
+
+        key.data = (uint8_t *)item;
+        key.fp[0] = fp[0];
+        key.fp[1] = fp[1];
+        return (struct s_db_item *)db_hash_find_by(db_node->index, &key,
+                                                   db_node_item_same);
+}
+
+struct s_db_item *db_node_put_item(void *node, uint8_t *data, int size)
+{
+        uint64_t fp[2];
+        if (data == NULL)
+                return NULL;
+
+        db_fp_bytes(data, size, fp);
+        return db_node_put_item_fp(node, data, size, fp);
+}
+
+/**
+ * @brief Put the item of the data, small data is copied into the item.
+ * The caller frees the data, if it is copied (DB_ITEM_EMBED is set).
+ * @param is_blob Data is read from the blob log, see db_node_alloc_item().
+ */
+static struct s_db_item *db_node_put(struct s_db_node *db_node,
+                                     uint8_t *data, int size,
+                                     uint32_t inline_size,
+                                     const uint64_t fp[2], int is_blob)
+{
+        struct s_db_item *db_item = NULL;
+        int grown = 0;
+
+        /* Grown index retires its old slots */
+        if (db_node_reserve(db_node, 1) != 0 ||
+                        db_node_limbo_reserve(db_node, 1) != 0)
+                return NULL;
+
+        db_item = db_node_alloc_item(db_node, (uint64_t)size + inline_size,
+                                     is_blob);
+        if (db_item == NULL)
+                return NULL;
+
+        if (db_item->flags & DB_ITEM_EMBED)
+                memcpy(db_item->data, data, size + inline_size);
+        else
+                db_item->data = data;
+        db_item->size = size;
+        db_item->inline_size = inline_size;
+        db_item->fp[0] = fp[0];
+        db_item->fp[1] = fp[1];
+        db_item->flags |= DB_ITEM_REFERENCED;
+
+        if (avl_probe(db_node->table, db_item) == NULL) {
+                db_slab_free(db_item);
+                return NULL;
+        }
+
+        /* The index publishes the item to readers without locks */
+        if (db_hash_insert(db_node->index, db_item) == 0) {
+                db_node_link(db_node, db_item);
+                db_node->mem_size += size;
+
+                /* Grown filter is built of all items, the item is there */
+                if (db_node->bloom != NULL &&
+                                avl_count(db_node->table) >
+                                db_bloom_capacity(db_node->bloom))
+                        grown = (db_node_bloom_rebuild(db_node) == 0);
+
+                if (!grown)
+                        db_bloom_add(db_node->bloom, fp);
+                db_node_evict(db_node);
+                return db_item;
+        }
+
+        avl_delete(db_node->table, db_item);
+        db_slab_free(db_item);
+        return NULL;
+}
+
+struct s_db_item *db_node_put_item_fp(void *node, uint8_t *data, int size,
+                                      const uint64_t fp[2])
+{
+        return db_node_put_item_inline(node, data, size, 0, fp);
+}
+
+struct s_db_item *db_node_put_item_inline(void *node, uint8_t *data,
+                                          int size, uint32_t inline_size,
+                                          const uint64_t fp[2])
+{
+        struct s_db_item *db_item = NULL;
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL || data == NULL || size == 0 || fp == NULL)
+                return NULL;
+
+        db_node_latch(db_node);
+        db_item = db_node_put(db_node, data, size, inline_size, fp, 0);
+        db_node_unlatch(db_node);
+
+        if (db_item != NULL && (db_item->flags & DB_ITEM_EMBED))
+                free(data);
+
+        return db_item;
+}
+
+static int db_node_offset_cmp(const void *a, const void *b)
+{
+        const struct s_db_item *item1 = *(struct s_db_item * const *)a;
+        const struct s_db_item *item2 = *(struct s_db_item * const *)b;
+
+        if (item1->f_offset < item2->f_offset) return -1;
+        if (item1->f_offset > item2->f_offset) return  1;
+
+        return 0;
+}
+
+static int db_node_record_cmp(const void *a, const void *b)
+{
+        const struct s_db_node_moved *r1 = (const struct s_db_node_moved *)a;
+        const struct s_db_node_moved *r2 = (const struct s_db_node_moved *)b;
+
+        if (r1->f_offset < r2->f_offset) return -1;
+        if (r1->f_offset > r2->f_offset) return  1;
+
+        return 0;
+}
+
+static void db_node_blob_ref(struct s_db_item *item,
+                             struct s_db_blob_ref *ref)
+{
+        ref->segment = db_node_tail(item)->u.blob.segment;
+        ref->size = item->size;
+        ref->offset = db_node_tail(item)->u.blob.offset;
+}
+
+static void db_node_blob_free(struct s_db_node *db_node,
+                              struct s_db_item *item)
+{
+        struct s_db_blob_ref ref;
+
+        db_node_blob_ref(item, &ref);
+        db_blob_free(db_node->blob, &ref);
+}
+
+/**
+ * @brief Append item data to the blob log.
+ * On error the data is kept in the node file.
+ */
+static void db_node_blob_append(struct s_db_node *db_node,
+                                struct s_db_item *item)
+{
+        struct s_db_blob_ref ref;
+
+        if (db_blob_append(db_node->blob, item->data, item->size, &ref) != 0) {
+                perror("DB blob append error");
+                return;
+        }
+
+        db_node_tail(item)->u.blob.segment = ref.segment;
+        db_node_tail(item)->u.blob.offset = ref.offset;
+        item->flags |= DB_ITEM_BLOB;
+}
+
+/**
+ * @brief Read data of the evicted item from the blob log
+ * or the node file.
+ */
+static int db_node_read_data(struct s_db_node *db_node,
+                             struct s_db_item *item,
+                             uint8_t *data)
+{
+        struct s_db_blob_ref ref;
+
+        __atomic_add_fetch(&db_node->read_count, 1, __ATOMIC_RELAXED);
+
+        if (item->flags & DB_ITEM_BLOB) {
+                db_node_blob_ref(item, &ref);
+                return db_blob_read(db_node->blob, &ref, data);
+        }
+
+        errno = EIO;
+        if (db_file_read_data(db_node->db_file,
+                              item->f_offset + DB_NODE_LEN_SIZE,
+                              data, item->size) != item->size)
+                return -1;
+
+        return 0;
+}
+
+/**
+ * @brief Read data of the evicted item back, before it is written.
+ * Node must be locked for write.
+ */
+static int db_node_load_data(struct s_db_node *db_node,
+                             struct s_db_item *item)
+{
+        uint8_t *data = NULL;
+        int is_arena = 0;
+
+        if (item->data != NULL)
+                return 0;
+
+        data = db_node_alloc_data(db_node, item->size, &is_arena);
+        if (data == NULL)
+                return -1;
+
+        if (db_node_read_data(db_node, item, data) != 0) {
+                db_node_free_bytes(data, is_arena);
+                return -1;
+        }
+
+        item->data = data;
+        if (is_arena)
+                item->flags |= DB_ITEM_ARENA;
+        db_node->mem_size += item->size;
+        return 0;
+}
+
+uint8_t *db_node_get_data(void *node, struct s_db_item *item, int *is_copy)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        uint8_t *data = NULL;
+        uint8_t *cur = NULL;
+        uint64_t size = 0;
+
+        if (db_node == NULL || item == NULL || is_copy == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        *is_copy = 0;
+
+        /* Readers race only with each other, under the read lock */
+        __atomic_fetch_or(&item->flags, DB_ITEM_REFERENCED, __ATOMIC_RELAXED);
+
+        data = __atomic_load_n(&item->data, __ATOMIC_ACQUIRE);
+        if (data != NULL)
+                return data;
+
+        /* The arena has no locks, readers use malloc */
+        data = (uint8_t *)malloc(item->size);
+        if (data == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        if (db_node_read_data(db_node, item, data) != 0) {
+                free(data);
+                return NULL;
+        }
+
+        /* Over the budget data is not kept, until writers evict */
+        size = __atomic_load_n(&db_node->mem_size, __ATOMIC_RELAXED);
+        if (db_node->mem_budget != 0 &&
+                        size + item->size > db_node->mem_budget) {
+                *is_copy = 1;
+                return data;
+        }
+
+        /* Other reader may have read it already */
+        if (!__atomic_compare_exchange_n(&item->data, &cur, data, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                free(data);
+                return cur;
+        }
+
+        __atomic_add_fetch(&db_node->mem_size, item->size, __ATOMIC_RELAXED);
+        return data;
+}
+
+int db_node_peek_value(void *node, struct s_db_item *item, uint8_t **data,
+                       uint32_t *size)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_item *ref = NULL;
+        uint8_t *ptr = NULL;
+        uint32_t ref_node_id = 0;
+        uint32_t handle = 0;
+        uint32_t len = 0;
+        uint32_t seq = 0;
+
+        if (db_node == NULL || item == NULL || data == NULL || size == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        seq = __atomic_load_n(&item->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+                return -1;
+
+        len = __atomic_load_n(&item->inline_size, __ATOMIC_RELAXED);
+        ref_node_id = __atomic_load_n(&item->ref_node_id, __ATOMIC_RELAXED);
+        handle = __atomic_load_n(&item->ref, __ATOMIC_RELAXED);
+        ptr = __atomic_load_n(&item->data, __ATOMIC_ACQUIRE);
+
+        /* Node id and handle are of one reference, before they are used */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&item->seq, __ATOMIC_RELAXED) != seq)
+                return -1;
+
+        if (len != 0 && ptr != NULL) {
+                ptr = &ptr[item->size];
+        } else if (len != 0) {
+                return -1;
+        } else if (handle != 0) {
+                /* Referred item is retired, not freed, while we are here */
+                ref = db_node_item_of(db_node->ref_nodes[ref_node_id], handle);
+                ptr = __atomic_load_n(&ref->data, __ATOMIC_ACQUIRE);
+                len = ref->size;
+                if (ptr == NULL)
+                        return -1;
+        } else {
+                ptr = NULL;
+        }
+
+        /* Shared line is written only once per CLOCK round */
+        if (ref != NULL && !(__atomic_load_n(&ref->flags, __ATOMIC_RELAXED) &
+                             DB_ITEM_REFERENCED))
+                __atomic_fetch_or(&ref->flags, DB_ITEM_REFERENCED,
+                                  __ATOMIC_RELAXED);
+
+        *data = ptr;
+        *size = len;
+        return 0;
+}
+
+void db_node_change_begin(struct s_db_item *item)
+{
+        if (item == NULL)
+                return;
+
+        __atomic_store_n(&item->seq, item->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void db_node_change_end(struct s_db_item *item)
+{
+        if (item == NULL)
+                return;
+
+        __atomic_store_n(&item->seq, item->seq + 1, __ATOMIC_RELEASE);
+}
+
+void db_node_set_ref_nodes(void *node, void **ref_nodes)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return;
+
+        db_node->ref_nodes = ref_nodes;
+}
+
+void db_node_set_ref(struct s_db_item *item, uint32_t ref_node_id,
+                     struct s_db_item *ref)
+{
+        if (item == NULL)
+                return;
+
+        __atomic_store_n(&item->ref_node_id, (ref) ? ref_node_id : 0,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&item->ref, db_slab_handle(ref), __ATOMIC_RELAXED);
+}
+
+struct s_db_item *db_node_item_of(void *node, uint32_t handle)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return NULL;
+
+        return (struct s_db_item *)db_slab_ptr(db_node->item_slab, handle);
+}
+
+/**
+ * @brief Get the item, which the item of the node refers to.
+ */
+static struct s_db_item *db_node_get_ref(struct s_db_node *db_node,
+                                         struct s_db_item *item)
+{
+        if (item->ref == 0 || db_node->ref_nodes == NULL)
+                return NULL;
+
+        return db_node_item_of(db_node->ref_nodes[item->ref_node_id],
+                               item->ref);
+}
+
+int db_node_set_data(void *node, struct s_db_item *item, uint8_t *data)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        int rc = 0;
+        if (db_node == NULL || item == NULL || data == NULL)
+                return -1;
+
+        db_node_latch(db_node);
+        rc = db_node_limbo_reserve(db_node, 1);
+        if (rc == 0)
+                db_node_retire_data(db_node, item, data);
+        db_node_unlatch(db_node);
+
+        return rc;
+}
+
+/**
+ * @brief Drop removed item from records of the compaction pass.
+ */
+static void db_node_compact_forget(struct s_db_node *db_node,
+                                   struct s_db_item *item)
+{
+        struct s_db_node_compact *c = &db_node->compact;
+        struct s_db_node_moved *found = NULL;
+        struct s_db_node_moved key;
+
+        if (c->count == 0 || item->f_size == 0)
+                return;
+
+        key.f_offset = item->f_offset;
+        found = (struct s_db_node_moved *)bsearch(&key, c->items, c->count,
+                                                  sizeof(*c->items),
+                                                  db_node_record_cmp);
+        if (found != NULL && found->item == item)
+                found->item = NULL;
+}
+
+static int db_node_remove(struct s_db_node *db_node, struct s_db_item *item)
+{
+        if (db_node_limbo_reserve(db_node, 1) != 0)
+                return -1;
+
+        if (item->flags & DB_ITEM_EVICTED)
+                db_node->evicted_count--;
+        else
+                item = (struct s_db_item *)avl_delete(db_node->table, item);
+
+        if (item != NULL && !(item->flags & DB_ITEM_EVICTED))
+                db_hash_delete(db_node->index, item);
+
+        if (item != NULL) {
+                if (item->f_size) {
+                        void *db_f = db_node->db_file;
+                        db_file_put_space(db_f, item->f_offset, item->f_size);
+                }
+                if (item->flags & DB_ITEM_DIRTY)
+                        db_node->dirty_count--;
+                if (item->flags & DB_ITEM_BLOB)
+                        db_node_blob_free(db_node, item);
+                db_node_compact_forget(db_node, item);
+                if (item->data != NULL)
+                        db_node->mem_size -= item->size;
+                db_node_unlink(db_node, item);
+                db_node_retire(db_node, item, DB_NODE_RETIRED_ITEM);
+                return 0;
+        }
+
+        return -1;
+}
+
+int db_node_remove_item(void *node, struct s_db_item *item)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        int rc = 0;
+        if (db_node == NULL || item == NULL)
+                return -1;
+
+        db_node_latch(db_node);
+        rc = db_node_remove(db_node, item);
+        db_node_unlatch(db_node);
+
+        return rc;
+}
+
+void *db_node_get_iterator(void *node, struct s_db_node_iterator *it)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+
+        if (db_node == NULL || it == NULL)
+                return NULL;
+
+        it->node = db_node;
+        it->pos = 0;
+        it->last = NULL;
+        return it;
+}
+
+/**
+ * @brief Get the position of the next item. If the item returned last
+ * is removed, the last item of the vector is in its place, it is next.
+ */
+static uint32_t db_node_iterator_pos(struct s_db_node_iterator *it)
+{
+        struct s_db_node *db_node = (struct s_db_node *)it->node;
+
+        if (it->pos != 0 && it->pos - 1 < db_node->item_count &&
+                        db_node->items[it->pos - 1] != it->last) {
+                it->pos--;
+                it->last = (it->pos != 0) ? db_node->items[it->pos - 1] :
+                                            NULL;
+        }
+
+        return it->pos;
+}
+
+int db_node_iterator_has_next(void *iterator)
+{
+        struct s_db_node_iterator *it = (struct s_db_node_iterator *)iterator;
+
+        if (it == NULL || it->node == NULL)
+                return 0;
+
+        return db_node_iterator_pos(it) <
+               ((struct s_db_node *)it->node)->item_count;
+}
+
+struct s_db_item *db_node_get_next(void *node, void *iterator)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_iterator *it = (struct s_db_node_iterator *)iterator;
+        struct s_db_item **items = NULL;
+        uint32_t count = 0;
+        uint32_t pos = 0;
+
+        if (db_node == NULL || it == NULL || it->node != db_node)
+                return NULL;
+
+        pos = db_node_iterator_pos(it);
+        items = db_node->items;
+        count = db_node->item_count;
+        if (pos >= count)
+                return NULL;
+
+        /* Items are scattered over slab pages, data - over the arena */
+        if (pos + DB_NODE_PREFETCH < count)
+                __builtin_prefetch(items[pos + DB_NODE_PREFETCH]);
+        if (pos + DB_NODE_PREFETCH / 2 < count)
+                __builtin_prefetch(__atomic_load_n(
+                        &items[pos + DB_NODE_PREFETCH / 2]->data,
+                        __ATOMIC_RELAXED));
+
+        it->pos = pos + 1;
+        it->last = items[pos];
+        return it->last;
+}
+
+struct s_db_item *db_node_seek(void *node, uint8_t *data, int size)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct avl_table *table = NULL;
+        struct avl_traverser trav;
+        struct s_db_item *item = NULL;
+        struct s_db_item key;
+
+        if (db_node == NULL)
+                return NULL;
+
+        table = db_node->table;
+        if (data == NULL)
+                return (struct s_db_item *)avl_t_first(&trav, table);
+
+        key.data = data;
+        key.size = size;
+
+        /* Nearest item may be the one before the data */
+        item = (struct s_db_item *)avl_t_find_near(&trav, table, &key);
+        if (item != NULL && table->avl_compare(item, &key, NULL) < 0)
+                item = (struct s_db_item *)avl_t_next(&trav);
 
-        item = it->current;
-        it->current = (struct s_db_item *)list_get_item(item->list_item.next);
         return item;
 }
 
+struct s_db_item *db_node_get_successor(void *node, struct s_db_item *item)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct avl_traverser trav;
+
+        if (db_node == NULL || item == NULL)
+                return NULL;
+
+        if (avl_t_find(&trav, db_node->table, item) == NULL)
+                return NULL;
+
+        return (struct s_db_item *)avl_t_next(&trav);
+}
+
+
+static void db_node_set_dirty(struct s_db_node *db_node,
+                              struct s_db_item *item)
+{
+        if (item->flags & DB_ITEM_DIRTY)
+                return;
+
+        item->flags |= DB_ITEM_DIRTY;
+        db_node->dirty_count++;
+}
+
+/**
+ * @brief Size of the data part of the record.
+ */
+static uint64_t db_node_data_size(struct s_db_item *item)
+{
+        if (item->flags & DB_ITEM_BLOB)
+                return 0;
+
+        return (uint64_t)item->size + item->inline_size;
+}
+
+/**
+ * @brief Size of the record of the item.
+ */
+static uint64_t db_node_record_size(struct s_db_item *item)
+{
+        uint64_t size = DB_NODE_LEN_SIZE;       /* total length */
+
+        if (item->inline_size)
+                size += DB_NODE_INLINE_SIZE;    /* key size */
+        else if (item->ref)
+                size += DB_NODE_REF_SIZE;       /* value node id and offset */
+
+        if (item->flags & DB_ITEM_BLOB)
+                size += DB_NODE_BLOB_SIZE;      /* blob log location */
+
+        return size + db_node_data_size(item);  /* key and inline value */
+}
+
+/**
+ * @brief Encode record header of the item.
+ * Record of the blob item is all header, it has no data part.
+ * @return Header size.
+ */
+static uint32_t db_node_encode_header(struct s_db_node *db_node,
+                                      struct s_db_item *item, uint8_t *hdr)
+{
+        struct s_db_item *ref = NULL;
+        uint64_t val64 = 0;
+        uint32_t val_n = 0;
+        uint32_t size = 0;
+
+        if (item->inline_size != 0) {
+                val64 = htobe64(item->f_size | DB_FILE_RECORD_FLAG);
+                memcpy(&hdr[size], &val64, sizeof(uint64_t));
+                size += sizeof(uint64_t);
+
+                val_n = htonl(item->size);
+                memcpy(&hdr[size], &val_n, sizeof(uint32_t));
+                size += sizeof(uint32_t);
+
+                return size;
+        }
+
+        if (item->flags & DB_ITEM_BLOB) {
+                val64 = htobe64(item->f_size | DB_FILE_RECORD_FLAG);
+                memcpy(&hdr[size], &val64, sizeof(uint64_t));
+                size += sizeof(uint64_t);
+
+                val_n = htonl(db_node_tail(item)->u.blob.segment);
+                memcpy(&hdr[size], &val_n, sizeof(uint32_t));
+                size += sizeof(uint32_t);
+
+                val_n = htonl(item->size);
+                memcpy(&hdr[size], &val_n, sizeof(uint32_t));
+                size += sizeof(uint32_t);
+
+                val64 = htobe64(db_node_tail(item)->u.blob.offset);
+                memcpy(&hdr[size], &val64, sizeof(uint64_t));
+                size += sizeof(uint64_t);
+
+                return size;
+        }
+
+        val64 = htobe64(item->f_size);
+        memcpy(&hdr[size], &val64, sizeof(uint64_t));
+        size += sizeof(uint64_t);
+
+        if (item->ref) {
+                val_n = htonl(item->ref_node_id);
+                memcpy(&hdr[size], &val_n, sizeof(uint32_t));
+                size += sizeof(uint32_t);
+
+                ref = db_node_get_ref(db_node, item);
+                val64 = htobe64((ref) ? ref->f_offset : 0);
+                memcpy(&hdr[size], &val64, sizeof(uint64_t));
+                size += sizeof(uint64_t);
+        }
+
+        return size;
+}
+
+static void db_node_write_ref(struct s_db_node *db_node,
+                              struct s_db_item *item)
+{
+        uint8_t hdr[DB_NODE_MAX_HEADER_SIZE];
+
+        db_node_encode_header(db_node, item, hdr);
+
+        /* Skip len field */
+        db_file_write_data(db_node->db_file,
+                           item->f_offset + DB_NODE_LEN_SIZE,
+                           &hdr[DB_NODE_LEN_SIZE],
+                           DB_NODE_REF_SIZE);
+}
+
+static void db_node_write_item(struct s_db_node *db_node,
+                               struct s_db_item *item)
+{
+        uint8_t hdr[DB_NODE_MAX_HEADER_SIZE];
+        struct iovec iov[2];
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len  = db_node_encode_header(db_node, item, hdr);
+        iov[1].iov_base = item->data;
+        iov[1].iov_len  = db_node_data_size(item);
+
+        db_file_write_vec(db_node->db_file, item->f_offset, iov, 2);
+}
+
+void db_node_update_ref(void *node, struct s_db_item *item)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (node == NULL || item == NULL)
+                return;
+
+        if (item->ref == 0 || item->f_size == 0)
+                return;
+
+        db_node_latch(db_node);
+        if (db_node->lazy)
+                db_node_set_dirty(db_node, item);
+        else if (!(item->flags & DB_ITEM_DIRTY))
+                db_node_write_ref(db_node, item);
+        db_node_unlatch(db_node);
+}
+
+static void db_node_save_item(struct s_db_node *db_node,
+                              struct s_db_item *item)
+{
+        void *db_f = db_node->db_file;
+
+        /* Large value goes to the blob log once, moves keep its location.
+         * Item of the smaller node blob size has no room for it. */
+        if (item->ref == 0 && (item->flags & DB_ITEM_TAIL) &&
+                        db_node_is_blob_size(db_node, item->size) &&
+                        !(item->flags & DB_ITEM_BLOB))
+                db_node_blob_append(db_node, item);
+
+        item->f_size = db_node_record_size(item);
+        item->f_offset = db_file_get_space(db_f, item->f_size);
+
+        if (db_node->lazy)
+                db_node_set_dirty(db_node, item);
+        else
+                db_node_write_item(db_node, item);
+}
+
+void db_node_save(void *node, struct s_db_item *item)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (node == NULL || item == NULL)
+                return;
+
+        db_node_latch(db_node);
+        db_node_save_item(db_node, item);
+        db_node_unlatch(db_node);
+}
+
+void db_node_update(void *node, struct s_db_item *item)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (node == NULL || item == NULL)
+                return;
+
+        db_node_latch(db_node);
+
+        if (item->f_size != 0 && item->f_size == db_node_record_size(item)) {
+                if (db_node->lazy)
+                        db_node_set_dirty(db_node, item);
+                else
+                        db_node_write_item(db_node, item);
+                db_node_unlatch(db_node);
+                return;
+        }
+
+        /* Record goes to the new place, compaction must not move it */
+        if (item->f_size != 0) {
+                db_node_compact_forget(db_node, item);
+                db_file_put_space(db_node->db_file,
+                                  item->f_offset, item->f_size);
+        }
+
+        db_node_save_item(db_node, item);
+        db_node_unlatch(db_node);
+}
+
+void db_node_set_lazy(void *node, int lazy)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return;
+
+        db_node->lazy = lazy;
+        db_file_set_lazy(db_node->db_file, lazy);
+}
+
+int db_node_set_blob(void *node,
+                     const char *name,
+                     uint32_t blob_size,
+                     uint64_t segment_size)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL || db_node->blob != NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        db_node->blob = db_blob_init(name, segment_size);
+        if (db_node->blob == NULL)
+                return -1;
+
+        db_node->blob_size = blob_size;
+        return 0;
+}
+
+void db_node_set_mem_budget(void *node, uint64_t budget)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return;
+
+        db_node->mem_budget = budget;
+}
+
+int db_node_set_order(void *node, int order)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL || (order != DB_NODE_ORDER_SIZE &&
+                                order != DB_NODE_ORDER_LEX &&
+                                order != DB_NODE_ORDER_FP)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (avl_count(db_node->table) != 0 || db_node->evicted_count != 0) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        if (order == DB_NODE_ORDER_LEX)
+                db_node->table->avl_compare = avl_compare_lex;
+        else if (order == DB_NODE_ORDER_FP)
+                db_node->table->avl_compare = avl_compare_fp;
+        else
+                db_node->table->avl_compare = avl_compare;
+        return 0;
+}
+
+int db_node_set_bloom(void *node, uint32_t bits)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        void *bloom = NULL;
+
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (avl_count(db_node->table) != 0 || db_node->evicted_count != 0) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        if (bits != 0) {
+                bloom = db_bloom_create(0, bits, NULL);
+                if (bloom == NULL)
+                        return -1;
+        }
+
+        db_bloom_destroy(db_node->bloom);
+        db_node->bloom = bloom;
+        db_node->bloom_bits = bits;
+        return 0;
+}
+
+int db_node_may_have(void *node, const uint64_t fp[2])
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return 0;
+
+        return db_bloom_check(__atomic_load_n(&db_node->bloom,
+                                              __ATOMIC_ACQUIRE), fp);
+}
+
+void db_node_get_mem_stats(void *node, struct s_db_node_mem_stats *stats)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_slab_stats slab;
+        uint32_t i = 0;
+
+        if (db_node == NULL || stats == NULL)
+                return;
+
+        memset(&slab, 0, sizeof(slab));
+        db_slab_add_stats(db_node->item_slab, &slab);
+        db_slab_add_stats(db_node->tail_slab, &slab);
+        db_slab_add_stats(db_node->avl_slab, &slab);
+        for (i = 0; i < DB_NODE_DATA_CLASSES; i++)
+                db_slab_add_stats(db_node->data_slabs[i], &slab);
+
+        stats->size = __atomic_load_n(&db_node->mem_size, __ATOMIC_RELAXED);
+        stats->evicted = db_node->evicted_count;
+        stats->items = db_node->item_count;
+        stats->reads = __atomic_load_n(&db_node->read_count, __ATOMIC_RELAXED);
+        stats->arena_size = slab.size;
+        stats->arena_used = slab.used;
+}
+
+int db_node_set_backend(void *node, int backend, uint64_t map_chunk)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return db_file_set_backend(db_node->db_file, backend, map_chunk);
+}
+
+int db_node_set_allocator(void *node, int allocator)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return db_file_set_allocator(db_node->db_file, allocator);
+}
+
+uint64_t db_node_get_write_seq(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return 0;
+
+        return db_file_get_write_seq(db_node->db_file);
+}
+
+int db_node_wait_writes(void *node, uint64_t seq)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return db_file_wait_writes(db_node->db_file, seq);
+}
+
+/**
+ * @brief Write items sorted by offset.
+ * Records following each other are written by one syscall.
+ */
+static int db_node_write_items(struct s_db_node *db_node,
+                               struct s_db_item **items,
+                               uint32_t count)
+{
+        const int max_records = (DB_FILE_MAX_IOV - 1) / 2;
+        uint8_t *hdrs = NULL;
+        uint8_t *hdr = NULL;
+        struct iovec *iov = NULL;
+        struct s_db_item *item = NULL;
+        uint64_t offset = 0;
+        uint64_t end = 0;
+        uint32_t i = 0;
+        int iovcnt = 0;
+        int rc = 0;
+
+        hdrs = (uint8_t *)malloc(max_records * DB_NODE_MAX_HEADER_SIZE);
+        iov  = (struct iovec *)malloc(2 * max_records * sizeof(*iov));
+        if (hdrs == NULL || iov == NULL) {
+                free(hdrs);
+                free(iov);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        for (i = 0; i <= count; i++) {
+                item = (i < count) ? items[i] : NULL;
+
+                if (iovcnt != 0 && (item == NULL || item->f_offset != end ||
+                                    iovcnt == 2 * max_records)) {
+                        if (db_file_write_vec(db_node->db_file, offset,
+                                              iov, iovcnt) < 0)
+                                rc = -1;
+                        iovcnt = 0;
+                }
+
+                if (item == NULL)
+                        break;
+
+                if (iovcnt == 0)
+                        offset = item->f_offset;
+
+                hdr = &hdrs[(iovcnt / 2) * DB_NODE_MAX_HEADER_SIZE];
+                iov[iovcnt].iov_base = hdr;
+                iov[iovcnt].iov_len  = db_node_encode_header(db_node, item,
+                                                             hdr);
+                iovcnt++;
+                iov[iovcnt].iov_base = item->data;
+                iov[iovcnt].iov_len  = db_node_data_size(item);
+                iovcnt++;
+
+                end = item->f_offset + item->f_size;
+                item->flags &= ~DB_ITEM_DIRTY;
+        }
+
+        free(hdrs);
+        free(iov);
+
+        return rc;
+}
+
+int db_node_flush(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_item **items = NULL;
+        struct s_db_item *item = NULL;
+        uint32_t count = 0;
+        uint32_t i = 0;
+        int rc = 0;
+
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* Blob records go first, node records refer to them */
+        if (db_node->blob != NULL && db_blob_sync(db_node->blob) != 0)
+                return -1;
+
+        /*
+         * Lacune headers go first: until the items are written,
+         * old headers still describe the regions consistently.
+         */
+        rc = db_file_flush(db_node->db_file);
+
+        if (db_node->dirty_count != 0) {
+                items = (struct s_db_item **)
+                        malloc(db_node->dirty_count * sizeof(*items));
+                if (items == NULL) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+
+                for (i = 0; i < db_node->item_count &&
+                                count < db_node->dirty_count; i++) {
+                        item = db_node->items[i];
+                        if (item->flags & DB_ITEM_DIRTY)
+                                items[count++] = item;
+                }
+
+                qsort(items, count, sizeof(*items), db_node_offset_cmp);
+
+                if (db_node_write_items(db_node, items, count) != 0)
+                        rc = -1;
+
+                db_node->dirty_count = 0;
+                free(items);
+        }
+
+        if (db_file_sync(db_node->db_file) != 0)
+                rc = -1;
+
+        /* Node file does not refer to dead segments any more */
+        if (rc == 0 && db_node->blob != NULL)
+                db_blob_collect(db_node->blob);
+
+        /* Written items may be evicted now */
+        if (rc == 0)
+                db_node_evict(db_node);
+
+        return rc;
+}
+
+static int db_node_load_record(void *arg,
+                               uint64_t offset,
+                               const uint8_t *data,
+                               uint64_t size)
+{
+        struct s_db_node_load *load = (struct s_db_node_load *)arg;
+        struct s_db_node *db_node = load->db_node;
+        struct s_db_item *item = NULL;
+        struct s_db_item *dup = NULL;
+        struct s_db_blob_ref ref;
+        uint64_t len = 0;
+        uint32_t val32 = 0;
+        int is_blob = 0;
+        int is_inline = 0;
+        uint32_t inline_size = 0;
+        uint32_t hdr_size = DB_NODE_LEN_SIZE;
+        uint32_t ref_size = DB_NODE_REF_SIZE;
+        uint32_t ref_node_id = 0;
+        uint64_t ref_offset = 0;
+        uint32_t ref_offset32 = 0;
+        uint8_t *item_data = NULL;
+        uint64_t fp[2];
+        int is_arena = 0;
+        int item_size = 0;
+
+        if (load->version == 1) {
+                hdr_size = DB_NODE_V1_LEN_SIZE;
+                ref_size = DB_NODE_V1_REF_SIZE;
+        }
+
+        if (load->version != 1) {
+                memcpy(&len, data, sizeof(uint64_t));
+                is_blob = (be64toh(len) & DB_FILE_RECORD_FLAG) != 0;
+        }
+
+        /* Flagged key record keeps the value inline */
+        if (is_blob && load->ref_handler) {
+                is_blob = 0;
+                is_inline = 1;
+        }
+
+        if (is_inline) {
+                if (size < hdr_size + DB_NODE_INLINE_SIZE)
+                        return -1;
+
+                memcpy(&val32, &data[hdr_size], sizeof(uint32_t));
+                item_size = (int)ntohl(val32);
+                hdr_size += DB_NODE_INLINE_SIZE;
+
+                if (item_size <= 0 || size - hdr_size <= (uint64_t)item_size ||
+                                size - hdr_size - item_size > INT32_MAX)
+                        return -1;
+
+                inline_size = size - hdr_size - item_size;
+        } else if (load->ref_handler) {
+                if (size < hdr_size + ref_size)
+                        return -1;
+
+                memcpy(&ref_node_id, &data[hdr_size], sizeof(uint32_t));
+                ref_node_id = ntohl(ref_node_id);
+
+                if (load->version == 1) {
+                        memcpy(&ref_offset32, &data[hdr_size +
+                               sizeof(uint32_t)], sizeof(uint32_t));
+                        ref_offset = ntohl(ref_offset32);
+                } else {
+                        memcpy(&ref_offset, &data[hdr_size +
+                               sizeof(uint32_t)], sizeof(uint64_t));
+                        ref_offset = be64toh(ref_offset);
+                }
+                hdr_size += ref_size;
+        }
+
+        if (is_blob) {
+                if (size != hdr_size + DB_NODE_BLOB_SIZE)
+                        return -1;
+
+                memcpy(&val32, &data[hdr_size], sizeof(uint32_t));
+                ref.segment = ntohl(val32);
+                memcpy(&val32, &data[hdr_size + sizeof(uint32_t)],
+                       sizeof(uint32_t));
+                ref.size = ntohl(val32);
+                memcpy(&len, &data[hdr_size + 2 * sizeof(uint32_t)],
+                       sizeof(uint64_t));
+                ref.offset = be64toh(len);
+
+                if (ref.size == 0 || ref.size > INT32_MAX)
+                        return -1;
+
+                item_size = (int)ref.size;
+                item_data = db_node_alloc_data(db_node, item_size, &is_arena);
+                if (item_data == NULL)
+                        return -1;
+
+                /* Lost blob is dropped as a broken record, keys go too */
+                if (db_blob_read(db_node->blob, &ref, item_data) != 0) {
+                        db_node_free_bytes(item_data, is_arena);
+                        if (errno != EINVAL)
+                                return -1;
+                        printf("%s: DB blob record is lost\n", __FUNCTION__);
+                        return 1;
+                }
+        } else if (!is_inline) {
+                if (size <= hdr_size || size - hdr_size > INT32_MAX)
+                        return -1;
+
+                item_size = (int)(size - hdr_size);
+        }
+
+        /* Duplicate may be left by crash, reuse its space */
+        db_fp_bytes((item_data != NULL) ? item_data :
+                    (uint8_t *)&data[hdr_size], item_size, fp);
+        dup = db_node_get_item_fp(db_node, (item_data != NULL) ? item_data :
+                                  (uint8_t *)&data[hdr_size], item_size, fp);
+        if (dup != NULL) {
+                db_node_free_bytes(item_data, is_arena);
+                if (load->dup_handler &&
+                                load->dup_handler(load->arg, dup, offset) != 0)
+                        return -1;
+                return 1;
+        }
+
+        /* Small record is copied into the item right from the file */
+        if (item_data == NULL && (uint64_t)item_size + inline_size >
+                        DB_ITEM_EMBED_SIZE) {
+                item_data = db_node_alloc_data(db_node,
+                                               item_size + inline_size,
+                                               &is_arena);
+                if (item_data == NULL)
+                        return -1;
+
+                memcpy(item_data, &data[hdr_size], item_size + inline_size);
+        }
+
+        item = db_node_put(db_node, (item_data != NULL) ? item_data :
+                           (uint8_t *)&data[hdr_size], item_size,
+                           inline_size, fp, is_blob);
+        if (item == NULL) {
+                db_node_free_bytes(item_data, is_arena);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        if (item->flags & DB_ITEM_EMBED)
+                db_node_free_bytes(item_data, is_arena);
+        else if (is_arena)
+                item->flags |= DB_ITEM_ARENA;
+
+        item->f_offset = offset;
+        item->f_size   = size;
+
+        if (is_blob) {
+                db_blob_use(db_node->blob, &ref);
+                db_node_tail(item)->u.blob.segment = ref.segment;
+                db_node_tail(item)->u.blob.offset = ref.offset;
+                item->flags |= DB_ITEM_BLOB;
+        }
+
+        if (load->ref_handler && !is_inline)
+                return load->ref_handler(load->arg, item,
+                                         ref_node_id, ref_offset);
+
+        return 0;
+}
+
+int db_node_load(void *node,
+                 f_db_node_ref_handler ref_handler,
+                 f_db_node_dup_handler dup_handler,
+                 void *arg)
+{
+        struct s_db_node_load load;
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        load.db_node = db_node;
+        load.version = db_file_get_version(db_node->db_file);
+        load.ref_handler = ref_handler;
+        load.dup_handler = dup_handler;
+        load.arg = arg;
+
+        return db_file_load(db_node->db_file, db_node_load_record, &load);
+}
+
+static void db_node_put_u64(uint8_t *buf, uint64_t val)
+{
+        val = htobe64(val);
+        memcpy(buf, &val, sizeof(val));
+}
+
+static uint64_t db_node_get_u64(const uint8_t *buf)
+{
+        uint64_t val = 0;
+
+        memcpy(&val, buf, sizeof(val));
+        return be64toh(val);
+}
+
+static void db_node_put_u32(uint8_t *buf, uint32_t val)
+{
+        val = htonl(val);
+        memcpy(buf, &val, sizeof(val));
+}
+
+static uint32_t db_node_get_u32(const uint8_t *buf)
+{
+        uint32_t val = 0;
+
+        memcpy(&val, buf, sizeof(val));
+        return ntohl(val);
+}
+
+static void db_node_snap_flush(struct s_db_node_snap *snap)
+{
+        uint32_t done = 0;
+        ssize_t rc = 0;
+
+        while (snap->rc == 0 && done < snap->len) {
+                rc = write(snap->fd, &snap->buf[done], snap->len - done);
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc <= 0) {
+                        snap->rc = -1;
+                        break;
+                }
+                done += rc;
+        }
+
+        snap->len = 0;
+}
+
+static void db_node_snap_write(struct s_db_node_snap *snap,
+                               const void *data,
+                               uint64_t size)
+{
+        const uint8_t *src = (const uint8_t *)data;
+        uint64_t part = 0;
+
+        while (size != 0 && snap->rc == 0) {
+                if (snap->len == DB_NODE_SNAP_BUF_SIZE)
+                        db_node_snap_flush(snap);
+
+                part = DB_NODE_SNAP_BUF_SIZE - snap->len;
+                if (part > size)
+                        part = size;
+
+                memcpy(&snap->buf[snap->len], src, part);
+                snap->len += part;
+                src  += part;
+                size -= part;
+        }
+}
+
+static int db_node_snap_lacune(void *arg, uint64_t offset, uint64_t size)
+{
+        struct s_db_node_snap *snap = (struct s_db_node_snap *)arg;
+        uint8_t rec[DB_NODE_SNAP_LACUNE_SIZE];
+
+        db_node_put_u64(&rec[0], offset);
+        db_node_put_u64(&rec[8], size);
+        db_node_snap_write(snap, rec, sizeof(rec));
+        snap->lacunes++;
+
+        return snap->rc;
+}
+
+static void db_node_snap_header(uint8_t *hdr,
+                                uint64_t file_size,
+                                uint64_t items,
+                                uint64_t lacunes)
+{
+        db_node_put_u32(&hdr[0], DB_NODE_SNAP_MAGIC);
+        db_node_put_u32(&hdr[4], DB_NODE_SNAP_VERSION);
+        db_node_put_u64(&hdr[8], file_size);
+        db_node_put_u64(&hdr[16], items);
+        db_node_put_u64(&hdr[24], lacunes);
+}
 
-void db_node_update_ref(void *node,
-                        struct s_db_item *item,
-                        uint32_t ref_node_id)
+int db_node_save_snapshot(void *node,
+                          const char *file_name,
+                          f_db_node_snap_handler handler,
+                          void *arg,
+                          uint8_t *buf)
 {
-        void *db_f = NULL;
         struct s_db_node *db_node = (struct s_db_node *)node;
-        struct s_db_item *val_item = NULL;
-        uint32_t offset = 0;
-        uint32_t val_n = 0;
-        if (node == NULL || item == NULL)
+        struct s_db_node_snap snap;
+        struct s_db_file_stats stats;
+        struct avl_traverser trav;
+        struct s_db_item *item = NULL;
+        uint8_t hdr[DB_NODE_SNAP_HDR_SIZE];
+        uint8_t rec[DB_NODE_SNAP_ITEM_SIZE];
+        uint8_t loc[DB_NODE_BLOB_SIZE];
+        char name[256];
+        size_t len = 0;
+        uint64_t index = 0;
+        uint64_t ref = 0;
+
+        if (db_node == NULL || file_name == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* No stdio, the child of fork() may call it */
+        len = strlen(file_name);
+        if (len + sizeof(".new") > sizeof(name)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+
+        /* Evicted items are out of the table order */
+        if (db_node->evicted_count != 0) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        memset(&snap, 0, sizeof(snap));
+        memcpy(name, file_name, len);
+        memcpy(&name[len], ".new", sizeof(".new"));
+
+        snap.buf = (buf != NULL) ? buf :
+                   (uint8_t *)malloc(DB_NODE_SNAP_BUF_SIZE);
+        if (snap.buf == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        snap.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+        if (snap.fd == -1) {
+                if (buf == NULL)
+                        free(snap.buf);
+                return -1;
+        }
+
+        /* Count of lacunes is known after the walk */
+        db_file_get_stats(db_node->db_file, &stats);
+        db_node_snap_header(hdr, stats.size, avl_count(db_node->table), 0);
+        db_node_snap_write(&snap, hdr, sizeof(hdr));
+
+        db_file_walk_lacunes(db_node->db_file, db_node_snap_lacune, &snap);
+
+        item = (struct s_db_item *)avl_t_first(&trav, db_node->table);
+        while (item != NULL && snap.rc == 0) {
+                if (item->inline_size)
+                        ref = item->inline_size;
+                else if (handler)
+                        ref = handler(arg, item, index);
+                else
+                        ref = (uint64_t)__atomic_load_n(&item->ref_counter,
+                                                        __ATOMIC_RELAXED);
+
+                db_node_put_u64(&rec[0], item->f_offset);
+                db_node_put_u64(&rec[8], item->f_size);
+                db_node_put_u32(&rec[16], (item->inline_size) ?
+                                DB_NODE_SNAP_INLINE_ID : item->ref_node_id);
+                db_node_put_u64(&rec[24], ref);
+
+                /* Data of the blob item is kept in the blob log */
+                if (item->flags & DB_ITEM_BLOB) {
+                        db_node_put_u32(&rec[20], sizeof(loc) |
+                                        DB_NODE_SNAP_BLOB_BIT);
+                        db_node_put_u32(&loc[0],
+                                        db_node_tail(item)->u.blob.segment);
+                        db_node_put_u32(&loc[4], item->size);
+                        db_node_put_u64(&loc[8],
+                                        db_node_tail(item)->u.blob.offset);
+                        db_node_snap_write(&snap, rec, sizeof(rec));
+                        db_node_snap_write(&snap, loc, sizeof(loc));
+                } else if (item->inline_size) {
+                        db_node_put_u32(&rec[20], item->size);
+                        db_node_snap_write(&snap, rec, sizeof(rec));
+                        db_node_snap_write(&snap, item->data, item->size +
+                                           item->inline_size);
+                } else {
+                        db_node_put_u32(&rec[20], item->size);
+                        db_node_snap_write(&snap, rec, sizeof(rec));
+                        db_node_snap_write(&snap, item->data, item->size);
+                }
+
+                index++;
+                item = (struct s_db_item *)avl_t_next(&trav);
+        }
+
+        db_node_snap_flush(&snap);
+
+        db_node_snap_header(hdr, stats.size, index, snap.lacunes);
+        if (snap.rc == 0 && (pwrite(snap.fd, hdr, sizeof(hdr), 0) !=
+                             sizeof(hdr) || fsync(snap.fd) != 0))
+                snap.rc = -1;
+
+        close(snap.fd);
+        if (buf == NULL)
+                free(snap.buf);
+
+        if (snap.rc == 0 && rename(name, file_name) != 0)
+                snap.rc = -1;
+
+        if (snap.rc != 0)
+                unlink(name);
+
+        return snap.rc;
+}
+
+/**
+ * @brief Parse lacunes and items of the mapped snapshot.
+ */
+static int db_node_parse_snapshot(struct s_db_node *db_node,
+                                  const uint8_t *map,
+                                  uint64_t map_size,
+                                  f_db_node_ref_handler handler,
+                                  void *arg)
+{
+        struct s_db_file_lacune *lacunes = NULL;
+        struct s_db_item **items = NULL;
+        struct s_db_item *item = NULL;
+        struct s_db_blob_ref blob_ref;
+        const uint8_t *rec = NULL;
+        uint64_t file_size = db_node_get_u64(&map[8]);
+        uint64_t count = db_node_get_u64(&map[16]);
+        uint64_t lacune_count = db_node_get_u64(&map[24]);
+        uint64_t offset = DB_NODE_SNAP_HDR_SIZE;
+        uint64_t ref = 0;
+        uint64_t i = 0;
+        uint64_t n = 0;
+        uint64_t size_all = 0;
+        uint32_t size = 0;
+        uint32_t inline_size = 0;
+        uint32_t ref_node_id = 0;
+        int is_arena = 0;
+        int rc = -1;
+
+        errno = EINVAL;
+
+        if (lacune_count > (map_size - offset) / DB_NODE_SNAP_LACUNE_SIZE ||
+                        count > map_size / DB_NODE_SNAP_ITEM_SIZE)
+                return -1;
+
+        lacunes = (struct s_db_file_lacune *)
+                malloc((lacune_count + 1) * sizeof(*lacunes));
+        items = (struct s_db_item **)malloc((count + 1) * sizeof(*items));
+        if (lacunes == NULL || items == NULL) {
+                errno = ENOMEM;
+                goto exit;
+        }
+
+        for (i = 0; i < lacune_count; i++) {
+                rec = &map[offset];
+                lacunes[i].offset = db_node_get_u64(&rec[0]);
+                lacunes[i].size = db_node_get_u64(&rec[8]);
+                offset += DB_NODE_SNAP_LACUNE_SIZE;
+        }
+
+        if (db_file_restore(db_node->db_file, file_size,
+                            lacunes, lacune_count) != 0)
+                goto exit;
+
+        errno = EINVAL;
+
+        for (n = 0; n < count; n++) {
+                if (map_size - offset < DB_NODE_SNAP_ITEM_SIZE)
+                        goto exit;
+
+                rec = &map[offset];
+                size = db_node_get_u32(&rec[20]);
+                ref = db_node_get_u64(&rec[24]);
+                offset += DB_NODE_SNAP_ITEM_SIZE;
+
+                memset(&blob_ref, 0, sizeof(blob_ref));
+                inline_size = 0;
+                if (db_node_get_u32(&rec[16]) == DB_NODE_SNAP_INLINE_ID) {
+                        /* Key and its inline value */
+                        if (size == 0 || size > INT32_MAX || ref == 0 ||
+                                        ref > INT32_MAX - (uint64_t)size ||
+                                        map_size - offset < size + ref)
+                                goto exit;
+                        inline_size = ref;
+                } else if (size == (DB_NODE_BLOB_SIZE | DB_NODE_SNAP_BLOB_BIT)) {
+                        if (map_size - offset < DB_NODE_BLOB_SIZE)
+                                goto exit;
+
+                        blob_ref.segment = db_node_get_u32(&map[offset]);
+                        blob_ref.size = db_node_get_u32(&map[offset + 4]);
+                        blob_ref.offset = db_node_get_u64(&map[offset + 8]);
+                        size = DB_NODE_BLOB_SIZE;
+                        if (blob_ref.size == 0 || blob_ref.size > INT32_MAX)
+                                goto exit;
+                } else if (size == 0 || size > INT32_MAX ||
+                                map_size - offset < size) {
+                        goto exit;
+                }
+
+                size_all = ((blob_ref.size) ? blob_ref.size : size) +
+                           (uint64_t)inline_size;
+                item = db_node_alloc_item(db_node, size_all,
+                                          blob_ref.size != 0);
+                if (item == NULL)
+                        goto exit;
+
+                item->size = (blob_ref.size) ? blob_ref.size : size;
+                item->inline_size = inline_size;
+                if (!(item->flags & DB_ITEM_EMBED)) {
+                        item->data = db_node_alloc_data(db_node, size_all,
+                                                        &is_arena);
+                        if (item->data == NULL) {
+                                db_slab_free(item);
+                                goto exit;
+                        }
+                        if (is_arena)
+                                item->flags |= DB_ITEM_ARENA;
+                }
+
+                if (blob_ref.size == 0) {
+                        memcpy(item->data, &map[offset], size + inline_size);
+                } else if (db_blob_read(db_node->blob, &blob_ref,
+                                        item->data) != 0) {
+                        avl_free_item(item, NULL);
+                        goto exit;
+                } else {
+                        db_node_tail(item)->u.blob.segment = blob_ref.segment;
+                        db_node_tail(item)->u.blob.offset = blob_ref.offset;
+                        item->flags |= DB_ITEM_BLOB;
+                }
+
+                item->f_offset = db_node_get_u64(&rec[0]);
+                item->f_size = db_node_get_u64(&rec[8]);
+                ref_node_id = (inline_size) ? 0 : db_node_get_u32(&rec[16]);
+                db_fp_bytes(item->data, item->size, item->fp);
+                offset += size + inline_size;
+                items[n] = item;
+
+                /* Sorted order is a must for the table build */
+                if ((n != 0 && db_node->table->avl_compare(items[n - 1],
+                                                           item, NULL) >= 0) ||
+                                item->f_offset > file_size ||
+                                item->f_size > file_size - item->f_offset) {
+                        n++;
+                        goto exit;
+                }
+
+                if (handler && !inline_size &&
+                                handler(arg, item, ref_node_id, ref) != 0) {
+                        n++;
+                        goto exit;
+                }
+        }
+
+        if (db_node_limbo_reserve(db_node, 1) != 0 ||
+                        db_hash_reserve(db_node->index, count) != 0 ||
+                        db_node_reserve(db_node, count) != 0)
+                goto exit;
+
+        for (i = 0; i < count; i++)
+                db_hash_insert(db_node->index, items[i]);
+
+        if (avl_build(db_node->table, (void **)items, count) != 0) {
+                errno = ENOMEM;
+                goto exit;
+        }
+
+        for (i = 0; i < count; i++) {
+                db_node_link(db_node, items[i]);
+                db_node->mem_size += items[i]->size;
+
+                if (items[i]->flags & DB_ITEM_BLOB) {
+                        db_node_blob_ref(items[i], &blob_ref);
+                        db_blob_use(db_node->blob, &blob_ref);
+                }
+        }
+
+        db_node_bloom_rebuild(db_node);
+
+        rc = 0;
+exit:
+        if (rc != 0 && items != NULL) {
+                for (i = 0; i < n; i++)
+                        avl_free_item(items[i], NULL);
+        }
+
+        free(lacunes);
+        free(items);
+
+        return rc;
+}
+
+int db_node_load_snapshot(void *node,
+                          const char *file_name,
+                          f_db_node_ref_handler handler,
+                          void *arg)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct stat st;
+        uint8_t *map = NULL;
+        int fd = -1;
+        int rc = -1;
+
+        if (db_node == NULL || file_name == NULL ||
+                        avl_count(db_node->table) != 0 ||
+                        db_file_get_version(db_node->db_file) !=
+                        DB_FILE_VERSION) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        fd = open(file_name, O_RDONLY);
+        if (fd == -1)
+                return -1;
+
+        if (fstat(fd, &st) != 0)
+                goto exit;
+
+        if ((uint64_t)st.st_size < DB_NODE_SNAP_HDR_SIZE) {
+                errno = EINVAL;
+                goto exit;
+        }
+
+        map = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+                goto exit;
+
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        if (db_node_get_u32(&map[0]) != DB_NODE_SNAP_MAGIC ||
+                        db_node_get_u32(&map[4]) != DB_NODE_SNAP_VERSION) {
+                errno = EINVAL;
+                goto exit_unmap;
+        }
+
+        rc = db_node_parse_snapshot(db_node, map, st.st_size, handler, arg);
+
+exit_unmap:
+        munmap(map, st.st_size);
+exit:
+        close(fd);
+        return rc;
+}
+
+int db_node_compact_begin(void *node, uint32_t min_free_pct)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_compact *c = NULL;
+        struct s_db_file_stats stats;
+        struct s_db_node_moved *items = NULL;
+        struct s_db_item *item = NULL;
+        uint64_t target = 0;
+        uint32_t max = 0;
+        uint32_t i = 0;
+
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        c = &db_node->compact;
+        c->count = 0;
+        c->tracking = 0;
+        c->track_failed = 0;
+        c->ref_count = 0;
+
+        /* Limbo is not left full, when writes stop */
+        db_node_reclaim(db_node);
+
+        db_file_get_stats(db_node->db_file, &stats);
+        if (stats.free_size == 0 || stats.free_size * 100 <
+                        (stats.size - DB_FILE_DATA_OFFSET) * min_free_pct)
+                return 0;
+
+        /* Records above the end of packed data are moved down */
+        target = stats.size - stats.free_size;
+
+        for (i = 0; i < db_node->item_count; i++) {
+                item = db_node->items[i];
+                if (item->f_size != 0 && item->f_offset >= target) {
+                        if (c->count == max) {
+                                max = (max) ? 2 * max : 1024;
+                                items = (struct s_db_node_moved *)
+                                        realloc(c->items, max * sizeof(*items));
+                                if (items == NULL) {
+                                        c->count = 0;
+                                        errno = ENOMEM;
+                                        return -1;
+                                }
+                                c->items = items;
+                        }
+                        c->items[c->count].item = item;
+                        c->items[c->count].f_offset = item->f_offset;
+                        c->items[c->count].f_size = item->f_size;
+                        c->count++;
+                }
+        }
+
+        qsort(c->items, c->count, sizeof(*c->items), db_node_record_cmp);
+        c->target = target;
+        c->tracking = (c->count != 0);
+
+        return c->count;
+}
+
+static int db_node_moved_cmp(const void *a, const void *b)
+{
+        const struct s_db_node_moved *m1 = (const struct s_db_node_moved *)a;
+        const struct s_db_node_moved *m2 = (const struct s_db_node_moved *)b;
+
+        if (m1->item < m2->item) return -1;
+        if (m1->item > m2->item) return  1;
+
+        return 0;
+}
+
+static int db_node_compact_pin(struct s_db_node_compact *c,
+                               struct s_db_item *item)
+{
+        struct s_db_node_moved *moved = NULL;
+
+        if (c->moved_count == c->moved_max) {
+                uint32_t max = (c->moved_max) ? 2 * c->moved_max : 256;
+                moved = (struct s_db_node_moved *)
+                        realloc(c->moved, max * sizeof(*moved));
+                if (moved == NULL)
+                        return -1;
+                c->moved = moved;
+                c->moved_max = max;
+        }
+
+        moved = &c->moved[c->moved_count++];
+        moved->item = item;
+        moved->f_offset = item->f_offset;
+        moved->f_size = item->f_size;
+        db_node_ref(item);
+
+        return 0;
+}
+
+uint64_t db_node_compact_step(void *node, uint64_t budget, int pin)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_compact *c = NULL;
+        struct s_db_item *item = NULL;
+        uint64_t old_offset = 0;
+        uint64_t offset = 0;
+        uint64_t bytes = 0;
+
+        if (db_node == NULL)
+                return 0;
+
+        c = &db_node->compact;
+
+        /* Keys of the rest records are not all known */
+        if (c->track_failed)
+                c->count = 0;
+
+        /* From the file tail down */
+        while (c->count != 0 && bytes < budget) {
+                item = c->items[--c->count].item;
+                if (item == NULL)
+                        continue;
+
+                /* Record is written with the data, blob record is not */
+                if (!(item->flags & DB_ITEM_BLOB) &&
+                                db_node_load_data(db_node, item) != 0) {
+                        perror("DB node read error");
+                        continue;
+                }
+
+                offset = db_file_get_space_below(db_node->db_file,
+                                                 item->f_size,
+                                                 item->f_offset);
+                if (offset == 0)
+                        continue;
+
+                if (pin && db_node_compact_pin(c, item) != 0) {
+                        db_file_put_space(db_node->db_file,
+                                          offset, item->f_size);
+                        c->count = 0;
+                        break;
+                }
+
+                old_offset = item->f_offset;
+                item->f_offset = offset;
+
+                if (db_node->lazy)
+                        db_node_set_dirty(db_node, item);
+                else
+                        db_node_write_item(db_node, item);
+
+                /* Old record is valid, until references are updated */
+                if (!pin)
+                        db_file_put_space(db_node->db_file,
+                                          old_offset, item->f_size);
+
+                bytes += item->f_size;
+        }
+
+        if (c->moved_count != 0)
+                qsort(c->moved, c->moved_count, sizeof(*c->moved),
+                      db_node_moved_cmp);
+
+        db_node_evict(db_node);
+
+        return bytes;
+}
+
+int db_node_compact_is_moved(void *node, struct s_db_item *item)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_compact *c = NULL;
+        struct s_db_node_moved key;
+
+        if (db_node == NULL || item == NULL)
+                return 0;
+
+        c = &db_node->compact;
+        if (c->moved_count == 0)
+                return 0;
+
+        key.item = item;
+        return bsearch(&key, c->moved, c->moved_count, sizeof(*c->moved),
+                       db_node_moved_cmp) != NULL;
+}
+
+/**
+ * @brief Grow arrays of keys, the latch is taken.
+ */
+static int db_node_compact_grow_refs(struct s_db_node_compact *c)
+{
+        struct s_db_node_referrer *refs = NULL;
+        uint32_t max = (c->ref_max) ? 2 * c->ref_max : 256;
+
+        /* Taking keys does not allocate */
+        refs = (struct s_db_node_referrer *)
+                realloc(c->taken, max * sizeof(*refs));
+        if (refs == NULL)
+                return -1;
+        c->taken = refs;
+
+        refs = (struct s_db_node_referrer *)
+                realloc(c->refs, max * sizeof(*refs));
+        if (refs == NULL)
+                return -1;
+        c->refs = refs;
+        c->ref_max = max;
+
+        return 0;
+}
+
+void db_node_compact_track(void *node, struct s_db_item *item,
+                           void *key_node, struct s_db_item *key)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_compact *c = NULL;
+        struct s_db_node_referrer *ref = NULL;
+
+        if (db_node == NULL || item == NULL || key == NULL)
+                return;
+
+        /* Pass changes under all stripes, record of the item too */
+        c = &db_node->compact;
+        if (!c->tracking || item->f_size == 0 || item->f_offset < c->target)
                 return;
 
-        db_f = db_node->db_file;
-        val_item = item->ref_item;
+        db_node_latch(db_node);
+        if (c->ref_count == c->ref_max &&
+                        db_node_compact_grow_refs(c) != 0) {
+                c->track_failed = 1;
+        } else {
+                ref = &c->refs[c->ref_count++];
+                ref->item = item;
+                ref->node = key_node;
+                ref->key = key;
+                ref->fp[0] = key->fp[0];
+                ref->fp[1] = key->fp[1];
+        }
+        db_node_unlatch(db_node);
+}
+
+void db_node_compact_scan(void *node, void *val_node, uint32_t val_node_id,
+                          uint32_t *pos, uint32_t count)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_item *item = NULL;
 
-        if (val_item == NULL || item->f_size == 0)
+        if (db_node == NULL || pos == NULL)
                 return;
 
-        /* Skip len field */
-        offset = item->f_offset + sizeof(uint32_t);
+        /* Removal puts the last item in place of the removed one */
+        if (*pos > db_node->item_count)
+                *pos = db_node->item_count;
+
+        while (*pos != 0 && count-- != 0) {
+                item = db_node->items[--(*pos)];
+                if (item->ref != 0 && item->ref_node_id == val_node_id)
+                        db_node_compact_track(val_node,
+                                              db_node_item_of(val_node,
+                                                              item->ref),
+                                              db_node, item);
+        }
+}
+
+uint32_t db_node_compact_take_refs(void *node,
+                                   struct s_db_node_referrer **refs)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_node_compact *c = NULL;
+        struct s_db_node_moved key;
+        uint32_t count = 0;
+        uint32_t kept = 0;
+        uint32_t i = 0;
+
+        if (db_node == NULL || refs == NULL)
+                return 0;
 
-        val_n = htonl(ref_node_id);
-        db_file_write_data(db_f, offset,
-                           (uint8_t *)&val_n,
-                           sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        c = &db_node->compact;
+        *refs = c->taken;
+
+        db_node_latch(db_node);
+        for (i = 0; i < c->ref_count; i++) {
+                key.item = c->refs[i].item;
+                if (c->moved_count != 0 &&
+                                bsearch(&key, c->moved, c->moved_count,
+                                        sizeof(*c->moved),
+                                        db_node_moved_cmp) != NULL)
+                        c->taken[count++] = c->refs[i];
+                else
+                        c->refs[kept++] = c->refs[i];
+        }
+        c->ref_count = kept;
+        db_node_unlatch(db_node);
 
-        val_n = htonl(val_item->f_offset);
-        db_file_write_data(db_f, offset,
-                           (uint8_t *)&val_n,
-                           sizeof(uint32_t));
+        return count;
 }
 
-void db_node_save(void *node, struct s_db_item *item, uint32_t ref_node_id)
+uint32_t db_node_compact_release(void *node, uint32_t count)
 {
-        void *db_f = NULL;
         struct s_db_node *db_node = (struct s_db_node *)node;
-        struct s_db_item *val_item = NULL;
-        uint32_t offset = 0;
-        uint32_t val_n;
-        if (node == NULL || item == NULL)
+        struct s_db_node_compact *c = NULL;
+        struct s_db_node_moved *moved = NULL;
+
+        if (db_node == NULL)
+                return 0;
+
+        c = &db_node->compact;
+
+        /* From the end, the rest stays sorted */
+        for (; c->moved_count != 0 && count != 0; count--) {
+                moved = &c->moved[--c->moved_count];
+                db_file_put_space(db_node->db_file,
+                                  moved->f_offset, moved->f_size);
+
+                if (__atomic_sub_fetch(&moved->item->ref_counter, 1,
+                                       __ATOMIC_ACQ_REL) == 0)
+                        db_node_remove(db_node, moved->item);
+        }
+
+        return c->moved_count;
+}
+
+void db_node_compact_end(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
                 return;
 
-        db_f = db_node->db_file;
-        val_item = item->ref_item;
+        db_node_compact_release(db_node, UINT32_MAX);
+        db_node->compact.count = 0;
+        db_node->compact.tracking = 0;
+        db_node->compact.ref_count = 0;
+
+        /* Removed items leave the filter */
+        db_node_bloom_rebuild(db_node);
+}
+
+uint64_t db_node_blob_gc(void *node, uint64_t budget, uint32_t max_live_pct)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_blob_ref ref;
+        struct s_db_item *item = NULL;
+        uint32_t segment = 0;
+        uint64_t bytes = 0;
+        uint32_t i = 0;
+
+        if (db_node == NULL || db_node->blob == NULL)
+                return 0;
+
+        if (!db_blob_get_victim(db_node->blob, max_live_pct, &segment))
+                return 0;
 
-        item->f_size  = sizeof(uint32_t);       /* total length */
-        if (val_item) {
-                item->f_size += sizeof(uint32_t);/* value node id */
-                item->f_size += sizeof(uint32_t);/* value offset for this key */
+        for (i = 0; i < db_node->item_count && bytes < budget; i++) {
+                item = db_node->items[i];
+                if ((item->flags & DB_ITEM_BLOB) &&
+                                db_node_tail(item)->u.blob.segment == segment) {
+                        if (db_node_load_data(db_node, item) != 0) {
+                                perror("DB blob read error");
+                                break;
+                        }
+
+                        if (db_blob_append(db_node->blob, item->data,
+                                           item->size, &ref) != 0) {
+                                perror("DB blob append error");
+                                break;
+                        }
+
+                        db_node_blob_free(db_node, item);
+                        db_node_tail(item)->u.blob.segment = ref.segment;
+                        db_node_tail(item)->u.blob.offset = ref.offset;
+
+                        /* Record keeps its size, it is written in place */
+                        if (db_node->lazy)
+                                db_node_set_dirty(db_node, item);
+                        else if (!(item->flags & DB_ITEM_DIRTY))
+                                db_node_write_item(db_node, item);
+
+                        bytes += item->size;
+                }
         }
-        item->f_size += item->size;             /* key length   */
-        item->f_offset = db_file_get_space(db_f, item->f_size);
 
-        offset = item->f_offset;
+        db_node_evict(db_node);
+
+        return bytes;
+}
+
+int db_node_blob_collect(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return 0;
+
+        return db_blob_collect(db_node->blob);
+}
+
+void db_node_get_blob_stats(void *node, struct s_db_blob_stats *stats)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return;
+
+        db_blob_get_stats(db_node->blob, stats);
+}
+
+void db_node_get_file_stats(void *node, struct s_db_file_stats *stats)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return;
+
+        db_file_get_stats(db_node->db_file, stats);
+}
+
+int db_node_need_rewrite(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL)
+                return 0;
+
+        return db_file_get_version(db_node->db_file) != DB_FILE_VERSION;
+}
+
+int db_node_rewrite(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        struct s_db_item *item = NULL;
+        uint32_t i = 0;
 
-        val_n = htonl(item->f_size);
-        db_file_write_data(db_f, offset, (uint8_t *)&val_n, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
 
-        if (val_item) {
-                val_n = htonl(ref_node_id);
-                db_file_write_data(db_f, offset,
-                                   (uint8_t *)&val_n,
-                                   sizeof(uint32_t));
-                offset += sizeof(uint32_t);
+        if (db_file_rewrite_begin(db_node->db_file) != 0)
+                return -1;
 
-                val_n = htonl(val_item->f_offset);
-                db_file_write_data(db_f, offset,
-                                   (uint8_t *)&val_n,
-                                   sizeof(uint32_t));
-                offset += sizeof(uint32_t);
+        for (i = 0; i < db_node->item_count; i++) {
+                item = db_node->items[i];
+                db_node_save_item(db_node, item);
         }
 
-        db_file_write_data(db_f, offset, item->data, item->size);
+        return 0;
 }
 
+int db_node_rewrite_end(void *node)
+{
+        struct s_db_node *db_node = (struct s_db_node *)node;
+        if (db_node == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return db_file_rewrite_end(db_node->db_file);
+}
@@ -6,35 +6,222 @@
  * @author Sviatoslav
  * @brief Database node.
  *
- * Provide access to the one table.
+ * Provide access to the one table. Items are kept in the AVL tree
+ * in order of data and in the hash index for lookups by data.
+ * The index is keyed by the 128-bit content fingerprint of the item,
+ * data are compared only when fingerprints match.
+ *
+ * Snapshot of the node is a sidecar file with all items sorted in order
+ * of the table and the free space index of the node file:
+ * header  [u32 magic "DBNS"][u32 version][u64 node file size]
+ *         [u64 item count][u64 lacune count]
+ * lacune  [u64 offset][u64 size]
+ * item    [u64 file offset][u64 file size][u32 ref node id][u32 data size]
+ *         [u64 ref][data]
+ * All numbers are big-endian. The snapshot is valid only while
+ * the node file is not changed.
+ *
+ * Values of the blob size and above may be kept in the blob log of the
+ * node (see db_blob.h), their records hold only the location in the log
+ * [u64 len | DB_FILE_RECORD_FLAG][u32 segment][u32 size][u64 offset].
+ * In the snapshot such item has bit 31 of data size set and the
+ * location instead of data.
+ *
+ * Key item may keep a small value inline, right after the key data,
+ * instead of the reference to the value item. Its record is
+ * [u64 len | DB_FILE_RECORD_FLAG][u32 key size][key][value].
+ * In the snapshot such item has ref node id 0xFFFFFFFF, the value size
+ * as ref and the value after the key data.
+ *
+ * Value node may have a memory budget. Above it, data of cold items is
+ * dropped and read back from the node file or the blob log on demand.
+ * Cold items are chosen by CLOCK: readers only set the reference bit,
+ * the hand goes round the items in order under the write lock. Evicted item
+ * leaves the table, so it is not found by data any more.
+ *
+ * The table is ordered by size and then by data words, which is the
+ * fastest. Key nodes may use byte-lexicographic order for range scans
+ * (see db_node_set_order()).
+ *
+ * Key node may keep the Bloom filter of its items (see db_bloom.h),
+ * so lookups of missing keys return before the node lock is taken
+ * (see db_node_may_have()). The filter grows with the node and is
+ * rebuilt without removed items at the end of compaction.
+ *
+ * Items and AVL nodes are cut from slab caches of the node (see
+ * db_slab.h), small data read from the node file goes to the size
+ * classes of the node arena. Such data is freed by the node only.
+ *
+ * Keys may be read without locks, in the epoch of the reader (see
+ * db_epoch.h): the hash index is safe beside the writer, removed items,
+ * evicted and replaced data are retired by the node and freed after
+ * readers leave. Writers change the value of the key item between
+ * db_node_change_begin() and db_node_change_end(), db_node_peek_value()
+ * reads it again, if it was changed meanwhile.
+ *
+ * The node lock is striped by the fingerprint of items. Writer of one
+ * item locks only its stripe (see db_node_wrlock_fp()), so writers of
+ * different items of the node run at the same time. The table, the index
+ * and the node file are shared: calls, which change them, take the short
+ * latch of the node inside. Readers and maintenance lock all stripes.
  */
 
 #include <stdint.h>
-#include "list.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct s_db_file_stats;
+struct s_db_blob_stats;
+
+/**
+ * @brief Item flags.
+ */
+enum DB_ITEM_FLAGS {
+        DB_ITEM_DIRTY = 0x01,   /**< Item is not written to the file yet */
+        DB_ITEM_BLOB  = 0x02,   /**< Data is kept in the blob log */
+        DB_ITEM_EVICTED = 0x04, /**< Item is out of the table, data may be
+                                     NULL, see db_node_get_data() */
+        DB_ITEM_REFERENCED = 0x08, /**< CLOCK reference bit */
+        DB_ITEM_ARENA = 0x10,   /**< Data is in the node arena, not malloc'ed */
+        DB_ITEM_EMBED = 0x20,   /**< Data is in the tail of the item */
+        DB_ITEM_TAIL  = 0x40    /**< Item has the tail for small data
+                                     or the blob log place */
+};
+
+/** Size of the write buffer of db_node_save_snapshot() */
+#define DB_NODE_SNAP_BUF_SIZE   (1024 * 1024)
+
+/** Max size of data kept in the item itself */
+#define DB_ITEM_EMBED_SIZE      24
+
+/**
+ * @brief Order of the node table.
+ */
+enum DB_NODE_ORDER {
+        DB_NODE_ORDER_SIZE,     /**< By size, then by data words */
+        DB_NODE_ORDER_LEX,      /**< Byte-lexicographic, shorter first */
+        DB_NODE_ORDER_FP        /**< By size, then by fingerprint, then by
+                                     data, so data are seldom compared */
+};
+
+/**
+ * @brief Memory statistics of the node.
+ */
+struct s_db_node_mem_stats {
+        uint64_t size;          /**< Size of item data in memory     */
+        uint64_t evicted;       /**< Count of items out of the table */
+        uint64_t items;         /**< Count of items, evicted too     */
+        uint64_t reads;         /**< Count of data reads on demand   */
+        uint64_t arena_size;    /**< Size of slab pages of the node  */
+        uint64_t arena_used;    /**< Size of allocated slab objects  */
+};
+
+/**
+ * @brief Lock statistics of the node, counters since the node is opened.
+ */
+struct s_db_node_lock_stats {
+        uint64_t stripe_locks;  /**< Write locks of one stripe         */
+        uint64_t stripe_waits;  /**< Of them, waited for other writers */
+        uint64_t latch_locks;   /**< Changes of the shared state       */
+        uint64_t latch_waits;   /**< Of them, waited for other stripes */
+};
+
 /**
  * @brief Table item struct.
  * ref_counter is a count reference to this item.
- * ref_item is a reference to another s_db_item.
+ * ref is a reference to another s_db_item: the 32-bit handle of the item
+ * in the node ref_node_id, see db_node_set_ref() and db_node_item_of().
  *
  * For example, key item refer to the value item.
- * Value item ref_counter not zero, ref_item of key item not NULL.
+ * Value item ref_counter not zero, ref of key item not zero.
+ * ref_counter is changed atomically, see db_node_unref().
  *
+ * Items of the node are kept in the dense item vector, which is walked
+ * in order of memory by LIST and maintenance. Removed item is replaced
+ * by the last one, so the order of puts is kept only until the first
+ * removal.
+ *
+ * Item of data up to DB_ITEM_EMBED_SIZE (most keys) or of the blob log
+ * has the tail (DB_ITEM_TAIL) from the other slab cache of the node:
+ * small data is copied into it at put or load, the blob log place is kept
+ * there. Replaced data never goes back to the tail, readers without locks
+ * may still read it. On 64-bit targets the item takes 72 bytes, 96 with
+ * the tail, and 32 more for its AVL node, see db_node_item_bench_test.
  */
 struct s_db_item {
-        uint8_t *data;  /**< Item data          */
+        uint8_t *data;  /**< Item data, may point to the tail */
+        uint64_t f_offset; /**< Offset in file  */
+        uint64_t f_size;   /**< Used space size in file */
+        uint64_t fp[2];        /**< Fingerprint of item data, see db_hash.h */
         int size;       /**< Size of item data  */
         int ref_counter;/**< Reference counter  */
-        uint32_t f_offset; /**< Offset in file  */
-        uint32_t f_size;   /**< Used space size in file */
-        struct s_db_item  *ref_item;    /**< Reference to another item  */
-        struct s_list_item list_item;
+        uint32_t ref_node_id; /**< Node id of the referred item */
+        uint32_t ref;          /**< Handle of the referred item, 0 - none */
+        uint32_t flags;    /**< DB_ITEM_FLAGS */
+        uint32_t inline_size;  /**< Size of value kept after the key data */
+        uint32_t seq;          /**< Odd while the value of the key changes */
+        uint32_t pos;          /**< Index in the item vector of the node */
+};
+
+/**
+ * @brief Items iterator, see db_node_get_iterator().
+ */
+struct s_db_node_iterator {
+        void *node;             /**< Node of the iterator */
+        uint32_t pos;           /**< Next item in the item vector */
+        struct s_db_item *last; /**< Item returned last */
+};
+
+/**
+ * @brief Key, which refers to the value of the compaction pass,
+ * see db_node_compact_track().
+ */
+struct s_db_node_referrer {
+        struct s_db_item *item; /**< Value item */
+        void *node;             /**< Node of the key */
+        struct s_db_item *key;  /**< Key item, may be removed meanwhile */
+        uint64_t fp[2];         /**< Fingerprint of the key */
 };
 
+/**
+ * db_node_load() call this function for each loaded key item.
+ * @param arg Handler arg.
+ * @param item Loaded key item, ref is not set yet.
+ * @param ref_node_id Stored node id of the value item.
+ * @param ref_offset Stored file offset of the value item.
+ * @return On success, return zero, otherwise -1 to stop loading.
+ */
+typedef int (*f_db_node_ref_handler)(void *arg,
+                                     struct s_db_item *item,
+                                     uint32_t ref_node_id,
+                                     uint64_t ref_offset);
+
+/**
+ * db_node_load() call this function for each duplicate record.
+ * Duplicate may be left by crash in the middle of compaction,
+ * it is turned into a lacune.
+ * @param arg Handler arg.
+ * @param item Loaded item with the same data.
+ * @param offset File offset of the duplicate.
+ * @return On success, return zero, otherwise -1 to stop loading.
+ */
+typedef int (*f_db_node_dup_handler)(void *arg,
+                                     struct s_db_item *item,
+                                     uint64_t offset);
+
+/**
+ * db_node_save_snapshot() call this function for each item.
+ * @param arg Handler arg.
+ * @param item Item.
+ * @param index Index of the item in the snapshot.
+ * @return Reference info to store with the item.
+ */
+typedef uint64_t (*f_db_node_snap_handler)(void *arg,
+                                           struct s_db_item *item,
+                                           uint64_t index);
+
 /**
  * @brief Initialize DB node.
  * @param node_name Unique node name.
@@ -51,22 +238,51 @@ void db_node_release(void *node);
 
 /**
  * @brief Lock db node with for read.
+ * All stripes are locked, so writers of items wait.
  * @param node DB node.
  */
 void db_node_rdlock(void *node);
 
 /**
  * @brief Lock DB node for write.
+ * All stripes are locked, items left without references by
+ * db_node_unref() are removed first.
  * @param node DB node.
  */
 void db_node_wrlock(void *node);
 
+/**
+ * @brief Lock the stripe of the item for write.
+ * Items of the stripe may be put, changed and removed, items of other
+ * stripes are changed by their writers meanwhile. The caller is in the
+ * epoch (see db_epoch.h) until db_node_unlock_fp().
+ * Items of the stripe left without references are removed first.
+ * @param node DB node.
+ * @param fp Fingerprint of item data, see db_fp_bytes().
+ */
+void db_node_wrlock_fp(void *node, const uint64_t fp[2]);
+
 /**
  * @brief Unlock DB node.
  * @param node DB node.
  */
 void db_node_unlock(void *node);
 
+/**
+ * @brief Unlock the stripe locked by db_node_wrlock_fp().
+ * @param node DB node.
+ * @param fp Fingerprint of item data.
+ */
+void db_node_unlock_fp(void *node, const uint64_t fp[2]);
+
+/**
+ * @brief Get lock statistics of the node.
+ * Node lock is not needed, counters may lag.
+ * @param node DB node.
+ * @param stats Statistics.
+ */
+void db_node_get_lock_stats(void *node, struct s_db_node_lock_stats *stats);
+
 /**
  * @brief Get node item with the same data and size.
  * @param node DB node.
@@ -76,9 +292,34 @@ void db_node_unlock(void *node);
  */
 struct s_db_item *db_node_get_item(void *node, uint8_t *data, int size);
 
+/**
+ * @brief Get node item with the same data and size by the given fingerprint.
+ * May be called without locks in the epoch, see db_epoch.h.
+ * @param node DB node.
+ * @param data Data.
+ * @param size Size of data.
+ * @param fp Fingerprint of data, see db_fp_bytes().
+ * @return Pointer to the item, if it exists in node, otherwise - NULL.
+ */
+struct s_db_item *db_node_get_item_fp(void *node, uint8_t *data, int size,
+                                      const uint64_t fp[2]);
+
+/**
+ * @brief Find the item by pointer, which may be removed and freed.
+ * Stripe of the fingerprint must be locked, see db_node_wrlock_fp().
+ * @param node DB node.
+ * @param item Item pointer, it is not read.
+ * @param fp Fingerprint of the item data.
+ * @return The item, if it is still in the node, otherwise - NULL.
+ */
+struct s_db_item *db_node_find_item(void *node, struct s_db_item *item,
+                                    const uint64_t fp[2]);
+
 /**
  * @brief Put data to the node.
  * Data must be allocated by malloc. Will be free() on release.
+ * Small data is copied into the item and freed at once, so the caller
+ * must use item->data after the put.
  * @param node DB node.
  * @param data Data.
  * @param size Data size.
@@ -86,6 +327,58 @@ struct s_db_item *db_node_get_item(void *node, uint8_t *data, int size);
  */
 struct s_db_item *db_node_put_item(void *node, uint8_t *data, int size);
 
+/**
+ * @brief Put data with the given fingerprint to the node.
+ * Data must be allocated by malloc. Will be free() on release,
+ * small data is freed at once, see db_node_put_item().
+ * @param node DB node.
+ * @param data Data.
+ * @param size Data size.
+ * @param fp Fingerprint of data, see db_fp_bytes().
+ * @return On success, return pointer to the item, otherwise - NULL.
+ */
+struct s_db_item *db_node_put_item_fp(void *node, uint8_t *data, int size,
+                                      const uint64_t fp[2]);
+
+/**
+ * @brief Put the key item with the inline value after the key data.
+ * @param node DB node.
+ * @param data Key data and the value, allocated by malloc.
+ * @param size Key size.
+ * @param inline_size Value size.
+ * @param fp Fingerprint of the key, see db_fp_bytes().
+ * @return On success, return pointer to the item, otherwise - NULL.
+ */
+struct s_db_item *db_node_put_item_inline(void *node, uint8_t *data,
+                                          int size, uint32_t inline_size,
+                                          const uint64_t fp[2]);
+
+/**
+ * @brief Get item data, read it back, if it was evicted.
+ * The item is marked as recently used.
+ * Node must be locked for read at least.
+ * @param node DB node.
+ * @param item Item of this node.
+ * @param is_copy Set to non-zero value, if the data is not kept
+ * by the item, because the node is over the budget.
+ * The caller must free() such data.
+ * @return Data pointer, valid while the node is locked.
+ * On error, NULL is returned, and errno is set.
+ */
+uint8_t *db_node_get_data(void *node, struct s_db_item *item, int *is_copy);
+
+/**
+ * @brief Replace data of the item, the old data is retired.
+ * Data must be allocated by malloc and have the same item size.
+ * Node must be locked for write.
+ * @param node DB node.
+ * @param item Item.
+ * @param data New data.
+ * @return On success, return zero, otherwise -1 is returned,
+ * the item keeps the old data.
+ */
+int db_node_set_data(void *node, struct s_db_item *item, uint8_t *data);
+
 /**
  * @brief Remove item from node and free item and data memory.
  * @param node DB node.
@@ -95,12 +388,34 @@ struct s_db_item *db_node_put_item(void *node, uint8_t *data, int size);
 int db_node_remove_item(void *node, struct s_db_item *item);
 
 /**
- * @brief Get DB node iterator.
- * Provides iteration of all items in node.
+ * @brief Add the reference to the value item.
+ * Stripe of the item must be locked for write, so the item is not
+ * removed meanwhile.
+ * @param item Value item.
+ */
+void db_node_ref(struct s_db_item *item);
+
+/**
+ * @brief Drop the reference to the value item, node need not be locked.
+ * The item without references is removed by the next writer of its
+ * stripe, see db_node_wrlock_fp(), unless it gets a reference again.
+ * @param node DB node of the item.
+ * @param item Value item.
+ * @return Count of references left, -1 on error.
+ */
+int db_node_unref(void *node, struct s_db_item *item);
+
+/**
+ * @brief Start iteration of all items in node.
+ * The iterator is owned by the caller, so readers may iterate the node
+ * at the same time. Node must be locked while the iterator is used.
+ * The item returned last may be removed, the item moved to its place
+ * is returned next. Items come in no fixed order.
  * @param node DB node.
- * @return Pointer to the DB node iterator.
+ * @param it Iterator of the caller.
+ * @return Pointer to the iterator, NULL on error.
  */
-void *db_node_get_iterator(void *node);
+void *db_node_get_iterator(void *node, struct s_db_node_iterator *it);
 
 /**
  * @brief Check, if iterator has next item.
@@ -117,23 +432,451 @@ int db_node_iterator_has_next(void *iterator);
  */
 struct s_db_item *db_node_get_next(void *node, void *iterator);
 
+/**
+ * @brief Get the first item not less than the data, in order of the table.
+ * Node must be locked for read at least.
+ * @param node DB node.
+ * @param data Data, NULL to get the first item.
+ * @param size Size of data.
+ * @return Item, NULL if there is no such item.
+ */
+struct s_db_item *db_node_seek(void *node, uint8_t *data, int size);
+
+/**
+ * @brief Get the next item in order of the table.
+ * Node must be locked for read at least.
+ * @param node DB node.
+ * @param item Item of the table.
+ * @return Item, NULL if the item is the last one.
+ */
+struct s_db_item *db_node_get_successor(void *node, struct s_db_item *item);
+
 /**
  * @brief Update in the file only reference info for given item.
  * @param node DB node.
  * @param item Item.
- * @param ref_node_id Node id of the ref_item, if it not NULL.
  */
-void db_node_update_ref(void *node,
-                        struct s_db_item *item,
-                        uint32_t ref_node_id);
+void db_node_update_ref(void *node, struct s_db_item *item);
 
 /**
  * @brief Save item to the file.
+ * Reference of the item is set before, see db_node_set_ref().
+ * @param node DB node.
+ * @param item Item.
+ */
+void db_node_save(void *node, struct s_db_item *item);
+
+/**
+ * @brief Save item again, after its size of inline value
+ * or its kind of reference is changed.
+ * Record of the same size is written in place,
+ * otherwise its old file space is freed.
  * @param node DB node.
  * @param item Item.
- * @param ref_node_id Node id of the ref_item, if it not NULL.
  */
-void db_node_save(void *node, struct s_db_item *item, uint32_t ref_node_id);
+void db_node_update(void *node, struct s_db_item *item);
+
+/**
+ * @brief Set nodes of the items, which items of the node refer to.
+ * Record of the key item keeps the file offset of its value item,
+ * which is found by ref_node_id and ref. Must be called before
+ * db_node_load(), if items of the node have references.
+ * @param node DB node.
+ * @param ref_nodes Nodes by id, the array is kept by the caller.
+ */
+void db_node_set_ref_nodes(void *node, void **ref_nodes);
+
+/**
+ * @brief Refer the item to the item of other node.
+ * Readers without locks see the node id and the handle together, if the
+ * item is published, the change is made between db_node_change_begin()
+ * and db_node_change_end().
+ * @param item Key item.
+ * @param ref_node_id Node id of the referred item.
+ * @param ref Referred item, NULL to drop the reference.
+ */
+void db_node_set_ref(struct s_db_item *item, uint32_t ref_node_id,
+                     struct s_db_item *ref);
+
+/**
+ * @brief Get the item of the node by its handle, see s_db_item::ref.
+ * Readers without locks may call it in their epoch.
+ * @param node DB node of the item.
+ * @param handle Handle of the item, may be 0.
+ * @return Item, NULL for handle 0.
+ */
+struct s_db_item *db_node_item_of(void *node, uint32_t handle);
+
+/**
+ * @brief Set lazy mode.
+ * In lazy mode db_node_save() and db_node_update_ref() only allocate
+ * file space and mark item dirty. Items are written by db_node_flush().
+ * @param node DB node.
+ * @param lazy Non-zero value to enable.
+ */
+void db_node_set_lazy(void *node, int lazy);
+
+/**
+ * @brief Select file access backend of the node file.
+ * Must be called before db_node_load().
+ * @param node DB node.
+ * @param backend enum DB_FILE_BACKEND, see db_file.h.
+ * @param map_chunk Growth step of the mapped file, 0 for default.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_set_backend(void *node, int backend, uint64_t map_chunk);
+
+/**
+ * @brief Select index of free space of the node file.
+ * Must be called before db_node_load().
+ * @param node DB node.
+ * @param allocator enum DB_FILE_ALLOCATOR, see db_file.h.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_set_allocator(void *node, int allocator);
+
+/**
+ * @brief Open the blob log of the node.
+ * Must be called before loading, if the node may have blob records.
+ * @param node DB node.
+ * @param name Name prefix of the log segments.
+ * @param blob_size Min size of the value kept in the log,
+ * 0 to keep only values, which are already there.
+ * @param segment_size Size of the log segment.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_set_blob(void *node,
+                     const char *name,
+                     uint32_t blob_size,
+                     uint64_t segment_size);
+
+/**
+ * @brief Set memory budget of item data.
+ * Above the budget, data of cold items, which are written to the file,
+ * is dropped. Items of the old format file are not evicted.
+ * Snapshot of the node with evicted items can not be written.
+ * @param node DB node.
+ * @param budget Max size of item data in bytes, 0 for no limit.
+ */
+void db_node_set_mem_budget(void *node, uint64_t budget);
+
+/**
+ * @brief Set order of the table, before items are put.
+ * @param node DB node.
+ * @param order DB_NODE_ORDER.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_set_order(void *node, int order);
+
+/**
+ * @brief Keep the Bloom filter of items, before items are put.
+ * @param node DB node.
+ * @param bits Bits per item, 0 for no filter.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_set_bloom(void *node, uint32_t bits);
+
+/**
+ * @brief Get the value of the key item without locks.
+ * Caller is in the epoch (see db_epoch.h), the value is valid until it
+ * exits. Inline value is read after the key data, the referred one from
+ * the value item, which gets the reference bit.
+ * @param node Key node, see db_node_set_ref_nodes().
+ * @param item Key item, found by db_node_get_item_fp().
+ * @param data Value data, NULL if the key has no value.
+ * @param size Size of the value.
+ * @return On success, return zero, otherwise -1, if the value is changed
+ * by the writer or is evicted. Then the caller reads it under locks.
+ */
+int db_node_peek_value(void *node, struct s_db_item *item, uint8_t **data,
+                       uint32_t *size);
+
+/**
+ * @brief Free retired items and data, which readers without locks have
+ * left. Retired objects are also freed by writers, when there are many.
+ * Node must be locked for write.
+ * @param node DB node.
+ */
+void db_node_reclaim(void *node);
+
+/**
+ * @brief Start the change of the value of the key item.
+ * Node must be locked for write.
+ * @param item Key item.
+ */
+void db_node_change_begin(struct s_db_item *item);
+
+/**
+ * @brief End the change of the value of the key item.
+ * @param item Key item.
+ */
+void db_node_change_end(struct s_db_item *item);
+
+/**
+ * @brief Check the item by the Bloom filter, node must not be locked.
+ * @param node DB node.
+ * @param fp Fingerprint of item data, see db_fp_bytes().
+ * @return Zero, if the node has no such item,
+ * otherwise non-zero value, the item may be there.
+ */
+int db_node_may_have(void *node, const uint64_t fp[2]);
+
+/**
+ * @brief Get memory statistics of the node.
+ * Node must be locked.
+ * @param node DB node.
+ * @param stats Statistics.
+ */
+void db_node_get_mem_stats(void *node, struct s_db_node_mem_stats *stats);
+
+/**
+ * @brief Get sequence number of the last queued write of the node file.
+ * Node must be locked.
+ * @param node DB node.
+ * @return Sequence number, 0 if the backend writes at once.
+ */
+uint64_t db_node_get_write_seq(void *node);
+
+/**
+ * @brief Wait until queued writes of the node file are done.
+ * Node lock is not needed.
+ * @param node DB node.
+ * @param seq Sequence number from db_node_get_write_seq().
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_wait_writes(void *node, uint64_t seq);
+
+/**
+ * @brief Write all dirty items in order of file offset and sync the file.
+ * Node must be protected from writers.
+ * @param node DB node.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_flush(void *node);
+
+/**
+ * @brief Load items from the existing node file.
+ * Must be called once, right after db_node_init().
+ * Items are appended to the node in order of file offset.
+ * @param node DB node.
+ * @param ref_handler Handler for key records. NULL for value node,
+ * whose records have no reference info.
+ * @param dup_handler Handler for duplicate records, may be NULL.
+ * @param arg Handler arg.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_load(void *node,
+                 f_db_node_ref_handler ref_handler,
+                 f_db_node_dup_handler dup_handler,
+                 void *arg);
+
+/**
+ * @brief Write snapshot of the node.
+ * Items must not change, while the snapshot is written.
+ * Node with evicted items fails with ENOTSUP.
+ * The file is written under temporary name, synced and renamed.
+ * @param node DB node.
+ * @param file_name Snapshot file name.
+ * @param handler Handler, which gives reference info of the item.
+ * @param arg Handler arg.
+ * @param buf Write buffer of DB_NODE_SNAP_BUF_SIZE, NULL to allocate it.
+ * With the buffer nothing is allocated, so the child of fork() may call it.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_save_snapshot(void *node,
+                          const char *file_name,
+                          f_db_node_snap_handler handler,
+                          void *arg,
+                          uint8_t *buf);
+
+/**
+ * @brief Load items and free space index from the snapshot.
+ * Used instead of db_node_load(), the node file is not read.
+ * Items are appended to the node in order of the snapshot,
+ * the table is built without comparisons.
+ * On error the node must be released.
+ * @param node DB node.
+ * @param file_name Snapshot file name.
+ * @param handler Handler for each item, ref_offset is the stored
+ * reference info.
+ * @param arg Handler arg.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_load_snapshot(void *node,
+                          const char *file_name,
+                          f_db_node_ref_handler handler,
+                          void *arg);
+
+/**
+ * @brief Start compaction pass of the node file.
+ * If lacunes take at least min_free_pct percent of the file, records
+ * placed above the size of packed data are collected to be moved down
+ * by db_node_compact_step(). Collected records may be removed
+ * by other threads between steps. From now keys, which refer to them,
+ * are kept, see db_node_compact_track().
+ * Node must be locked for write.
+ * @param node DB node.
+ * @param min_free_pct Percent of lacunes in the file.
+ * @return Count of records to move, zero if the pass is not needed.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_compact_begin(void *node, uint32_t min_free_pct);
+
+/**
+ * @brief Move records from the file tail to the lacunes below them.
+ * The file is cut, as soon as its tail is free.
+ *
+ * If items are referenced from another node, pin must be set:
+ * moved items keep the old record and are pinned by ref_counter,
+ * until db_node_compact_release() releases them. So references may be
+ * updated without lock of this node. If a key could not be kept for
+ * lack of memory, the pass ends without moves.
+ * Node must be locked for write.
+ * @param node DB node.
+ * @param budget Max bytes to write, the last record may exceed it.
+ * @param pin Non-zero value to keep old records.
+ * @return Count of written bytes, zero at the end of the pass.
+ */
+uint64_t db_node_compact_step(void *node, uint64_t budget, int pin);
+
+/**
+ * @brief Keep the key, which gets the reference to the item, if the item
+ * may be moved by the compaction pass. Moved items are given with their
+ * keys by db_node_compact_take_refs(), so only those key records are
+ * updated. Stripe of the item must be locked for write, or the caller is
+ * the thread of the compaction.
+ * @param node DB node of the item.
+ * @param item Value item.
+ * @param key_node DB node of the key.
+ * @param key Key item, its stripe is locked.
+ */
+void db_node_compact_track(void *node, struct s_db_item *item,
+                           void *key_node, struct s_db_item *key);
+
+/**
+ * @brief Keep keys of the node, which refer to the values of the
+ * compaction pass, see db_node_compact_track(). Items are walked down
+ * from the end, so an item, which takes the place of a removed one,
+ * is not skipped. Keys changed between calls are kept by their writers.
+ * Node must be locked for read at least, it may be unlocked between calls.
+ * @param node DB node of keys.
+ * @param val_node DB node of values, the compaction pass is started.
+ * @param val_node_id Node id of values.
+ * @param pos Position to go on, UINT32_MAX at start, zero at the end.
+ * @param count Max count of items to walk.
+ */
+void db_node_compact_scan(void *node, void *val_node, uint32_t val_node_id,
+                          uint32_t *pos, uint32_t count);
+
+/**
+ * @brief Take keys of the items moved by the last step.
+ * The array is kept by the node until the next call or the end of
+ * the pass. Node lock is not needed in the thread of the compaction.
+ * @param node DB node.
+ * @param refs Keys of the moved items.
+ * @return Count of keys.
+ */
+uint32_t db_node_compact_take_refs(void *node,
+                                   struct s_db_node_referrer **refs);
+
+/**
+ * @brief Check if the item is moved by the last step and is pinned.
+ * Node lock is not needed in the thread of the compaction.
+ * @param node DB node.
+ * @param item Item of this node.
+ * @return Non-zero value, if references to the item must be updated.
+ */
+int db_node_compact_is_moved(void *node, struct s_db_item *item);
+
+/**
+ * @brief Free old records of the pinned items and unpin them.
+ * Items, which lost all references meanwhile, are removed. Items are
+ * released by runs, so writers do not wait for all of them.
+ * Node must be locked for write.
+ * @param node DB node.
+ * @param count Max count of items to release.
+ * @return Count of pinned items left.
+ */
+uint32_t db_node_compact_release(void *node, uint32_t count);
+
+/**
+ * @brief Stop compaction pass.
+ * Node must be locked for write.
+ * @param node DB node.
+ */
+void db_node_compact_end(void *node);
+
+/**
+ * @brief Get free space statistics of the node file.
+ * @param node DB node.
+ * @param stats Statistics, see db_file.h.
+ */
+void db_node_get_file_stats(void *node, struct s_db_file_stats *stats);
+
+/**
+ * @brief Move live values out of the blob log segment, whose live part
+ * is below the given percent. Records of moved values are rewritten
+ * in place. The segment is deleted by db_node_blob_collect().
+ * Node must be locked for writing.
+ * @param node DB node.
+ * @param budget Max bytes to move.
+ * @param max_live_pct Max percent of live records in the segment.
+ * @return Count of moved bytes.
+ */
+uint64_t db_node_blob_gc(void *node, uint64_t budget, uint32_t max_live_pct);
+
+/**
+ * @brief Delete blob log segments without live values.
+ * Node file must not refer to them, so in lazy mode it is called
+ * by db_node_flush().
+ * Node must be locked for writing.
+ * @param node DB node.
+ * @return Count of deleted segments.
+ */
+int db_node_blob_collect(void *node);
+
+/**
+ * @brief Get statistics of the blob log.
+ * @param node DB node.
+ * @param stats Statistics, see db_blob.h.
+ */
+void db_node_get_blob_stats(void *node, struct s_db_blob_stats *stats);
+
+/**
+ * @brief Check if the node file is in the old format.
+ * @param node DB node.
+ * @return Non-zero value, if the node must be rewritten.
+ */
+int db_node_need_rewrite(void *node);
+
+/**
+ * @brief Write all items to the new file in the current format.
+ * Items get new file offsets, so value nodes must be rewritten before
+ * key nodes. The old file is replaced by db_node_rewrite_end().
+ * Node must be protected from other threads.
+ * @param node DB node.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_rewrite(void *node);
+
+/**
+ * @brief Replace the old node file by the rewritten one.
+ * @param node DB node.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_node_rewrite_end(void *node);
 
 #ifdef __cplusplus
 }
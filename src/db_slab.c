@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#include "db_slab.h"
+
+/* Objects start after the page header, at the cache line */
+#define DB_SLAB_HDR_SIZE        64
+#define DB_SLAB_ALIGN           sizeof(void *)
+
+struct s_db_slab_page {
+        struct s_db_slab *slab;         /**< Owner of the page */
+        uint32_t number;                /**< Index in the page table */
+};
+
+/**
+ * @brief Array of pages by number.
+ */
+struct s_db_slab_pages {
+        struct s_db_slab_pages *old;    /**< Replaced array */
+        struct s_db_slab_page *page[];
+};
+
+/**
+ * @brief Page table, shared by the caches of one group.
+ * Readers without locks find pages in it: the table grows to the new
+ * array, and replaced arrays are kept until the table is freed.
+ */
+struct s_db_slab_table {
+        struct s_db_slab_pages *pages;
+        uint64_t page_count;
+        uint64_t page_max;              /**< Size of the pages array */
+        uint32_t users;                 /**< Caches of the table */
+};
+
+struct s_db_slab {
+        uint32_t size;          /**< Object size, aligned */
+        void *free_list;        /**< Freed objects, linked by first word */
+        uint8_t *next;          /**< Next never used object of last page */
+        uint8_t *end;           /**< End of last page */
+        struct s_db_slab_table *table;  /**< Page table */
+        uint64_t page_count;    /**< Count of pages of the cache */
+        uint64_t used;          /**< Count of allocated objects */
+};
+
+/**
+ * @brief Map the page aligned to its size.
+ * The double size is mapped, the rest is unmapped.
+ */
+static struct s_db_slab_page *db_slab_map_page(void)
+{
+        uint8_t *map = NULL;
+        uint8_t *page = NULL;
+        size_t head = 0;
+        size_t tail = 0;
+
+        map = (uint8_t *)mmap(NULL, 2 * DB_SLAB_PAGE_SIZE,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        page = (uint8_t *)(((uintptr_t)map + DB_SLAB_PAGE_SIZE - 1) &
+                           ~((uintptr_t)DB_SLAB_PAGE_SIZE - 1));
+        head = page - map;
+        tail = DB_SLAB_PAGE_SIZE - head;
+
+        if (head != 0)
+                munmap(map, head);
+        if (tail != 0)
+                munmap(page + DB_SLAB_PAGE_SIZE, tail);
+
+        return (struct s_db_slab_page *)page;
+}
+
+void *db_slab_create_shared(uint32_t size, void *shared)
+{
+        struct s_db_slab *slab = NULL;
+
+        if (size == 0 || size > DB_SLAB_MAX_SIZE) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        slab = (struct s_db_slab *)malloc(sizeof(struct s_db_slab));
+        if (slab == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        memset(slab, 0, sizeof(struct s_db_slab));
+
+        if (shared != NULL) {
+                slab->table = ((struct s_db_slab *)shared)->table;
+        } else {
+                slab->table = (struct s_db_slab_table *)
+                        calloc(1, sizeof(struct s_db_slab_table));
+                if (slab->table == NULL) {
+                        free(slab);
+                        errno = ENOMEM;
+                        return NULL;
+                }
+        }
+        slab->table->users++;
+
+        /* Freed object keeps the link to the next one */
+        if (size < sizeof(void *))
+                size = sizeof(void *);
+        slab->size = (size + DB_SLAB_ALIGN - 1) & ~(DB_SLAB_ALIGN - 1);
+
+        return slab;
+}
+
+void *db_slab_create(uint32_t size)
+{
+        return db_slab_create_shared(size, NULL);
+}
+
+void db_slab_destroy(void *slab)
+{
+        struct s_db_slab *s = (struct s_db_slab *)slab;
+        struct s_db_slab_table *t = NULL;
+        struct s_db_slab_pages *pages = NULL;
+        uint64_t i = 0;
+
+        if (s == NULL)
+                return;
+
+        /* Pages of the group go with its last cache */
+        t = s->table;
+        free(s);
+        if (--t->users != 0)
+                return;
+
+        for (i = 0; i < t->page_count; i++)
+                munmap(t->pages->page[i], DB_SLAB_PAGE_SIZE);
+
+        while (t->pages != NULL) {
+                pages = t->pages;
+                t->pages = pages->old;
+                free(pages);
+        }
+
+        free(t);
+}
+
+/**
+ * @brief Add the new page to the page table.
+ */
+static struct s_db_slab_page *db_slab_add_page(struct s_db_slab *s)
+{
+        struct s_db_slab_table *t = s->table;
+        struct s_db_slab_pages *pages = NULL;
+        struct s_db_slab_page *page = NULL;
+        uint64_t max = 0;
+
+        if (t->page_count == DB_SLAB_MAX_PAGES) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        /* Readers may be in the old array, it is kept */
+        if (t->page_count == t->page_max) {
+                max = (t->page_max) ? 2 * t->page_max : 16;
+                pages = (struct s_db_slab_pages *)
+                        malloc(sizeof(*pages) + max * sizeof(page));
+                if (pages == NULL) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+
+                pages->old = t->pages;
+                if (t->page_count != 0)
+                        memcpy(pages->page, t->pages->page,
+                               t->page_count * sizeof(page));
+                __atomic_store_n(&t->pages, pages, __ATOMIC_RELEASE);
+                t->page_max = max;
+        }
+
+        page = db_slab_map_page();
+        if (page == NULL)
+                return NULL;
+
+        page->slab = s;
+        page->number = t->page_count;
+        __atomic_store_n(&t->pages->page[t->page_count], page,
+                         __ATOMIC_RELEASE);
+        t->page_count++;
+        s->page_count++;
+        return page;
+}
+
+void *db_slab_alloc(void *slab)
+{
+        struct s_db_slab *s = (struct s_db_slab *)slab;
+        struct s_db_slab_page *page = NULL;
+        void *ptr = NULL;
+
+        if (s == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (s->free_list != NULL) {
+                ptr = s->free_list;
+                s->free_list = *(void **)ptr;
+                s->used++;
+                return ptr;
+        }
+
+        if (s->next == NULL || s->end - s->next < s->size) {
+                page = db_slab_add_page(s);
+                if (page == NULL)
+                        return NULL;
+
+                s->next = (uint8_t *)page + DB_SLAB_HDR_SIZE;
+                s->end = (uint8_t *)page + DB_SLAB_PAGE_SIZE;
+        }
+
+        ptr = s->next;
+        s->next += s->size;
+        s->used++;
+
+        return ptr;
+}
+
+void db_slab_free(void *ptr)
+{
+        struct s_db_slab_page *page = NULL;
+        struct s_db_slab *s = NULL;
+
+        if (ptr == NULL)
+                return;
+
+        page = (struct s_db_slab_page *)((uintptr_t)ptr &
+                                         ~((uintptr_t)DB_SLAB_PAGE_SIZE - 1));
+        s = page->slab;
+
+        *(void **)ptr = s->free_list;
+        s->free_list = ptr;
+        s->used--;
+}
+
+uint32_t db_slab_handle(const void *ptr)
+{
+        struct s_db_slab_page *page = NULL;
+        uint32_t slot = 0;
+
+        if (ptr == NULL)
+                return 0;
+
+        page = (struct s_db_slab_page *)((uintptr_t)ptr &
+                                         ~((uintptr_t)DB_SLAB_PAGE_SIZE - 1));
+        slot = ((uintptr_t)ptr - (uintptr_t)page - DB_SLAB_HDR_SIZE) /
+               page->slab->size;
+
+        return ((page->number << DB_SLAB_SLOT_BITS) | slot) + 1;
+}
+
+void *db_slab_ptr(void *slab, uint32_t handle)
+{
+        struct s_db_slab *s = (struct s_db_slab *)slab;
+        struct s_db_slab_pages *pages = NULL;
+        struct s_db_slab_page *page = NULL;
+
+        if (s == NULL || handle == 0)
+                return NULL;
+
+        handle--;
+        pages = __atomic_load_n(&s->table->pages, __ATOMIC_ACQUIRE);
+        page = __atomic_load_n(&pages->page[handle >> DB_SLAB_SLOT_BITS],
+                               __ATOMIC_ACQUIRE);
+
+        /* The page may be of other cache of the table */
+        return (uint8_t *)page + DB_SLAB_HDR_SIZE +
+               (handle & ((1U << DB_SLAB_SLOT_BITS) - 1)) * page->slab->size;
+}
+
+void db_slab_add_stats(void *slab, struct s_db_slab_stats *stats)
+{
+        struct s_db_slab *s = (struct s_db_slab *)slab;
+        if (s == NULL || stats == NULL)
+                return;
+
+        stats->pages += s->page_count;
+        stats->size += s->page_count * DB_SLAB_PAGE_SIZE;
+        stats->used += s->used * s->size;
+}
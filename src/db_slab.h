@@ -0,0 +1,116 @@
+#ifndef DB_SLAB_H
+#define DB_SLAB_H
+
+/**
+ * @file db_slab.h
+ * @author Sviatoslav
+ * @brief Slab cache of objects of the same size.
+ *
+ * Objects are cut from pages of DB_SLAB_PAGE_SIZE, each page is aligned
+ * to its size and starts with the header, which points to the cache.
+ * So the object is freed by pointer only. Freed objects are reused
+ * first, new ones are cut one by one, so the page memory is touched
+ * in order. Pages are kept until the cache is destroyed.
+ *
+ * Object may be named by the 32-bit handle instead of the pointer:
+ * the page number in the page table and the object number in the page.
+ * Handle 0 is no object. Caches of different object sizes may share
+ * the page table, then their handles are unique, see
+ * db_slab_create_shared().
+ *
+ * The cache has no locks, the owner serializes calls. Only db_slab_ptr()
+ * may run beside them: the page table grows to the new array, the old
+ * one is kept until the cache is destroyed.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DB_SLAB_PAGE_SIZE       (64 * 1024)
+/** Max object size, a page holds at least 8 objects */
+#define DB_SLAB_MAX_SIZE        (DB_SLAB_PAGE_SIZE / 8)
+/** Bits of the object number in the handle */
+#define DB_SLAB_SLOT_BITS       13
+/** Max count of pages of the page table, all handles fit in 32 bits */
+#define DB_SLAB_MAX_PAGES       ((1U << (32 - DB_SLAB_SLOT_BITS)) - 1)
+
+/**
+ * @brief Statistics of the cache.
+ */
+struct s_db_slab_stats {
+        uint64_t pages;         /**< Count of pages            */
+        uint64_t size;          /**< Size of pages             */
+        uint64_t used;          /**< Size of allocated objects */
+};
+
+/**
+ * @brief Create empty cache.
+ * @param size Object size, up to DB_SLAB_MAX_SIZE.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_slab_create(uint32_t size);
+
+/**
+ * @brief Create empty cache, which shares the page table of the given one.
+ * Handle of an object of either cache is found by db_slab_ptr() of the
+ * other. Calls of both caches are serialized by the owner, pages are
+ * freed with the last cache of the table.
+ * @param size Object size, up to DB_SLAB_MAX_SIZE.
+ * @param shared Cache of the page table, NULL for the new table.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_slab_create_shared(uint32_t size, void *shared);
+
+/**
+ * @brief Free all pages of the cache, objects are freed too.
+ * Pages of the shared table are freed with its last cache.
+ * @param slab Slab cache.
+ */
+void db_slab_destroy(void *slab);
+
+/**
+ * @brief Allocate object.
+ * @param slab Slab cache.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_slab_alloc(void *slab);
+
+/**
+ * @brief Free object of any cache, the cache is found by the page.
+ * @param ptr Object, may be NULL.
+ */
+void db_slab_free(void *ptr);
+
+/**
+ * @brief Get the handle of the object.
+ * @param ptr Object of any cache, may be NULL.
+ * @return Handle, 0 for NULL.
+ */
+uint32_t db_slab_handle(const void *ptr);
+
+/**
+ * @brief Get the object by the handle.
+ * @param slab Slab cache of the object or of its page table.
+ * @param handle Handle of db_slab_handle(), may be 0.
+ * @return Object, NULL for handle 0.
+ */
+void *db_slab_ptr(void *slab, uint32_t handle);
+
+/**
+ * @brief Add statistics of the cache to the given one.
+ * @param slab Slab cache.
+ * @param stats Statistics.
+ */
+void db_slab_add_stats(void *slab, struct s_db_slab_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_SLAB_H */
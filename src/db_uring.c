@@ -0,0 +1,609 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+
+#include "db_uring.h"
+
+#define DB_URING_ENTRIES        64
+#define DB_URING_MAX_RUN        64
+#define DB_URING_MAX_QUEUED     (64 * 1024 * 1024)
+
+enum DB_URING_OP {
+        DB_URING_OP_WRITE,
+        DB_URING_OP_TRUNCATE
+};
+
+struct s_db_uring_op {
+        struct s_db_uring_op *next;
+        int type;               /**< enum DB_URING_OP                   */
+        uint64_t offset;        /**< Write offset or new file size      */
+        uint32_t len;           /**< Size of data                       */
+        uint32_t done;          /**< Bytes written                      */
+        uint64_t seq;           /**< Sequence number                    */
+        uint8_t *data;          /**< Copy of data, follows the struct   */
+};
+
+/**
+ * @brief Writes to adjacent offsets, submitted as one writev.
+ */
+struct s_db_uring_run {
+        struct s_db_uring_op *first;    /**< First op of the run        */
+        uint32_t count;                 /**< Count of ops               */
+        int res;                        /**< Result of the writev       */
+        uint64_t offset;
+        uint64_t len;
+        struct iovec iov[DB_URING_MAX_RUN];
+};
+
+struct s_db_uring {
+        int fd;                 /**< File descriptor, not owned         */
+        int ring_fd;            /**< io_uring, -1 for pwrite() fallback */
+
+        uint8_t *sq_ptr;        /**< Submission ring mapping            */
+        size_t sq_size;
+        uint8_t *cq_ptr;        /**< Completion ring mapping            */
+        size_t cq_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        uint32_t *sq_tail;
+        uint32_t *sq_mask;
+        uint32_t *sq_array;
+        uint32_t *cq_head;
+        uint32_t *cq_tail;
+        uint32_t *cq_mask;
+        struct io_uring_cqe *cqes;
+        struct s_db_uring_run *runs;    /**< Batch of DB_URING_ENTRIES runs */
+
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;   /**< Signaled on new op, done and stop  */
+        struct s_db_uring_op *first;    /**< Queue of pending ops       */
+        struct s_db_uring_op *last;
+        uint64_t queued_bytes;  /**< Data of pending and running ops    */
+        uint64_t last_seq;      /**< Sequence number of the last op     */
+        uint64_t done_seq;      /**< Sequence number of the last done op */
+        int err;                /**< errno of the failed op             */
+
+        pthread_t thread;
+        int started;
+        int stop;
+};
+
+static void db_uring_teardown(struct s_db_uring *u)
+{
+        if (u->sqes != NULL)
+                munmap(u->sqes, u->sqes_size);
+
+        if (u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr)
+                munmap(u->cq_ptr, u->cq_size);
+
+        if (u->sq_ptr != NULL)
+                munmap(u->sq_ptr, u->sq_size);
+
+        if (u->ring_fd >= 0)
+                close(u->ring_fd);
+
+        u->sqes = NULL;
+        u->cq_ptr = NULL;
+        u->sq_ptr = NULL;
+        u->ring_fd = -1;
+}
+
+/**
+ * @brief Create io_uring and map its rings.
+ * liburing is not required, only the kernel interface.
+ */
+static int db_uring_setup(struct s_db_uring *u)
+{
+        struct io_uring_params p;
+        void *ptr = NULL;
+
+        memset(&p, 0, sizeof(p));
+        u->ring_fd = syscall(__NR_io_uring_setup, DB_URING_ENTRIES, &p);
+        if (u->ring_fd < 0)
+                return -1;
+
+        u->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        u->cq_size = p.cq_off.cqes +
+                     p.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (u->cq_size > u->sq_size)
+                        u->sq_size = u->cq_size;
+                u->cq_size = u->sq_size;
+        }
+
+        ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+        if (ptr == MAP_FAILED)
+                goto exit_on_fail;
+        u->sq_ptr = (uint8_t *)ptr;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                u->cq_ptr = u->sq_ptr;
+        } else {
+                ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                           IORING_OFF_CQ_RING);
+                if (ptr == MAP_FAILED)
+                        goto exit_on_fail;
+                u->cq_ptr = (uint8_t *)ptr;
+        }
+
+        u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ptr = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+        if (ptr == MAP_FAILED)
+                goto exit_on_fail;
+        u->sqes = (struct io_uring_sqe *)ptr;
+
+        u->sq_tail  = (uint32_t *)(u->sq_ptr + p.sq_off.tail);
+        u->sq_mask  = (uint32_t *)(u->sq_ptr + p.sq_off.ring_mask);
+        u->sq_array = (uint32_t *)(u->sq_ptr + p.sq_off.array);
+        u->cq_head  = (uint32_t *)(u->cq_ptr + p.cq_off.head);
+        u->cq_tail  = (uint32_t *)(u->cq_ptr + p.cq_off.tail);
+        u->cq_mask  = (uint32_t *)(u->cq_ptr + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *)(u->cq_ptr + p.cq_off.cqes);
+
+        return 0;
+
+exit_on_fail:
+        db_uring_teardown(u);
+        return -1;
+}
+
+/**
+ * @brief Submit runs of writes and reap all their completions.
+ * Runs of the batch do not overlap, so they may be done in any order.
+ */
+static void db_uring_submit(struct s_db_uring *u, uint32_t count)
+{
+        struct s_db_uring_run *run = NULL;
+        struct io_uring_sqe *sqe = NULL;
+        struct io_uring_cqe *cqe = NULL;
+        uint32_t tail = *u->sq_tail;
+        uint32_t head = 0;
+        uint32_t idx = 0;
+        uint32_t to_submit = count;
+        uint32_t reaped = 0;
+        uint32_t i = 0;
+        int rc = 0;
+
+        for (i = 0; i < count; i++) {
+                run = &u->runs[i];
+                idx = tail & *u->sq_mask;
+                sqe = &u->sqes[idx];
+                memset(sqe, 0, sizeof(*sqe));
+
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->fd = u->fd;
+                sqe->off = run->offset;
+                sqe->addr = (uint64_t)(uintptr_t)run->iov;
+                sqe->len = run->count;
+                sqe->user_data = i;
+
+                u->sq_array[idx] = idx;
+                run->res = -ECANCELED;
+                tail++;
+        }
+
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+        while (reaped < count) {
+                rc = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+                if (rc < 0) {
+                        if (errno == EINTR || errno == EAGAIN ||
+                                        errno == EBUSY)
+                                continue;
+
+                        /* Ops are finished by pwrite() from now */
+                        perror("DB io_uring enter error");
+                        db_uring_teardown(u);
+                        return;
+                }
+
+                to_submit -= ((uint32_t)rc < to_submit) ? rc : to_submit;
+
+                head = *u->cq_head;
+                while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                        cqe = &u->cqes[head & *u->cq_mask];
+                        if (cqe->user_data < count)
+                                u->runs[cqe->user_data].res = cqe->res;
+                        head++;
+                        reaped++;
+                }
+                __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        }
+}
+
+/**
+ * @brief Check if the write overlaps one of the batch runs.
+ */
+static int db_uring_overlaps(struct s_db_uring *u,
+                             uint32_t count,
+                             struct s_db_uring_op *op)
+{
+        struct s_db_uring_run *run = NULL;
+        uint32_t i = 0;
+
+        for (i = 0; i < count; i++) {
+                run = &u->runs[i];
+                if (op->offset < run->offset + run->len &&
+                                run->offset < op->offset + op->len)
+                        return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Collect writes following the first one into the batch runs.
+ * Writes to adjacent offsets go to one run, written by one writev.
+ * @return Count of runs.
+ */
+static uint32_t db_uring_collect(struct s_db_uring *u,
+                                 struct s_db_uring_op **ops)
+{
+        struct s_db_uring_op *op = *ops;
+        struct s_db_uring_run *run = NULL;
+        uint32_t count = 0;
+
+        while (op != NULL && op->type == DB_URING_OP_WRITE) {
+                if (db_uring_overlaps(u, count, op))
+                        break;
+
+                run = (count != 0) ? &u->runs[count - 1] : NULL;
+                if (run == NULL || run->count == DB_URING_MAX_RUN ||
+                                op->offset != run->offset + run->len) {
+                        if (count == DB_URING_ENTRIES)
+                                break;
+
+                        run = &u->runs[count++];
+                        run->first = op;
+                        run->count = 0;
+                        run->offset = op->offset;
+                        run->len = 0;
+                        run->res = 0;
+                }
+
+                run->iov[run->count].iov_base = op->data;
+                run->iov[run->count].iov_len  = op->len;
+                run->count++;
+                run->len += op->len;
+
+                op = op->next;
+        }
+
+        *ops = op;
+        return count;
+}
+
+static int db_uring_write_rest(struct s_db_uring *u, struct s_db_uring_op *op)
+{
+        ssize_t iwrite = 0;
+
+        while (op->done < op->len) {
+                iwrite = pwrite(u->fd, &op->data[op->done], op->len - op->done,
+                                (off_t)(op->offset + op->done));
+                if (iwrite < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                op->done += iwrite;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Execute ops in order of the queue.
+ * @return Zero or errno of the first failed op.
+ */
+static int db_uring_process(struct s_db_uring *u, struct s_db_uring_op *ops)
+{
+        struct s_db_uring_op *op = ops;
+        struct s_db_uring_run *run = NULL;
+        uint64_t written = 0;
+        uint32_t count = 0;
+        uint32_t i = 0;
+        uint32_t j = 0;
+        int err = 0;
+
+        while (op != NULL) {
+                if (op->type == DB_URING_OP_TRUNCATE) {
+                        if (ftruncate(u->fd, op->offset) != 0 && err == 0)
+                                err = errno;
+                        op = op->next;
+                        continue;
+                }
+
+                count = db_uring_collect(u, &op);
+
+                if (u->ring_fd >= 0)
+                        db_uring_submit(u, count);
+
+                /* Short or failed writes are finished by pwrite() */
+                for (i = 0; i < count; i++) {
+                        run = &u->runs[i];
+                        written = (run->res > 0) ? run->res : 0;
+
+                        ops = run->first;
+                        for (j = 0; j < run->count; j++, ops = ops->next) {
+                                ops->done = (written < ops->len) ?
+                                            written : ops->len;
+                                written -= ops->done;
+
+                                if (db_uring_write_rest(u, ops) != 0 &&
+                                                err == 0)
+                                        err = errno;
+                        }
+                }
+        }
+
+        return err;
+}
+
+static void *db_uring_thread(void *arg)
+{
+        struct s_db_uring *u = (struct s_db_uring *)arg;
+        struct s_db_uring_op *ops = NULL;
+        struct s_db_uring_op *op = NULL;
+        int err = 0;
+
+        pthread_mutex_lock(&u->lock);
+        while (1) {
+                while (u->first == NULL && !u->stop)
+                        pthread_cond_wait(&u->cond, &u->lock);
+
+                /* Stop only after the queue is drained */
+                if (u->first == NULL)
+                        break;
+
+                ops = u->first;
+                u->first = NULL;
+                u->last = NULL;
+                pthread_mutex_unlock(&u->lock);
+
+                err = db_uring_process(u, ops);
+
+                pthread_mutex_lock(&u->lock);
+                while (ops != NULL) {
+                        op = ops;
+                        ops = ops->next;
+                        u->queued_bytes -= op->len;
+                        u->done_seq = op->seq;
+                        free(op);
+                }
+
+                if (err != 0 && u->err == 0)
+                        u->err = err;
+
+                pthread_cond_broadcast(&u->cond);
+        }
+        pthread_mutex_unlock(&u->lock);
+
+        return NULL;
+}
+
+void *db_uring_init(int fd)
+{
+        struct s_db_uring *u = NULL;
+
+        if (fd < 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        u = (struct s_db_uring *)malloc(sizeof(struct s_db_uring));
+        if (u == NULL) {
+                errno = ENOMEM;
+                printf("%s: DB uring allocate memory error\n", __FUNCTION__);
+                return NULL;
+        }
+
+        memset(u, 0, sizeof(struct s_db_uring));
+        u->fd = fd;
+        u->ring_fd = -1;
+
+        pthread_mutex_init(&u->lock, NULL);
+        pthread_cond_init(&u->cond, NULL);
+
+        u->runs = (struct s_db_uring_run *)
+                malloc(DB_URING_ENTRIES * sizeof(struct s_db_uring_run));
+        if (u->runs == NULL) {
+                errno = ENOMEM;
+                goto exit_on_fail;
+        }
+
+        if (db_uring_setup(u) != 0)
+                printf("%s: io_uring is not available, use pwrite\n",
+                       __FUNCTION__);
+
+        if (pthread_create(&u->thread, NULL, db_uring_thread, u) != 0) {
+                perror("DB uring thread create error");
+                goto exit_on_fail;
+        }
+        u->started = 1;
+
+        return u;
+
+exit_on_fail:
+        db_uring_release(u);
+        return NULL;
+}
+
+void db_uring_release(void *uring)
+{
+        struct s_db_uring *u = (struct s_db_uring *)uring;
+        if (u == NULL)
+                return;
+
+        if (u->started) {
+                pthread_mutex_lock(&u->lock);
+                u->stop = 1;
+                pthread_cond_broadcast(&u->cond);
+                pthread_mutex_unlock(&u->lock);
+
+                pthread_join(u->thread, NULL);
+        }
+
+        db_uring_teardown(u);
+        free(u->runs);
+
+        pthread_cond_destroy(&u->cond);
+        pthread_mutex_destroy(&u->lock);
+        free(u);
+}
+
+/**
+ * @brief Append op to the queue, wait while the queue is too big.
+ */
+static uint64_t db_uring_queue(struct s_db_uring *u, struct s_db_uring_op *op)
+{
+        uint64_t seq = 0;
+
+        pthread_mutex_lock(&u->lock);
+
+        while (u->queued_bytes > DB_URING_MAX_QUEUED)
+                pthread_cond_wait(&u->cond, &u->lock);
+
+        op->seq = ++u->last_seq;
+        seq = op->seq;
+        u->queued_bytes += op->len;
+
+        /* The I/O thread sleeps only on the empty queue */
+        if (u->last != NULL) {
+                u->last->next = op;
+        } else {
+                u->first = op;
+                pthread_cond_broadcast(&u->cond);
+        }
+        u->last = op;
+
+        pthread_mutex_unlock(&u->lock);
+
+        return seq;
+}
+
+uint64_t db_uring_write(void *uring,
+                        uint64_t offset,
+                        const struct iovec *iov,
+                        int iovcnt)
+{
+        struct s_db_uring *u = (struct s_db_uring *)uring;
+        struct s_db_uring_op *op = NULL;
+        uint8_t *dst = NULL;
+        size_t len = 0;
+        int i = 0;
+
+        if (u == NULL || iov == NULL || iovcnt <= 0) {
+                errno = EINVAL;
+                return 0;
+        }
+
+        for (i = 0; i < iovcnt; i++)
+                len += iov[i].iov_len;
+
+        op = (struct s_db_uring_op *)malloc(sizeof(*op) + len);
+        if (op == NULL) {
+                errno = ENOMEM;
+                return 0;
+        }
+
+        memset(op, 0, sizeof(*op));
+        op->type = DB_URING_OP_WRITE;
+        op->offset = offset;
+        op->len = len;
+        op->data = (uint8_t *)(op + 1);
+
+        dst = op->data;
+        for (i = 0; i < iovcnt; i++) {
+                memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+                dst += iov[i].iov_len;
+        }
+
+        return db_uring_queue(u, op);
+}
+
+uint64_t db_uring_truncate(void *uring, uint64_t size)
+{
+        struct s_db_uring *u = (struct s_db_uring *)uring;
+        struct s_db_uring_op *op = NULL;
+
+        if (u == NULL) {
+                errno = EINVAL;
+                return 0;
+        }
+
+        op = (struct s_db_uring_op *)malloc(sizeof(*op));
+        if (op == NULL) {
+                errno = ENOMEM;
+                return 0;
+        }
+
+        memset(op, 0, sizeof(*op));
+        op->type = DB_URING_OP_TRUNCATE;
+        op->offset = size;
+
+        return db_uring_queue(u, op);
+}
+
+uint64_t db_uring_get_seq(void *uring)
+{
+        struct s_db_uring *u = (struct s_db_uring *)uring;
+        uint64_t seq = 0;
+
+        if (u == NULL)
+                return 0;
+
+        pthread_mutex_lock(&u->lock);
+        seq = u->last_seq;
+        pthread_mutex_unlock(&u->lock);
+
+        return seq;
+}
+
+int db_uring_wait(void *uring, uint64_t seq)
+{
+        struct s_db_uring *u = (struct s_db_uring *)uring;
+        int err = 0;
+
+        if (u == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        pthread_mutex_lock(&u->lock);
+
+        while (u->done_seq < seq)
+                pthread_cond_wait(&u->cond, &u->lock);
+
+        /* Error is reported once */
+        err = u->err;
+        u->err = 0;
+
+        pthread_mutex_unlock(&u->lock);
+
+        if (err != 0) {
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+int db_uring_is_native(void *uring)
+{
+        struct s_db_uring *u = (struct s_db_uring *)uring;
+
+        return (u != NULL && u->ring_fd >= 0) ? 1 : 0;
+}
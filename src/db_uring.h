@@ -0,0 +1,90 @@
+#ifndef DB_URING_H
+#define DB_URING_H
+
+/**
+ * @file db_uring.h
+ * @author Sviatoslav
+ * @brief Asynchronous write-back queue of the one file.
+ *
+ * Writers copy data to the queue and return at once.
+ * The I/O thread submits queued writes to io_uring in batches
+ * and reaps completions. Writes to adjacent offsets are joined into
+ * one writev. A batch ends before a write overlapping one of the batch,
+ * so writes reach the file in the order of the queue.
+ * Truncate goes in the same order.
+ *
+ * If io_uring is not available, the I/O thread uses pwrite().
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Create write-back queue and start the I/O thread.
+ * @param fd File descriptor, owned by caller.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_uring_init(int fd);
+
+/**
+ * @brief Wait for all queued writes and stop the I/O thread.
+ * @param uring Write-back queue.
+ */
+void db_uring_release(void *uring);
+
+/**
+ * @brief Queue write of data parts.
+ * Data is copied, so caller may free it at once.
+ * Blocks only when too much data is queued.
+ * @param uring Write-back queue.
+ * @param offset File offset.
+ * @param iov Data parts.
+ * @param iovcnt Count of parts.
+ * @return Sequence number of the write, or 0 on error.
+ */
+uint64_t db_uring_write(void *uring,
+                        uint64_t offset,
+                        const struct iovec *iov,
+                        int iovcnt);
+
+/**
+ * @brief Queue truncate of the file.
+ * @param uring Write-back queue.
+ * @param size New file size.
+ * @return Sequence number of the truncate, or 0 on error.
+ */
+uint64_t db_uring_truncate(void *uring, uint64_t size);
+
+/**
+ * @brief Get sequence number of the last queued operation.
+ * @param uring Write-back queue.
+ * @return Sequence number, 0 if nothing was queued.
+ */
+uint64_t db_uring_get_seq(void *uring);
+
+/**
+ * @brief Wait until operations up to given sequence number are done.
+ * @param uring Write-back queue.
+ * @param seq Sequence number.
+ * @return On success, return zero.
+ * If some write failed, -1 is returned, and errno is set.
+ */
+int db_uring_wait(void *uring, uint64_t seq);
+
+/**
+ * @brief Check if io_uring is used.
+ * @param uring Write-back queue.
+ * @return Non-zero value for io_uring, zero for pwrite() fallback.
+ */
+int db_uring_is_native(void *uring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_URING_H */
@@ -0,0 +1,553 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "db_wal.h"
+
+#define DB_WAL_MAX_NAME_LEN     64
+#define DB_WAL_HEADER_SIZE      (5 * sizeof(uint32_t))
+#define DB_WAL_BUF_SIZE         (64 * 1024)
+
+/*
+ * Record layout, all fields in network byte order:
+ * total length, crc32 of the rest, type, key size, value size, key, value.
+ */
+#define DB_WAL_LEN_OFF          0
+#define DB_WAL_CRC_OFF          4
+#define DB_WAL_TYPE_OFF         8
+#define DB_WAL_KEY_SIZE_OFF     12
+#define DB_WAL_VAL_SIZE_OFF     16
+
+struct s_db_wal {
+        char file_name[DB_WAL_MAX_NAME_LEN];
+        int fd;                 /**< File descriptor, opened for append */
+        int mode;               /**< enum DB_WAL_MODE */
+
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;   /**< Signaled on flush done and stop */
+
+        uint8_t *buf;           /**< Pending group of records   */
+        uint32_t buf_len;
+        uint32_t buf_max;
+        uint8_t *flush_buf;     /**< Spare buffer, swapped on flush */
+        uint32_t flush_max;
+
+        uint64_t last_lsn;      /**< LSN of the last appended record */
+        uint64_t flushed_lsn;   /**< LSN of the last record on the disk */
+        uint64_t disk_size;     /**< Size of the file */
+        int flushing;           /**< Some thread writes the group */
+
+        uint32_t interval_ms;
+        uint64_t checkpoint_size;
+        uint32_t checkpoint_ms;
+        uint64_t reset_ms;      /**< Monotonic time of the last reset */
+        f_db_wal_checkpoint checkpoint;
+        void *checkpoint_arg;
+
+        pthread_t thread;
+        int started;
+        int stop;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void db_wal_crc_init(void)
+{
+        uint32_t i, j, c;
+
+        for (i = 0; i < 256; i++) {
+                c = i;
+                for (j = 0; j < 8; j++)
+                        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                crc_table[i] = c;
+        }
+}
+
+static uint32_t db_wal_crc(const uint8_t *data, uint32_t size)
+{
+        uint32_t crc = 0xFFFFFFFF;
+        uint32_t i;
+
+        for (i = 0; i < size; i++)
+                crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+        return crc ^ 0xFFFFFFFF;
+}
+
+static void db_wal_put_u32(uint8_t *buf, uint32_t val)
+{
+        val = htonl(val);
+        memcpy(buf, &val, sizeof(uint32_t));
+}
+
+static uint32_t db_wal_get_u32(const uint8_t *buf)
+{
+        uint32_t val;
+
+        memcpy(&val, buf, sizeof(uint32_t));
+        return ntohl(val);
+}
+
+void *db_wal_init(const char *file_name)
+{
+        struct s_db_wal *wal = NULL;
+        struct stat st;
+
+        if (file_name == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        pthread_once(&crc_once, db_wal_crc_init);
+
+        wal = (struct s_db_wal *)malloc(sizeof(struct s_db_wal));
+        if (wal == NULL) {
+                errno = ENOMEM;
+                printf("%s: WAL allocate memory error\n", __FUNCTION__);
+                return NULL;
+        }
+
+        memset(wal, 0, sizeof(struct s_db_wal));
+        strncpy(wal->file_name, file_name, DB_WAL_MAX_NAME_LEN - 1);
+        wal->mode = DB_WAL_NONE;
+
+        pthread_mutex_init(&wal->lock, NULL);
+        pthread_cond_init(&wal->cond, NULL);
+
+        wal->buf_max   = DB_WAL_BUF_SIZE;
+        wal->flush_max = DB_WAL_BUF_SIZE;
+        wal->buf       = (uint8_t *)malloc(wal->buf_max);
+        wal->flush_buf = (uint8_t *)malloc(wal->flush_max);
+        if (wal->buf == NULL || wal->flush_buf == NULL) {
+                errno = ENOMEM;
+                goto exit_on_fail;
+        }
+
+        wal->fd = open(wal->file_name, O_RDWR | O_CREAT | O_APPEND, 0640);
+        if (wal->fd == -1) {
+                perror("WAL open file error");
+                goto exit_on_fail;
+        }
+
+        if (fstat(wal->fd, &st) == 0)
+                wal->disk_size = st.st_size;
+
+        return wal;
+
+exit_on_fail:
+        wal->fd = -1;
+        db_wal_release(wal);
+        return NULL;
+}
+
+static int db_wal_write(int fd, const uint8_t *buf, uint32_t size)
+{
+        ssize_t iwrite = 0;
+
+        while (size > 0) {
+                iwrite = write(fd, buf, size);
+                if (iwrite < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                buf  += iwrite;
+                size -= iwrite;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Write pending group. Must be called under lock, when nobody flushes.
+ * Lock is released for the time of I/O, so writers can append
+ * records to the next group meanwhile.
+ */
+static int db_wal_flush_group(struct s_db_wal *wal)
+{
+        uint8_t *buf = wal->buf;
+        uint32_t len = wal->buf_len;
+        uint32_t max = wal->buf_max;
+        uint64_t lsn = wal->last_lsn;
+        int rc = 0;
+
+        wal->buf     = wal->flush_buf;
+        wal->buf_max = wal->flush_max;
+        wal->buf_len = 0;
+        wal->flushing = 1;
+
+        pthread_mutex_unlock(&wal->lock);
+
+        rc = db_wal_write(wal->fd, buf, len);
+        if (rc == 0)
+                rc = fdatasync(wal->fd);
+
+        if (rc != 0)
+                perror("WAL write error");
+
+        pthread_mutex_lock(&wal->lock);
+
+        wal->flush_buf = buf;
+        wal->flush_max = max;
+        wal->flushing  = 0;
+        wal->disk_size += len;
+
+        /* Do not hang waiters on I/O error, they get error code instead */
+        wal->flushed_lsn = lsn;
+
+        pthread_cond_broadcast(&wal->cond);
+
+        return rc;
+}
+
+static uint64_t db_wal_now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Check if log is too big or too old. Lock must be held.
+ */
+static int db_wal_need_checkpoint(struct s_db_wal *wal)
+{
+        uint64_t size = wal->disk_size + wal->buf_len;
+
+        if (wal->checkpoint == NULL || size == 0)
+                return 0;
+
+        if (size >= wal->checkpoint_size)
+                return 1;
+
+        return wal->checkpoint_ms != 0 &&
+               db_wal_now_ms() - wal->reset_ms >= wal->checkpoint_ms;
+}
+
+static void *db_wal_thread(void *arg)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)arg;
+        struct timespec ts;
+
+        pthread_mutex_lock(&wal->lock);
+
+        while (!wal->stop) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec  += wal->interval_ms / 1000;
+                ts.tv_nsec += (wal->interval_ms % 1000) * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000L;
+                }
+
+                pthread_cond_timedwait(&wal->cond, &wal->lock, &ts);
+                if (wal->stop)
+                        break;
+
+                if (wal->mode == DB_WAL_INTERVAL &&
+                                wal->buf_len != 0 && !wal->flushing)
+                        db_wal_flush_group(wal);
+
+                if (db_wal_need_checkpoint(wal)) {
+                        pthread_mutex_unlock(&wal->lock);
+                        wal->checkpoint(wal->checkpoint_arg);
+                        pthread_mutex_lock(&wal->lock);
+                }
+        }
+
+        pthread_mutex_unlock(&wal->lock);
+
+        return NULL;
+}
+
+int db_wal_start(void *wal_ptr,
+                 int mode,
+                 uint32_t interval_ms,
+                 uint64_t checkpoint_size,
+                 uint32_t checkpoint_ms,
+                 f_db_wal_checkpoint checkpoint,
+                 void *arg)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+
+        if (wal == NULL || wal->started || interval_ms == 0 ||
+                        (mode != DB_WAL_INTERVAL && mode != DB_WAL_SYNC)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        wal->mode = mode;
+        wal->interval_ms = interval_ms;
+        wal->checkpoint_size = checkpoint_size;
+        wal->checkpoint_ms = checkpoint_ms;
+        wal->reset_ms = db_wal_now_ms();
+        wal->checkpoint = checkpoint;
+        wal->checkpoint_arg = arg;
+
+        if (pthread_create(&wal->thread, NULL, db_wal_thread, wal) != 0) {
+                perror("WAL thread create error");
+                return -1;
+        }
+
+        wal->started = 1;
+
+        return 0;
+}
+
+void db_wal_release(void *wal_ptr)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        if (wal == NULL)
+                return;
+
+        if (wal->started) {
+                pthread_mutex_lock(&wal->lock);
+                wal->stop = 1;
+                pthread_cond_broadcast(&wal->cond);
+                pthread_mutex_unlock(&wal->lock);
+
+                pthread_join(wal->thread, NULL);
+        }
+
+        if (wal->fd >= 0) {
+                db_wal_flush(wal);
+                close(wal->fd);
+        }
+
+        pthread_cond_destroy(&wal->cond);
+        pthread_mutex_destroy(&wal->lock);
+
+        free(wal->buf);
+        free(wal->flush_buf);
+        free(wal);
+}
+
+int db_wal_replay(void *wal_ptr, f_db_wal_handler handler, void *arg)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        struct stat st;
+        const uint8_t *rec = NULL;
+        uint8_t *map = NULL;
+        uint64_t offset = 0;
+        uint64_t file_size = 0;
+        uint32_t len, type, key_size, val_size;
+        int count = 0;
+
+        if (wal == NULL || handler == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (fstat(wal->fd, &st) != 0)
+                return -1;
+
+        file_size = st.st_size;
+        if (file_size == 0)
+                return 0;
+
+        map = (uint8_t *)mmap(NULL, file_size, PROT_READ,
+                              MAP_PRIVATE, wal->fd, 0);
+        if (map == MAP_FAILED)
+                return -1;
+
+        madvise(map, file_size, MADV_SEQUENTIAL);
+
+        while (offset + DB_WAL_HEADER_SIZE <= file_size) {
+                rec = &map[offset];
+
+                len      = db_wal_get_u32(&rec[DB_WAL_LEN_OFF]);
+                type     = db_wal_get_u32(&rec[DB_WAL_TYPE_OFF]);
+                key_size = db_wal_get_u32(&rec[DB_WAL_KEY_SIZE_OFF]);
+                val_size = db_wal_get_u32(&rec[DB_WAL_VAL_SIZE_OFF]);
+
+                if (len < DB_WAL_HEADER_SIZE || len > file_size - offset)
+                        break;
+
+                if ((uint64_t)DB_WAL_HEADER_SIZE + key_size + val_size != len)
+                        break;
+
+                if (db_wal_crc(&rec[DB_WAL_TYPE_OFF], len - DB_WAL_TYPE_OFF) !=
+                                db_wal_get_u32(&rec[DB_WAL_CRC_OFF]))
+                        break;
+
+                handler(arg, type,
+                        &rec[DB_WAL_HEADER_SIZE], key_size,
+                        (val_size) ? &rec[DB_WAL_HEADER_SIZE + key_size] : NULL,
+                        val_size);
+
+                offset += len;
+                count++;
+        }
+
+        munmap(map, file_size);
+
+        return count;
+}
+
+uint64_t db_wal_append(void *wal_ptr,
+                       uint32_t type,
+                       const uint8_t *key,
+                       uint32_t key_size,
+                       const uint8_t *val,
+                       uint32_t val_size)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        uint64_t len = DB_WAL_HEADER_SIZE;
+        uint64_t lsn = 0;
+        uint8_t *rec = NULL;
+
+        if (wal == NULL || key == NULL || (val == NULL && val_size != 0)) {
+                errno = EINVAL;
+                return 0;
+        }
+
+        len += key_size;
+        len += val_size;
+        if (len > UINT32_MAX) {
+                errno = EFBIG;
+                return 0;
+        }
+
+        pthread_mutex_lock(&wal->lock);
+
+        if (wal->buf_len + len > wal->buf_max) {
+                uint32_t max = wal->buf_max;
+                uint8_t *buf = NULL;
+
+                while (wal->buf_len + len > max)
+                        max *= 2;
+
+                buf = (uint8_t *)realloc(wal->buf, max);
+                if (buf == NULL) {
+                        pthread_mutex_unlock(&wal->lock);
+                        errno = ENOMEM;
+                        return 0;
+                }
+
+                wal->buf = buf;
+                wal->buf_max = max;
+        }
+
+        rec = &wal->buf[wal->buf_len];
+
+        db_wal_put_u32(&rec[DB_WAL_LEN_OFF], (uint32_t)len);
+        db_wal_put_u32(&rec[DB_WAL_TYPE_OFF], type);
+        db_wal_put_u32(&rec[DB_WAL_KEY_SIZE_OFF], key_size);
+        db_wal_put_u32(&rec[DB_WAL_VAL_SIZE_OFF], val_size);
+        memcpy(&rec[DB_WAL_HEADER_SIZE], key, key_size);
+        if (val_size)
+                memcpy(&rec[DB_WAL_HEADER_SIZE + key_size], val, val_size);
+
+        db_wal_put_u32(&rec[DB_WAL_CRC_OFF],
+                       db_wal_crc(&rec[DB_WAL_TYPE_OFF],
+                                  (uint32_t)len - DB_WAL_TYPE_OFF));
+
+        wal->buf_len += (uint32_t)len;
+        lsn = ++wal->last_lsn;
+
+        pthread_mutex_unlock(&wal->lock);
+
+        return lsn;
+}
+
+int db_wal_commit(void *wal_ptr, uint64_t lsn)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        int rc = 0;
+
+        if (wal == NULL || wal->mode != DB_WAL_SYNC)
+                return 0;
+
+        pthread_mutex_lock(&wal->lock);
+
+        while (wal->flushed_lsn < lsn) {
+                if (!wal->flushing)
+                        rc = db_wal_flush_group(wal);
+                else
+                        pthread_cond_wait(&wal->cond, &wal->lock);
+        }
+
+        pthread_mutex_unlock(&wal->lock);
+
+        return rc;
+}
+
+int db_wal_flush(void *wal_ptr)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        int rc = 0;
+
+        if (wal == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        pthread_mutex_lock(&wal->lock);
+
+        while (wal->flushing)
+                pthread_cond_wait(&wal->cond, &wal->lock);
+
+        if (wal->buf_len != 0)
+                rc = db_wal_flush_group(wal);
+
+        pthread_mutex_unlock(&wal->lock);
+
+        return rc;
+}
+
+int db_wal_reset(void *wal_ptr)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        int rc = 0;
+
+        if (wal == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        pthread_mutex_lock(&wal->lock);
+
+        while (wal->flushing)
+                pthread_cond_wait(&wal->cond, &wal->lock);
+
+        wal->buf_len = 0;
+        wal->flushed_lsn = wal->last_lsn;
+
+        rc = ftruncate(wal->fd, 0);
+        if (rc == 0)
+                rc = fdatasync(wal->fd);
+        wal->disk_size = 0;
+        wal->reset_ms = db_wal_now_ms();
+
+        pthread_cond_broadcast(&wal->cond);
+        pthread_mutex_unlock(&wal->lock);
+
+        return rc;
+}
+
+uint64_t db_wal_get_size(void *wal_ptr)
+{
+        struct s_db_wal *wal = (struct s_db_wal *)wal_ptr;
+        uint64_t size = 0;
+
+        if (wal == NULL)
+                return 0;
+
+        pthread_mutex_lock(&wal->lock);
+        size = wal->disk_size + wal->buf_len;
+        pthread_mutex_unlock(&wal->lock);
+
+        return size;
+}
@@ -0,0 +1,157 @@
+#ifndef DB_WAL_H
+#define DB_WAL_H
+
+/**
+ * @file db_wal.h
+ * @author Sviatoslav
+ * @brief Database write-ahead log.
+ *
+ * Append-only log of PUT and ERASE commands.
+ * Writers append one record per command to the memory buffer,
+ * then the whole group of records is written to the file by one write()
+ * and one fdatasync().
+ *
+ * Each record starts with 4 byte total length and 4 byte checksum,
+ * so a torn tail is detected on replay.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Durability mode.
+ */
+enum DB_WAL_MODE {
+        DB_WAL_NONE,     /**< No log, node files are written at once   */
+        DB_WAL_INTERVAL, /**< Group commit once per interval           */
+        DB_WAL_SYNC      /**< Command is acked after its group commit  */
+};
+
+/**
+ * db_wal_replay() call this function for each valid record.
+ * @param arg Handler arg.
+ * @param type Command type, DB_CMD_PUT or DB_CMD_ERASE.
+ * @param key Key data.
+ * @param key_size Key size.
+ * @param val Value data, NULL for DB_CMD_ERASE.
+ * @param val_size Value size.
+ */
+typedef void (*f_db_wal_handler)(void *arg,
+                                 uint32_t type,
+                                 const uint8_t *key,
+                                 uint32_t key_size,
+                                 const uint8_t *val,
+                                 uint32_t val_size);
+
+/**
+ * WAL thread call this function, when log grows over checkpoint size
+ * or checkpoint interval is over.
+ */
+typedef void (*f_db_wal_checkpoint)(void *arg);
+
+/**
+ * @brief Open WAL file.
+ * @param file_name Unique file name.
+ * @return On success returns not NULL pointer,
+ * otherwise returns NULL and set errno.
+ */
+void *db_wal_init(const char *file_name);
+
+/**
+ * @brief Stop WAL thread, flush pending records and close the file.
+ * @param wal WAL.
+ */
+void db_wal_release(void *wal);
+
+/**
+ * @brief Start group commit.
+ * Starts WAL thread, which flushes pending records once per interval
+ * and calls checkpoint handler, when log is too big or too old.
+ * @param wal WAL.
+ * @param mode Durability mode, DB_WAL_INTERVAL or DB_WAL_SYNC.
+ * @param interval_ms Group commit interval.
+ * @param checkpoint_size Log size for checkpoint.
+ * @param checkpoint_ms Max time from the reset to checkpoint of not empty
+ * log, 0 for checkpoint only by size.
+ * @param checkpoint Checkpoint handler.
+ * @param arg Checkpoint handler arg.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_wal_start(void *wal,
+                 int mode,
+                 uint32_t interval_ms,
+                 uint64_t checkpoint_size,
+                 uint32_t checkpoint_ms,
+                 f_db_wal_checkpoint checkpoint,
+                 void *arg);
+
+/**
+ * @brief Call handler for each record in the file.
+ * Stops on the first torn record.
+ * @param wal WAL.
+ * @param handler Record handler.
+ * @param arg Handler arg.
+ * @return Count of replayed records, or -1 on error.
+ */
+int db_wal_replay(void *wal, f_db_wal_handler handler, void *arg);
+
+/**
+ * @brief Append record to the pending group.
+ * @param wal WAL.
+ * @param type Command type.
+ * @param key Key data.
+ * @param key_size Key size.
+ * @param val Value data or NULL.
+ * @param val_size Value size.
+ * @return Log sequence number of the record, or 0 on error.
+ */
+uint64_t db_wal_append(void *wal,
+                       uint32_t type,
+                       const uint8_t *key,
+                       uint32_t key_size,
+                       const uint8_t *val,
+                       uint32_t val_size);
+
+/**
+ * @brief Wait until record with given LSN is on the disk.
+ * Does nothing if mode is not DB_WAL_SYNC.
+ * One of the waiting writers flushes the whole group for others.
+ * @param wal WAL.
+ * @param lsn Log sequence number.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_wal_commit(void *wal, uint64_t lsn);
+
+/**
+ * @brief Write and sync all pending records.
+ * @param wal WAL.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_wal_flush(void *wal);
+
+/**
+ * @brief Drop all records. Called after checkpoint.
+ * @param wal WAL.
+ * @return On success, return zero.
+ * On error, -1 is returned, and errno is set.
+ */
+int db_wal_reset(void *wal);
+
+/**
+ * @brief Get size of the log file with pending records.
+ * @param wal WAL.
+ * @return Size in bytes.
+ */
+uint64_t db_wal_get_size(void *wal);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DB_WAL_H */
@@ -66,6 +66,23 @@ static void put_msg_to_queue(struct s_message *msg, void * arg);
 
 static void *thread_run(void *arg);
 
+/**
+ * @brief Remove socket file left by crashed server.
+ * File is kept, if another server listens on it.
+ */
+static void server_remove_stale_socket(struct sockaddr_un *addr)
+{
+        int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sd == -1)
+                return;
+
+        if (connect(sd, (struct sockaddr *)addr, sizeof(*addr)) != 0 &&
+                        errno == ECONNREFUSED)
+                unlink(addr->sun_path);
+
+        close(sd);
+}
+
 static int server_init_threads(struct s_thread *threads, uint32_t count)
 {
         int i;
@@ -134,7 +151,8 @@ static int server_release_threads(struct s_thread *threads, uint32_t count)
 int server_init(uint32_t max_server_connections,
                 uint32_t db_nodes_count,
                 uint32_t readers_count,
-                uint32_t writers_count)
+                uint32_t writers_count,
+                const struct s_db_options *db_options)
 {
         sigset_t sigset, oldset;
         struct sockaddr_un addr;
@@ -150,7 +168,7 @@ int server_init(uint32_t max_server_connections,
 
         serv->max_connection = max_server_connections;
 
-        if (db_init(db_nodes_count) != 0) {
+        if (db_init_options(db_nodes_count, db_options) != 0) {
                 perror("DB init error");
                 goto exit_on_fail;
         }
@@ -172,6 +190,7 @@ int server_init(uint32_t max_server_connections,
         memset(&addr, 0, sizeof(addr));
         addr.sun_family = AF_UNIX;
         strncpy(addr.sun_path, DB_SOCKET_NAME, sizeof(addr.sun_path)-1);
+        server_remove_stale_socket(&addr);
         if (bind(serv->sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
                 perror("Bind server socket error");
                 goto exit_on_fail;
@@ -354,7 +373,8 @@ static void put_msg_to_queue(struct s_message *msg, void * arg)
         struct s_server *server = (struct s_server *)arg;
         struct s_thread *th = NULL;
 
-        if (msg->cmd.type == DB_CMD_PUT || msg->cmd.type == DB_CMD_ERASE) {
+        if (msg->cmd.type == DB_CMD_PUT || msg->cmd.type == DB_CMD_ERASE ||
+                        msg->cmd.type == DB_CMD_RESHARD) {
                 server->last_writer++;
                 server->last_writer %= server->writers_count;
                 th = &server->writers[server->last_writer];
@@ -384,8 +404,14 @@ static void *thread_run(void *arg)
                         continue;
 
                 do {
-                        if (size > 0)
+                        /* Do not cancel thread with DB locks held */
+                        if (size > 0) {
+                                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,
+                                                       NULL);
                                 db_process_message(&msg);
+                                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,
+                                                       NULL);
+                        }
 
                         size = queue_read(th->queue, (uint8_t *)&msg, msg_size);
                 } while (size > 0);
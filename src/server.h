@@ -12,18 +12,22 @@
 
 #include <stdint.h>
 
+struct s_db_options;
+
 /**
  * @brief Initialize databse server.
  * @param max_server_connections Max listen connections.
  * @param db_nodes_count Max pair of DB nodes <key node, value node>.
  * @param readers_count Max thread count for execute read command (GET, LIST).
  * @param writers_count MAX thread count for execute write command (PUT, ERASE).
+ * @param db_options Database options, NULL for defaults.
  * @return On success, return 0, otherwise -1 is returned.
  */
 int server_init(uint32_t max_server_connections,
                 uint32_t db_nodes_count,
                 uint32_t readers_count,
-                uint32_t writers_count);
+                uint32_t writers_count,
+                const struct s_db_options *db_options);
 
 /**
  * @brief Release all server resources.
@@ -2,8 +2,13 @@
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "server.h"
+#include "db.h"
+#include "db_wal.h"
+#include "db_file.h"
 #include "config.h"
 
 static void signal_handler(int signo)
@@ -11,11 +16,174 @@ static void signal_handler(int signo)
         server_stop();
 }
 
-int main(void)
+static void usage(const char *name)
+{
+        printf("Usage: %s [-d none|interval|sync] [-i interval_ms] "
+               "[-c checkpoint_mb] [-b pwrite|mmap|uring] "
+               "[-r compact_mb] [-a avl|seg] [-t checkpoint_sec] "
+               "[-s on|off] [-v blob_kb] [-l inline_size] [-m mem_mb] "
+               "[-f bloom_bits] [-p list_threads] [-n nodes] [-w writers]\n",
+               name);
+        printf("  -d  durability mode: no WAL, group commit once per "
+               "interval, ack after group commit\n");
+        printf("  -i  WAL group commit interval in ms\n");
+        printf("  -c  WAL size in MB, that triggers checkpoint\n");
+        printf("  -b  node file backend: write syscalls, memory mapping "
+               "or write-back queue with io_uring\n");
+        printf("  -r  I/O budget of node file compaction in MB per second, "
+               "0 to disable\n");
+        printf("  -a  node file free space index: best fit over AVL trees "
+               "or segregated fit over size classes\n");
+        printf("  -t  WAL age in seconds, that triggers checkpoint, "
+               "0 to disable\n");
+        printf("  -s  write node snapshots at checkpoint for fast restart\n");
+        printf("  -v  min size of value in KB, that is appended to the blob log, "
+               "0 to disable\n");
+        printf("  -l  size of value in bytes, below which it is kept in the "
+               "key record, 0 to disable\n");
+        printf("  -m  memory budget of values of each node in MB, cold values "
+               "are read from disk, disables snapshots, 0 for no limit\n");
+        printf("  -f  bits per key of the Bloom filter of each key node, "
+               "0 to disable\n");
+        printf("  -p  threads of one LIST request, nodes are shared "
+               "between them, all but one are pooled\n");
+        printf("  -n  count of key and value node pairs, database of other "
+               "count is resharded in background, by default the stored "
+               "count is kept\n");
+        printf("  -w  count of writer threads, 0 for one per online CPU\n");
+}
+
+static int parse_options(int argc, char *argv[], struct s_db_options *opts,
+                         uint32_t *nodes, uint32_t *writers)
+{
+        int opt = 0;
+
+        db_options_default(opts);
+        opts->wal_mode = DB_SERVER_WAL_MODE;
+        opts->wal_interval_ms = DB_SERVER_WAL_INTERVAL_MS;
+        opts->checkpoint_size = (uint64_t)DB_SERVER_CHECKPOINT_MB << 20;
+        opts->file_backend = DB_SERVER_FILE_BACKEND;
+        opts->compact_rate = (uint64_t)DB_SERVER_COMPACT_MB << 20;
+        opts->file_allocator = DB_SERVER_FILE_ALLOCATOR;
+        opts->checkpoint_interval_ms = DB_SERVER_CHECKPOINT_SEC * 1000;
+        opts->snapshot = DB_SERVER_SNAPSHOT;
+        opts->blob_size = DB_SERVER_BLOB_KB << 10;
+        opts->inline_size = DB_SERVER_INLINE_SIZE;
+        opts->mem_budget = (uint64_t)DB_SERVER_MEM_MB << 20;
+        opts->bloom_bits = DB_SERVER_BLOOM_BITS;
+        opts->list_threads = DB_SERVER_LIST_THREADS;
+        *nodes = 0;
+        *writers = DB_SERVER_WRITERS_COUNT;
+
+        while ((opt = getopt(argc, argv, "d:i:c:b:r:a:t:s:v:l:m:f:p:n:w:h")) != -1) {
+                switch (opt) {
+                case 'd':
+                        if (strcmp(optarg, "none") == 0)
+                                opts->wal_mode = DB_WAL_NONE;
+                        else if (strcmp(optarg, "interval") == 0)
+                                opts->wal_mode = DB_WAL_INTERVAL;
+                        else if (strcmp(optarg, "sync") == 0)
+                                opts->wal_mode = DB_WAL_SYNC;
+                        else
+                                return -1;
+                        break;
+                case 'i':
+                        opts->wal_interval_ms = strtoul(optarg, NULL, 10);
+                        if (opts->wal_interval_ms == 0)
+                                return -1;
+                        break;
+                case 'c':
+                        opts->checkpoint_size = strtoull(optarg, NULL, 10) << 20;
+                        if (opts->checkpoint_size == 0)
+                                return -1;
+                        break;
+                case 'b':
+                        if (strcmp(optarg, "pwrite") == 0)
+                                opts->file_backend = DB_FILE_BACKEND_PWRITE;
+                        else if (strcmp(optarg, "mmap") == 0)
+                                opts->file_backend = DB_FILE_BACKEND_MMAP;
+                        else if (strcmp(optarg, "uring") == 0)
+                                opts->file_backend = DB_FILE_BACKEND_URING;
+                        else
+                                return -1;
+                        break;
+                case 'r':
+                        opts->compact_rate = strtoull(optarg, NULL, 10) << 20;
+                        break;
+                case 'a':
+                        if (strcmp(optarg, "avl") == 0)
+                                opts->file_allocator = DB_FILE_ALLOCATOR_AVL;
+                        else if (strcmp(optarg, "seg") == 0)
+                                opts->file_allocator = DB_FILE_ALLOCATOR_SEG;
+                        else
+                                return -1;
+                        break;
+                case 't':
+                        opts->checkpoint_interval_ms =
+                                strtoul(optarg, NULL, 10) * 1000;
+                        break;
+                case 's':
+                        if (strcmp(optarg, "on") == 0)
+                                opts->snapshot = 1;
+                        else if (strcmp(optarg, "off") == 0)
+                                opts->snapshot = 0;
+                        else
+                                return -1;
+                        break;
+                case 'v':
+                        opts->blob_size = strtoul(optarg, NULL, 10) << 10;
+                        break;
+                case 'l':
+                        opts->inline_size = strtoul(optarg, NULL, 10);
+                        break;
+                case 'm':
+                        opts->mem_budget = strtoull(optarg, NULL, 10) << 20;
+                        break;
+                case 'f':
+                        opts->bloom_bits = strtoul(optarg, NULL, 10);
+                        break;
+                case 'p':
+                        opts->list_threads = strtoul(optarg, NULL, 10);
+                        break;
+                case 'n':
+                        *nodes = strtoul(optarg, NULL, 10);
+                        if (*nodes == 0 || *nodes > DB_MAX_NODES)
+                                return -1;
+                        break;
+                case 'w':
+                        *writers = strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        return -1;
+                }
+        }
+
+        /* Count of the database resharded before is kept, unless given */
+        if (*nodes == 0 && db_get_stored_node_count(nodes) != 0)
+                *nodes = DB_SERVER_NODES_COUNT;
+
+        /* Writers of distinct nodes run in parallel, one per core */
+        if (*writers == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                *writers = (cpus > 0) ? (uint32_t)cpus : 1;
+        }
+
+        return 0;
+}
+
+int main(int argc, char *argv[])
 {
         struct sigaction sa;
+        struct s_db_options db_options;
+        uint32_t nodes = 0;
+        uint32_t writers = 0;
         int rc = EXIT_SUCCESS;
 
+        if (parse_options(argc, argv, &db_options, &nodes, &writers) != 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+
         memset(&sa, 0, sizeof(sa));
 
         sa.sa_handler = &signal_handler;
@@ -32,9 +200,10 @@ int main(void)
                 perror("Warning: cannot hanle SIGSEGV");
 
         if (server_init(DB_SERVER_MAX_CONNECTIONS,
-                        DB_SERVER_NODES_COUNT,
+                        nodes,
                         DB_SERVER_READERS_COUNT,
-                        DB_SERVER_WRITERS_COUNT) != 0) {
+                        writers,
+                        &db_options) != 0) {
                 rc = EXIT_FAILURE;
                 goto server_init_err;
         }
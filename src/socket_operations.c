@@ -30,6 +30,14 @@ static int cmd_is_valid(struct s_command *cmd)
                 if (cmd->key_size == 0)
                         return 0;
                 break;
+        case DB_CMD_SCAN:
+                if (cmd->val_size < DB_SCAN_LIMIT_SIZE)
+                        return 0;
+                break;
+        case DB_CMD_RESHARD:
+                if (cmd->key_size != 0 || cmd->val_size != DB_RESHARD_SIZE)
+                        return 0;
+                break;
         case DB_CMD_LIST:
         case DB_CMD_RESP:
                 return 1;
@@ -105,6 +113,9 @@ void socket_read(struct s_message *msg,
 
                                         if (alloc_key_val(msg) != 0)
                                                 goto close_socket;
+
+                                        if (cmd->type == DB_CMD_PUT)
+                                                db_fp_init(&msg->val_fp);
                                 }
                         }
 
@@ -134,6 +145,12 @@ void socket_read(struct s_message *msg,
                                                 &buf[offset],
                                                 cp);
 
+                                /* Value is hashed while it is in cache */
+                                if (cmd->type == DB_CMD_PUT)
+                                        db_fp_update(&msg->val_fp,
+                                                     &msg->val[msg->val_len],
+                                                     cp);
+
                                 msg->val_len += cp;
                                 offset  += cp;
                                 iread   -= cp;
@@ -143,6 +160,9 @@ void socket_read(struct s_message *msg,
                                         cmd->key_size == msg->key_len &&
                                         cmd->val_size == msg->val_len) {
 
+                                if (cmd->type == DB_CMD_PUT)
+                                        db_fp_final(&msg->val_fp);
+
                                 (*msg_handler)(msg, handler_arg);
 
                                 memset(msg, 0, sizeof(struct s_message));
@@ -0,0 +1,213 @@
+#define BOOST_TEST_MODULE db_blob_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db_blob.h"
+
+#define DB_BLOB_NAME "db_test_blob"
+#define DB_BLOB_MAX_SEGMENTS 16
+
+struct db_blob_fixture {
+        db_blob_fixture()  { remove_files(); }
+        ~db_blob_fixture() { remove_files(); }
+
+        static void remove_files()
+        {
+                char name[64];
+                int i = 0;
+
+                for (i = 1; i <= DB_BLOB_MAX_SEGMENTS; i++) {
+                        sprintf(name, "%s.%d", DB_BLOB_NAME, i);
+                        unlink(name);
+                }
+        }
+};
+
+static int segment_exists(uint32_t id)
+{
+        char name[64];
+
+        sprintf(name, "%s.%u", DB_BLOB_NAME, id);
+        return access(name, F_OK) == 0;
+}
+
+static void append_value(void *blob, uint8_t val, uint32_t size,
+                         struct s_db_blob_ref *ref)
+{
+        uint8_t buf[size];
+
+        memset(buf, val, size);
+        BOOST_REQUIRE(db_blob_append(blob, buf, size, ref) == 0);
+}
+
+static int check_value(void *blob, uint8_t val, const struct s_db_blob_ref *ref)
+{
+        uint8_t buf[ref->size];
+        uint32_t i = 0;
+
+        if (db_blob_read(blob, ref, buf) != 0)
+                return 0;
+
+        for (i = 0; i < ref->size; i++) {
+                if (buf[i] != val)
+                        return 0;
+        }
+
+        return 1;
+}
+
+BOOST_FIXTURE_TEST_SUITE(BOOST_TEST_MODULE, db_blob_fixture)
+
+BOOST_AUTO_TEST_CASE(db_blob_append_test)
+{
+        struct s_db_blob_stats stats;
+        struct s_db_blob_ref ref1, ref2;
+        void *blob = db_blob_init(DB_BLOB_NAME, 1024 * 1024);
+        BOOST_REQUIRE(blob != NULL);
+
+        /* Segment is created on the first append */
+        BOOST_CHECK(!segment_exists(1));
+        append_value(blob, 0x11, 100, &ref1);
+        append_value(blob, 0x22, 200, &ref2);
+        BOOST_CHECK(segment_exists(1));
+
+        BOOST_CHECK(ref1.segment == 1);
+        BOOST_CHECK(ref2.segment == 1);
+        BOOST_CHECK(ref2.offset == ref1.offset + sizeof(uint64_t) + 100);
+
+        BOOST_CHECK(check_value(blob, 0x11, &ref1));
+        BOOST_CHECK(check_value(blob, 0x22, &ref2));
+
+        db_blob_get_stats(blob, &stats);
+        BOOST_CHECK(stats.segments == 1);
+        BOOST_CHECK(stats.live_size == 2 * sizeof(uint64_t) + 300);
+        BOOST_CHECK(stats.size == ref2.offset + sizeof(uint64_t) + 200);
+
+        /* Size of the record is checked */
+        ref1.size++;
+        BOOST_CHECK(!check_value(blob, 0x11, &ref1));
+        ref1.segment = 5;
+        BOOST_CHECK(db_blob_read(blob, &ref1, NULL) == -1);
+        BOOST_CHECK(errno == EINVAL);
+
+        BOOST_CHECK(db_blob_sync(blob) == 0);
+        db_blob_release(blob);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_reopen_test)
+{
+        struct s_db_blob_stats stats;
+        struct s_db_blob_ref ref1, ref2, ref3;
+        void *blob = db_blob_init(DB_BLOB_NAME, 1024 * 1024);
+        BOOST_REQUIRE(blob != NULL);
+
+        append_value(blob, 0x11, 100, &ref1);
+        append_value(blob, 0x22, 100, &ref2);
+        db_blob_release(blob);
+
+        /* Segments are found, nothing is live until it is used */
+        blob = db_blob_init(DB_BLOB_NAME, 1024 * 1024);
+        BOOST_REQUIRE(blob != NULL);
+        db_blob_get_stats(blob, &stats);
+        BOOST_CHECK(stats.segments == 1);
+        BOOST_CHECK(stats.live_size == 0);
+
+        BOOST_CHECK(db_blob_use(blob, &ref2) == 0);
+        BOOST_CHECK(check_value(blob, 0x22, &ref2));
+
+        /* The next run appends to the new segment */
+        append_value(blob, 0x33, 100, &ref3);
+        BOOST_CHECK(ref3.segment == 2);
+        BOOST_CHECK(check_value(blob, 0x11, &ref1));
+
+        db_blob_get_stats(blob, &stats);
+        BOOST_CHECK(stats.segments == 2);
+        BOOST_CHECK(stats.live_size == 2 * (sizeof(uint64_t) + 100));
+
+        ref3.offset += 1024;
+        BOOST_CHECK(db_blob_use(blob, &ref3) == -1);
+        BOOST_CHECK(errno == EINVAL);
+
+        db_blob_release(blob);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_collect_test)
+{
+        struct s_db_blob_ref refs[8];
+        struct s_db_blob_stats stats;
+        uint32_t segment = 0;
+        int i = 0;
+        void *blob = db_blob_init(DB_BLOB_NAME, 256);
+        BOOST_REQUIRE(blob != NULL);
+
+        /* Two records fill the segment */
+        for (i = 0; i < 8; i++)
+                append_value(blob, i, 120, &refs[i]);
+
+        BOOST_CHECK(refs[0].segment == 1);
+        BOOST_CHECK(refs[2].segment == 2);
+        BOOST_CHECK(refs[7].segment == 4);
+
+        /* Active segment is not a victim */
+        BOOST_CHECK(!db_blob_get_victim(blob, 100, &segment));
+        db_blob_free(blob, &refs[7]);
+        BOOST_CHECK(!db_blob_get_victim(blob, 100, &segment));
+
+        db_blob_free(blob, &refs[1]);
+        db_blob_free(blob, &refs[2]);
+        db_blob_free(blob, &refs[3]);
+        db_blob_free(blob, &refs[5]);
+
+        /* The first segment is half live, the second one is empty */
+        BOOST_CHECK(!db_blob_get_victim(blob, 50, &segment));
+        BOOST_CHECK(db_blob_get_victim(blob, 51, &segment));
+        BOOST_CHECK(segment == 1 || segment == 3);
+
+        BOOST_CHECK(db_blob_collect(blob) == 1);
+        BOOST_CHECK(!segment_exists(2));
+        BOOST_CHECK(segment_exists(4));
+
+        db_blob_get_stats(blob, &stats);
+        BOOST_CHECK(stats.segments == 3);
+        BOOST_CHECK(stats.live_size == 3 * (sizeof(uint64_t) + 120));
+
+        BOOST_CHECK(check_value(blob, 0, &refs[0]));
+        BOOST_CHECK(check_value(blob, 4, &refs[4]));
+        BOOST_CHECK(db_blob_read(blob, &refs[2], NULL) == -1);
+
+        /* Appends go on after the collect */
+        append_value(blob, 8, 120, &refs[7]);
+        BOOST_CHECK(refs[7].segment == 5);
+        BOOST_CHECK(check_value(blob, 8, &refs[7]));
+
+        db_blob_release(blob);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_error_test)
+{
+        struct s_db_blob_ref ref;
+        uint8_t buf[16];
+
+        BOOST_CHECK(db_blob_init(NULL, 1024) == NULL);
+        BOOST_CHECK(db_blob_init(DB_BLOB_NAME, 0) == NULL);
+        BOOST_CHECK(db_blob_init("no_such_dir/blob", 1024) == NULL);
+
+        void *blob = db_blob_init(DB_BLOB_NAME, 1024);
+        BOOST_REQUIRE(blob != NULL);
+        BOOST_CHECK(db_blob_append(blob, buf, 0, &ref) == -1);
+        BOOST_CHECK(errno == EINVAL);
+        db_blob_release(blob);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,154 @@
+#define BOOST_TEST_MODULE db_bloom_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "db_bloom.h"
+#include "db_hash.h"
+
+#define DB_BLOOM_BENCH_COUNT 1000000
+
+static uint64_t *key_fp(int num, uint64_t fp[2])
+{
+        char key[32];
+        int size = sprintf(key, "key:%d", num) + 1;
+
+        db_fp_bytes((uint8_t *)key, size, fp);
+        return fp;
+}
+
+BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+
+BOOST_AUTO_TEST_CASE(db_bloom_add_check_test)
+{
+        void *bloom = db_bloom_create(10000, 16, NULL);
+        uint64_t fp[2];
+        int false_pos = 0;
+        int i = 0;
+        BOOST_REQUIRE(bloom != NULL);
+        BOOST_CHECK(db_bloom_capacity(bloom) == 10000);
+
+        for (i = 0; i < 10000; i++)
+                BOOST_CHECK(!db_bloom_check(bloom, key_fp(i, fp)));
+
+        for (i = 0; i < 10000; i++)
+                db_bloom_add(bloom, key_fp(i, fp));
+
+        /* No false negatives, few false positives */
+        for (i = 0; i < 10000; i++)
+                BOOST_CHECK(db_bloom_check(bloom, key_fp(i, fp)));
+
+        for (i = 10000; i < 110000; i++)
+                false_pos += db_bloom_check(bloom, key_fp(i, fp));
+        BOOST_CHECK(false_pos < 1000);
+
+        db_bloom_destroy(bloom);
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_copy_test)
+{
+        void *bloom = db_bloom_create(1000, 16, NULL);
+        void *src = db_bloom_create(1000, 16, NULL);
+        void *other = db_bloom_create(100000, 16, NULL);
+        uint64_t fp[2];
+        int i = 0;
+        BOOST_REQUIRE(bloom != NULL && src != NULL && other != NULL);
+
+        for (i = 0; i < 1000; i++) {
+                db_bloom_add(bloom, key_fp(i, fp));
+                if (i % 2)
+                        db_bloom_add(src, key_fp(i, fp));
+        }
+
+        /* Keys left out of the source are dropped */
+        BOOST_CHECK(db_bloom_copy(bloom, src) == 0);
+        for (i = 1; i < 1000; i += 2)
+                BOOST_CHECK(db_bloom_check(bloom, key_fp(i, fp)));
+        BOOST_CHECK(!db_bloom_check(bloom, key_fp(0, fp)) ||
+                    !db_bloom_check(bloom, key_fp(2, fp)));
+
+        BOOST_CHECK(db_bloom_copy(bloom, other) == -1);
+        BOOST_CHECK(errno == EINVAL);
+
+        db_bloom_destroy(other);
+        db_bloom_destroy(src);
+        db_bloom_destroy(bloom);
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_chain_test)
+{
+        void *bloom = db_bloom_create(0, 8, NULL);
+        uint64_t fp[2];
+        BOOST_REQUIRE(bloom != NULL);
+        BOOST_CHECK(db_bloom_capacity(bloom) == DB_BLOOM_MIN_COUNT);
+
+        /* The old filter is freed with the new one */
+        db_bloom_add(bloom, key_fp(1, fp));
+        bloom = db_bloom_create(2 * DB_BLOOM_MIN_COUNT, 8, bloom);
+        BOOST_REQUIRE(bloom != NULL);
+        BOOST_CHECK(!db_bloom_check(bloom, key_fp(1, fp)));
+        db_bloom_destroy(bloom);
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_error_test)
+{
+        uint64_t fp[2] = {1, 2};
+
+        BOOST_CHECK(db_bloom_create(100, 0, NULL) == NULL);
+        BOOST_CHECK(errno == EINVAL);
+
+        /* No filter, the key may be there */
+        BOOST_CHECK(db_bloom_check(NULL, fp));
+        BOOST_CHECK(db_bloom_capacity(NULL) == 0);
+        db_bloom_add(NULL, fp);
+        db_bloom_destroy(NULL);
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_bench_test)
+{
+        struct timespec start, end;
+        void *bloom = db_bloom_create(DB_BLOOM_BENCH_COUNT, 16, NULL);
+        uint64_t (*fps)[2] = NULL;
+        double ns = 0;
+        int found = 0;
+        int i = 0;
+
+        fps = (uint64_t (*)[2])malloc(2 * DB_BLOOM_BENCH_COUNT * sizeof(*fps));
+        BOOST_REQUIRE(bloom != NULL && fps != NULL);
+
+        for (i = 0; i < 2 * DB_BLOOM_BENCH_COUNT; i++)
+                key_fp(i, fps[i]);
+        for (i = 0; i < DB_BLOOM_BENCH_COUNT; i++)
+                db_bloom_add(bloom, fps[i]);
+
+        /* Half of checks are for missing keys */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < 2 * DB_BLOOM_BENCH_COUNT; i++)
+                found += db_bloom_check(bloom, fps[(i * 7919ULL) %
+                                                   (2 * DB_BLOOM_BENCH_COUNT)]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        ns  = (end.tv_sec - start.tv_sec) * 1e9;
+        ns += end.tv_nsec - start.tv_nsec;
+
+        BOOST_CHECK(found >= DB_BLOOM_BENCH_COUNT);
+        BOOST_TEST_MESSAGE("Check of " << DB_BLOOM_BENCH_COUNT << " keys: "
+                           << ns / (2 * DB_BLOOM_BENCH_COUNT) << " ns, "
+                           << found - DB_BLOOM_BENCH_COUNT
+                           << " false positives of "
+                           << DB_BLOOM_BENCH_COUNT);
+
+        free(fps);
+        db_bloom_destroy(bloom);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,103 @@
+#define BOOST_TEST_MODULE db_epoch_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "db_epoch.h"
+
+struct reader_arg {
+        volatile int entered;
+        volatile int stop;
+        int rc;
+};
+
+static void *reader_thread(void *ptr)
+{
+        struct reader_arg *arg = (struct reader_arg *)ptr;
+
+        arg->rc = db_epoch_enter();
+        __atomic_store_n(&arg->entered, 1, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&arg->stop, __ATOMIC_ACQUIRE))
+                usleep(1000);
+        db_epoch_exit();
+
+        return NULL;
+}
+
+static void *enter_thread(void *ptr)
+{
+        int *rc = (int *)ptr;
+
+        *rc = db_epoch_enter();
+        db_epoch_exit();
+
+        return NULL;
+}
+
+BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+
+BOOST_AUTO_TEST_CASE(db_epoch_nested_test)
+{
+        uint64_t tag = 0;
+
+        BOOST_REQUIRE(db_epoch_enter() == 0);
+        BOOST_REQUIRE(db_epoch_enter() == 0);
+        tag = db_epoch_advance();
+
+        /* The thread is in the epoch of the tag, until the outer exit */
+        BOOST_CHECK(db_epoch_safe() <= tag);
+        db_epoch_exit();
+        BOOST_CHECK(db_epoch_safe() <= tag);
+        db_epoch_exit();
+        BOOST_CHECK(db_epoch_safe() > tag);
+
+        /* Unbalanced exit is ignored */
+        db_epoch_exit();
+        BOOST_CHECK(db_epoch_advance() > tag);
+}
+
+BOOST_AUTO_TEST_CASE(db_epoch_reader_test)
+{
+        struct reader_arg arg = {0, 0, -1};
+        pthread_t thread;
+        uint64_t tag = 0;
+
+        BOOST_REQUIRE(pthread_create(&thread, NULL, reader_thread, &arg) == 0);
+        while (!__atomic_load_n(&arg.entered, __ATOMIC_ACQUIRE))
+                usleep(1000);
+        BOOST_CHECK(arg.rc == 0);
+
+        /* Objects unlinked while the reader is in are kept */
+        tag = db_epoch_advance();
+        db_epoch_advance();
+        BOOST_CHECK(db_epoch_safe() <= tag);
+
+        __atomic_store_n(&arg.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+        BOOST_CHECK(db_epoch_safe() > tag);
+}
+
+BOOST_AUTO_TEST_CASE(db_epoch_slots_test)
+{
+        pthread_t thread;
+        int rc = 0;
+        int i = 0;
+
+        /* Slots of exited threads are taken again */
+        for (i = 0; i < 2 * DB_EPOCH_MAX_THREADS; i++) {
+                rc = -1;
+                BOOST_REQUIRE(pthread_create(&thread, NULL, enter_thread,
+                                             &rc) == 0);
+                pthread_join(thread, NULL);
+                BOOST_REQUIRE(rc == 0);
+        }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
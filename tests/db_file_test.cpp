@@ -8,12 +8,165 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 
 #include "db_file.h"
 
 #define DB_FILE_NAME "db_test_file.txt"
+#define OFF(x) (DB_FILE_DATA_OFFSET + (x))
+#define DB_FILE_BENCH_RECORDS 200000
+#define DB_FILE_CHURN_LIVE    100000
+#define DB_FILE_CHURN_OPS     1000000
+
+struct db_file_fixture {
+        db_file_fixture()  { unlink(DB_FILE_NAME); }
+        ~db_file_fixture() { unlink(DB_FILE_NAME);
+                             unlink(DB_FILE_NAME ".new"); }
+};
+
+static int count_records(void *arg, uint64_t offset,
+                         const uint8_t *data, uint64_t size)
+{
+        (*(int *)arg)++;
+        return 0;
+}
+
+static void write_record(void *db_file, uint64_t offset,
+                         uint32_t size, uint64_t len)
+{
+        uint8_t buf[size];
+
+        memset(buf, 0xAA, size);
+        len = htobe64(len);
+        memcpy(buf, &len, sizeof(len));
+        BOOST_REQUIRE(db_file_write_data(db_file, offset,
+                                         buf, size) == (int)size);
+}
+
+static long file_size(const char *name)
+{
+        struct stat st;
+
+        if (stat(name, &st) != 0)
+                return -1;
+
+        return st.st_size;
+}
 
-BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+/**
+ * @brief Write records of 32..287 bytes, erase every third one.
+ * Prints time spent in write calls (node lock is held for it)
+ * and total time with the final sync.
+ */
+static void write_bench(const char *name, int backend)
+{
+        struct timespec start, written, end;
+        double write_sec = 0;
+        double total_sec = 0;
+        uint8_t buf[512];
+        uint64_t len = 0;
+        uint64_t offset = 0;
+        uint32_t size = 0;
+        int i = 0;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_backend(db_file, backend, 0) == 0);
+
+        memset(buf, 0xCC, sizeof(buf));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < DB_FILE_BENCH_RECORDS; i++) {
+                size = 32 + (i * 7919) % 256;
+                offset = db_file_get_space(db_file, size);
+                len = htobe64(size);
+                memcpy(buf, &len, sizeof(len));
+                BOOST_REQUIRE(db_file_write_data(db_file, offset,
+                                                 buf, size) == (int)size);
+                if (i % 3 == 2)
+                        db_file_put_space(db_file, offset, size);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &written);
+        db_file_sync(db_file);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        db_file_release(db_file);
+        unlink(DB_FILE_NAME);
+
+        write_sec = (written.tv_sec - start.tv_sec) +
+                    (written.tv_nsec - start.tv_nsec) / 1e9;
+        total_sec = (end.tv_sec - start.tv_sec) +
+                    (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        BOOST_TEST_MESSAGE(name << " backend: " << DB_FILE_BENCH_RECORDS
+                           << " records, write calls " << write_sec
+                           << " s (" << write_sec * 1e9 / DB_FILE_BENCH_RECORDS
+                           << " ns per record), with sync " << total_sec
+                           << " s");
+}
+
+/**
+ * @brief Keep live records of random size, free random one and take
+ * a new one for it. Headers are not written (lazy mode), so only
+ * the free space index is measured.
+ * Prints time per get and put pair and lacunes left in the file.
+ */
+static void allocator_bench(const char *name, int allocator)
+{
+        struct s_db_file_stats stats;
+        struct timespec start, end;
+        uint64_t *offsets = new uint64_t[DB_FILE_CHURN_LIVE];
+        uint32_t *sizes = new uint32_t[DB_FILE_CHURN_LIVE];
+        uint64_t seed = 1;
+        double sec = 0;
+        uint32_t j = 0;
+        int i = 0;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_allocator(db_file, allocator) == 0);
+        db_file_set_lazy(db_file, 1);
+
+        for (i = 0; i < DB_FILE_CHURN_LIVE; i++) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                sizes[i] = 32 + (seed >> 33) % ((seed >> 60) ? 256 : 4096);
+                offsets[i] = db_file_get_space(db_file, sizes[i]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < DB_FILE_CHURN_OPS; i++) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                j = (seed >> 20) % DB_FILE_CHURN_LIVE;
+                db_file_put_space(db_file, offsets[j], sizes[j]);
+                sizes[j] = 32 + (seed >> 33) % ((seed >> 60) ? 256 : 4096);
+                offsets[j] = db_file_get_space(db_file, sizes[j]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        db_file_get_stats(db_file, &stats);
+        db_file_release(db_file);
+        unlink(DB_FILE_NAME);
+        delete[] offsets;
+        delete[] sizes;
+
+        sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        BOOST_TEST_MESSAGE(name << " allocator: " << DB_FILE_CHURN_OPS
+                           << " put and get pairs " << sec << " s ("
+                           << sec * 1e9 / DB_FILE_CHURN_OPS << " ns per pair)"
+                           << ", file " << stats.size << " bytes, lacunes "
+                           << stats.free_count << " of " << stats.free_size
+                           << " bytes ("
+                           << 100.0 * stats.free_size / stats.size << "%)");
+}
+
+BOOST_FIXTURE_TEST_SUITE(BOOST_TEST_MODULE, db_file_fixture)
 
 BOOST_AUTO_TEST_CASE(db_file_init_test)
 {
@@ -39,7 +192,7 @@ BOOST_AUTO_TEST_CASE(db_file_release_test)
         db_file_release(db_file);
 
         file = fopen(DB_FILE_NAME, "r");
-        BOOST_CHECK(file == NULL);
+        BOOST_CHECK(file != NULL);
 
         if (file != NULL )
                 fclose(file);
@@ -50,9 +203,9 @@ BOOST_AUTO_TEST_CASE(db_file_get_space_test)
         void *db_file = db_file_init(DB_FILE_NAME);
         BOOST_REQUIRE(db_file != NULL);
 
-        BOOST_CHECK(db_file_get_space(db_file, 1024) == 0);
-        BOOST_CHECK(db_file_get_space(db_file, 1024) == 1024);
-        BOOST_CHECK(db_file_get_space(db_file, 1024) == 2048);
+        BOOST_CHECK(db_file_get_space(db_file, 1024) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 1024) == OFF(1024));
+        BOOST_CHECK(db_file_get_space(db_file, 1024) == OFF(2048));
 
         db_file_release(db_file);
 }
@@ -62,16 +215,16 @@ BOOST_AUTO_TEST_CASE(db_file_put_space_test)
         void *db_file = db_file_init(DB_FILE_NAME);
         BOOST_REQUIRE(db_file != NULL);
 
-        BOOST_CHECK(db_file_get_space(db_file, 512) == 0);
-        BOOST_CHECK(db_file_get_space(db_file, 512) == 512);
-        BOOST_CHECK(db_file_get_space(db_file, 512) == 1024);
+        BOOST_CHECK(db_file_get_space(db_file, 512) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 512) == OFF(512));
+        BOOST_CHECK(db_file_get_space(db_file, 512) == OFF(1024));
 
-        db_file_put_space(db_file, 512, 512);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 512);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 512 + 128);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 512 + 2*128);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 512 + 3*128);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 1024 + 512);
+        db_file_put_space(db_file, OFF(512), 512);
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(512));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(512 + 128));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(512 + 2*128));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(512 + 3*128));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(1024 + 512));
 
         db_file_release(db_file);
 }
@@ -81,15 +234,15 @@ BOOST_AUTO_TEST_CASE(db_file_put_near_spaces_and_get_equal_test)
         void *db_file = db_file_init(DB_FILE_NAME);
         BOOST_REQUIRE(db_file != NULL);
 
-        BOOST_CHECK(db_file_get_space(db_file, 64) == 0);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 64);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 64 + 128);
-        BOOST_CHECK(db_file_get_space(db_file, 256) == 64 + 256);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64 + 128));
+        BOOST_CHECK(db_file_get_space(db_file, 256) == OFF(64 + 256));
 
-        db_file_put_space(db_file, 0, 64);
-        db_file_put_space(db_file, 64, 128);
+        db_file_put_space(db_file, OFF(0), 64);
+        db_file_put_space(db_file, OFF(64), 128);
 
-        BOOST_CHECK(db_file_get_space(db_file, 64 + 128) == 0);
+        BOOST_CHECK(db_file_get_space(db_file, 64 + 128) == OFF(0));
 
         db_file_release(db_file);
 }
@@ -99,15 +252,15 @@ BOOST_AUTO_TEST_CASE(db_file_put_near_spaces_and_get_bigger_test)
         void *db_file = db_file_init(DB_FILE_NAME);
         BOOST_REQUIRE(db_file != NULL);
 
-        BOOST_CHECK(db_file_get_space(db_file, 64) == 0);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 64);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 64 + 128);
-        BOOST_CHECK(db_file_get_space(db_file, 256) == 64 + 256);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64 + 128));
+        BOOST_CHECK(db_file_get_space(db_file, 256) == OFF(64 + 256));
 
-        db_file_put_space(db_file, 0, 64);
-        db_file_put_space(db_file, 64, 128);
+        db_file_put_space(db_file, OFF(0), 64);
+        db_file_put_space(db_file, OFF(64), 128);
 
-        BOOST_CHECK(db_file_get_space(db_file, 256) == 512 + 64);
+        BOOST_CHECK(db_file_get_space(db_file, 256) == OFF(512 + 64));
 
         db_file_release(db_file);
 }
@@ -117,18 +270,486 @@ BOOST_AUTO_TEST_CASE(db_file_put_two_spaces_and_get_more_suitable_test)
         void *db_file = db_file_init(DB_FILE_NAME);
         BOOST_REQUIRE(db_file != NULL);
 
-        BOOST_CHECK(db_file_get_space(db_file, 64) == 0);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 64);
-        BOOST_CHECK(db_file_get_space(db_file, 128) == 64 + 128);
-        BOOST_CHECK(db_file_get_space(db_file, 256) == 64 + 256);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64 + 128));
+        BOOST_CHECK(db_file_get_space(db_file, 256) == OFF(64 + 256));
+
+        db_file_put_space(db_file, OFF(0), 64);
+        db_file_put_space(db_file, OFF(64 + 128), 128);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64 + 128));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_get_space_keeps_header_room_test)
+{
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+
+        db_file_put_space(db_file, OFF(0), 64);
+
+        /* Rest of 2 bytes cannot hold the lacune header */
+        BOOST_CHECK(db_file_get_space(db_file, 62) == OFF(128));
+        BOOST_CHECK(db_file_get_space(db_file, 56) == OFF(0));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_put_space_merges_both_sides_test)
+{
+        struct s_db_file_stats stats;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(192));
+
+        db_file_put_space(db_file, OFF(0), 64);
+        db_file_put_space(db_file, OFF(128), 64);
+        db_file_put_space(db_file, OFF(64), 64);
+
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.size == OFF(256));
+        BOOST_CHECK(stats.free_size == 192);
+        BOOST_CHECK(stats.free_count == 1);
+
+        /* Whole lacune goes with the tail */
+        db_file_put_space(db_file, OFF(192), 64);
+
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.size == OFF(0));
+        BOOST_CHECK(stats.free_size == 0);
+        BOOST_CHECK(stats.free_count == 0);
+        BOOST_CHECK(file_size(DB_FILE_NAME) == OFF(0));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_get_space_below_test)
+{
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(192));
+
+        db_file_put_space(db_file, OFF(128), 64);
 
-        db_file_put_space(db_file, 0, 64);
-        db_file_put_space(db_file, 64 + 128, 128);
+        /* File never grows */
+        BOOST_CHECK(db_file_get_space_below(db_file, 64, OFF(128)) == 0);
+        BOOST_CHECK(db_file_get_space_below(db_file, 128, OFF(256)) == 0);
 
-        BOOST_CHECK(db_file_get_space(db_file, 64) == 0);
-        BOOST_CHECK(db_file_get_space(db_file, 64) == 64 + 128);
+        db_file_put_space(db_file, OFF(0), 64);
+        BOOST_CHECK(db_file_get_space_below(db_file, 64, OFF(128)) == OFF(0));
+        BOOST_CHECK(db_file_get_space_below(db_file, 32, OFF(256)) == OFF(128));
+        BOOST_CHECK(db_file_get_space_below(db_file, 32, OFF(256)) == OFF(160));
+        BOOST_CHECK(db_file_get_space_below(db_file, 32, OFF(256)) == 0);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(256));
 
         db_file_release(db_file);
 }
 
+BOOST_AUTO_TEST_CASE(db_file_seg_allocator_test)
+{
+        struct s_db_file_stats stats;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_allocator(db_file,
+                                            DB_FILE_ALLOCATOR_SEG) == 0);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(192));
+        BOOST_CHECK(db_file_get_space(db_file, 1000) == OFF(256));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(1256));
+
+        db_file_put_space(db_file, OFF(0), 64);
+        db_file_put_space(db_file, OFF(256), 1000);
+
+        /* Index is not empty */
+        BOOST_CHECK(db_file_set_allocator(db_file,
+                                          DB_FILE_ALLOCATOR_AVL) == -1);
+        BOOST_CHECK(errno == EBUSY);
+
+        /* Exact fit, rest without room for the header, split of bigger */
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 996) == OFF(1320));
+        BOOST_CHECK(db_file_get_space(db_file, 100) == OFF(256));
+
+        /* Merge with both neighbours by boundary tags */
+        db_file_put_space(db_file, OFF(192), 64);
+        db_file_put_space(db_file, OFF(64), 128);
+        db_file_put_space(db_file, OFF(0), 64);
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.free_size == 256 + 900);
+        BOOST_CHECK(stats.free_count == 2);
+
+        db_file_put_space(db_file, OFF(256), 100);
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.free_size == 1256);
+        BOOST_CHECK(stats.free_count == 1);
+
+        BOOST_CHECK(db_file_get_space_below(db_file, 512, OFF(1256)) ==
+                    OFF(0));
+        BOOST_CHECK(db_file_get_space_below(db_file, 900, OFF(1256)) == 0);
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_seg_allocator_churn_test)
+{
+        struct s_db_file_stats stats;
+        uint64_t offsets[4096];
+        uint64_t end = 0;
+        uint64_t used = 0;
+        int i = 0;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_allocator(db_file,
+                                            DB_FILE_ALLOCATOR_SEG) == 0);
+        db_file_set_lazy(db_file, 1);
+
+        /* Enough lacunes to grow boundary tag hashes */
+        for (i = 0; i < 4096; i++)
+                offsets[i] = db_file_get_space(db_file, 32 + i % 64);
+        for (i = 0; i < 4096; i += 2)
+                db_file_put_space(db_file, offsets[i], 32 + i % 64);
+
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.free_count == 2048);
+        end = stats.size;
+
+        /* Freed space is reused before the file grows */
+        for (i = 0; i < 4096; i += 2) {
+                offsets[i] = db_file_get_space(db_file, 32 + i % 64);
+                BOOST_CHECK(offsets[i] < end);
+        }
+
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.size == end);
+        BOOST_CHECK(stats.free_count == 0);
+
+        for (i = 0; i < 4096; i++) {
+                if (i % 3 == 0)
+                        continue;
+                db_file_put_space(db_file, offsets[i], 32 + i % 64);
+        }
+        for (i = 0; i < 4096; i += 3)
+                used += 32 + i % 64;
+
+        db_file_get_stats(db_file, &stats);
+        BOOST_CHECK(stats.size - stats.free_size == OFF(used));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_seg_load_test)
+{
+        int count = 0;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(192));
+        write_record(db_file, OFF(0), 64, 64);
+        write_record(db_file, OFF(64), 64, 64);
+        write_record(db_file, OFF(128), 64, 64);
+        write_record(db_file, OFF(192), 64, 64);
+
+        db_file_put_space(db_file, OFF(64), 64);
+        db_file_put_space(db_file, OFF(128), 64);
+        db_file_release(db_file);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_allocator(db_file,
+                                            DB_FILE_ALLOCATOR_SEG) == 0);
+
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 2);
+
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(256));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_load_test)
+{
+        int count = 0;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        write_record(db_file, OFF(0), 64, 64);
+        write_record(db_file, OFF(64), 64, 64);
+        write_record(db_file, OFF(128), 64, 64);
+
+        db_file_put_space(db_file, OFF(64), 64);
+        db_file_release(db_file);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 2);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(192));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_load_torn_tail_test)
+{
+        int count = 0;
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        write_record(db_file, OFF(0), 64, 64);
+        write_record(db_file, OFF(64), 64, 1024);
+        db_file_release(db_file);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 1);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_write_vec_test)
+{
+        int count = 0;
+        uint8_t payload[56];
+        uint64_t len = htobe64(64);
+        struct iovec iov[2];
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_get_space(db_file, 128) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        write_record(db_file, OFF(0), 128, 128);
+        write_record(db_file, OFF(128), 64, 64);
+        db_file_put_space(db_file, OFF(0), 128);
+
+        /* Rest of the lacune header goes with the record */
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+
+        memset(payload, 0xBB, sizeof(payload));
+        iov[0].iov_base = &len;
+        iov[0].iov_len  = sizeof(len);
+        iov[1].iov_base = payload;
+        iov[1].iov_len  = sizeof(payload);
+        BOOST_CHECK(db_file_write_vec(db_file, OFF(0), iov, 2) == 64);
+
+        db_file_release(db_file);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 2);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(192));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_v1_rewrite_test)
+{
+        int count = 0;
+        int fd = -1;
+        uint8_t buf[3 * 32];
+        uint32_t len = 0;
+        void *db_file = NULL;
+
+        /* Version 1: record, lacune, record */
+        memset(buf, 0xAA, sizeof(buf));
+        len = htonl(32);
+        memcpy(&buf[0], &len, sizeof(len));
+        memcpy(&buf[64], &len, sizeof(len));
+        len = htonl(32 | 0x10000000);
+        memcpy(&buf[32], &len, sizeof(len));
+
+        fd = open(DB_FILE_NAME, O_RDWR | O_CREAT, 0640);
+        BOOST_REQUIRE(fd != -1);
+        BOOST_REQUIRE(write(fd, buf, sizeof(buf)) == (int)sizeof(buf));
+        close(fd);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_CHECK(db_file_get_version(db_file) == 1);
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 2);
+
+        BOOST_REQUIRE(db_file_rewrite_begin(db_file) == 0);
+        BOOST_CHECK(db_file_get_version(db_file) == DB_FILE_VERSION);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        write_record(db_file, OFF(0), 64, 64);
+        BOOST_REQUIRE(db_file_rewrite_end(db_file) == 0);
+        db_file_release(db_file);
+
+        count = 0;
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_CHECK(db_file_get_version(db_file) == DB_FILE_VERSION);
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 1);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_mmap_test)
+{
+        int count = 0;
+        uint8_t rbuf[64];
+        uint8_t wbuf[64];
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_backend(db_file,
+                                          DB_FILE_BACKEND_MMAP, 4096) == 0);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        write_record(db_file, OFF(0), 64, 64);
+        write_record(db_file, OFF(64), 64, 64);
+        write_record(db_file, OFF(128), 64, 64);
+
+        /* File grows by chunks */
+        BOOST_CHECK(file_size(DB_FILE_NAME) == 4096);
+
+        memset(wbuf, 0xAA, sizeof(wbuf));
+        BOOST_CHECK(db_file_read_data(db_file, OFF(64) + 8, rbuf, 56) == 56);
+        BOOST_CHECK(memcmp(rbuf, wbuf, 56) == 0);
+
+        db_file_put_space(db_file, OFF(64), 64);
+        BOOST_CHECK(db_file_sync(db_file) == 0);
+        db_file_release(db_file);
+
+        /* File is cut to the data size */
+        BOOST_CHECK(file_size(DB_FILE_NAME) == OFF(192));
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 2);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_mmap_crash_test)
+{
+        int count = 0;
+        int status = 0;
+        pid_t pid = 0;
+        void *db_file = NULL;
+
+        /* Child dies without release, the file keeps the chunk size */
+        pid = fork();
+        BOOST_REQUIRE(pid >= 0);
+        if (pid == 0) {
+                db_file = db_file_init(DB_FILE_NAME);
+                if (db_file == NULL ||
+                                db_file_set_backend(db_file,
+                                        DB_FILE_BACKEND_MMAP, 4096) != 0)
+                        _exit(1);
+
+                db_file_get_space(db_file, 64);
+                db_file_get_space(db_file, 64);
+                write_record(db_file, OFF(0), 64, 64);
+                write_record(db_file, OFF(64), 64, 64);
+
+                /* Stale record after the end must not be loaded */
+                db_file_put_space(db_file, OFF(64), 64);
+                _exit(0);
+        }
+
+        BOOST_REQUIRE(waitpid(pid, &status, 0) == pid);
+        BOOST_REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        BOOST_CHECK(file_size(DB_FILE_NAME) == 4096);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 1);
+        BOOST_CHECK(file_size(DB_FILE_NAME) == OFF(64));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_uring_test)
+{
+        int count = 0;
+        uint8_t rbuf[56];
+        uint8_t wbuf[56];
+        void *db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_REQUIRE(db_file_set_backend(db_file,
+                                          DB_FILE_BACKEND_URING, 0) == 0);
+
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(0));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(128));
+        write_record(db_file, OFF(0), 64, 64);
+        write_record(db_file, OFF(64), 64, 64);
+        write_record(db_file, OFF(128), 64, 64);
+        BOOST_CHECK(db_file_get_write_seq(db_file) == 3);
+
+        /* Read waits for queued writes */
+        memset(wbuf, 0xAA, sizeof(wbuf));
+        BOOST_CHECK(db_file_read_data(db_file, OFF(128) + 8, rbuf, 56) == 56);
+        BOOST_CHECK(memcmp(rbuf, wbuf, 56) == 0);
+
+        /* Lacune header and truncate go by the same queue */
+        db_file_put_space(db_file, OFF(64), 64);
+        db_file_put_space(db_file, OFF(128), 64);
+        BOOST_CHECK(db_file_wait_writes(db_file,
+                                        db_file_get_write_seq(db_file)) == 0);
+        BOOST_CHECK(file_size(DB_FILE_NAME) == OFF(64));
+        db_file_release(db_file);
+
+        db_file = db_file_init(DB_FILE_NAME);
+        BOOST_REQUIRE(db_file != NULL);
+        BOOST_CHECK(db_file_load(db_file, count_records, &count) == 0);
+        BOOST_CHECK(count == 1);
+        BOOST_CHECK(db_file_get_space(db_file, 64) == OFF(64));
+
+        db_file_release(db_file);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_backend_bench_test)
+{
+        write_bench("pwrite", DB_FILE_BACKEND_PWRITE);
+        write_bench("mmap", DB_FILE_BACKEND_MMAP);
+        write_bench("uring", DB_FILE_BACKEND_URING);
+}
+
+BOOST_AUTO_TEST_CASE(db_file_allocator_bench_test)
+{
+        allocator_bench("avl", DB_FILE_ALLOCATOR_AVL);
+        allocator_bench("seg", DB_FILE_ALLOCATOR_SEG);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
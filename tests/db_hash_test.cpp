@@ -0,0 +1,408 @@
+#define BOOST_TEST_MODULE db_hash_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "db_hash.h"
+#include "avl.h"
+
+#define DB_HASH_BENCH_LOOKUPS 1000000
+
+struct test_item {
+        uint8_t data[16];
+        int size;
+        uint64_t hash;
+};
+
+static uint64_t item_hash(const void *item)
+{
+        return ((const struct test_item *)item)->hash;
+}
+
+static int item_equal(const void *item, const void *key)
+{
+        const struct test_item *item1 = (const struct test_item *)item;
+        const struct test_item *item2 = (const struct test_item *)key;
+
+        return item1->hash == item2->hash && item1->size == item2->size &&
+               memcmp(item1->data, item2->data, item1->size) == 0;
+}
+
+/* The same order as the node table */
+static int item_compare(const void *a, const void *b, void *param)
+{
+        const struct test_item *item1 = (const struct test_item *)a;
+        const struct test_item *item2 = (const struct test_item *)b;
+        (void)param;
+
+        if (item1->size < item2->size) return -1;
+        if (item1->size > item2->size) return  1;
+
+        return memcmp(item1->data, item2->data, item1->size);
+}
+
+/* Key carries the pointer to find in its data */
+static int item_same(const void *item, const void *key)
+{
+        const struct test_item *item2 = (const struct test_item *)key;
+        const void *ptr = NULL;
+
+        memcpy(&ptr, item2->data, sizeof(ptr));
+        return item == ptr;
+}
+
+static void make_item(struct test_item *item, int num)
+{
+        memset(item, 0, sizeof(*item));
+        item->size = sprintf((char *)item->data, "key:%d", num) + 1;
+        item->hash = db_hash_bytes(item->data, item->size);
+}
+
+BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+
+BOOST_AUTO_TEST_CASE(db_hash_insert_find_test)
+{
+        static struct test_item items[1000];
+        struct test_item key;
+        int i = 0;
+        void *hash = db_hash_create(item_hash, item_equal);
+        BOOST_REQUIRE(hash != NULL);
+
+        /* Index grows from one group */
+        for (i = 0; i < 1000; i++) {
+                make_item(&items[i], i);
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+        BOOST_CHECK(db_hash_count(hash) == 1000);
+
+        for (i = 0; i < 1000; i++) {
+                make_item(&key, i);
+                BOOST_CHECK(db_hash_find(hash, &key) == &items[i]);
+        }
+
+        make_item(&key, 1000);
+        BOOST_CHECK(db_hash_find(hash, &key) == NULL);
+
+        for (i = 0; i < 1000; i += 2)
+                BOOST_CHECK(db_hash_delete(hash, &items[i]) == 0);
+        BOOST_CHECK(db_hash_delete(hash, &items[0]) == -1);
+        BOOST_CHECK(db_hash_count(hash) == 500);
+
+        for (i = 0; i < 1000; i++) {
+                make_item(&key, i);
+                BOOST_CHECK((db_hash_find(hash, &key) == NULL) == (i % 2 == 0));
+        }
+
+        db_hash_destroy(hash);
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_collision_test)
+{
+        static struct test_item items[100];
+        struct test_item key;
+        int i = 0;
+        int round = 0;
+        void *hash = db_hash_create(item_hash, item_equal);
+        BOOST_REQUIRE(hash != NULL);
+
+        /* The same hash, items are found by the equality */
+        for (i = 0; i < 100; i++) {
+                make_item(&items[i], i);
+                items[i].hash = 42;
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+
+        for (i = 0; i < 100; i++) {
+                make_item(&key, i);
+                key.hash = 42;
+                BOOST_CHECK(db_hash_find(hash, &key) == &items[i]);
+        }
+
+        /* Deleted slots are reused, the index does not grow without end */
+        for (round = 0; round < 100; round++) {
+                for (i = 0; i < 100; i++)
+                        BOOST_REQUIRE(db_hash_delete(hash, &items[i]) == 0);
+                for (i = 0; i < 100; i++)
+                        BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+
+        BOOST_CHECK(db_hash_count(hash) == 100);
+        for (i = 0; i < 100; i++) {
+                make_item(&key, i);
+                key.hash = 42;
+                BOOST_CHECK(db_hash_find(hash, &key) == &items[i]);
+        }
+
+        db_hash_destroy(hash);
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_find_by_test)
+{
+        static struct test_item items[10];
+        struct test_item key;
+        const void *ptr = NULL;
+        int i = 0;
+        void *hash = db_hash_create(item_hash, item_equal);
+        BOOST_REQUIRE(hash != NULL);
+
+        /* Equal items of the same hash differ by pointer only */
+        for (i = 0; i < 10; i++) {
+                make_item(&items[i], 0);
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+
+        for (i = 0; i < 10; i++) {
+                make_item(&key, 0);
+                ptr = &items[i];
+                memcpy(key.data, &ptr, sizeof(ptr));
+                BOOST_CHECK(db_hash_find_by(hash, &key, item_same) ==
+                            &items[i]);
+        }
+
+        BOOST_REQUIRE(db_hash_delete(hash, &items[3]) == 0);
+        ptr = &items[3];
+        memcpy(key.data, &ptr, sizeof(ptr));
+        BOOST_CHECK(db_hash_find_by(hash, &key, item_same) == NULL);
+
+        db_hash_destroy(hash);
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_reserve_test)
+{
+        static struct test_item items[5000];
+        struct test_item key;
+        int i = 0;
+        void *hash = db_hash_create(item_hash, item_equal);
+        BOOST_REQUIRE(hash != NULL);
+
+        for (i = 0; i < 10; i++) {
+                make_item(&items[i], i);
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+
+        /* Items are moved to the new slots */
+        BOOST_CHECK(db_hash_reserve(hash, 5000) == 0);
+        for (i = 10; i < 5000; i++) {
+                make_item(&items[i], i);
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+
+        for (i = 0; i < 5000; i++) {
+                make_item(&key, i);
+                BOOST_CHECK(db_hash_find(hash, &key) == &items[i]);
+        }
+
+        db_hash_destroy(hash);
+}
+
+static void retire_slots(void *arg, void *ptr)
+{
+        void **retired = (void **)arg;
+        int i = 0;
+
+        while (retired[i] != NULL)
+                i++;
+        retired[i] = ptr;
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_retire_test)
+{
+        static struct test_item items[1000];
+        void *retired[32];
+        struct test_item key;
+        int i = 0;
+        void *hash = db_hash_create(item_hash, item_equal);
+        BOOST_REQUIRE(hash != NULL);
+
+        /* Replaced slot arrays are given to the owner */
+        memset(retired, 0, sizeof(retired));
+        db_hash_set_retire(hash, retire_slots, retired);
+        for (i = 0; i < 1000; i++) {
+                make_item(&items[i], i);
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+        BOOST_CHECK(retired[0] != NULL);
+
+        for (i = 0; i < 1000; i++) {
+                make_item(&key, i);
+                BOOST_CHECK(db_hash_find(hash, &key) == &items[i]);
+        }
+
+        for (i = 0; retired[i] != NULL; i++)
+                free(retired[i]);
+        db_hash_destroy(hash);
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_error_test)
+{
+        struct test_item item;
+
+        BOOST_CHECK(db_hash_create(NULL, item_equal) == NULL);
+        BOOST_CHECK(errno == EINVAL);
+        BOOST_CHECK(db_hash_insert(NULL, &item) == -1);
+        BOOST_CHECK(db_hash_find(NULL, &item) == NULL);
+        BOOST_CHECK(db_hash_delete(NULL, &item) == -1);
+        BOOST_CHECK(db_hash_count(NULL) == 0);
+
+        /* Hash depends on each byte and on the size */
+        BOOST_CHECK(db_hash_bytes((const uint8_t *)"key:1", 5) !=
+                    db_hash_bytes((const uint8_t *)"key:2", 5));
+        BOOST_CHECK(db_hash_bytes((const uint8_t *)"key:1\0", 6) !=
+                    db_hash_bytes((const uint8_t *)"key:1", 5));
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_jump_test)
+{
+        uint32_t counts[9];
+        uint32_t b4 = 0;
+        uint32_t b5 = 0;
+        uint64_t fp[2];
+        char key[32];
+        int moved = 0;
+        int i = 0;
+
+        BOOST_CHECK(db_hash_jump(12345, 0) == 0);
+        BOOST_CHECK(db_hash_jump(12345, 1) == 0);
+
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < 90000; i++) {
+                int size = sprintf(key, "user:%d:v", i) + 1;
+
+                db_fp_bytes((uint8_t *)key, size, fp);
+                counts[db_hash_jump(fp[1], 9)]++;
+
+                /* Added bucket takes keys only from others */
+                b4 = db_hash_jump(fp[1], 4);
+                b5 = db_hash_jump(fp[1], 5);
+                BOOST_REQUIRE(b4 < 4 && b5 < 5);
+                if (b4 != b5) {
+                        BOOST_CHECK(b5 == 4);
+                        moved++;
+                }
+        }
+
+        /* About 1/5 of keys move, buckets get about 1/9 of keys each */
+        BOOST_CHECK(moved > 17000 && moved < 19000);
+        for (i = 0; i < 9; i++)
+                BOOST_CHECK(counts[i] > 9500 && counts[i] < 10500);
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_fp_test)
+{
+        static uint8_t data[1000];
+        struct s_db_fp fp;
+        uint64_t h[2];
+        uint32_t i = 0;
+        uint32_t part = 0;
+        uint32_t size = 0;
+
+        for (i = 0; i < sizeof(data); i++)
+                data[i] = (uint8_t)(i * 7 + 3);
+
+        /* The same fingerprint for any split of data */
+        for (size = 0; size < 100; size++) {
+                db_fp_bytes(data, size, h);
+
+                for (part = 1; part <= 17; part++) {
+                        db_fp_init(&fp);
+                        for (i = 0; i < size; i += part)
+                                db_fp_update(&fp, &data[i], (size - i < part) ?
+                                                            size - i : part);
+                        db_fp_final(&fp);
+
+                        BOOST_CHECK(fp.ready);
+                        BOOST_CHECK(fp.h[0] == h[0] && fp.h[1] == h[1]);
+                }
+        }
+
+        /* Fingerprint depends on each byte and on the size */
+        db_fp_bytes(data, sizeof(data), h);
+        for (i = 0; i < sizeof(data); i += 97) {
+                uint64_t h2[2];
+
+                data[i] ^= 1;
+                db_fp_bytes(data, sizeof(data), h2);
+                data[i] ^= 1;
+                BOOST_CHECK(h2[0] != h[0] && h2[1] != h[1]);
+        }
+
+        db_fp_bytes(data, sizeof(data) - 1, h);
+        {
+                uint64_t h2[2];
+                db_fp_bytes(data, sizeof(data), h2);
+                BOOST_CHECK(h2[0] != h[0] && h2[1] != h[1]);
+        }
+}
+
+/**
+ * @brief Look up keys in random order, by the tree and by the index.
+ */
+static void lookup_bench(int count)
+{
+        struct timespec start, end;
+        struct test_item *items = NULL;
+        struct test_item *keys = NULL;
+        struct avl_table *table = NULL;
+        void *hash = NULL;
+        double avl_ns = 0;
+        double hash_ns = 0;
+        int found = 0;
+        int i = 0;
+
+        items = (struct test_item *)malloc(count * sizeof(*items));
+        keys = (struct test_item *)malloc(DB_HASH_BENCH_LOOKUPS * sizeof(*keys));
+        table = avl_create(item_compare, NULL, NULL);
+        hash = db_hash_create(item_hash, item_equal);
+        BOOST_REQUIRE(items != NULL && keys != NULL);
+        BOOST_REQUIRE(table != NULL && hash != NULL);
+
+        for (i = 0; i < count; i++) {
+                make_item(&items[i], i);
+                BOOST_REQUIRE(avl_probe(table, &items[i]) != NULL);
+                BOOST_REQUIRE(db_hash_insert(hash, &items[i]) == 0);
+        }
+
+        for (i = 0; i < DB_HASH_BENCH_LOOKUPS; i++)
+                make_item(&keys[i], (int)(((uint64_t)i * 2654435761U) % count));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_HASH_BENCH_LOOKUPS; i++)
+                found += (avl_find(table, &keys[i]) != NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        avl_ns  = (end.tv_sec - start.tv_sec) * 1e9;
+        avl_ns += end.tv_nsec - start.tv_nsec;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_HASH_BENCH_LOOKUPS; i++)
+                found += (db_hash_find(hash, &keys[i]) != NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        hash_ns  = (end.tv_sec - start.tv_sec) * 1e9;
+        hash_ns += end.tv_nsec - start.tv_nsec;
+
+        BOOST_CHECK(found == 2 * DB_HASH_BENCH_LOOKUPS);
+        BOOST_TEST_MESSAGE("Lookup of " << count << " keys: AVL "
+                           << avl_ns / DB_HASH_BENCH_LOOKUPS << " ns, hash "
+                           << hash_ns / DB_HASH_BENCH_LOOKUPS << " ns");
+
+        db_hash_destroy(hash);
+        avl_destroy(table, NULL);
+        free(keys);
+        free(items);
+}
+
+BOOST_AUTO_TEST_CASE(db_hash_bench_test)
+{
+        lookup_bench(1000000);
+        lookup_bench(10000000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
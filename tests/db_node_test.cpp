@@ -10,12 +10,172 @@
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <malloc.h>
 
 #include "db_node.h"
+#include "db_file.h"
+#include "db_blob.h"
+#include "db_hash.h"
+#include "db_epoch.h"
 
 #define DB_NODE_NAME "db_test_file.txt"
+#define DB_NODE_SNAP_NAME "db_test_file.txt.snap"
+#define DB_NODE_BLOB_NAME "db_test_node_blob"
 
-BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+struct db_node_fixture {
+        db_node_fixture()  { remove_files(); }
+        ~db_node_fixture() { remove_files(); }
+
+        static void remove_files()
+        {
+                unlink(DB_NODE_NAME);
+                unlink(DB_NODE_SNAP_NAME);
+                unlink(DB_NODE_BLOB_NAME ".1");
+                unlink(DB_NODE_BLOB_NAME ".2");
+                unlink(DB_NODE_BLOB_NAME ".3");
+        }
+};
+
+struct load_ref {
+        struct s_db_item *item;
+        uint32_t node_id;
+        uint64_t offset;
+};
+
+static int save_ref(void *arg, struct s_db_item *item,
+                    uint32_t ref_node_id, uint64_t ref_offset)
+{
+        struct load_ref *ref = (struct load_ref *)arg;
+
+        ref->item = item;
+        ref->node_id = ref_node_id;
+        ref->offset = ref_offset;
+        return 0;
+}
+
+static uint64_t snap_index(void *arg, struct s_db_item *item, uint64_t index)
+{
+        (void)arg;
+        (void)item;
+        return 1000 + index;
+}
+
+static int check_snap_ref(void *arg, struct s_db_item *item,
+                          uint32_t ref_node_id, uint64_t ref)
+{
+        int *count = (int *)arg;
+
+        (void)item;
+        if (ref_node_id != 0 || ref != 1000 + (uint64_t)*count)
+                return -1;
+
+        (*count)++;
+        return 0;
+}
+
+static int count_dup(void *arg, struct s_db_item *item, uint64_t offset)
+{
+        (void)item;
+        (void)offset;
+        (*(int *)arg)++;
+        return 0;
+}
+
+/**
+ * @brief Put items of given size, the first byte is the item number.
+ */
+static void put_items(void *node, int first, int count, int size)
+{
+        struct s_db_item *db_item = NULL;
+        uint8_t *buf = NULL;
+        int i = 0;
+
+        for (i = first; i < first + count; i++) {
+                buf = (uint8_t *)malloc(size);
+                memset(buf, 0x5A, size);
+                buf[0] = i;
+                db_item = db_node_put_item(node, buf, size);
+                BOOST_REQUIRE(db_item != NULL);
+                db_node_save(node, db_item);
+        }
+}
+
+static struct s_db_item *find_item(void *node, int num, int size)
+{
+        uint8_t buf[size];
+
+        memset(buf, 0x5A, size);
+        buf[0] = num;
+        return db_node_get_item(node, buf, size);
+}
+
+struct stripe_arg {
+        void *node;
+        uint64_t fp[2];
+        int done;
+};
+
+static void *stripe_thread(void *ptr)
+{
+        struct stripe_arg *arg = (struct stripe_arg *)ptr;
+
+        db_node_wrlock_fp(arg->node, arg->fp);
+        __atomic_store_n(&arg->done, 1, __ATOMIC_RELEASE);
+        db_node_unlock_fp(arg->node, arg->fp);
+
+        return NULL;
+}
+
+static int wait_done(struct stripe_arg *arg, int ms)
+{
+        while (!__atomic_load_n(&arg->done, __ATOMIC_ACQUIRE) && ms-- > 0)
+                usleep(1000);
+
+        return __atomic_load_n(&arg->done, __ATOMIC_ACQUIRE);
+}
+
+struct writer_arg {
+        void *node;
+        int id;
+        int count;
+        int failed;
+};
+
+/**
+ * @brief Put items of the writer, each under the lock of its stripe.
+ */
+static void *writer_thread(void *ptr)
+{
+        struct writer_arg *arg = (struct writer_arg *)ptr;
+        struct s_db_item *item = NULL;
+        uint8_t *buf = NULL;
+        uint64_t fp[2];
+        int i = 0;
+
+        for (i = 0; i < arg->count; i++) {
+                buf = (uint8_t *)malloc(2 * sizeof(int));
+                memcpy(buf, &arg->id, sizeof(int));
+                memcpy(&buf[sizeof(int)], &i, sizeof(int));
+                db_fp_bytes(buf, 2 * sizeof(int), fp);
+
+                db_node_wrlock_fp(arg->node, fp);
+                item = db_node_put_item_fp(arg->node, buf,
+                                           2 * sizeof(int), fp);
+                if (item != NULL)
+                        db_node_save(arg->node, item);
+                else
+                        arg->failed++;
+                db_node_unlock_fp(arg->node, fp);
+        }
+
+        return NULL;
+}
+
+BOOST_FIXTURE_TEST_SUITE(BOOST_TEST_MODULE, db_node_fixture)
 
 BOOST_AUTO_TEST_CASE(db_node_init_test)
 {
@@ -41,7 +201,7 @@ BOOST_AUTO_TEST_CASE(db_node_release_test)
         db_node_release(node);
 
         file = fopen(DB_NODE_NAME, "r");
-        BOOST_CHECK(file == NULL);
+        BOOST_CHECK(file != NULL);
         if (file != NULL)
                 fclose(file);
 }
@@ -61,9 +221,8 @@ BOOST_AUTO_TEST_CASE(db_node_put_item_test)
         BOOST_CHECK(db_item->ref_counter == 0);
         BOOST_CHECK(db_item->f_offset == 0);
         BOOST_CHECK(db_item->f_size == 0);
-        BOOST_CHECK(db_item->ref_item == NULL);
-        BOOST_CHECK(db_item->list_item.next == NULL);
-        BOOST_CHECK(db_item->list_item.prev == NULL);
+        BOOST_CHECK(db_item->ref == 0);
+        BOOST_CHECK(db_item->pos == 0);
 
         db_node_release(node);
 }
@@ -102,15 +261,17 @@ BOOST_AUTO_TEST_CASE(db_node_get_item_test)
         strncpy((char *)buf, "magic value", size);
         strncpy((char *)gbuf, (char *)buf, size);
 
-        db_item = db_node_put_item(node, buf, strlen((char *)buf));
+        /* Small data is copied into the item, buf is freed */
+        db_item = db_node_put_item(node, buf, strlen((char *)gbuf));
         BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(db_item->flags & DB_ITEM_EMBED);
 
-        strncpy((char *)gbuf, (char *)buf, size);
-        db_item = db_node_get_item(node, gbuf, strlen((char *)buf));
-        BOOST_CHECK(db_node_get_item(node, gbuf, strlen((char *)buf)) != NULL);
+        BOOST_CHECK(db_node_get_item(node, gbuf, strlen((char *)gbuf)) ==
+                    db_item);
 
         strncpy((char *)gbuf, "not exists value", size);
-        BOOST_CHECK(db_node_get_item(node, gbuf, strlen((char *)buf)) == NULL);
+        BOOST_CHECK(db_node_get_item(node, gbuf, strlen("magic value")) ==
+                    NULL);
 
         db_node_release(node);
 }
@@ -128,7 +289,10 @@ BOOST_AUTO_TEST_CASE(db_node_iterator_test)
         db_item = db_node_put_item(node, buf, size);
         BOOST_REQUIRE(db_item != NULL);
 
-        void *it = db_node_get_iterator(node);
+        struct s_db_node_iterator iter;
+        struct s_db_node_iterator iter2;
+        void *it = db_node_get_iterator(node, &iter);
+        void *it2 = NULL;
         struct s_db_item *next = NULL;
         BOOST_CHECK(it != NULL);
         BOOST_CHECK(db_node_iterator_has_next(it) != 0);
@@ -136,13 +300,190 @@ BOOST_AUTO_TEST_CASE(db_node_iterator_test)
         BOOST_CHECK(next != NULL);
         BOOST_CHECK(next->data[0] = 0xAA);
 
+        /* Iterators of callers do not share the cursor */
+        put_items(node, 1, 2, 16);
+        it = db_node_get_iterator(node, &iter);
+        it2 = db_node_get_iterator(node, &iter2);
+        BOOST_CHECK(db_node_get_next(node, it) == db_item);
+        BOOST_CHECK(db_node_get_next(node, it) != db_item);
+        BOOST_CHECK(db_node_get_next(node, it2) == db_item);
+        BOOST_CHECK(db_node_get_next(node, it) != NULL);
+        BOOST_CHECK(db_node_iterator_has_next(it) == 0);
+        BOOST_CHECK(db_node_iterator_has_next(it2) != 0);
+        BOOST_CHECK(db_node_get_iterator(node, NULL) == NULL);
+
         BOOST_CHECK(db_node_remove_item(node, db_item) == 0);
-        it = db_node_get_iterator(node);
+        BOOST_CHECK(db_node_remove_item(node, find_item(node, 1, 16)) == 0);
+        BOOST_CHECK(db_node_remove_item(node, find_item(node, 2, 16)) == 0);
+        it = db_node_get_iterator(node, &iter);
         BOOST_CHECK(db_node_iterator_has_next(it) == 0);
 
         db_node_release(node);
 }
 
+BOOST_AUTO_TEST_CASE(db_node_iterator_remove_test)
+{
+        struct s_db_node_iterator iter;
+        struct s_db_item *item = NULL;
+        int seen[10];
+        void *it = NULL;
+        int i = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        put_items(node, 0, 10, 16);
+
+        /* The last item takes the place of the removed one, it is not
+         * skipped by the iterator */
+        memset(seen, 0, sizeof(seen));
+        it = db_node_get_iterator(node, &iter);
+        while (db_node_iterator_has_next(it)) {
+                item = db_node_get_next(node, it);
+                seen[item->data[0]]++;
+                if (item->data[0] % 2 == 0)
+                        BOOST_CHECK(db_node_remove_item(node, item) == 0);
+        }
+
+        for (i = 0; i < 10; i++) {
+                BOOST_CHECK(seen[i] == 1);
+                BOOST_CHECK((find_item(node, i, 16) != NULL) == (i % 2));
+        }
+
+        /* The removed last item is not replaced */
+        it = db_node_get_iterator(node, &iter);
+        for (i = 0; i < 5; i++)
+                item = db_node_get_next(node, it);
+        BOOST_CHECK(db_node_remove_item(node, item) == 0);
+        BOOST_CHECK(db_node_iterator_has_next(it) == 0);
+        BOOST_CHECK(db_node_get_next(node, it) == NULL);
+
+        db_node_release(node);
+}
+
+static struct s_db_item *put_str(void *node, const char *str)
+{
+        int size = strlen(str);
+        uint8_t *buf = (uint8_t *)malloc(size);
+
+        memcpy(buf, str, size);
+        return db_node_put_item(node, buf, size);
+}
+
+static int item_is(struct s_db_item *item, const char *str)
+{
+        return item != NULL && item->size == (int)strlen(str) &&
+               memcmp(item->data, str, item->size) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(db_node_order_test)
+{
+        const char *keys[] = {"b", "ab", "a", "abc", "ba", "c"};
+        const char *sorted[] = {"a", "ab", "abc", "b", "ba", "c"};
+        struct s_db_item *item = NULL;
+        void *node = db_node_init(DB_NODE_NAME);
+        int i = 0;
+        BOOST_REQUIRE(node != NULL);
+
+        BOOST_CHECK(db_node_set_order(node, 5) == -1);
+        BOOST_CHECK(errno == EINVAL);
+        BOOST_CHECK(db_node_set_order(node, DB_NODE_ORDER_LEX) == 0);
+
+        for (i = 0; i < 6; i++)
+                BOOST_REQUIRE(put_str(node, keys[i]) != NULL);
+
+        BOOST_CHECK(db_node_set_order(node, DB_NODE_ORDER_SIZE) == -1);
+        BOOST_CHECK(errno == EBUSY);
+
+        /* Byte order, the shorter key goes first */
+        item = db_node_seek(node, NULL, 0);
+        for (i = 0; i < 6; i++) {
+                BOOST_CHECK(item_is(item, sorted[i]));
+                item = db_node_get_successor(node, item);
+        }
+        BOOST_CHECK(item == NULL);
+
+        /* Seek stops at the first item not less than the data */
+        BOOST_CHECK(item_is(db_node_seek(node, (uint8_t *)"ab", 2), "ab"));
+        BOOST_CHECK(item_is(db_node_seek(node, (uint8_t *)"abb", 3), "abc"));
+        BOOST_CHECK(item_is(db_node_seek(node, (uint8_t *)"abd", 3), "b"));
+        BOOST_CHECK(item_is(db_node_seek(node, (uint8_t *)"", 0), "a"));
+        BOOST_CHECK(db_node_seek(node, (uint8_t *)"d", 1) == NULL);
+        BOOST_CHECK(item_is(db_node_get_item(node, (uint8_t *)"ba", 2), "ba"));
+
+        db_node_release(node);
+}
+
+static uint64_t *num_fp(int num, uint64_t fp[2])
+{
+        char buf[16];
+
+        sprintf(buf, "key:%d", num);
+        db_fp_bytes((uint8_t *)buf, strlen(buf), fp);
+        return fp;
+}
+
+BOOST_AUTO_TEST_CASE(db_node_bloom_test)
+{
+        const int count = 5000;
+        struct s_db_item *item = NULL;
+        void *node = db_node_init(DB_NODE_NAME);
+        uint64_t fp[2];
+        char buf[16];
+        int false_pos = 0;
+        int i = 0;
+        BOOST_REQUIRE(node != NULL);
+
+        /* No filter, any item may be there */
+        BOOST_CHECK(db_node_may_have(node, num_fp(0, fp)));
+        BOOST_CHECK(db_node_set_bloom(node, 16) == 0);
+        BOOST_CHECK(!db_node_may_have(node, num_fp(0, fp)));
+
+        /* Filter grows over the min count */
+        for (i = 0; i < count; i++) {
+                sprintf(buf, "key:%d", i);
+                item = put_str(node, buf);
+                BOOST_REQUIRE(item != NULL);
+                db_node_save(node, item);
+        }
+
+        BOOST_CHECK(db_node_set_bloom(node, 16) == -1);
+        BOOST_CHECK(errno == EBUSY);
+
+        for (i = 0; i < count; i++)
+                BOOST_CHECK(db_node_may_have(node, num_fp(i, fp)));
+
+        for (i = count; i < 10 * count; i++)
+                false_pos += db_node_may_have(node, num_fp(i, fp));
+        BOOST_CHECK(false_pos < 9 * count / 100);
+
+        /* Removed items leave the filter at the end of compaction */
+        for (i = 0; i < count; i += 2) {
+                sprintf(buf, "key:%d", i);
+                db_node_remove_item(node, db_node_get_item(node, (uint8_t *)buf,
+                                                           strlen(buf)));
+        }
+        db_node_compact_end(node);
+
+        false_pos = 0;
+        for (i = 0; i < count; i++) {
+                if (i % 2)
+                        BOOST_CHECK(db_node_may_have(node, num_fp(i, fp)));
+                else
+                        false_pos += db_node_may_have(node, num_fp(i, fp));
+        }
+        BOOST_CHECK(false_pos < count / 2 / 100);
+        db_node_release(node);
+
+        /* Loaded items are in the filter */
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_set_bloom(node, 16) == 0);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+        for (i = 1; i < count; i += 2)
+                BOOST_CHECK(db_node_may_have(node, num_fp(i, fp)));
+        db_node_release(node);
+}
+
 BOOST_AUTO_TEST_CASE(db_node_save_test)
 {
         int fd = -1;
@@ -159,12 +500,13 @@ BOOST_AUTO_TEST_CASE(db_node_save_test)
         db_item = db_node_put_item(node, buf, size);
         BOOST_REQUIRE(db_item != NULL);
 
-        db_node_save(node, db_item, 0);
+        db_node_save(node, db_item);
 
         fd = open(DB_NODE_NAME, O_RDONLY);
         BOOST_REQUIRE(fd != -1);
 
-        BOOST_CHECK(pread(fd, rbuf, size, sizeof(db_item->f_size)) == size);
+        BOOST_CHECK(pread(fd, rbuf, size,
+                          DB_FILE_DATA_OFFSET + sizeof(uint64_t)) == size);
         BOOST_CHECK(memcmp(db_item->data, rbuf, size) == 0);
 
         if (fd != -1)
@@ -173,4 +515,1128 @@ BOOST_AUTO_TEST_CASE(db_node_save_test)
         db_node_release(node);
 }
 
+BOOST_AUTO_TEST_CASE(db_node_load_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        struct s_db_item *db_item = NULL;
+        const int size = 64;
+        uint8_t *buf1 = (uint8_t *)malloc(size);
+        uint8_t *buf2 = (uint8_t *)malloc(size);
+        uint8_t gbuf[size];
+        BOOST_REQUIRE(node != NULL);
+
+        memset(buf1, 0x11, size);
+        memset(buf2, 0x22, size);
+        memset(gbuf, 0x22, size);
+
+        db_item = db_node_put_item(node, buf1, size);
+        BOOST_REQUIRE(db_item != NULL);
+        db_node_save(node, db_item);
+
+        db_item = db_node_put_item(node, buf2, size);
+        BOOST_REQUIRE(db_item != NULL);
+        db_node_save(node, db_item);
+        BOOST_CHECK(db_item->f_offset != 0);
+
+        BOOST_CHECK(db_node_remove_item(node, db_node_get_item(node, buf1, size)) == 0);
+        db_node_release(node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+
+        db_item = db_node_get_item(node, gbuf, size);
+        BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(db_item->f_offset ==
+                    DB_FILE_DATA_OFFSET + sizeof(uint64_t) + size);
+        BOOST_CHECK(db_item->f_size == sizeof(uint64_t) + size);
+
+        memset(gbuf, 0x11, size);
+        BOOST_CHECK(db_node_get_item(node, gbuf, size) == NULL);
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_load_ref_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        void *val_node = db_node_init(DB_NODE_SNAP_NAME);
+        void *ref_nodes[4] = {NULL, NULL, NULL, val_node};
+        struct s_db_item *db_item = NULL;
+        struct s_db_item *val_item = NULL;
+        struct load_ref ref;
+        const int size = 16;
+        uint8_t *buf = (uint8_t *)malloc(size);
+        BOOST_REQUIRE(node != NULL && val_node != NULL);
+
+        memset(buf, 0x33, size);
+        memset(&ref, 0, sizeof(ref));
+        db_node_set_ref_nodes(node, ref_nodes);
+        val_item = db_node_put_item(val_node, (uint8_t *)malloc(size), size);
+        BOOST_REQUIRE(val_item != NULL);
+        val_item->f_offset = 0x123456789ULL;
+
+        /* Reference is resolved by the node id and the handle */
+        db_item = db_node_put_item(node, buf, size);
+        BOOST_REQUIRE(db_item != NULL);
+        db_node_set_ref(db_item, 3, val_item);
+        BOOST_CHECK(db_item->ref != 0);
+        BOOST_CHECK(db_node_item_of(val_node, db_item->ref) == val_item);
+        db_node_save(node, db_item);
+        db_node_release(node);
+        db_node_release(val_node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, save_ref, NULL, &ref) == 0);
+
+        BOOST_REQUIRE(ref.item != NULL);
+        BOOST_CHECK(ref.item->size == size);
+        BOOST_CHECK(ref.item->ref == 0);
+        BOOST_CHECK(ref.node_id == 3);
+        BOOST_CHECK(ref.offset == 0x123456789ULL);
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_snapshot_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        struct s_db_item *db_item = NULL;
+        uint64_t lacune = 0;
+        const int size = 32;
+        int count = 0;
+        int i = 0;
+        BOOST_REQUIRE(node != NULL);
+
+        put_items(node, 0, 20, size);
+        lacune = find_item(node, 5, size)->f_offset;
+        for (i = 5; i < 10; i++)
+                BOOST_CHECK(db_node_remove_item(node, find_item(node, i, size)) == 0);
+
+        BOOST_CHECK(db_node_save_snapshot(node, DB_NODE_SNAP_NAME,
+                                          snap_index, NULL, NULL) == 0);
+        db_node_release(node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load_snapshot(node, DB_NODE_SNAP_NAME,
+                                          check_snap_ref, &count) == 0);
+        BOOST_CHECK(count == 15);
+
+        for (i = 0; i < 20; i++) {
+                db_item = find_item(node, i, size);
+                if (i >= 5 && i < 10) {
+                        BOOST_CHECK(db_item == NULL);
+                } else {
+                        BOOST_REQUIRE(db_item != NULL);
+                        BOOST_CHECK(db_item->f_offset == DB_FILE_DATA_OFFSET +
+                                    (uint64_t)i * (sizeof(uint64_t) + size));
+                }
+        }
+
+        /* Free space index is restored from the snapshot */
+        put_items(node, 100, 1, size);
+        BOOST_CHECK(find_item(node, 100, size)->f_offset == lacune);
+
+        /* Snapshot is loaded to the empty node only */
+        BOOST_CHECK(db_node_load_snapshot(node, DB_NODE_SNAP_NAME,
+                                          NULL, NULL) == -1);
+        db_node_release(node);
+}
+
+/**
+ * @brief Put key item with the inline value, value bytes are val.
+ */
+static struct s_db_item *put_inline(void *node, int num, int size,
+                                    uint32_t inline_size, uint8_t val)
+{
+        struct s_db_item *db_item = NULL;
+        uint8_t *buf = (uint8_t *)malloc(size + inline_size);
+        uint64_t fp[2];
+
+        memset(buf, 0x5A, size);
+        memset(&buf[size], val, inline_size);
+        buf[0] = num;
+        db_fp_bytes(buf, size, fp);
+        db_item = db_node_put_item_inline(node, buf, size, inline_size, fp);
+        BOOST_REQUIRE(db_item != NULL);
+        db_node_save(node, db_item);
+
+        return db_item;
+}
+
+BOOST_AUTO_TEST_CASE(db_node_inline_test)
+{
+        struct s_db_item *db_item = NULL;
+        struct s_db_item *val_item = NULL;
+        struct load_ref ref;
+        const int size = 16;
+        uint64_t offset = 0;
+        uint8_t *buf = NULL;
+        int i = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        void *val_node = db_node_init(DB_NODE_SNAP_NAME);
+        void *ref_nodes[4] = {NULL, NULL, NULL, val_node};
+        BOOST_REQUIRE(node != NULL && val_node != NULL);
+
+        memset(&ref, 0, sizeof(ref));
+        db_node_set_ref_nodes(node, ref_nodes);
+        val_item = db_node_put_item(val_node, (uint8_t *)malloc(size), size);
+        BOOST_REQUIRE(val_item != NULL);
+        val_item->f_offset = 0x1000;
+
+        for (i = 0; i < 4; i++)
+                put_inline(node, i, size, 8, 0x11);
+        db_item = find_item(node, 2, size);
+        db_item->inline_size = 4;
+        db_node_update(node, db_item);
+
+        /* Record of the same size is written in place */
+        db_item = find_item(node, 1, size);
+        offset = db_item->f_offset;
+        BOOST_CHECK(db_item->f_size == sizeof(uint64_t) +
+                    sizeof(uint32_t) + size + 8);
+        memset(&db_item->data[size], 0x22, 8);
+        db_node_update(node, db_item);
+        BOOST_CHECK(db_item->f_offset == offset);
+
+        /* Key refers to the value, its space is reused by the next key.
+         * Reference takes 4 bytes more, than the inline value */
+        db_item = find_item(node, 2, size);
+        offset = db_item->f_offset;
+        db_item->inline_size = 0;
+        db_node_set_ref(db_item, 3, val_item);
+        db_node_update(node, db_item);
+        BOOST_CHECK(db_item->f_offset != offset);
+        BOOST_CHECK(put_inline(node, 4, size, 4, 0x44)->f_offset == offset);
+
+        db_node_release(node);
+        db_node_release(val_node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, save_ref, NULL, &ref) == 0);
+
+        /* Only the key with reference is passed to the handler */
+        BOOST_CHECK(ref.item == find_item(node, 2, size));
+        BOOST_CHECK(ref.node_id == 3);
+        BOOST_CHECK(ref.offset == 0x1000);
+
+        db_item = find_item(node, 1, size);
+        BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(db_item->inline_size == 8);
+        BOOST_CHECK(db_item->data[size] == 0x22);
+        BOOST_CHECK(find_item(node, 4, size)->data[size + 3] == 0x44);
+        BOOST_CHECK(find_item(node, 2, size)->inline_size == 0);
+
+        /* Buffer of the caller, as in the snapshot child */
+        buf = (uint8_t *)malloc(DB_NODE_SNAP_BUF_SIZE);
+        BOOST_REQUIRE(buf != NULL);
+        BOOST_CHECK(db_node_save_snapshot(node, DB_NODE_SNAP_NAME,
+                                          NULL, NULL, buf) == 0);
+        free(buf);
+        ref.item = NULL;
+        db_node_release(node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load_snapshot(node, DB_NODE_SNAP_NAME,
+                                          save_ref, &ref) == 0);
+        BOOST_CHECK(ref.item == find_item(node, 2, size));
+
+        for (i = 0; i < 5; i++) {
+                db_item = find_item(node, i, size);
+                BOOST_REQUIRE(db_item != NULL);
+                BOOST_CHECK(db_item->inline_size ==
+                            ((i == 2) ? 0U : (i == 4) ? 4U : 8U));
+        }
+
+        buf = find_item(node, 0, size)->data;
+        BOOST_CHECK(buf[size] == 0x11 && buf[size + 7] == 0x11);
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_embed_test)
+{
+        struct s_db_node_iterator iter;
+        struct s_db_item *db_item = NULL;
+        struct s_db_item *items[2];
+        uint8_t *data = NULL;
+        void *it = NULL;
+        int i = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        /* Key with the inline value fits the item, the large one does not */
+        put_items(node, 0, 1, DB_ITEM_EMBED_SIZE);
+        put_inline(node, 1, 16, DB_ITEM_EMBED_SIZE - 16, 0x11);
+        put_items(node, 2, 1, DB_ITEM_EMBED_SIZE + 1);
+        put_items(node, 3, 1, 8);
+
+        BOOST_CHECK(find_item(node, 0, DB_ITEM_EMBED_SIZE)->flags &
+                    DB_ITEM_EMBED);
+        db_item = find_item(node, 1, 16);
+        BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(db_item->flags & DB_ITEM_EMBED);
+        BOOST_CHECK(db_item->data[DB_ITEM_EMBED_SIZE - 1] == 0x11);
+
+        /* Item without the tail is not larger than the struct */
+        db_item = find_item(node, 2, DB_ITEM_EMBED_SIZE + 1);
+        BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(!(db_item->flags & (DB_ITEM_EMBED | DB_ITEM_TAIL)));
+
+        /* Items keep the order of puts around the removed one */
+        BOOST_CHECK(db_node_remove_item(node, db_item) == 0);
+        it = db_node_get_iterator(node, &iter);
+        BOOST_CHECK(db_node_get_next(node, it)->data[0] == 0);
+        BOOST_CHECK(db_node_get_next(node, it)->data[0] == 1);
+        BOOST_CHECK(db_node_get_next(node, it)->data[0] == 3);
+        BOOST_CHECK(db_node_iterator_has_next(it) == 0);
+
+        /* Inline record is loaded by key nodes only */
+        BOOST_CHECK(db_node_remove_item(node, find_item(node, 1, 16)) == 0);
+
+        /* Replaced data does not go back to the item */
+        db_item = find_item(node, 3, 8);
+        data = (uint8_t *)malloc(8);
+        memcpy(data, db_item->data, 8);
+        db_node_set_data(node, db_item, data);
+        BOOST_CHECK(db_item->data == data);
+        BOOST_CHECK(!(db_item->flags & DB_ITEM_EMBED));
+        BOOST_CHECK(db_item->data[0] == 3 && db_item->data[7] == 0x5A);
+        db_node_release(node);
+
+        /* Small records are loaded into items */
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+        BOOST_CHECK(find_item(node, 2, DB_ITEM_EMBED_SIZE + 1) == NULL);
+        items[0] = find_item(node, 0, DB_ITEM_EMBED_SIZE);
+        items[1] = find_item(node, 3, 8);
+        for (i = 0; i < 2; i++) {
+                BOOST_REQUIRE(items[i] != NULL);
+                BOOST_CHECK(items[i]->flags & DB_ITEM_EMBED);
+        }
+        db_node_release(node);
+}
+
+/**
+ * @brief Open node with the blob log for values from 256 bytes.
+ */
+static void *blob_node_init()
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_REQUIRE(db_node_set_blob(node, DB_NODE_BLOB_NAME,
+                                       256, 64 * 1024) == 0);
+        return node;
+}
+
+BOOST_AUTO_TEST_CASE(db_node_blob_test)
+{
+        struct s_db_blob_stats stats;
+        struct s_db_item *db_item = NULL;
+        const int size = 1000;
+        int i = 0;
+        void *node = blob_node_init();
+
+        put_items(node, 0, 10, size);
+        put_items(node, 10, 10, 32);
+
+        /* Only the location of large value is in the node file */
+        db_item = find_item(node, 0, size);
+        BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(db_item->flags & DB_ITEM_BLOB);
+        BOOST_CHECK(db_item->f_size == 3 * sizeof(uint64_t));
+        BOOST_CHECK(!(find_item(node, 10, 32)->flags & DB_ITEM_BLOB));
+
+        for (i = 0; i < 5; i++)
+                BOOST_CHECK(db_node_remove_item(node, find_item(node, i, size)) == 0);
+
+        db_node_get_blob_stats(node, &stats);
+        BOOST_CHECK(stats.segments == 1);
+        BOOST_CHECK(stats.live_size == 5 * (sizeof(uint64_t) + size));
+        BOOST_CHECK(db_node_flush(node) == 0);
+        db_node_release(node);
+
+        node = blob_node_init();
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+
+        for (i = 0; i < 20; i++) {
+                db_item = find_item(node, i, (i < 10) ? size : 32);
+                BOOST_CHECK((db_item == NULL) == (i < 5));
+        }
+
+        db_node_get_blob_stats(node, &stats);
+        BOOST_CHECK(stats.live_size == 5 * (sizeof(uint64_t) + size));
+
+        /* Half live segment is moved, the old one goes on flush */
+        BOOST_CHECK(db_node_blob_gc(node, 1024 * 1024, 60) == 5 * size);
+        BOOST_CHECK(db_node_blob_gc(node, 1024 * 1024, 60) == 0);
+        BOOST_CHECK(db_node_flush(node) == 0);
+
+        db_node_get_blob_stats(node, &stats);
+        BOOST_CHECK(stats.segments == 1);
+        BOOST_CHECK(stats.live_size == 5 * (sizeof(uint64_t) + size));
+        BOOST_CHECK(access(DB_NODE_BLOB_NAME ".1", F_OK) != 0);
+        BOOST_CHECK(access(DB_NODE_BLOB_NAME ".2", F_OK) == 0);
+        BOOST_CHECK(find_item(node, 7, size)->flags & DB_ITEM_BLOB);
+        BOOST_CHECK(db_node_save_snapshot(node, DB_NODE_SNAP_NAME,
+                                          snap_index, NULL, NULL) == 0);
+        db_node_release(node);
+
+        /* Blob items of the snapshot are read from the log */
+        node = blob_node_init();
+        BOOST_CHECK(db_node_load_snapshot(node, DB_NODE_SNAP_NAME,
+                                          NULL, NULL) == 0);
+        for (i = 5; i < 10; i++) {
+                db_item = find_item(node, i, size);
+                BOOST_REQUIRE(db_item != NULL);
+                BOOST_CHECK(db_item->flags & DB_ITEM_BLOB);
+        }
+
+        db_node_get_blob_stats(node, &stats);
+        BOOST_CHECK(stats.live_size == 5 * (sizeof(uint64_t) + size));
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_blob_lost_test)
+{
+        struct s_db_item *db_item = NULL;
+        const int size = 1000;
+        void *node = blob_node_init();
+
+        put_items(node, 0, 2, size);
+        BOOST_CHECK(db_node_flush(node) == 0);
+        db_node_release(node);
+
+        /* Record without its blob is dropped, the rest is loaded */
+        BOOST_REQUIRE(truncate(DB_NODE_BLOB_NAME ".1",
+                               2 * sizeof(uint32_t) + sizeof(uint64_t) + size) == 0);
+        node = blob_node_init();
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+
+        db_item = find_item(node, 0, size);
+        BOOST_REQUIRE(db_item != NULL);
+        BOOST_CHECK(db_item->data[size - 1] == 0x5A);
+        BOOST_CHECK(find_item(node, 1, size) == NULL);
+        db_node_release(node);
+}
+
+/**
+ * @brief Check data of the item number, read it back if needed.
+ * @return Non-zero value, if the data is right.
+ */
+static int check_data(void *node, struct s_db_item *item, int num, int size)
+{
+        uint8_t *data = NULL;
+        int is_copy = 0;
+        int rc = 0;
+
+        data = db_node_get_data(node, item, &is_copy);
+        if (data == NULL)
+                return 0;
+
+        rc = (data[0] == (uint8_t)num && data[size - 1] == 0x5A);
+        if (is_copy)
+                free(data);
+
+        return rc;
+}
+
+static struct s_db_item *nth_item(void *node, int num)
+{
+        struct s_db_node_iterator iter;
+        void *it = db_node_get_iterator(node, &iter);
+        struct s_db_item *item = NULL;
+
+        while (db_node_iterator_has_next(it) && num-- >= 0)
+                item = db_node_get_next(node, it);
+
+        return item;
+}
+
+BOOST_AUTO_TEST_CASE(db_node_evict_test)
+{
+        struct s_db_node_mem_stats stats;
+        struct s_db_item *item = NULL;
+        const int size = 100;
+        uint8_t *data = NULL;
+        int copies = 0;
+        int is_copy = 0;
+        int i = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        db_node_set_mem_budget(node, 10 * size);
+        put_items(node, 0, 20, size);
+
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.size <= 10 * size);
+        BOOST_CHECK(stats.evicted >= 10);
+        BOOST_CHECK(stats.reads == 0);
+
+        /* Evicted item is out of the table, its data is read back */
+        item = nth_item(node, 0);
+        BOOST_REQUIRE(item != NULL);
+        BOOST_CHECK(item->flags & DB_ITEM_EVICTED);
+        BOOST_CHECK(item->data == NULL);
+        BOOST_CHECK(find_item(node, 0, size) == NULL);
+
+        for (i = 0; i < 20; i++) {
+                item = nth_item(node, i);
+                data = db_node_get_data(node, item, &is_copy);
+                BOOST_REQUIRE(data != NULL);
+                BOOST_CHECK(data[0] == i && data[size - 1] == 0x5A);
+                if (is_copy) {
+                        copies++;
+                        free(data);
+                }
+        }
+
+        /* Data read over the budget is not kept */
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.size <= 10 * size);
+        BOOST_CHECK(stats.reads >= 10);
+        BOOST_CHECK(copies != 0);
+
+        BOOST_CHECK(db_node_save_snapshot(node, DB_NODE_SNAP_NAME,
+                                          NULL, NULL, NULL) == -1);
+        BOOST_CHECK(errno == ENOTSUP);
+
+        BOOST_CHECK(db_node_remove_item(node, nth_item(node, 0)) == 0);
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.evicted >= 9);
+        db_node_release(node);
+
+        /* Items over the budget are evicted on load */
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        db_node_set_mem_budget(node, 5 * size);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.size <= 5 * size);
+        BOOST_CHECK(stats.evicted >= 14);
+
+        for (i = 1; i < 20; i++)
+                BOOST_CHECK(check_data(node, nth_item(node, i - 1), i, size));
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_evict_clock_test)
+{
+        struct s_db_item *items[5];
+        const int size = 100;
+        int i = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        db_node_set_mem_budget(node, 3 * size);
+        put_items(node, 0, 4, size);
+
+        /* The first sweep clears reference bits, the oldest goes */
+        for (i = 0; i < 4; i++)
+                items[i] = nth_item(node, i);
+        BOOST_CHECK(items[0]->data == NULL);
+
+        /* Used item gets the second chance */
+        BOOST_CHECK(check_data(node, items[1], 1, size));
+        put_items(node, 4, 1, size);
+        items[4] = nth_item(node, 4);
+
+        BOOST_CHECK(items[1]->data != NULL);
+        BOOST_CHECK(items[2]->data == NULL);
+        BOOST_CHECK(items[3]->data != NULL);
+        BOOST_CHECK(items[4]->data != NULL);
+
+        /* Dirty items are kept */
+        db_node_set_lazy(node, 1);
+        put_items(node, 5, 4, size);
+        for (i = 5; i < 9; i++)
+                BOOST_CHECK(find_item(node, i, size) != NULL);
+
+        BOOST_CHECK(db_node_flush(node) == 0);
+        for (i = 0; i < 9; i++)
+                BOOST_CHECK(check_data(node, nth_item(node, i), i, size));
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_evict_blob_test)
+{
+        struct s_db_node_mem_stats stats;
+        const int size = 1000;
+        int i = 0;
+        void *node = blob_node_init();
+
+        db_node_set_mem_budget(node, 2 * size);
+        put_items(node, 0, 8, size);
+
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.evicted >= 6);
+
+        /* Blob value is read back from the log */
+        for (i = 0; i < 8; i++)
+                BOOST_CHECK(check_data(node, nth_item(node, i), i, size));
+
+        db_node_release(node);
+
+        /* Evicted values are read back to be moved by the blob GC */
+        node = blob_node_init();
+        db_node_set_mem_budget(node, 2 * size);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+
+        /* The last items go, so others keep their places */
+        for (i = 7; i >= 4; i--)
+                db_node_remove_item(node, nth_item(node, i));
+        BOOST_CHECK(db_node_blob_gc(node, 1 << 20, 100) == 4 * size);
+        BOOST_CHECK(db_node_blob_collect(node) == 1);
+
+        for (i = 0; i < 4; i++)
+                BOOST_CHECK(check_data(node, nth_item(node, i), i, size));
+
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.size <= 2 * size);
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_arena_test)
+{
+        struct s_db_node_mem_stats stats;
+        struct s_db_item *item = NULL;
+        uint8_t *data = NULL;
+        uint64_t used = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        /* Items and AVL nodes are cut from slab pages */
+        put_items(node, 0, 10, 100);
+        put_items(node, 10, 10, 1000);
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.arena_size != 0);
+        BOOST_CHECK(stats.arena_used >= 20 * sizeof(struct s_db_item));
+        BOOST_CHECK(stats.arena_used <= stats.arena_size);
+        db_node_release(node);
+
+        /* Small data read from the file goes to the arena */
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.arena_used >= 20 * sizeof(struct s_db_item) +
+                                        10 * 100);
+
+        item = find_item(node, 1, 100);
+        BOOST_REQUIRE(item != NULL);
+        BOOST_CHECK(item->flags & DB_ITEM_ARENA);
+        item = find_item(node, 11, 1000);
+        BOOST_REQUIRE(item != NULL);
+        BOOST_CHECK(!(item->flags & DB_ITEM_ARENA));
+
+        /* Replaced data goes back to the arena, once it is reclaimed */
+        item = find_item(node, 1, 100);
+        BOOST_REQUIRE(item != NULL);
+        data = (uint8_t *)malloc(100);
+        memcpy(data, item->data, 100);
+        used = stats.arena_used;
+        db_node_set_data(node, item, data);
+        BOOST_CHECK(!(item->flags & DB_ITEM_ARENA));
+        BOOST_CHECK(check_data(node, item, 1, 100));
+        db_node_reclaim(node);
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.arena_used < used);
+
+        used = stats.arena_used;
+        BOOST_CHECK(db_node_remove_item(node, find_item(node, 2, 100)) == 0);
+        db_node_reclaim(node);
+        db_node_get_mem_stats(node, &stats);
+        BOOST_CHECK(stats.arena_used + sizeof(struct s_db_item) + 100 <
+                    used);
+        BOOST_CHECK(find_item(node, 3, 100) != NULL);
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_peek_test)
+{
+        struct s_db_node_mem_stats stats;
+        struct s_db_item *key_item = NULL;
+        struct s_db_item *val_item = NULL;
+        uint8_t *data = NULL;
+        uint32_t size = 0;
+        uint64_t used = 0;
+        void *key_node = db_node_init(DB_NODE_NAME);
+        void *val_node = db_node_init(DB_NODE_SNAP_NAME);
+        void *ref_nodes[1] = {val_node};
+        BOOST_REQUIRE(key_node != NULL && val_node != NULL);
+
+        db_node_set_ref_nodes(key_node, ref_nodes);
+
+        /* Inline value is after the key data */
+        key_item = put_inline(key_node, 1, 16, 8, 0x11);
+        BOOST_CHECK(db_node_peek_value(key_node, key_item, &data, &size) == 0);
+        BOOST_REQUIRE(data != NULL && size == 8);
+        BOOST_CHECK(data[0] == 0x11 && data[7] == 0x11);
+
+        /* Value of the key is changing */
+        db_node_change_begin(key_item);
+        BOOST_CHECK(db_node_peek_value(key_node, key_item, &data, &size) == -1);
+        db_node_change_end(key_item);
+
+        /* Referred value */
+        put_items(val_node, 2, 1, 100);
+        val_item = find_item(val_node, 2, 100);
+        BOOST_REQUIRE(val_item != NULL);
+        key_item = put_inline(key_node, 2, 16, 0, 0);
+        db_node_change_begin(key_item);
+        db_node_set_ref(key_item, 0, val_item);
+        db_node_change_end(key_item);
+        val_item->ref_counter = 1;
+
+        /* Removed value is kept for the reader in the epoch */
+        BOOST_REQUIRE(db_epoch_enter() == 0);
+        BOOST_CHECK(db_node_peek_value(key_node, key_item, &data, &size) == 0);
+        BOOST_REQUIRE(data == val_item->data && size == 100);
+
+        db_node_get_mem_stats(val_node, &stats);
+        used = stats.arena_used;
+        BOOST_CHECK(db_node_remove_item(val_node, val_item) == 0);
+        db_node_reclaim(val_node);
+        BOOST_CHECK(data[0] == 2 && data[99] == 0x5A);
+
+        /* The item goes back to the slab after the reader exits */
+        db_node_get_mem_stats(val_node, &stats);
+        BOOST_CHECK(stats.arena_used < used);
+        used = stats.arena_used;
+        db_epoch_exit();
+        db_node_reclaim(val_node);
+        db_node_get_mem_stats(val_node, &stats);
+        BOOST_CHECK(stats.arena_used + sizeof(struct s_db_item) <= used);
+
+        /* Key without value */
+        key_item = put_inline(key_node, 3, 16, 0, 0);
+        BOOST_CHECK(db_node_peek_value(key_node, key_item, &data, &size) == 0);
+        BOOST_CHECK(data == NULL);
+        BOOST_CHECK(db_node_peek_value(key_node, NULL, &data, &size) == -1);
+
+        db_node_release(val_node);
+        db_node_release(key_node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_compact_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        struct s_db_file_stats stats;
+        const int size = 56;    /* Record size is 64 */
+        int i = 0;
+        BOOST_REQUIRE(node != NULL);
+
+        put_items(node, 0, 100, size);
+
+        /* Every other record in the first half is free */
+        for (i = 0; i < 50; i += 2)
+                db_node_remove_item(node, find_item(node, i, size));
+
+        BOOST_CHECK(db_node_compact_begin(node, 50) == 0);
+        BOOST_CHECK(db_node_compact_begin(node, 10) == 25);
+
+        /* Removed item is skipped */
+        db_node_remove_item(node, find_item(node, 99, size));
+
+        BOOST_CHECK(db_node_compact_step(node, 640, 0) == 640);
+        while (db_node_compact_step(node, 640, 0) != 0)
+                ;
+        db_node_compact_end(node);
+
+        /* 24 records are moved to 25 lacunes */
+        db_node_get_file_stats(node, &stats);
+        BOOST_CHECK(stats.free_size == 64);
+        BOOST_CHECK(stats.size == DB_FILE_DATA_OFFSET + 75 * 64);
+        db_node_release(node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, NULL, NULL, NULL) == 0);
+
+        for (i = 0; i < 100; i++) {
+                int removed = (i < 50 && i % 2 == 0) || i == 99;
+                BOOST_CHECK((find_item(node, i, size) == NULL) == removed);
+        }
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_compact_pin_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        struct s_db_item *moved = NULL;
+        struct s_db_item *erased = NULL;
+        struct s_db_file_stats stats;
+        const int size = 56;
+        int dup = 0;
+        BOOST_REQUIRE(node != NULL);
+
+        put_items(node, 0, 4, size);
+        moved  = find_item(node, 3, size);
+        erased = find_item(node, 2, size);
+        moved->ref_counter  = 1;
+        erased->ref_counter = 1;
+
+        db_node_remove_item(node, find_item(node, 0, size));
+        db_node_remove_item(node, find_item(node, 1, size));
+
+        BOOST_CHECK(db_node_compact_begin(node, 0) == 2);
+        BOOST_CHECK(db_node_compact_step(node, 1000, 1) == 128);
+        BOOST_CHECK(db_node_compact_is_moved(node, moved));
+        BOOST_CHECK(db_node_compact_is_moved(node, erased));
+        BOOST_CHECK(moved->ref_counter == 2);
+        BOOST_CHECK(moved->f_offset == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(erased->f_offset == DB_FILE_DATA_OFFSET + 64);
+
+        /* Old records are kept until release */
+        db_node_get_file_stats(node, &stats);
+        BOOST_CHECK(stats.size == DB_FILE_DATA_OFFSET + 4 * 64);
+
+        /* Last reference is dropped meanwhile */
+        erased->ref_counter--;
+
+        /* One by one, the rest stays pinned */
+        BOOST_CHECK(db_node_compact_release(node, 1) == 1);
+        BOOST_CHECK(db_node_compact_is_moved(node, moved) +
+                    db_node_compact_is_moved(node, erased) == 1);
+        BOOST_CHECK(db_node_compact_release(node, UINT32_MAX) == 0);
+        BOOST_CHECK(!db_node_compact_is_moved(node, moved));
+        BOOST_CHECK(moved->ref_counter == 1);
+        BOOST_CHECK(find_item(node, 2, size) == NULL);
+        db_node_compact_end(node);
+
+        db_node_get_file_stats(node, &stats);
+        BOOST_CHECK(stats.size == DB_FILE_DATA_OFFSET + 64);
+        BOOST_CHECK(stats.free_size == 0);
+
+        /* Crash before release leaves duplicate record */
+        put_items(node, 4, 2, size);
+        db_node_remove_item(node, find_item(node, 4, size));
+        BOOST_CHECK(db_node_compact_begin(node, 0) == 1);
+        BOOST_CHECK(db_node_compact_step(node, 1000, 1) == 64);
+        db_node_release(node);
+
+        node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+        BOOST_CHECK(db_node_load(node, NULL, count_dup, &dup) == 0);
+        BOOST_CHECK(dup == 1);
+        BOOST_REQUIRE(find_item(node, 5, size) != NULL);
+        BOOST_CHECK(find_item(node, 5, size)->f_offset ==
+                    DB_FILE_DATA_OFFSET + 64);
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_compact_track_test)
+{
+        void *val_node = db_node_init(DB_NODE_NAME);
+        void *key_node = db_node_init(DB_NODE_SNAP_NAME);
+        struct s_db_node_referrer *refs = NULL;
+        struct s_db_item *keys[5];
+        struct s_db_item *vals[2];
+        uint64_t fp[2];
+        uint32_t pos = UINT32_MAX;
+        uint32_t count = 0;
+        uint32_t i = 0;
+        const int size = 56;
+        BOOST_REQUIRE(val_node != NULL && key_node != NULL);
+
+        put_items(val_node, 0, 4, size);
+        vals[0] = find_item(val_node, 2, size);
+        vals[1] = find_item(val_node, 3, size);
+        put_items(key_node, 10, 5, 20);
+        for (i = 0; i < 5; i++) {
+                keys[i] = find_item(key_node, 10 + i, 20);
+                db_node_set_ref(keys[i], 0, vals[i % 2]);
+                vals[i % 2]->ref_counter++;
+        }
+        db_node_remove_item(val_node, find_item(val_node, 0, size));
+        db_node_remove_item(val_node, find_item(val_node, 1, size));
+
+        /* Keys are walked down by runs, the key put last is kept by writer */
+        BOOST_CHECK(db_node_compact_begin(val_node, 0) == 2);
+        db_node_compact_scan(key_node, val_node, 0, &pos, 2);
+        BOOST_CHECK(pos == 3);
+
+        /* The last key takes the place of the removed one, it is seen */
+        db_node_remove_item(key_node, keys[1]);
+        db_node_compact_scan(key_node, val_node, 0, &pos, 2);
+        db_node_compact_scan(key_node, val_node, 0, &pos, 2);
+        BOOST_CHECK(pos == 0);
+        db_node_compact_track(val_node, vals[0], key_node, keys[0]);
+
+        /* Keys of the moved values only */
+        BOOST_CHECK(db_node_compact_take_refs(val_node, &refs) == 0);
+        BOOST_CHECK(db_node_compact_step(val_node, 1000, 1) == 128);
+        count = db_node_compact_take_refs(val_node, &refs);
+        BOOST_CHECK(count == 6);
+        for (i = 0; i < count; i++) {
+                BOOST_CHECK(refs[i].node == key_node);
+                BOOST_CHECK(refs[i].key != keys[1]);
+                BOOST_CHECK(refs[i].item ==
+                            db_node_item_of(val_node, refs[i].key->ref));
+                BOOST_CHECK(db_node_find_item(key_node, refs[i].key,
+                                              refs[i].fp) == refs[i].key);
+        }
+        BOOST_CHECK(db_node_compact_take_refs(val_node, &refs) == 0);
+
+        /* Removed key is not found by its pointer */
+        fp[0] = keys[2]->fp[0];
+        fp[1] = keys[2]->fp[1];
+        db_node_remove_item(key_node, keys[2]);
+        BOOST_CHECK(db_node_find_item(key_node, keys[2], fp) == NULL);
+        BOOST_CHECK(db_node_find_item(key_node, keys[0], fp) == NULL);
+
+        /* Moved value has the new record, its keys are not kept */
+        BOOST_CHECK(db_node_compact_release(val_node, UINT32_MAX) == 0);
+        db_node_compact_track(val_node, vals[1], key_node, keys[3]);
+        BOOST_CHECK(db_node_compact_take_refs(val_node, &refs) == 0);
+        db_node_compact_end(val_node);
+
+        db_node_release(key_node);
+        db_node_release(val_node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_unref_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        struct s_db_item *shared = NULL;
+        struct s_db_item *own = NULL;
+        struct s_db_file_stats stats;
+        const int size = 56;
+        BOOST_REQUIRE(node != NULL);
+
+        put_items(node, 0, 2, size);
+        shared = find_item(node, 0, size);
+        own = find_item(node, 1, size);
+        db_node_ref(shared);
+        db_node_ref(shared);
+        db_node_ref(own);
+
+        /* References are dropped without the node lock */
+        BOOST_CHECK(db_node_unref(node, shared) == 1);
+        BOOST_CHECK(db_node_unref(node, own) == 0);
+        BOOST_CHECK(find_item(node, 1, size) == own);
+
+        /* Value put again is kept by the writer */
+        db_node_ref(own);
+        db_node_wrlock(node);
+        db_node_unlock(node);
+        BOOST_CHECK(find_item(node, 1, size) == own);
+
+        /* Value left without references is removed by the writer */
+        BOOST_CHECK(db_node_unref(node, own) == 0);
+        db_node_wrlock(node);
+        db_node_unlock(node);
+        BOOST_CHECK(find_item(node, 1, size) == NULL);
+        BOOST_CHECK(find_item(node, 0, size) == shared);
+
+        db_node_get_file_stats(node, &stats);
+        BOOST_CHECK(stats.size == DB_FILE_DATA_OFFSET + 64);
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_stripe_test)
+{
+        void *node = db_node_init(DB_NODE_NAME);
+        struct stripe_arg other = {node, {0, 1ULL << 32}, 0};
+        struct stripe_arg same = {node, {0, 0}, 0};
+        struct s_db_node_lock_stats stats;
+        uint64_t fp[2] = {0, 0};
+        pthread_t thread;
+        BOOST_REQUIRE(node != NULL);
+
+        /* Writer of the other stripe does not wait */
+        db_node_wrlock_fp(node, fp);
+        BOOST_REQUIRE(pthread_create(&thread, NULL, stripe_thread,
+                                     &other) == 0);
+        BOOST_CHECK(wait_done(&other, 1000));
+        pthread_join(thread, NULL);
+
+        /* Writer of the same stripe waits */
+        BOOST_REQUIRE(pthread_create(&thread, NULL, stripe_thread,
+                                     &same) == 0);
+        BOOST_CHECK(!wait_done(&same, 50));
+        db_node_unlock_fp(node, fp);
+        pthread_join(thread, NULL);
+        BOOST_CHECK(same.done);
+
+        db_node_get_lock_stats(node, &stats);
+        BOOST_CHECK(stats.stripe_locks == 3);
+        BOOST_CHECK(stats.stripe_waits == 1);
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_stripe_writers_test)
+{
+        const int writers = 4;
+        const int count = 2000;
+        void *node = db_node_init(DB_NODE_NAME);
+        struct writer_arg args[writers];
+        struct s_db_node_lock_stats stats;
+        struct s_db_file_stats file_stats;
+        pthread_t threads[writers];
+        uint8_t buf[2 * sizeof(int)];
+        int found = 0;
+        int i = 0;
+        int j = 0;
+        BOOST_REQUIRE(node != NULL);
+
+        for (i = 0; i < writers; i++) {
+                args[i].node = node;
+                args[i].id = i;
+                args[i].count = count;
+                args[i].failed = 0;
+                BOOST_REQUIRE(pthread_create(&threads[i], NULL, writer_thread,
+                                             &args[i]) == 0);
+        }
+
+        for (i = 0; i < writers; i++) {
+                pthread_join(threads[i], NULL);
+                BOOST_CHECK(args[i].failed == 0);
+        }
+
+        for (i = 0; i < writers; i++) {
+                for (j = 0; j < count; j++) {
+                        memcpy(buf, &i, sizeof(int));
+                        memcpy(&buf[sizeof(int)], &j, sizeof(int));
+                        found += (db_node_get_item(node, buf,
+                                                   sizeof(buf)) != NULL);
+                }
+        }
+        BOOST_CHECK(found == writers * count);
+
+        /* Records do not overlap */
+        db_node_get_file_stats(node, &file_stats);
+        BOOST_CHECK(file_stats.size == DB_FILE_DATA_OFFSET +
+                    (uint64_t)writers * count * (8 + 2 * sizeof(int)));
+
+        db_node_get_lock_stats(node, &stats);
+        BOOST_CHECK(stats.stripe_locks == (uint64_t)writers * count);
+        BOOST_CHECK(stats.latch_locks >= 2 * stats.stripe_locks);
+        printf("Stripe waits %llu of %llu, latch waits %llu of %llu\n",
+               (unsigned long long)stats.stripe_waits,
+               (unsigned long long)stats.stripe_locks,
+               (unsigned long long)stats.latch_waits,
+               (unsigned long long)stats.latch_locks);
+
+        db_node_release(node);
+}
+
+
+BOOST_AUTO_TEST_CASE(db_node_item_bench_test)
+{
+        const int count = 200000;
+        struct s_db_node_mem_stats stats;
+        struct timespec start, end;
+        struct mallinfo2 before;
+        struct mallinfo2 after;
+        double heap = 0;
+        uint8_t *buf = NULL;
+        char key[32];
+        double ns = 0;
+        int found = 0;
+        int i = 0;
+
+        /* 20-byte keys, as the server keeps "user:<15 digits>" */
+        before = mallinfo2();
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        for (i = 0; i < count; i++) {
+                sprintf(key, "user:%015d", i);
+                buf = (uint8_t *)malloc(20);
+                memcpy(buf, key, 20);
+                BOOST_REQUIRE(db_node_put_item(node, buf, 20) != NULL);
+        }
+        after = mallinfo2();
+        db_node_get_mem_stats(node, &stats);
+
+        /* Large blocks, as the hash index, are mapped apart */
+        heap  = (double)after.uordblks - before.uordblks;
+        heap += (double)after.hblkhd - before.hblkhd;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < count; i++) {
+                sprintf(key, "user:%015d", (int)((i * 7919ULL) % count));
+                found += (db_node_get_item(node, (uint8_t *)key, 20) != NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        BOOST_CHECK(found == count);
+
+        ns  = (end.tv_sec - start.tv_sec) * 1e9;
+        ns += end.tv_nsec - start.tv_nsec;
+        printf("Item of 20-byte key: %zu bytes struct, %.1f bytes per item "
+               "(%.1f slab, %.1f heap), lookup %.1f ns\n",
+               sizeof(struct s_db_item),
+               (stats.arena_used + heap) / count,
+               (double)stats.arena_used / count, heap / count,
+               ns / count);
+        /* Handles and 32-bit fields fit without padding, embed is apart */
+        BOOST_CHECK(sizeof(void *) != 8 || sizeof(struct s_db_item) == 72);
+
+        db_node_release(node);
+}
+
+BOOST_AUTO_TEST_CASE(db_node_list_bench_test)
+{
+        const int count = 1000000;
+        struct s_db_node_iterator iter;
+        struct s_db_item *item = NULL;
+        struct timespec start, end;
+        uint8_t *buf = NULL;
+        uint64_t sum = 0;
+        uint64_t seen = 0;
+        double sec = 0;
+        void *it = NULL;
+        int i = 0;
+        void *node = db_node_init(DB_NODE_NAME);
+        BOOST_REQUIRE(node != NULL);
+
+        /* Values of 64 bytes, every third is erased and put again,
+         * so the order of items is not the order of their memory */
+        for (i = 0; i < count; i++) {
+                buf = (uint8_t *)malloc(64);
+                memset(buf, 0x5A, 64);
+                memcpy(buf, &i, sizeof(i));
+                BOOST_REQUIRE(db_node_put_item(node, buf, 64) != NULL);
+        }
+        for (i = 0; i < count; i += 3) {
+                buf = (uint8_t *)malloc(64);
+                memset(buf, 0x5A, 64);
+                memcpy(buf, &i, sizeof(i));
+                item = db_node_get_item(node, buf, 64);
+                BOOST_REQUIRE(item != NULL);
+                BOOST_CHECK(db_node_remove_item(node, item) == 0);
+                BOOST_REQUIRE(db_node_put_item(node, buf, 64) != NULL);
+        }
+        db_node_reclaim(node);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        db_node_rdlock(node);
+        it = db_node_get_iterator(node, &iter);
+        while (db_node_iterator_has_next(it)) {
+                item = db_node_get_next(node, it);
+                sum += item->data[item->size - 1];
+                seen++;
+        }
+        db_node_unlock(node);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        BOOST_CHECK(seen == (uint64_t)count);
+        BOOST_CHECK(sum == 0x5AULL * count);
+
+        sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("LIST walk of %d items: %.0f items/s\n", count, seen / sec);
+
+        db_node_release(node);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,261 @@
+#define BOOST_TEST_MODULE db_slab_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "db_slab.h"
+
+#define DB_SLAB_BENCH_COUNT 1000000
+
+/* The same size as the node item */
+struct test_item {
+        uint8_t *data;
+        struct test_item *next;
+        uint64_t fields[12];
+};
+
+BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+
+BOOST_AUTO_TEST_CASE(db_slab_alloc_test)
+{
+        static void *objs[10000];
+        struct s_db_slab_stats stats;
+        void *slab = db_slab_create(100);
+        int i = 0;
+        BOOST_REQUIRE(slab != NULL);
+
+        for (i = 0; i < 10000; i++) {
+                objs[i] = db_slab_alloc(slab);
+                BOOST_REQUIRE(objs[i] != NULL);
+                BOOST_CHECK(((uintptr_t)objs[i] % sizeof(void *)) == 0);
+                memset(objs[i], i & 0xFF, 100);
+        }
+
+        /* Objects do not overlap */
+        for (i = 0; i < 10000; i++)
+                BOOST_CHECK(((uint8_t *)objs[i])[99] == (i & 0xFF));
+
+        memset(&stats, 0, sizeof(stats));
+        db_slab_add_stats(slab, &stats);
+        BOOST_CHECK(stats.pages >= 10000 * 104 / DB_SLAB_PAGE_SIZE + 1);
+        BOOST_CHECK(stats.size == stats.pages * DB_SLAB_PAGE_SIZE);
+        BOOST_CHECK(stats.used == 10000 * 104);
+
+        /* Freed objects are reused, pages are kept */
+        for (i = 0; i < 10000; i += 2)
+                db_slab_free(objs[i]);
+        for (i = 0; i < 10000; i += 2)
+                BOOST_REQUIRE(db_slab_alloc(slab) != NULL);
+
+        memset(&stats, 0, sizeof(stats));
+        db_slab_add_stats(slab, &stats);
+        BOOST_CHECK(stats.size == stats.pages * DB_SLAB_PAGE_SIZE);
+        BOOST_CHECK(stats.used == 10000 * 104);
+
+        db_slab_free(NULL);
+        db_slab_destroy(slab);
+}
+
+BOOST_AUTO_TEST_CASE(db_slab_owner_test)
+{
+        void *slab1 = db_slab_create(16);
+        void *slab2 = db_slab_create(32);
+        struct s_db_slab_stats stats;
+        void *obj1 = NULL;
+        void *obj2 = NULL;
+        BOOST_REQUIRE(slab1 != NULL && slab2 != NULL);
+
+        obj1 = db_slab_alloc(slab1);
+        obj2 = db_slab_alloc(slab2);
+        BOOST_REQUIRE(obj1 != NULL && obj2 != NULL);
+
+        /* Object goes back to its own cache */
+        db_slab_free(obj2);
+        memset(&stats, 0, sizeof(stats));
+        db_slab_add_stats(slab1, &stats);
+        BOOST_CHECK(stats.used == 16);
+        memset(&stats, 0, sizeof(stats));
+        db_slab_add_stats(slab2, &stats);
+        BOOST_CHECK(stats.used == 0);
+        BOOST_CHECK(db_slab_alloc(slab2) == obj2);
+
+        db_slab_destroy(slab1);
+        db_slab_destroy(slab2);
+}
+
+BOOST_AUTO_TEST_CASE(db_slab_handle_test)
+{
+        static void *objs[20000];
+        void *slab = db_slab_create(8);
+        uint32_t handle = 0;
+        int i = 0;
+        BOOST_REQUIRE(slab != NULL);
+
+        BOOST_CHECK(db_slab_handle(NULL) == 0);
+        BOOST_CHECK(db_slab_ptr(slab, 0) == NULL);
+
+        /* Objects of several pages, the smallest size fills the slot bits */
+        for (i = 0; i < 20000; i++) {
+                objs[i] = db_slab_alloc(slab);
+                BOOST_REQUIRE(objs[i] != NULL);
+        }
+
+        for (i = 0; i < 20000; i++) {
+                handle = db_slab_handle(objs[i]);
+                BOOST_CHECK(handle != 0);
+                BOOST_CHECK(db_slab_ptr(slab, handle) == objs[i]);
+        }
+        BOOST_CHECK(db_slab_handle(objs[0]) != db_slab_handle(objs[1]));
+
+        db_slab_destroy(slab);
+}
+
+BOOST_AUTO_TEST_CASE(db_slab_shared_test)
+{
+        static void *objs[20000];
+        struct s_db_slab_stats stats;
+        void *slab1 = db_slab_create(72);
+        void *slab2 = db_slab_create_shared(96, slab1);
+        void *other = db_slab_create(72);
+        uint32_t handle = 0;
+        int i = 0;
+        BOOST_REQUIRE(slab1 != NULL && slab2 != NULL && other != NULL);
+
+        /* Pages of both caches interleave in the one table */
+        for (i = 0; i < 20000; i++) {
+                objs[i] = db_slab_alloc((i % 3) ? slab1 : slab2);
+                BOOST_REQUIRE(objs[i] != NULL);
+                BOOST_REQUIRE(db_slab_alloc(other) != NULL);
+        }
+
+        for (i = 0; i < 20000; i++) {
+                handle = db_slab_handle(objs[i]);
+                BOOST_CHECK(db_slab_ptr(slab1, handle) == objs[i]);
+                BOOST_CHECK(db_slab_ptr(slab2, handle) == objs[i]);
+        }
+        BOOST_CHECK(db_slab_handle(objs[0]) != db_slab_handle(objs[1]));
+
+        memset(&stats, 0, sizeof(stats));
+        db_slab_add_stats(slab2, &stats);
+        BOOST_CHECK(stats.used == 6667 * 96);
+        BOOST_CHECK(stats.pages == 6667 * 96 / (DB_SLAB_PAGE_SIZE - 64) + 1);
+
+        /* Objects of the other cache are kept with the table */
+        db_slab_destroy(slab1);
+        for (i = 0; i < 20000; i += 3)
+                memset(objs[i], 0, 96);
+        db_slab_destroy(slab2);
+        db_slab_destroy(other);
+}
+
+BOOST_AUTO_TEST_CASE(db_slab_error_test)
+{
+        void *slab = NULL;
+
+        BOOST_CHECK(db_slab_create(0) == NULL);
+        BOOST_CHECK(errno == EINVAL);
+        BOOST_CHECK(db_slab_create(DB_SLAB_MAX_SIZE + 1) == NULL);
+        BOOST_CHECK(db_slab_alloc(NULL) == NULL);
+
+        slab = db_slab_create(DB_SLAB_MAX_SIZE);
+        BOOST_REQUIRE(slab != NULL);
+        BOOST_CHECK(db_slab_alloc(slab) != NULL);
+        db_slab_destroy(slab);
+}
+
+static double elapsed_ns(struct timespec *start)
+{
+        struct timespec end;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (end.tv_sec - start->tv_sec) * 1e9 +
+               (end.tv_nsec - start->tv_nsec);
+}
+
+static long minor_faults(void)
+{
+        struct rusage usage;
+
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_minflt;
+}
+
+/**
+ * @brief Allocate items with small data, then walk them in order.
+ * Item and its data go to the slab caches or to malloc.
+ */
+static void alloc_bench(int use_slab)
+{
+        struct test_item *first = NULL;
+        struct test_item *item = NULL;
+        struct test_item *next = NULL;
+        struct timespec start;
+        void *item_slab = db_slab_create(sizeof(struct test_item));
+        void *data_slab = db_slab_create(32);
+        double alloc_ns = 0;
+        double walk_ns = 0;
+        uint64_t sum = 0;
+        long faults = 0;
+        int i = 0;
+
+        BOOST_REQUIRE(item_slab != NULL && data_slab != NULL);
+
+        faults = minor_faults();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_SLAB_BENCH_COUNT; i++) {
+                if (use_slab) {
+                        item = (struct test_item *)db_slab_alloc(item_slab);
+                        item->data = (uint8_t *)db_slab_alloc(data_slab);
+                } else {
+                        item = (struct test_item *)malloc(sizeof(*item));
+                        item->data = (uint8_t *)malloc(20 + i % 12);
+                }
+                item->data[0] = (uint8_t)i;
+                item->fields[0] = i;
+                item->next = first;
+                first = item;
+        }
+        alloc_ns = elapsed_ns(&start);
+        faults = minor_faults() - faults;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (item = first; item != NULL; item = item->next)
+                sum += item->fields[0] + item->data[0];
+        walk_ns = elapsed_ns(&start);
+
+        BOOST_CHECK(sum != 0);
+        BOOST_TEST_MESSAGE((use_slab ? "Slab" : "Malloc") << ": alloc "
+                           << alloc_ns / DB_SLAB_BENCH_COUNT << " ns, walk "
+                           << walk_ns / DB_SLAB_BENCH_COUNT << " ns, "
+                           << faults << " page faults");
+
+        for (item = first; item != NULL; item = next) {
+                next = item->next;
+                if (!use_slab) {
+                        free(item->data);
+                        free(item);
+                }
+        }
+
+        db_slab_destroy(item_slab);
+        db_slab_destroy(data_slab);
+}
+
+BOOST_AUTO_TEST_CASE(db_slab_bench_test)
+{
+        alloc_bench(0);
+        alloc_bench(1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -10,10 +10,104 @@
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include <string>
 
 #include "common.h"
 #include "db.h"
+#include "db_wal.h"
+#include "db_file.h"
+#include "db_hash.h"
+
+#define DB_BENCH_ITEMS 50000
+#define DB_BLOB_MAX_SEGMENTS 256
+#define DB_TEST_MAX_NODES 4
+
+struct db_fixture {
+        db_fixture()  { remove_files(); }
+        ~db_fixture() { remove_files(); }
+
+        static void remove_files()
+        {
+                const char *types[] = {"key", "val"};
+                char name[64];
+                int i = 0;
+                int t = 0;
+
+                unlink("db_wal.txt");
+                unlink("db_shards.txt");
+                unlink("db_shards.txt.new");
+
+                for (i = 0; i < DB_TEST_MAX_NODES; i++) {
+                        for (t = 0; t < 2; t++) {
+                                sprintf(name, "db_%s_node_%d.txt", types[t], i);
+                                unlink(name);
+                                strcat(name, ".snap");
+                                unlink(name);
+                                strcat(name, ".new");
+                                unlink(name);
+                        }
+                }
+
+                remove_blobs();
+        }
+
+        static void remove_blobs()
+        {
+                char name[64];
+                int i = 0;
+                int n = 0;
+
+                for (n = 0; n < DB_TEST_MAX_NODES; n++) {
+                        for (i = 1; i <= DB_BLOB_MAX_SEGMENTS; i++) {
+                                sprintf(name, "db_blob_node_%d.%d", n, i);
+                                unlink(name);
+                        }
+                }
+        }
+};
+
+static long file_size(const char *name)
+{
+        struct stat st;
+
+        if (stat(name, &st) != 0)
+                return -1;
+
+        return st.st_size;
+}
+
+extern "C" void create_kv_msg(struct s_message *msg, int cmd_type,
+                              const char *key, const char *val)
+{
+        memset(msg, 0, sizeof(struct s_message));
+        msg->sd = -1;
+
+        msg->cmd.type = cmd_type;
+        msg->cmd.key_size = strlen(key) + 1;
+        if (val != NULL)
+                msg->cmd.val_size = strlen(val) + 1;
+        msg->cmd.len = sizeof(msg->cmd) + msg->cmd.key_size + msg->cmd.val_size;
+
+        msg->key = (uint8_t *)malloc(msg->cmd.key_size);
+        BOOST_REQUIRE(msg->key != NULL);
+        memcpy(msg->key, key, msg->cmd.key_size);
+
+        if (val != NULL) {
+                msg->val = (uint8_t *)malloc(msg->cmd.val_size);
+                BOOST_REQUIRE(msg->val != NULL);
+                memcpy(msg->val, val, msg->cmd.val_size);
+        }
+}
 
 extern "C" void create_msg(struct s_message *msg, int cmd_type, int key_only)
 {
@@ -40,7 +134,37 @@ extern "C" void create_msg(struct s_message *msg, int cmd_type, int key_only)
         }
 }
 
-BOOST_AUTO_TEST_SUITE(BOOST_TEST_MODULE)
+/**
+ * @brief Get value by the key through the socket pair.
+ * @return Value size, 0 if the key is not found, -1 on error.
+ */
+static int get_value(const char *key, char *val, uint32_t size)
+{
+        struct s_message msg;
+        struct s_command resp;
+        int sv[2];
+        int rc = -1;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+                return -1;
+
+        create_kv_msg(&msg, DB_CMD_GET, key, NULL);
+        msg.sd = sv[0];
+        db_process_message(&msg);
+
+        if (read(sv[1], &resp, sizeof(resp)) == sizeof(resp) &&
+                        resp.val_size < size &&
+                        read(sv[1], val, resp.val_size) ==
+                                (ssize_t)resp.val_size)
+                rc = resp.val_size;
+
+        close(sv[0]);
+        close(sv[1]);
+
+        return rc;
+}
+
+BOOST_FIXTURE_TEST_SUITE(BOOST_TEST_MODULE, db_fixture)
 
 BOOST_AUTO_TEST_CASE(db_init_release_test)
 {
@@ -62,12 +186,12 @@ BOOST_AUTO_TEST_CASE(db_init_release_test)
         db_release();
 
         file = fopen("db_key_node_0.txt", "r");
-        BOOST_CHECK(file == NULL);
+        BOOST_CHECK(file != NULL);
         if (file != NULL)
                 fclose(file);
 
         file = fopen("db_val_node_0.txt", "r");
-        BOOST_CHECK(file == NULL);
+        BOOST_CHECK(file != NULL);
         if (file != NULL)
                 fclose(file);
 }
@@ -77,25 +201,30 @@ BOOST_AUTO_TEST_CASE(db_put_test)
         int fd = -1;
         const int size = 64;
         char rbuf[size];
+        char key[size];
+        char val[size];
         struct s_message msg;
         int rc = db_init(1);
         BOOST_REQUIRE(rc == 0);
 
+        /* Small key and value are copied into items and freed */
         create_msg(&msg, DB_CMD_PUT, 0);
+        memcpy(key, msg.key, msg.cmd.key_size);
+        memcpy(val, msg.val, msg.cmd.val_size);
         db_process_message(&msg);
 
         fd = open("db_key_node_0.txt", O_RDONLY);
         BOOST_REQUIRE(fd != -1);
-        rc = pread(fd, rbuf, msg.cmd.key_size, 3*sizeof(uint32_t));
+        rc = pread(fd, rbuf, msg.cmd.key_size, DB_FILE_DATA_OFFSET + 20);
         BOOST_CHECK(rc == (int)msg.cmd.key_size);
-        BOOST_CHECK(memcmp(msg.key, rbuf, msg.cmd.key_size) == 0);
+        BOOST_CHECK(memcmp(key, rbuf, msg.cmd.key_size) == 0);
         close(fd);
 
         fd = open("db_val_node_0.txt", O_RDONLY);
         BOOST_REQUIRE(fd != -1);
-        rc = pread(fd, rbuf, msg.cmd.val_size, sizeof(uint32_t));
+        rc = pread(fd, rbuf, msg.cmd.val_size, DB_FILE_DATA_OFFSET + 8);
         BOOST_CHECK(rc == (int)msg.cmd.val_size);
-        BOOST_CHECK(memcmp(msg.val, rbuf, msg.cmd.val_size) == 0);
+        BOOST_CHECK(memcmp(val, rbuf, msg.cmd.val_size) == 0);
         close(fd);
 
         db_release();
@@ -119,17 +248,2520 @@ BOOST_AUTO_TEST_CASE(db_erase_test)
 
         fd = open("db_key_node_0.txt", O_RDONLY);
         BOOST_REQUIRE(fd != -1);
-        rc = pread(fd, rbuf, msg_put.cmd.key_size, 3*sizeof(uint32_t));
+        rc = pread(fd, rbuf, msg_put.cmd.key_size, DB_FILE_DATA_OFFSET + 20);
         BOOST_CHECK(rc == 0);
         close(fd);
 
         fd = open("db_val_node_0.txt", O_RDONLY);
         BOOST_REQUIRE(fd != -1);
-        rc = pread(fd, rbuf, msg_put.cmd.val_size, sizeof(uint32_t));
+        rc = pread(fd, rbuf, msg_put.cmd.val_size, DB_FILE_DATA_OFFSET + 8);
         BOOST_CHECK(rc == 0);
         close(fd);
 
         db_release();
 }
 
+BOOST_AUTO_TEST_CASE(db_recovery_test)
+{
+        struct s_message msg;
+        int rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+
+        create_kv_msg(&msg, DB_CMD_PUT, "key1", "shared value");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key2", "shared value");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key3", "own value");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_ERASE, "key3", NULL);
+        db_process_message(&msg);
+
+        db_release();
+
+        rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+
+        /* Value is still referred by key2 */
+        create_kv_msg(&msg, DB_CMD_ERASE, "key1", NULL);
+        db_process_message(&msg);
+        BOOST_CHECK(file_size("db_key_node_0.txt") > DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") > DB_FILE_DATA_OFFSET);
+
+        create_kv_msg(&msg, DB_CMD_ERASE, "key2", NULL);
+        db_process_message(&msg);
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_replay_test)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        pid_t pid = 0;
+        int status = 0;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = DB_WAL_SYNC;
+
+        /* Child dies without db_release(), node files are not written */
+        pid = fork();
+        BOOST_REQUIRE(pid >= 0);
+        if (pid == 0) {
+                if (db_init_options(1, &opts) != 0)
+                        _exit(1);
+
+                create_kv_msg(&msg, DB_CMD_PUT, "key1", "value");
+                db_process_message(&msg);
+                create_kv_msg(&msg, DB_CMD_PUT, "key2", "value");
+                db_process_message(&msg);
+                create_kv_msg(&msg, DB_CMD_ERASE, "key1", NULL);
+                db_process_message(&msg);
+
+                _exit(file_size("db_key_node_0.txt") ==
+                      DB_FILE_DATA_OFFSET ? 0 : 2);
+        }
+
+        BOOST_REQUIRE(waitpid(pid, &status, 0) == pid);
+        BOOST_REQUIRE(WIFEXITED(status));
+        BOOST_CHECK(WEXITSTATUS(status) == 0);
+        BOOST_CHECK(file_size("db_wal.txt") > 0);
+
+        rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(file_size("db_key_node_0.txt") > DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") > DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_wal.txt") == -1);
+
+        create_kv_msg(&msg, DB_CMD_ERASE, "key2", NULL);
+        db_process_message(&msg);
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_checkpoint_test)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = DB_WAL_INTERVAL;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        create_kv_msg(&msg, DB_CMD_PUT, "key1", "value");
+        db_process_message(&msg);
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") > DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_wal.txt") == 0);
+
+        rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+        create_kv_msg(&msg, DB_CMD_ERASE, "key1", NULL);
+        db_process_message(&msg);
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        db_release();
+}
+
+static void backend_test(int backend)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.file_backend = backend;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        create_kv_msg(&msg, DB_CMD_PUT, "key1", "value");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key2", "value");
+        db_process_message(&msg);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") ==
+                    DB_FILE_DATA_OFFSET + 2 * (20 + 5));
+        BOOST_CHECK(file_size("db_val_node_0.txt") ==
+                    DB_FILE_DATA_OFFSET + 8 + 6);
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        create_kv_msg(&msg, DB_CMD_ERASE, "key1", NULL);
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_ERASE, "key2", NULL);
+        db_process_message(&msg);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+}
+
+BOOST_AUTO_TEST_CASE(db_mmap_backend_test)
+{
+        backend_test(DB_FILE_BACKEND_MMAP);
+}
+
+BOOST_AUTO_TEST_CASE(db_uring_backend_test)
+{
+        backend_test(DB_FILE_BACKEND_URING);
+}
+
+static void write_v1_record(int fd, uint32_t *offset, const uint32_t *hdr,
+                            int hdr_count, const char *data)
+{
+        uint32_t buf[3];
+        uint32_t size = strlen(data) + 1;
+        int i = 0;
+
+        buf[0] = htonl((hdr_count + 1) * sizeof(uint32_t) + size);
+        for (i = 0; i < hdr_count; i++)
+                buf[i + 1] = htonl(hdr[i]);
+
+        BOOST_REQUIRE(pwrite(fd, buf, (hdr_count + 1) * sizeof(uint32_t),
+                             *offset) > 0);
+        *offset += (hdr_count + 1) * sizeof(uint32_t);
+        BOOST_REQUIRE(pwrite(fd, data, size, *offset) == (ssize_t)size);
+        *offset += size;
+}
+
+BOOST_AUTO_TEST_CASE(db_v1_upgrade_test)
+{
+        struct s_message msg;
+        uint32_t key_off = 0;
+        uint32_t val_off = 0;
+        uint32_t ref[2];
+        int key_fd = -1;
+        int val_fd = -1;
+        int rc = 0;
+
+        key_fd = open("db_key_node_0.txt", O_RDWR | O_CREAT, 0640);
+        val_fd = open("db_val_node_0.txt", O_RDWR | O_CREAT, 0640);
+        BOOST_REQUIRE(key_fd != -1 && val_fd != -1);
+
+        write_v1_record(val_fd, &val_off, NULL, 0, "value1");
+        ref[0] = 0;
+        ref[1] = val_off;
+        write_v1_record(val_fd, &val_off, NULL, 0, "value2");
+
+        write_v1_record(key_fd, &key_off, ref, 2, "key2");
+        ref[1] = 0;
+        write_v1_record(key_fd, &key_off, ref, 2, "key1");
+        close(key_fd);
+        close(val_fd);
+
+        rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(file_size("db_key_node_0.txt") ==
+                    DB_FILE_DATA_OFFSET + 2 * (20 + 5));
+        BOOST_CHECK(file_size("db_val_node_0.txt") ==
+                    DB_FILE_DATA_OFFSET + 2 * (8 + 7));
+        db_release();
+
+        /* References survive the rewrite and the next load */
+        rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+        create_kv_msg(&msg, DB_CMD_ERASE, "key1", NULL);
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_ERASE, "key2", NULL);
+        db_process_message(&msg);
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+        db_release();
+}
+
+/**
+ * @brief Leave every fourth of the first 240 keys, compact node files
+ * and check values of the rest keys.
+ */
+static void compact_test(int wal_mode, uint32_t bloom_bits)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char key[32];
+        char val[128];
+        char buf[128];
+        long key_size = 0;
+        long val_size = 0;
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = wal_mode;
+        opts.bloom_bits = bloom_bits;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 300; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%0100d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        for (i = 0; i < 240; i++) {
+                if (i % 4 == 0)
+                        continue;
+                sprintf(key, "key:%d", i);
+                create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+                db_process_message(&msg);
+        }
+
+        db_release();
+
+        key_size = file_size("db_key_node_0.txt");
+        val_size = file_size("db_val_node_0.txt");
+
+        opts.compact_rate = 64 << 20;
+        opts.compact_free_pct = 10;
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        /* Compaction starts at once and takes few steps */
+        usleep(500000);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") < key_size / 2);
+        BOOST_CHECK(file_size("db_val_node_0.txt") < val_size / 2);
+
+        opts.compact_rate = 0;
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 300; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%0100d", i, i);
+                rc = get_value(key, buf, sizeof(buf));
+
+                if (i < 240 && i % 4 != 0) {
+                        BOOST_CHECK(rc == 0);
+                } else {
+                        BOOST_CHECK(rc == (int)strlen(val) + 1);
+                        BOOST_CHECK(strcmp(buf, val) == 0);
+                }
+        }
+
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_compact_test)
+{
+        compact_test(DB_WAL_NONE, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_compact_wal_test)
+{
+        compact_test(DB_WAL_INTERVAL, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_compact_bloom_test)
+{
+        compact_test(DB_WAL_NONE, 16);
+}
+
+/**
+ * @brief Measure PUT latency, while values are moved by compaction.
+ * Only stripes of the keys of moved values are locked, so PUT does not
+ * wait for a walk of all keys.
+ */
+BOOST_AUTO_TEST_CASE(db_compact_latency_test)
+{
+        struct s_db_options opts;
+        struct timespec start, end, now;
+        struct s_message msg;
+        char key[32];
+        char val[128];
+        char buf[128];
+        double total = 0;
+        double max = 0;
+        double ns = 0;
+        long val_size = 0;
+        int count = 0;
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%0100d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                if (i % 4 == 0)
+                        continue;
+                sprintf(key, "key:%d", i);
+                create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+                db_process_message(&msg);
+        }
+
+        db_release();
+        val_size = file_size("db_val_node_0.txt");
+
+        opts.compact_rate = 4 << 20;
+        opts.compact_free_pct = 10;
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        /* Few keys and values, so the files grow little */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        do {
+                sprintf(key, "new:%d", count % 1000);
+                sprintf(val, "new:%d:%0100d", count % 2000, count % 2000);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                db_process_message(&msg);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                ns  = (end.tv_sec - start.tv_sec) * 1e9;
+                ns += end.tv_nsec - start.tv_nsec;
+                total += ns;
+                max = (ns > max) ? ns : max;
+                count++;
+        } while (end.tv_sec - now.tv_sec < 2);
+
+        db_release();
+
+        BOOST_TEST_MESSAGE("PUT under compaction: " << count << " puts, avg "
+                           << total / count / 1000 << " us, max "
+                           << max / 1000 << " us");
+        BOOST_CHECK(file_size("db_val_node_0.txt") < val_size / 2);
+
+        /* PUT waits at most for one step of 100 ms */
+        BOOST_CHECK(max < 100e6);
+
+        opts.compact_rate = 0;
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS; i += 4) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%0100d", i, i);
+                rc = get_value(key, buf, sizeof(buf));
+                BOOST_CHECK(rc == (int)strlen(val) + 1);
+                BOOST_CHECK(strcmp(buf, val) == 0);
+        }
+
+        db_release();
+}
+
+/**
+ * @brief Put keys, every third key shares the value with the next one.
+ * Erase every fifth key.
+ */
+static void snapshot_fill(int count)
+{
+        struct s_message msg;
+        char key[32];
+        char val[64];
+        int i = 0;
+
+        for (i = 0; i < count; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d", i - (i % 3 == 1));
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        for (i = 0; i < count; i += 5) {
+                sprintf(key, "key:%d", i);
+                create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+                db_process_message(&msg);
+        }
+}
+
+/**
+ * @brief Check values left by snapshot_fill() and erase all keys.
+ * Node files must be empty after that.
+ */
+static void snapshot_check(int count)
+{
+        struct s_message msg;
+        char key[32];
+        char val[64];
+        char buf[64];
+        int rc = 0;
+        int i = 0;
+
+        for (i = 0; i < count; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d", i - (i % 3 == 1));
+                rc = get_value(key, buf, sizeof(buf));
+
+                if (i % 5 == 0) {
+                        BOOST_CHECK(rc == 0);
+                } else {
+                        BOOST_CHECK(rc == (int)strlen(val) + 1);
+                        BOOST_CHECK(strcmp(buf, val) == 0);
+                }
+        }
+
+        for (i = 0; i < count; i++) {
+                sprintf(key, "key:%d", i);
+                create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+                db_process_message(&msg);
+        }
+}
+
+BOOST_AUTO_TEST_CASE(db_snapshot_test)
+{
+        struct s_db_options opts;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.snapshot = 1;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        snapshot_fill(200);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt.snap") > 0);
+        BOOST_CHECK(file_size("db_val_node_0.txt.snap") > 0);
+
+        /* Without the log, snapshots are dropped until release */
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(file_size("db_key_node_0.txt.snap") == -1);
+        BOOST_CHECK(file_size("db_val_node_0.txt.snap") == -1);
+
+        /* Lacunes of the snapshot are reused, the files are cut */
+        snapshot_check(200);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+}
+
+/**
+ * @brief Missing, erased and present keys with Bloom filters of key nodes,
+ * before and after restart.
+ */
+static void bloom_test(int snapshot)
+{
+        struct s_db_options opts;
+        char key[32];
+        char buf[64];
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.snapshot = snapshot;
+        opts.bloom_bits = 16;
+
+        rc = db_init_options(DB_TEST_MAX_NODES, &opts);
+        BOOST_REQUIRE(rc == 0);
+        snapshot_fill(3000);
+
+        for (i = 3000; i < 6000; i++) {
+                sprintf(key, "key:%d", i);
+                BOOST_CHECK(get_value(key, buf, sizeof(buf)) == 0);
+        }
+        db_release();
+
+        rc = db_init_options(DB_TEST_MAX_NODES, &opts);
+        BOOST_REQUIRE(rc == 0);
+        snapshot_check(3000);
+
+        for (i = 0; i < 6000; i++) {
+                sprintf(key, "key:%d", i);
+                BOOST_CHECK(get_value(key, buf, sizeof(buf)) == 0);
+        }
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_test)
+{
+        bloom_test(0);
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_snapshot_test)
+{
+        bloom_test(1);
+}
+
+BOOST_AUTO_TEST_CASE(db_snapshot_wal_test)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char buf[64];
+        pid_t pid = 0;
+        int status = 0;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = DB_WAL_SYNC;
+        opts.snapshot = 1;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        snapshot_fill(200);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt.snap") > 0);
+        BOOST_CHECK(file_size("db_val_node_0.txt.snap") > 0);
+
+        /* Child dies after the snapshot is loaded, the log is not empty */
+        pid = fork();
+        BOOST_REQUIRE(pid >= 0);
+        if (pid == 0) {
+                if (db_init_options(1, &opts) != 0)
+                        _exit(1);
+
+                create_kv_msg(&msg, DB_CMD_PUT, "new key", "new value");
+                db_process_message(&msg);
+                _exit(0);
+        }
+
+        BOOST_REQUIRE(waitpid(pid, &status, 0) == pid);
+        BOOST_REQUIRE(WIFEXITED(status));
+        BOOST_CHECK(WEXITSTATUS(status) == 0);
+        BOOST_CHECK(file_size("db_wal.txt") > 0);
+
+        /* Snapshot is stale, node files are scanned */
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(get_value("new key", buf, sizeof(buf)) == 10);
+        BOOST_CHECK(strcmp(buf, "new value") == 0);
+        db_release();
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(get_value("new key", buf, sizeof(buf)) == 10);
+        create_kv_msg(&msg, DB_CMD_ERASE, "new key", NULL);
+        db_process_message(&msg);
+        snapshot_check(200);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+}
+
+BOOST_AUTO_TEST_CASE(db_snapshot_broken_test)
+{
+        struct s_db_options opts;
+        int fd = -1;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.snapshot = 1;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        snapshot_fill(200);
+        db_release();
+
+        /* Cut the item list, the node files are scanned */
+        fd = open("db_key_node_0.txt.snap", O_WRONLY);
+        BOOST_REQUIRE(fd != -1);
+        BOOST_REQUIRE(ftruncate(fd, file_size("db_key_node_0.txt.snap") / 2) == 0);
+        close(fd);
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(file_size("db_key_node_0.txt.snap") == -1);
+        snapshot_check(200);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+}
+
+static void *list_thread(void *arg)
+{
+        db_process_message((struct s_message *)arg);
+        return NULL;
+}
+
+/**
+ * @brief Count values sent by LIST.
+ * Responses may not fit the socket buffer, so they are read at once.
+ */
+static int list_count()
+{
+        struct s_message msg;
+        struct s_command resp;
+        pthread_t thread;
+        char buf[256];
+        int count = 0;
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+                return -1;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.sd = sv[0];
+        msg.cmd.type = DB_CMD_LIST;
+        msg.cmd.len = sizeof(msg.cmd);
+
+        /* No test macros, LIST is also counted by other threads */
+        if (pthread_create(&thread, NULL, list_thread, &msg) != 0) {
+                close(sv[0]);
+                close(sv[1]);
+                return -1;
+        }
+
+        while (read(sv[1], &resp, sizeof(resp)) == sizeof(resp) &&
+                        resp.val_size != 0 && resp.val_size <= sizeof(buf) &&
+                        recv(sv[1], buf, resp.val_size, MSG_WAITALL) ==
+                                (ssize_t)resp.val_size)
+                count++;
+
+        pthread_join(thread, NULL);
+        close(sv[0]);
+        close(sv[1]);
+
+        return count;
+}
+
+/**
+ * @brief Get keys and values sent by SCAN.
+ * @param start Start of the range, without the terminating zero.
+ * @param end End of the range, without the terminating zero.
+ * @param pairs Pairs "key=value" separated by spaces.
+ * @return Count of pairs.
+ */
+static int scan_keys(const char *start, const char *end, uint32_t limit,
+                     std::string &pairs)
+{
+        struct s_message msg;
+        struct s_command resp;
+        pthread_t thread;
+        char key[256];
+        char val[256];
+        int count = 0;
+        int sv[2];
+
+        pairs.clear();
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+                return -1;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.sd = sv[0];
+        msg.cmd.type = DB_CMD_SCAN;
+        msg.cmd.key_size = strlen(start);
+        msg.cmd.val_size = DB_SCAN_LIMIT_SIZE + strlen(end);
+        msg.cmd.len = sizeof(msg.cmd) + msg.cmd.key_size + msg.cmd.val_size;
+        msg.key = (uint8_t *)malloc(msg.cmd.key_size + 1);
+        msg.val = (uint8_t *)malloc(msg.cmd.val_size);
+        BOOST_REQUIRE(msg.key != NULL && msg.val != NULL);
+        memcpy(msg.key, start, msg.cmd.key_size);
+        limit = htonl(limit);
+        memcpy(msg.val, &limit, DB_SCAN_LIMIT_SIZE);
+        memcpy(&msg.val[DB_SCAN_LIMIT_SIZE], end, strlen(end));
+        BOOST_REQUIRE(pthread_create(&thread, NULL, list_thread, &msg) == 0);
+
+        while (read(sv[1], &resp, sizeof(resp)) == sizeof(resp) &&
+                        resp.key_size != 0 && resp.key_size <= sizeof(key) &&
+                        resp.val_size <= sizeof(val) &&
+                        recv(sv[1], key, resp.key_size, MSG_WAITALL) ==
+                                (ssize_t)resp.key_size &&
+                        recv(sv[1], val, resp.val_size, MSG_WAITALL) ==
+                                (ssize_t)resp.val_size) {
+                if (count++ != 0)
+                        pairs += " ";
+                pairs += std::string(key, resp.key_size - 1) + "=" +
+                         std::string(val, resp.val_size - 1);
+        }
+
+        pthread_join(thread, NULL);
+        close(sv[0]);
+        close(sv[1]);
+
+        return count;
+}
+
+static void scan_test(uint32_t node_count, int snapshot)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        std::string pairs;
+        char key[32];
+        char val[128];
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.snapshot = snapshot;
+        opts.inline_size = 16;
+
+        BOOST_REQUIRE(db_init_options(node_count, &opts) == 0);
+        for (i = 0; i < 100; i++) {
+                sprintf(key, "key:%d", i);
+                if (i % 2)
+                        sprintf(val, "v%d", i);
+                else
+                        sprintf(val, "shared value, not inline %d", i % 4);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+        create_kv_msg(&msg, DB_CMD_PUT, "a", "first");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "z", "last");
+        db_process_message(&msg);
+
+        /* Keys are merged in byte order, the shorter key goes first */
+        BOOST_CHECK(scan_keys("key:1", "key:2", 0, pairs) == 11);
+        BOOST_CHECK(pairs.compare(0, 30, "key:1=v1 key:10=shared value, ") == 0);
+        BOOST_CHECK(pairs.find("key:19=v19") != std::string::npos);
+        BOOST_CHECK(pairs.find("key:2") == std::string::npos);
+
+        BOOST_CHECK(scan_keys("", "", 3, pairs) == 3);
+        BOOST_CHECK(pairs == "a=first key:0=shared value, not inline 0 key:1=v1");
+        BOOST_CHECK(scan_keys("key:99", "", 0, pairs) == 2);
+        BOOST_CHECK(pairs == "key:99=v99 z=last");
+        BOOST_CHECK(scan_keys("key:5", "key:50", 0, pairs) == 1);
+        BOOST_CHECK(scan_keys("y", "", 0, pairs) == 1);
+        BOOST_CHECK(scan_keys("zz", "", 0, pairs) == 0);
+        BOOST_CHECK(scan_keys("", "", 0, pairs) == 102);
+        db_release();
+
+        /* Order is restored on load */
+        BOOST_REQUIRE(db_init_options(node_count, &opts) == 0);
+        BOOST_CHECK(scan_keys("key:1", "key:2", 0, pairs) == 11);
+        BOOST_CHECK(pairs.compare(0, 8, "key:1=v1") == 0);
+
+        create_kv_msg(&msg, DB_CMD_ERASE, "key:1", NULL);
+        db_process_message(&msg);
+        BOOST_CHECK(scan_keys("key:1", "key:2", 1, pairs) == 1);
+        BOOST_CHECK(pairs.compare(0, 7, "key:10=") == 0);
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_scan_test)
+{
+        scan_test(1, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_scan_nodes_test)
+{
+        scan_test(DB_TEST_MAX_NODES, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_scan_snapshot_test)
+{
+        scan_test(DB_TEST_MAX_NODES, 1);
+}
+
+static void *list_count_thread(void *arg)
+{
+        *(int *)arg = list_count();
+        return NULL;
+}
+
+BOOST_AUTO_TEST_CASE(db_list_parallel_test)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        pthread_t threads[8];
+        int counts[8];
+        char key[32];
+        char val[64];
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.inline_size = 16;
+        opts.list_threads = 4;
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+
+        /* Inline values, shared ones and one value of 100 keys */
+        for (i = 0; i < 1000; i++) {
+                sprintf(key, "key:%d", i);
+                if (i % 2)
+                        sprintf(val, "v:%d", i);
+                else if (i % 10)
+                        sprintf(val, "value:%d:%040d", i, i);
+                else
+                        sprintf(val, "same:%040d", 0);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        BOOST_CHECK(list_count() == 500 + 400 + 1);
+
+        /* Each LIST has its own iterators, LISTs over the limit wait */
+        for (i = 0; i < 8; i++)
+                BOOST_REQUIRE(pthread_create(&threads[i], NULL,
+                                             list_count_thread,
+                                             &counts[i]) == 0);
+        for (i = 0; i < 8; i++) {
+                pthread_join(threads[i], NULL);
+                BOOST_CHECK(counts[i] == 500 + 400 + 1);
+        }
+
+        db_release();
+}
+
+static int copy_file(const char *from, const char *to)
+{
+        char buf[4096];
+        ssize_t n = 0;
+        int rc = 0;
+        int in = open(from, O_RDONLY);
+        int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        while (in >= 0 && out >= 0 && (n = read(in, buf, sizeof(buf))) > 0)
+                if (write(out, buf, n) != n)
+                        rc = -1;
+
+        if (in < 0 || out < 0 || n < 0)
+                rc = -1;
+        if (in >= 0)
+                close(in);
+        if (out >= 0)
+                close(out);
+
+        return rc;
+}
+
+static void rehome_check(int count)
+{
+        char key[32];
+        char val[64];
+        char exp[64];
+        int i = 0;
+
+        for (i = 0; i < count; i++) {
+                sprintf(key, "user:%d:v", i);
+                if (i % 2)
+                        sprintf(exp, "v%d", i);
+                else
+                        sprintf(exp, "shared value, not inline %d", i % 4);
+                BOOST_CHECK(get_value(key, val, sizeof(val)) ==
+                            (int)strlen(exp) + 1);
+                BOOST_CHECK(strcmp(val, exp) == 0);
+        }
+
+        BOOST_CHECK(list_count() == count / 2 + 2);
+}
+
+BOOST_AUTO_TEST_CASE(db_rehome_test)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char key[32];
+        char val[64];
+        char name[64];
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.inline_size = 16;
+
+        /* All keys are in one node */
+        BOOST_REQUIRE(db_init_options(1, &opts) == 0);
+        for (i = 0; i < 200; i++) {
+                sprintf(key, "user:%d:v", i);
+                if (i % 2)
+                        sprintf(val, "v%d", i);
+                else
+                        sprintf(val, "shared value, not inline %d", i % 4);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+        db_release();
+        BOOST_REQUIRE(copy_file("db_key_node_0.txt", "db_key_node_0.txt.bak")
+                      == 0);
+
+        /* Keys go to their nodes, values are found by reference */
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+        BOOST_CHECK(db_reshard_wait() == DB_TEST_MAX_NODES);
+        rehome_check(200);
+        db_release();
+
+        for (i = 0; i < DB_TEST_MAX_NODES; i++) {
+                sprintf(name, "db_key_node_%d.txt", i);
+                BOOST_CHECK(file_size(name) > 0);
+        }
+
+        /* Move broken by crash: keys are in both nodes */
+        BOOST_REQUIRE(rename("db_key_node_0.txt.bak", "db_key_node_0.txt")
+                      == 0);
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+        rehome_check(200);
+
+        create_kv_msg(&msg, DB_CMD_ERASE, "user:0:v", NULL);
+        db_process_message(&msg);
+        db_release();
+
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+        BOOST_CHECK(get_value("user:0:v", val, sizeof(val)) == 0);
+        BOOST_CHECK(get_value("user:2:v", val, sizeof(val)) > 0);
+        db_release();
+}
+
+#define RESHARD_KEYS 2000
+
+static void reshard_value(int i, char *val)
+{
+        if (i % 3 == 0)
+                sprintf(val, "shared value of resharding %d", i % 7);
+        else if (i % 2)
+                sprintf(val, "v%d", i);
+        else
+                sprintf(val, "long value of resharding key %d", i);
+}
+
+static void reshard_put(int i)
+{
+        struct s_message msg;
+        char key[32];
+        char val[64];
+
+        sprintf(key, "reshard:%d", i);
+        reshard_value(i, val);
+        create_kv_msg(&msg, DB_CMD_PUT, key, val);
+        db_process_message(&msg);
+}
+
+/**
+ * @brief Check values of all keys, every 10th key is erased, if asked.
+ * @return Count of bad values.
+ */
+static int reshard_check(int erased)
+{
+        char key[32];
+        char val[64];
+        char exp[64];
+        int bad = 0;
+        int rc = 0;
+        int i = 0;
+
+        for (i = 0; i < RESHARD_KEYS; i++) {
+                sprintf(key, "reshard:%d", i);
+                reshard_value(i, exp);
+                rc = get_value(key, val, sizeof(val));
+                if (erased && i % 10 == 1)
+                        bad += (rc != 0);
+                else
+                        bad += (rc != (int)strlen(exp) + 1 ||
+                                strcmp(val, exp) != 0);
+        }
+
+        return bad;
+}
+
+/**
+ * @brief Serve requests, while the nodes are resharded.
+ * Every 10th key is erased and put again. Shared values are left,
+ * they are put once more to their new nodes.
+ * @return Count of bad values.
+ */
+static int reshard_serve()
+{
+        struct s_message msg;
+        char key[32];
+        int i = 0;
+
+        for (i = 0; i < RESHARD_KEYS; i += 10) {
+                if (i % 3 == 0)
+                        continue;
+                sprintf(key, "reshard:%d", i);
+                create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+                db_process_message(&msg);
+                reshard_put(i);
+        }
+
+        return reshard_check(0);
+}
+
+static void reshard_test(int wal_mode)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char key[32];
+        char name[64];
+        uint32_t stored = 0;
+        int count = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = wal_mode;
+        opts.inline_size = 16;
+
+        BOOST_CHECK(db_get_stored_node_count(&stored) == -1 &&
+                    errno == ENOENT);
+        BOOST_REQUIRE(db_init_options(1, &opts) == 0);
+        for (i = 0; i < RESHARD_KEYS; i++)
+                reshard_put(i);
+        count = list_count();
+
+        BOOST_CHECK(db_reshard(0) == -1 && errno == EINVAL);
+        BOOST_CHECK(db_reshard(DB_MAX_NODES + 1) == -1 && errno == EINVAL);
+
+        /* Split: keys move to new nodes, values stay */
+        BOOST_REQUIRE(db_reshard(DB_TEST_MAX_NODES) == 0);
+        BOOST_CHECK(reshard_serve() == 0);
+        BOOST_CHECK(db_reshard_wait() == DB_TEST_MAX_NODES);
+        BOOST_CHECK(reshard_check(0) == 0);
+        BOOST_CHECK(list_count() == count);
+        BOOST_CHECK(db_reshard(DB_TEST_MAX_NODES) == 0);
+
+        for (i = 0; i < DB_TEST_MAX_NODES; i++) {
+                sprintf(name, "db_key_node_%d.txt", i);
+                BOOST_CHECK(file_size(name) > 0);
+        }
+
+        /* Merge: keys and values leave removed nodes */
+        BOOST_REQUIRE(db_reshard(2) == 0);
+        BOOST_CHECK(reshard_serve() == 0);
+        for (i = 1; i < RESHARD_KEYS; i += 10) {
+                sprintf(key, "reshard:%d", i);
+                create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+                db_process_message(&msg);
+        }
+        BOOST_CHECK(db_reshard_wait() == 2);
+        BOOST_CHECK(reshard_check(1) == 0);
+
+        for (i = 2; i < DB_TEST_MAX_NODES; i++) {
+                sprintf(name, "db_key_node_%d.txt", i);
+                BOOST_CHECK(file_size(name) == -1);
+                sprintf(name, "db_val_node_%d.txt", i);
+                BOOST_CHECK(file_size(name) == -1);
+        }
+        db_release();
+
+        /* Map is stored */
+        BOOST_CHECK(db_get_stored_node_count(&stored) == 0 && stored == 2);
+        BOOST_REQUIRE(db_init_options(2, &opts) == 0);
+        BOOST_CHECK(reshard_check(1) == 0);
+        db_release();
+
+        /* Stopped resharding is resumed, then the given count is taken */
+        BOOST_REQUIRE(db_init_options(2, &opts) == 0);
+        BOOST_REQUIRE(db_reshard(1) == 0);
+        db_release();
+
+        BOOST_CHECK(db_get_stored_node_count(&stored) == 0 && stored == 1);
+        BOOST_REQUIRE(db_init_options(3, &opts) == 0);
+        BOOST_CHECK(reshard_check(1) == 0);
+        BOOST_CHECK(db_reshard_wait() == 3);
+        BOOST_CHECK(reshard_check(1) == 0);
+        BOOST_CHECK(file_size("db_key_node_2.txt") > 0);
+        BOOST_CHECK(file_size("db_key_node_3.txt") == -1);
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_reshard_test)
+{
+        reshard_test(DB_WAL_NONE);
+}
+
+BOOST_AUTO_TEST_CASE(db_reshard_wal_test)
+{
+        reshard_test(DB_WAL_INTERVAL);
+}
+
+BOOST_AUTO_TEST_CASE(db_reshard_msg_test)
+{
+        struct s_message msg;
+        struct s_command resp;
+        uint32_t count = htonl(2);
+        char buf[64];
+        int sv[2];
+
+        BOOST_REQUIRE(db_init(1) == 0);
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.sd = sv[0];
+        msg.cmd.type = DB_CMD_RESHARD;
+        msg.cmd.val_size = DB_RESHARD_SIZE;
+        msg.cmd.len = sizeof(msg.cmd) + msg.cmd.val_size;
+        msg.val = (uint8_t *)malloc(DB_RESHARD_SIZE);
+        memcpy(msg.val, &count, sizeof(count));
+        db_process_message(&msg);
+
+        BOOST_REQUIRE(read(sv[1], &resp, sizeof(resp)) == sizeof(resp));
+        BOOST_REQUIRE(resp.val_size < sizeof(buf));
+        BOOST_REQUIRE(read(sv[1], buf, resp.val_size) ==
+                      (ssize_t)resp.val_size);
+        BOOST_CHECK(strcmp(buf, "2") == 0);
+        BOOST_REQUIRE(read(sv[1], &resp, sizeof(resp)) == sizeof(resp));
+        BOOST_CHECK(resp.val_size == 0);
+
+        close(sv[0]);
+        close(sv[1]);
+        BOOST_CHECK(db_reshard_wait() == 2);
+        db_release();
+}
+
+static void inline_test(int wal_mode, int snapshot)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char val[128];
+        char buf[128];
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = wal_mode;
+        opts.snapshot = snapshot;
+        opts.inline_size = 64;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        snapshot_fill(200);
+        db_release();
+
+        /* Small values are only in the key node */
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(list_count() == 160);
+
+        /* Inline value is replaced by the shared one and back */
+        sprintf(val, "%0100d", 1);
+        create_kv_msg(&msg, DB_CMD_PUT, "key:1", val);
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key:2", val);
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key:2", "value:2");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key:3", "longer value:3");
+        db_process_message(&msg);
+        BOOST_CHECK(list_count() == 160);
+        db_release();
+
+        BOOST_CHECK(file_size("db_val_node_0.txt") > DB_FILE_DATA_OFFSET);
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        BOOST_CHECK(get_value("key:1", buf, sizeof(buf)) == 101);
+        BOOST_CHECK(strcmp(buf, val) == 0);
+        BOOST_CHECK(get_value("key:3", buf, sizeof(buf)) == 15);
+        BOOST_CHECK(strcmp(buf, "longer value:3") == 0);
+
+        create_kv_msg(&msg, DB_CMD_PUT, "key:1", "value:0");
+        db_process_message(&msg);
+        create_kv_msg(&msg, DB_CMD_PUT, "key:3", "value:3");
+        db_process_message(&msg);
+        snapshot_check(200);
+        db_release();
+
+        BOOST_CHECK(file_size("db_key_node_0.txt") == DB_FILE_DATA_OFFSET);
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+}
+
+BOOST_AUTO_TEST_CASE(db_inline_test)
+{
+        inline_test(DB_WAL_NONE, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_inline_wal_test)
+{
+        inline_test(DB_WAL_SYNC, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_inline_snapshot_test)
+{
+        inline_test(DB_WAL_INTERVAL, 1);
+}
+
+static long blob_files_size()
+{
+        char name[64];
+        long size = 0;
+        long total = 0;
+        int i = 0;
+
+        for (i = 1; i <= DB_BLOB_MAX_SEGMENTS; i++) {
+                sprintf(name, "db_blob_node_0.%d", i);
+                size = file_size(name);
+                if (size > 0)
+                        total += size;
+        }
+
+        return total;
+}
+
+/**
+ * @brief Value of given size, filled by the item number.
+ */
+static char *blob_value(int num, int size)
+{
+        char *val = (char *)malloc(size);
+        BOOST_REQUIRE(val != NULL);
+
+        memset(val, 'a' + num % 26, size - 1);
+        sprintf(val, "%d:", num);
+        val[strlen(val)] = 'x';
+        val[size - 1] = '\0';
+
+        return val;
+}
+
+static void blob_put(int num, int size)
+{
+        struct s_message msg;
+        char key[32];
+        char *val = blob_value(num, size);
+
+        sprintf(key, "key:%d", num);
+        create_kv_msg(&msg, DB_CMD_PUT, key, val);
+        db_process_message(&msg);
+        free(val);
+}
+
+static void blob_erase(int num)
+{
+        struct s_message msg;
+        char key[32];
+
+        sprintf(key, "key:%d", num);
+        create_kv_msg(&msg, DB_CMD_ERASE, key, NULL);
+        db_process_message(&msg);
+}
+
+static int blob_check(int num, int size)
+{
+        char key[32];
+        char *val = blob_value(num, size);
+        char *buf = (char *)malloc(size + 1);
+        int rc = 0;
+        BOOST_REQUIRE(buf != NULL);
+
+        sprintf(key, "key:%d", num);
+        rc = (get_value(key, buf, size + 1) == size &&
+              memcmp(buf, val, size) == 0);
+
+        free(val);
+        free(buf);
+
+        return rc;
+}
+
+/* Every fourth value goes to the blob log */
+#define BLOB_SIZE(i) (((i) % 4 == 0) ? 4096 : 100)
+
+static void blob_test(int wal_mode, int snapshot)
+{
+        struct s_db_options opts;
+        char key[32];
+        char buf[32];
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = wal_mode;
+        opts.snapshot = snapshot;
+        opts.blob_size = 1024;
+        opts.blob_segment_size = 64 * 1024;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 200; i++)
+                blob_put(i, BLOB_SIZE(i));
+        for (i = 0; i < 200; i += 8)
+                blob_erase(i);
+        db_release();
+
+        /* Value node keeps only locations of large values */
+        BOOST_CHECK(blob_files_size() > 25 * 4096);
+        BOOST_CHECK(file_size("db_val_node_0.txt") < 200 * 150);
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 200; i++) {
+                sprintf(key, "key:%d", i);
+                if (i % 8 == 0)
+                        BOOST_CHECK(get_value(key, buf, sizeof(buf)) == 0);
+                else
+                        BOOST_CHECK(blob_check(i, BLOB_SIZE(i)));
+        }
+
+        for (i = 0; i < 200; i++)
+                blob_erase(i);
+        db_release();
+
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+
+        /* Dead segments are deleted on the next start */
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        db_release();
+
+        BOOST_CHECK(blob_files_size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_test)
+{
+        blob_test(DB_WAL_NONE, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_wal_test)
+{
+        blob_test(DB_WAL_SYNC, 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_snapshot_test)
+{
+        blob_test(DB_WAL_INTERVAL, 1);
+}
+
+static void blob_gc_test(int wal_mode)
+{
+        struct s_db_options opts;
+        long size = 0;
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = wal_mode;
+        opts.blob_size = 1024;
+        opts.blob_segment_size = 64 * 1024;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 400; i++)
+                blob_put(i, 4096);
+        for (i = 0; i < 400; i++) {
+                if (i % 4 != 0)
+                        blob_erase(i);
+        }
+        db_release();
+
+        size = blob_files_size();
+
+        /* Live quarter of each segment is moved, old segments go */
+        opts.compact_rate = 64 << 20;
+        opts.checkpoint_interval_ms = 100;
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+        usleep(500000);
+        db_release();
+
+        BOOST_CHECK(blob_files_size() < size / 2);
+
+        opts.compact_rate = 0;
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 400; i += 4)
+                BOOST_CHECK(blob_check(i, 4096));
+        db_release();
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_gc_test)
+{
+        blob_gc_test(DB_WAL_NONE);
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_gc_wal_test)
+{
+        blob_gc_test(DB_WAL_INTERVAL);
+}
+
+static void mem_budget_test(int wal_mode, int backend)
+{
+        struct s_db_options opts;
+        char key[32];
+        char buf[32];
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = wal_mode;
+        opts.file_backend = backend;
+        opts.snapshot = 1;
+        opts.mem_budget = 8 * 1024;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        /* Ten times over the budget, evicted values are read back */
+        for (i = 0; i < 400; i++)
+                blob_put(i, 200);
+        for (i = 0; i < 400; i++)
+                BOOST_CHECK(blob_check(i, 200));
+
+        /* Old value of the key may be evicted */
+        for (i = 0; i < 400; i += 8)
+                blob_erase(i);
+        for (i = 1; i < 400; i += 8)
+                blob_put(i, 150);
+        for (i = 2; i < 400; i += 8)
+                blob_put(i + 1, 200);
+        BOOST_CHECK(list_count() == 350);
+        db_release();
+
+        /* Snapshots are not written with the budget */
+        BOOST_CHECK(file_size("db_val_node_0.txt.snap") == -1);
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < 400; i++) {
+                sprintf(key, "key:%d", i);
+                if (i % 8 == 0)
+                        BOOST_CHECK(get_value(key, buf, sizeof(buf)) == 0);
+                else if (i % 8 == 1)
+                        BOOST_CHECK(blob_check(i, 150));
+                else if (i % 8 == 2)
+                        BOOST_CHECK(blob_check(i, 200));
+        }
+
+        for (i = 0; i < 400; i++)
+                blob_erase(i);
+        BOOST_CHECK(list_count() == 0);
+        db_release();
+
+        BOOST_CHECK(file_size("db_val_node_0.txt") == DB_FILE_DATA_OFFSET);
+}
+
+BOOST_AUTO_TEST_CASE(db_mem_budget_test)
+{
+        mem_budget_test(DB_WAL_NONE, DB_FILE_BACKEND_PWRITE);
+}
+
+BOOST_AUTO_TEST_CASE(db_mem_budget_wal_test)
+{
+        mem_budget_test(DB_WAL_INTERVAL, DB_FILE_BACKEND_PWRITE);
+}
+
+BOOST_AUTO_TEST_CASE(db_mem_budget_uring_test)
+{
+        mem_budget_test(DB_WAL_NONE, DB_FILE_BACKEND_URING);
+}
+
+BOOST_AUTO_TEST_CASE(db_recovery_bench_test)
+{
+        struct s_message msg;
+        struct timespec start, end;
+        char key[32];
+        char val[64];
+        double sec = 0;
+        long bytes = 0;
+        int i = 0;
+        int rc = db_init(1);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%040d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        db_release();
+
+        bytes  = file_size("db_key_node_0.txt");
+        bytes += file_size("db_val_node_0.txt");
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = db_init(1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        BOOST_REQUIRE(rc == 0);
+
+        sec  = end.tv_sec - start.tv_sec;
+        sec += (end.tv_nsec - start.tv_nsec) / 1e9;
+        BOOST_TEST_MESSAGE("Recovery of " << bytes << " bytes: " << sec
+                           << " s, " << sec * (1 << 30) / bytes << " s per GB");
+
+        db_release();
+}
+
+static double init_time(const struct s_db_options *opts)
+{
+        struct timespec start, end;
+        double sec = 0;
+        int rc = 0;
+
+        /* Free chunks of the previous run are not counted */
+        malloc_trim(0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = db_init_options(1, opts);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        BOOST_REQUIRE(rc == 0);
+
+        sec  = end.tv_sec - start.tv_sec;
+        sec += (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        return sec;
+}
+
+BOOST_AUTO_TEST_CASE(db_snapshot_bench_test)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char key[32];
+        char val[64];
+        double scan = 0;
+        double snap = 0;
+        int i = 0;
+        int rc = 0;
+
+        db_options_default(&opts);
+        opts.wal_mode = DB_WAL_INTERVAL;
+        opts.snapshot = 1;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%040d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        db_release();
+
+        snap = init_time(&opts);
+        db_release();
+
+        opts.snapshot = 0;
+        scan = init_time(&opts);
+        db_release();
+
+        BOOST_TEST_MESSAGE("Restart of " << DB_BENCH_ITEMS << " items: scan "
+                           << scan << " s, snapshot " << snap << " s");
+}
+
+/**
+ * @brief Put keys, 80% of values are below 64 bytes.
+ * @return Total size of the node files.
+ */
+static long inline_fill(uint32_t inline_size, double *sec)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        struct timespec start, end;
+        char key[32];
+        char val[256];
+        long size = 0;
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.inline_size = inline_size;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                if (i % 5 == 0)
+                        sprintf(val, "value:%d:%0150d", i, i);
+                else
+                        sprintf(val, "value:%d:%020d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        db_release();
+
+        *sec  = end.tv_sec - start.tv_sec;
+        *sec += (end.tv_nsec - start.tv_nsec) / 1e9;
+        size  = file_size("db_key_node_0.txt");
+        size += file_size("db_val_node_0.txt");
+
+        db_fixture::remove_files();
+
+        return size;
+}
+
+BOOST_AUTO_TEST_CASE(db_scan_bench_test)
+{
+        struct s_message msg;
+        struct timespec start, end;
+        std::string pairs;
+        char key[32];
+        char val[64];
+        double list_ms = 0;
+        double scan_ms = 0;
+        int count = 0;
+        int i = 0;
+
+        BOOST_REQUIRE(db_init(DB_TEST_MAX_NODES) == 0);
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d:%040d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        /* Keys of the prefix: by LIST of everything or by SCAN */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        BOOST_CHECK(list_count() == DB_BENCH_ITEMS);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        list_ms  = (end.tv_sec - start.tv_sec) * 1e3;
+        list_ms += (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        count = scan_keys("key:1234", "key:1235", 0, pairs);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        scan_ms  = (end.tv_sec - start.tv_sec) * 1e3;
+        scan_ms += (end.tv_nsec - start.tv_nsec) / 1e6;
+        BOOST_CHECK(count == 11);
+
+        BOOST_TEST_MESSAGE("Prefix of " << count << " keys in "
+                           << DB_BENCH_ITEMS << " items: LIST " << list_ms
+                           << " ms, SCAN " << scan_ms << " ms");
+        db_release();
+}
+
+/**
+ * @brief Spread of values over the nodes, and PUT of large values,
+ * each one by two keys.
+ */
+BOOST_AUTO_TEST_CASE(db_large_put_bench_test)
+{
+        const int large_size = 4 << 20;
+        const int large_count = 16;
+        struct s_message msg;
+        struct timespec start, end;
+        char name[64];
+        char key[32];
+        char *val = NULL;
+        long size = 0;
+        long min = -1;
+        long max = 0;
+        double ms = 0;
+        int i = 0;
+
+        BOOST_REQUIRE(db_init(DB_TEST_MAX_NODES) == 0);
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(name, "value:%d:%040d", i, i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, name);
+                db_process_message(&msg);
+        }
+        db_release();
+
+        for (i = 0; i < DB_TEST_MAX_NODES; i++) {
+                sprintf(name, "db_val_node_%d.txt", i);
+                size = file_size(name);
+                min = (min < 0 || size < min) ? size : min;
+                max = (size > max) ? size : max;
+        }
+        db_fixture::remove_files();
+
+        val = (char *)malloc(large_size + 1);
+        BOOST_REQUIRE(val != NULL);
+
+        BOOST_REQUIRE(db_init(DB_TEST_MAX_NODES) == 0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < 2 * large_count; i++) {
+                memset(val, 'a' + i % large_count, large_size);
+                val[large_size] = 0;
+                sprintf(key, "big:%d", i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        db_release();
+        free(val);
+
+        /* Each value is stored once */
+        size = 0;
+        for (i = 0; i < DB_TEST_MAX_NODES; i++) {
+                sprintf(name, "db_val_node_%d.txt", i);
+                size += file_size(name);
+        }
+        BOOST_CHECK(size > (long)large_count * large_size);
+        BOOST_CHECK(size < (long)(large_count + 1) * large_size);
+
+        ms  = (end.tv_sec - start.tv_sec) * 1e3;
+        ms += (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        BOOST_TEST_MESSAGE("Value nodes of " << DB_BENCH_ITEMS
+                           << " items: min " << min << " max " << max
+                           << " bytes; PUT of " << large_size
+                           << " byte values " << ms / (2 * large_count)
+                           << " ms");
+}
+
+BOOST_AUTO_TEST_CASE(db_inline_bench_test)
+{
+        double ref_sec = 0;
+        double inline_sec = 0;
+        long ref_size = 0;
+        long inline_size = 0;
+
+        ref_size = inline_fill(0, &ref_sec);
+        inline_size = inline_fill(64, &inline_sec);
+
+        BOOST_TEST_MESSAGE("Put of " << DB_BENCH_ITEMS << " items: referred "
+                           << ref_sec << " s, " << ref_size << " bytes; inline "
+                           << inline_sec << " s, " << inline_size << " bytes");
+}
+
+/**
+ * @brief Overwrite values of mixed sizes, each round changes the sizes.
+ * @return Size of the value node file.
+ */
+static long blob_churn(uint32_t blob_size, double *sec)
+{
+        struct s_db_options opts;
+        struct timespec start, end;
+        long size = 0;
+        int round = 0;
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.blob_size = blob_size;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (round = 0; round < 4; round++) {
+                for (i = 0; i < 2000; i++) {
+                        /* Few bytes to 256 KB, large values are rare */
+                        if ((i + round) % 50 == 0)
+                                blob_put(i, 65536 << ((i + round) % 3));
+                        else
+                                blob_put(i, 16 + (i * 7 + round * 13) % 200);
+                }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        db_release();
+
+        *sec  = end.tv_sec - start.tv_sec;
+        *sec += (end.tv_nsec - start.tv_nsec) / 1e9;
+        size = file_size("db_val_node_0.txt");
+
+        db_fixture::remove_files();
+
+        return size;
+}
+
+BOOST_AUTO_TEST_CASE(db_blob_bench_test)
+{
+        double inline_sec = 0;
+        double blob_sec = 0;
+        long inline_size = 0;
+        long blob_size = 0;
+
+        inline_size = blob_churn(0, &inline_sec);
+        blob_size = blob_churn(4096, &blob_sec);
+
+        BOOST_TEST_MESSAGE("Mixed overwrites: inline " << inline_sec
+                           << " s, value file " << inline_size
+                           << " bytes; blob log " << blob_sec
+                           << " s, value file " << blob_size << " bytes");
+}
+
+/**
+ * @brief Fill 1 KB values, then get them in random order.
+ * @return Size of allocated memory after the fill.
+ */
+static long mem_fill(uint64_t mem_budget, double *sec)
+{
+        struct s_db_options opts;
+        struct timespec start, end;
+        long used = 0;
+        int rc = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.mem_budget = mem_budget;
+
+        malloc_trim(0);
+        used = mallinfo2().uordblks;
+
+        rc = db_init_options(1, &opts);
+        BOOST_REQUIRE(rc == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS / 2; i++)
+                blob_put(i, 1024);
+
+        used = mallinfo2().uordblks - used;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_BENCH_ITEMS / 2; i++)
+                BOOST_CHECK(blob_check((i * 7919) % (DB_BENCH_ITEMS / 2), 1024));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        db_release();
+
+        *sec  = end.tv_sec - start.tv_sec;
+        *sec += (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        db_fixture::remove_files();
+
+        return used;
+}
+
+struct bloom_client {
+        pthread_t thread;
+        int cmd_type;
+        int first;
+        volatile int *stop;
+};
+
+/**
+ * @brief Make the key only message, test macros are too slow for
+ * the timed loop.
+ */
+static void bloom_msg(struct s_message *msg, int cmd_type, const char *key)
+{
+        memset(msg, 0, sizeof(struct s_message));
+        msg->sd = -1;
+        msg->cmd.type = cmd_type;
+        msg->cmd.key_size = strlen(key) + 1;
+        msg->cmd.len = sizeof(msg->cmd) + msg->cmd.key_size;
+        msg->key = (uint8_t *)malloc(msg->cmd.key_size);
+        memcpy(msg->key, key, msg->cmd.key_size);
+}
+
+/**
+ * @brief Get or erase keys, 9 of 10 are missing.
+ */
+static void *bloom_client_thread(void *arg)
+{
+        struct bloom_client *c = (struct bloom_client *)arg;
+        struct s_message msg;
+        char key[32];
+        int i = 0;
+
+        for (i = c->first; i < c->first + DB_BENCH_ITEMS; i++) {
+                if (i % 10 == 0)
+                        sprintf(key, "key:%d", (i / 10) % DB_BENCH_ITEMS);
+                else
+                        sprintf(key, "miss:%d", i);
+                bloom_msg(&msg, c->cmd_type, key);
+                db_process_message(&msg);
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Overwrite values, until clients are done.
+ */
+static void *bloom_writer_thread(void *arg)
+{
+        struct bloom_client *c = (struct bloom_client *)arg;
+        struct s_message msg;
+        char key[32];
+        char val[64];
+        int i = 0;
+
+        for (i = 0; !*c->stop; i++) {
+                sprintf(key, "key:%d", i % DB_BENCH_ITEMS);
+                sprintf(val, "value:%d", i);
+                bloom_msg(&msg, DB_CMD_PUT, key);
+                msg.cmd.val_size = strlen(val) + 1;
+                msg.cmd.len += msg.cmd.val_size;
+                msg.val = (uint8_t *)malloc(msg.cmd.val_size);
+                memcpy(msg.val, val, msg.cmd.val_size);
+                db_process_message(&msg);
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Run 4 clients of mostly missing keys beside the writer.
+ * @return Time of clients in seconds.
+ */
+static double bloom_run(int cmd_type)
+{
+        struct timespec start, end;
+        struct bloom_client clients[4];
+        struct bloom_client writer;
+        volatile int stop = 0;
+        int i = 0;
+
+        writer.stop = &stop;
+        BOOST_REQUIRE(pthread_create(&writer.thread, NULL,
+                                     bloom_writer_thread, &writer) == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < 4; i++) {
+                clients[i].cmd_type = cmd_type;
+                clients[i].first = i * DB_BENCH_ITEMS;
+                BOOST_REQUIRE(pthread_create(&clients[i].thread, NULL,
+                                             bloom_client_thread,
+                                             &clients[i]) == 0);
+        }
+        for (i = 0; i < 4; i++)
+                pthread_join(clients[i].thread, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        stop = 1;
+        pthread_join(writer.thread, NULL);
+
+        return (end.tv_sec - start.tv_sec) +
+               (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void bloom_bench(uint32_t bloom_bits, double *get_sec, double *erase_sec)
+{
+        struct s_db_options opts;
+        struct s_message msg;
+        char key[32];
+        char val[64];
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.bloom_bits = bloom_bits;
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d", i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        *get_sec = bloom_run(DB_CMD_GET);
+        *erase_sec = bloom_run(DB_CMD_ERASE);
+
+        db_release();
+        db_fixture::remove_files();
+}
+
+BOOST_AUTO_TEST_CASE(db_bloom_bench_test)
+{
+        double get_sec[2];
+        double erase_sec[2];
+
+        bloom_bench(0, &get_sec[0], &erase_sec[0]);
+        bloom_bench(16, &get_sec[1], &erase_sec[1]);
+
+        BOOST_TEST_MESSAGE("90% missing keys by 4 threads beside the writer, "
+                           << 4 * DB_BENCH_ITEMS << " requests: GET "
+                           << get_sec[0] << " s, with Bloom filters "
+                           << get_sec[1] << " s; ERASE " << erase_sec[0]
+                           << " s, with Bloom filters " << erase_sec[1]
+                           << " s");
+}
+
+struct get_client {
+        pthread_t thread;
+        int count;              /**< Requests to send, 0 - until stop */
+        volatile int *stop;
+        int found;
+        int bad;                /**< Values of other keys or torn ones */
+};
+
+static void get_put(const char *key, const char *val)
+{
+        struct s_message msg;
+
+        bloom_msg(&msg, DB_CMD_PUT, key);
+        msg.cmd.val_size = strlen(val) + 1;
+        msg.cmd.len += msg.cmd.val_size;
+        msg.val = (uint8_t *)malloc(msg.cmd.val_size);
+        memcpy(msg.val, val, msg.cmd.val_size);
+        db_process_message(&msg);
+}
+
+/**
+ * @brief Put inline and shared values of 100 keys, erase some of them.
+ */
+static void *get_churn_thread(void *arg)
+{
+        struct get_client *c = (struct get_client *)arg;
+        struct s_message msg;
+        char key[32];
+        char val[256];
+        int i = 0;
+        int k = 0;
+
+        for (i = 0; !*c->stop; i++) {
+                for (k = 0; k < 100; k++) {
+                        sprintf(key, "key:%d", k);
+                        sprintf(val, "v:%s:%d", key, i);
+                        get_put(key, val);
+
+                        memset(&val[strlen(val)], 'x', 200);
+                        val[200] = '\0';
+                        get_put(key, val);
+
+                        if ((i + k) % 3 == 0) {
+                                bloom_msg(&msg, DB_CMD_ERASE, key);
+                                db_process_message(&msg);
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Get values of 100 keys, each must be of its own key.
+ */
+static void *get_check_thread(void *arg)
+{
+        struct get_client *c = (struct get_client *)arg;
+        char key[32];
+        char prefix[40];
+        char val[256];
+        int rc = 0;
+        int i = 0;
+
+        for (i = 0; !*c->stop; i++) {
+                sprintf(key, "key:%d", i % 100);
+                sprintf(prefix, "v:%s:", key);
+                rc = get_value(key, val, sizeof(val));
+                if (rc <= 0)
+                        continue;
+
+                c->found++;
+                if (strncmp(val, prefix, strlen(prefix)) != 0 ||
+                                (rc > 64 && val[rc - 2] != 'x') ||
+                                val[rc - 1] != '\0')
+                        c->bad++;
+        }
+
+        return NULL;
+}
+
+BOOST_AUTO_TEST_CASE(db_get_unlocked_test)
+{
+        struct s_db_options opts;
+        struct get_client writer;
+        struct get_client readers[4];
+        volatile int stop = 0;
+        int i = 0;
+
+        /* Values are inline, shared and evicted under the small budget */
+        db_options_default(&opts);
+        opts.inline_size = 64;
+        opts.mem_budget = 8 * 1024;
+        opts.bloom_bits = 16;
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+
+        memset(&writer, 0, sizeof(writer));
+        memset(readers, 0, sizeof(readers));
+        writer.stop = &stop;
+        BOOST_REQUIRE(pthread_create(&writer.thread, NULL, get_churn_thread,
+                                     &writer) == 0);
+        for (i = 0; i < 4; i++) {
+                readers[i].stop = &stop;
+                BOOST_REQUIRE(pthread_create(&readers[i].thread, NULL,
+                                             get_check_thread,
+                                             &readers[i]) == 0);
+        }
+
+        usleep(1000000);
+        stop = 1;
+        pthread_join(writer.thread, NULL);
+        for (i = 0; i < 4; i++) {
+                pthread_join(readers[i].thread, NULL);
+                BOOST_CHECK(readers[i].found != 0);
+                BOOST_CHECK(readers[i].bad == 0);
+        }
+
+        db_release();
+}
+
+/**
+ * @brief Get existing keys, until the count is sent.
+ */
+static void *get_bench_thread(void *arg)
+{
+        struct get_client *c = (struct get_client *)arg;
+        struct s_message msg;
+        char key[32];
+        int i = 0;
+
+        for (i = 0; i < c->count; i++) {
+                sprintf(key, "key:%d", (int)((i * 7919ULL) % DB_BENCH_ITEMS));
+                bloom_msg(&msg, DB_CMD_GET, key);
+                db_process_message(&msg);
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Run readers beside the writer of the same keys.
+ * @return Requests per second of all readers.
+ */
+static double get_scale_run(int threads)
+{
+        struct timespec start, end;
+        struct get_client clients[4];
+        struct bloom_client writer;
+        volatile int stop = 0;
+        double sec = 0;
+        int i = 0;
+
+        writer.stop = &stop;
+        BOOST_REQUIRE(pthread_create(&writer.thread, NULL,
+                                     bloom_writer_thread, &writer) == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < threads; i++) {
+                clients[i].count = 4 * DB_BENCH_ITEMS;
+                BOOST_REQUIRE(pthread_create(&clients[i].thread, NULL,
+                                             get_bench_thread,
+                                             &clients[i]) == 0);
+        }
+        for (i = 0; i < threads; i++)
+                pthread_join(clients[i].thread, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        stop = 1;
+        pthread_join(writer.thread, NULL);
+
+        sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        return threads * 4 * DB_BENCH_ITEMS / sec;
+}
+
+BOOST_AUTO_TEST_CASE(db_get_scale_bench_test)
+{
+        struct s_db_options opts;
+        char key[32];
+        char val[64];
+        double rps[3];
+        int i = 0;
+
+        db_options_default(&opts);
+        BOOST_REQUIRE(db_init_options(DB_TEST_MAX_NODES, &opts) == 0);
+
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "key:%d", i);
+                sprintf(val, "value:%d", i);
+                get_put(key, val);
+        }
+
+        rps[0] = get_scale_run(1);
+        rps[1] = get_scale_run(2);
+        rps[2] = get_scale_run(4);
+
+        BOOST_TEST_MESSAGE("GET of existing keys beside the writer: "
+                           << "1 thread " << rps[0] << " req/s, "
+                           << "2 threads " << rps[1] << " req/s, "
+                           << "4 threads " << rps[2] << " req/s");
+
+        db_release();
+}
+
+struct put_client {
+        pthread_t thread;
+        int id;                 /**< Prefix of own keys */
+        int count;              /**< Keys to put */
+};
+
+/**
+ * @brief Put own keys with values shared by all writers, erase every
+ * third key.
+ */
+static void *put_stripe_thread(void *arg)
+{
+        struct put_client *c = (struct put_client *)arg;
+        struct s_message msg;
+        char key[32];
+        char val[256];
+        int i = 0;
+
+        for (i = 0; i < c->count; i++) {
+                sprintf(key, "w%d:key:%d", c->id, i);
+                sprintf(val, "shared:%d:", i % 50);
+                memset(&val[strlen(val)], 'x', 100);
+                val[100] = '\0';
+                get_put(key, val);
+
+                if (i % 3 == 0) {
+                        bloom_msg(&msg, DB_CMD_ERASE, key);
+                        db_process_message(&msg);
+                }
+        }
+
+        return NULL;
+}
+
+BOOST_AUTO_TEST_CASE(db_put_stripe_test)
+{
+        struct s_db_options opts;
+        struct put_client writers[4];
+        char key[32];
+        char val[256];
+        char expect[256];
+        int rc = 0;
+        int i = 0;
+        int k = 0;
+
+        /* One node, so all writers meet on its stripes and latch */
+        db_options_default(&opts);
+        opts.inline_size = 64;
+        BOOST_REQUIRE(db_init_options(1, &opts) == 0);
+
+        memset(writers, 0, sizeof(writers));
+        for (i = 0; i < 4; i++) {
+                writers[i].count = 2000;
+                writers[i].id = i;
+                BOOST_REQUIRE(pthread_create(&writers[i].thread, NULL,
+                                             put_stripe_thread,
+                                             &writers[i]) == 0);
+        }
+        for (i = 0; i < 4; i++)
+                pthread_join(writers[i].thread, NULL);
+
+        for (i = 0; i < 4; i++) {
+                for (k = 0; k < 2000; k++) {
+                        sprintf(key, "w%d:key:%d", i, k);
+                        rc = get_value(key, val, sizeof(val));
+                        if (k % 3 == 0) {
+                                BOOST_CHECK(rc <= 0);
+                                continue;
+                        }
+
+                        sprintf(expect, "shared:%d:", k % 50);
+                        memset(&expect[strlen(expect)], 'x', 100);
+                        expect[100] = '\0';
+                        BOOST_CHECK(rc == 101);
+                        BOOST_CHECK(strcmp(val, expect) == 0);
+                }
+        }
+
+        db_release();
+}
+
+/**
+ * @brief Run writers of own keys on one node.
+ * @return Requests per second of all writers.
+ */
+static double put_scale_run(int threads)
+{
+        struct timespec start, end;
+        struct put_client clients[4];
+        struct s_db_options opts;
+        double sec = 0;
+        int i = 0;
+
+        db_options_default(&opts);
+        opts.inline_size = 64;
+        BOOST_REQUIRE(db_init_options(1, &opts) == 0);
+
+        memset(clients, 0, sizeof(clients));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < threads; i++) {
+                clients[i].count = DB_BENCH_ITEMS / threads;
+                clients[i].id = i;
+                BOOST_REQUIRE(pthread_create(&clients[i].thread, NULL,
+                                             put_stripe_thread,
+                                             &clients[i]) == 0);
+        }
+        for (i = 0; i < threads; i++)
+                pthread_join(clients[i].thread, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        db_release();
+
+        sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        return (DB_BENCH_ITEMS / threads) * threads * 4 / 3 / sec;
+}
+
+BOOST_AUTO_TEST_CASE(db_put_scale_bench_test)
+{
+        double rps[3];
+
+        rps[0] = put_scale_run(1);
+        rps[1] = put_scale_run(2);
+        rps[2] = put_scale_run(4);
+
+        BOOST_TEST_MESSAGE("PUT and ERASE of own keys on one node: "
+                           << "1 thread " << rps[0] << " req/s, "
+                           << "2 threads " << rps[1] << " req/s, "
+                           << "4 threads " << rps[2] << " req/s");
+}
+
+BOOST_AUTO_TEST_CASE(db_mem_budget_bench_test)
+{
+        double all_sec = 0;
+        double budget_sec = 0;
+        long all_used = 0;
+        long budget_used = 0;
+
+        all_used = mem_fill(0, &all_sec);
+        budget_used = mem_fill(2 << 20, &budget_sec);
+
+        BOOST_TEST_MESSAGE("Get of " << DB_BENCH_ITEMS / 2 << " 1 KB values: "
+                           << "in memory " << all_sec << " s, "
+                           << all_used << " bytes; budget 2 MB "
+                           << budget_sec << " s, " << budget_used << " bytes");
+}
+
+/**
+ * @brief Node of the key by its first and last bytes, as it was routed
+ * before the fingerprint.
+ */
+static uint32_t bytes_node_id(const char *key, uint32_t size, uint32_t max)
+{
+        uint8_t first = key[0];
+        uint8_t last = (size > 2) ? key[size - 2] : first;
+
+        return (first ^ last) % max;
+}
+
+BOOST_AUTO_TEST_CASE(db_route_bench_test)
+{
+        struct timespec start, end;
+        struct s_message msg;
+        uint32_t bytes_counts[DB_TEST_MAX_NODES];
+        uint32_t fp_counts[DB_TEST_MAX_NODES];
+        uint64_t fp[2];
+        char key[32];
+        char val[64];
+        double put_ns = 0;
+        double get_ns = 0;
+        int found = 0;
+        int size = 0;
+        int i = 0;
+
+        /* Keys of the same prefix and suffix */
+        memset(bytes_counts, 0, sizeof(bytes_counts));
+        memset(fp_counts, 0, sizeof(fp_counts));
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                size = sprintf(key, "user:%d:v", i) + 1;
+                db_fp_bytes((uint8_t *)key, size, fp);
+                bytes_counts[bytes_node_id(key, size, DB_TEST_MAX_NODES)]++;
+                fp_counts[db_hash_jump(fp[1], DB_TEST_MAX_NODES)]++;
+        }
+
+        for (i = 0; i < DB_TEST_MAX_NODES; i++) {
+                BOOST_CHECK(fp_counts[i] > DB_BENCH_ITEMS /
+                                           DB_TEST_MAX_NODES * 9 / 10);
+                BOOST_TEST_MESSAGE("Node " << i << ": " << bytes_counts[i]
+                                   << " keys by bytes, " << fp_counts[i]
+                                   << " keys by fingerprint");
+        }
+
+        BOOST_REQUIRE(db_init(DB_TEST_MAX_NODES) == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "user:%d:v", i);
+                sprintf(val, "value:%d", i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        put_ns  = (end.tv_sec - start.tv_sec) * 1e9;
+        put_ns += end.tv_nsec - start.tv_nsec;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "user:%d:v", i);
+                found += (get_value(key, val, sizeof(val)) > 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        get_ns  = (end.tv_sec - start.tv_sec) * 1e9;
+        get_ns += end.tv_nsec - start.tv_nsec;
+
+        BOOST_CHECK(found == DB_BENCH_ITEMS);
+        BOOST_TEST_MESSAGE("Skewed keys of " << DB_BENCH_ITEMS << " items: PUT "
+                           << put_ns / DB_BENCH_ITEMS << " ns, GET "
+                           << get_ns / DB_BENCH_ITEMS << " ns");
+        db_release();
+}
+
+static void *reshard_wait_thread(void *arg)
+{
+        db_reshard_wait();
+        __atomic_store_n((int *)arg, 1, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+/**
+ * @brief Run GETs of random keys, until the flag is set or count is done.
+ * @return Average GET time in ns, the max one is given by max_ns.
+ * Keys, which are not found, are counted by missed.
+ */
+static double reshard_get_run(volatile int *done, int count, double *max_ns,
+                              int *missed)
+{
+        struct timespec start, end;
+        char key[32];
+        char val[64];
+        double total = 0;
+        double ns = 0;
+        int n = 0;
+
+        *max_ns = 0;
+        for (n = 0; (count == 0 || n < count) &&
+                        (done == NULL || !__atomic_load_n(done,
+                                                __ATOMIC_ACQUIRE)); n++) {
+                sprintf(key, "user:%d:v", (int)((n * 7919ULL) %
+                                                DB_BENCH_ITEMS));
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                *missed += (get_value(key, val, sizeof(val)) <= 0);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                ns  = (end.tv_sec - start.tv_sec) * 1e9;
+                ns += end.tv_nsec - start.tv_nsec;
+                total += ns;
+                if (ns > *max_ns)
+                        *max_ns = ns;
+        }
+
+        return (n != 0) ? total / n : 0;
+}
+
+BOOST_AUTO_TEST_CASE(db_reshard_bench_test)
+{
+        struct timespec start, end;
+        struct s_message msg;
+        pthread_t thread;
+        char key[32];
+        char val[64];
+        double idle_ns = 0;
+        double idle_max = 0;
+        double split_ns = 0;
+        double split_max = 0;
+        double sec = 0;
+        int missed = 0;
+        int done = 0;
+        int i = 0;
+
+        BOOST_REQUIRE(db_init(1) == 0);
+        for (i = 0; i < DB_BENCH_ITEMS; i++) {
+                sprintf(key, "user:%d:v", i);
+                sprintf(val, "value:%d", i);
+                create_kv_msg(&msg, DB_CMD_PUT, key, val);
+                db_process_message(&msg);
+        }
+
+        idle_ns = reshard_get_run(NULL, DB_BENCH_ITEMS, &idle_max, &missed);
+
+        /* Keys are read by both maps, while they move */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        BOOST_REQUIRE(db_reshard(DB_TEST_MAX_NODES) == 0);
+        BOOST_REQUIRE(pthread_create(&thread, NULL, reshard_wait_thread,
+                                     &done) == 0);
+        split_ns = reshard_get_run(&done, 0, &split_max, &missed);
+        pthread_join(thread, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        sec  = end.tv_sec - start.tv_sec;
+        sec += (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        BOOST_CHECK(missed == 0);
+        BOOST_TEST_MESSAGE("Split of " << DB_BENCH_ITEMS << " keys from 1 to "
+                           << DB_TEST_MAX_NODES << " nodes: " << sec
+                           << " s, GET " << idle_ns << " ns idle (max "
+                           << idle_max << "), " << split_ns
+                           << " ns while split (max " << split_max << ")");
+        db_release();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,171 @@
+#define BOOST_TEST_MODULE db_uring_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db_uring.h"
+
+#define DB_URING_FILE_NAME "db_test_uring.txt"
+
+struct db_uring_fixture {
+        int fd;
+
+        db_uring_fixture()
+        {
+                unlink(DB_URING_FILE_NAME);
+                fd = open(DB_URING_FILE_NAME, O_RDWR | O_CREAT, 0640);
+                BOOST_REQUIRE(fd != -1);
+        }
+
+        ~db_uring_fixture()
+        {
+                close(fd);
+                unlink(DB_URING_FILE_NAME);
+        }
+};
+
+static uint64_t write_byte(void *uring, uint64_t offset, uint8_t val, size_t size)
+{
+        uint8_t buf[size];
+        struct iovec iov;
+
+        memset(buf, val, size);
+        iov.iov_base = buf;
+        iov.iov_len  = size;
+
+        return db_uring_write(uring, offset, &iov, 1);
+}
+
+BOOST_FIXTURE_TEST_SUITE(BOOST_TEST_MODULE, db_uring_fixture)
+
+BOOST_AUTO_TEST_CASE(db_uring_write_test)
+{
+        uint8_t rbuf[16];
+        uint8_t buf[16];
+        struct iovec iov[2];
+        uint64_t seq = 0;
+        void *uring = db_uring_init(fd);
+        BOOST_REQUIRE(uring != NULL);
+
+        BOOST_TEST_MESSAGE("io_uring native: " << db_uring_is_native(uring));
+        BOOST_CHECK(db_uring_get_seq(uring) == 0);
+
+        memset(buf, 0x11, 8);
+        memset(&buf[8], 0x22, 8);
+        iov[0].iov_base = buf;
+        iov[0].iov_len  = 8;
+        iov[1].iov_base = &buf[8];
+        iov[1].iov_len  = 8;
+
+        seq = db_uring_write(uring, 0, iov, 2);
+        BOOST_CHECK(seq == 1);
+        BOOST_CHECK(db_uring_wait(uring, seq) == 0);
+
+        BOOST_CHECK(pread(fd, rbuf, sizeof(rbuf), 0) == sizeof(rbuf));
+        BOOST_CHECK(memcmp(rbuf, buf, sizeof(buf)) == 0);
+
+        db_uring_release(uring);
+}
+
+BOOST_AUTO_TEST_CASE(db_uring_order_test)
+{
+        struct stat st;
+        uint8_t rbuf[64];
+        uint8_t buf[64];
+        uint64_t seq = 0;
+        int i = 0;
+        void *uring = db_uring_init(fd);
+        BOOST_REQUIRE(uring != NULL);
+
+        /* More overlapping writes, than ring entries */
+        for (i = 0; i < 1000; i++)
+                seq = write_byte(uring, (i % 2) * 32, i & 0xFF, 64);
+
+        /* Truncate goes after the writes, the last write goes after it */
+        db_uring_truncate(uring, 16);
+        seq = write_byte(uring, 8, 0xEE, 8);
+        BOOST_CHECK(seq == 1002);
+        BOOST_CHECK(db_uring_wait(uring, seq) == 0);
+
+        BOOST_REQUIRE(fstat(fd, &st) == 0);
+        BOOST_CHECK(st.st_size == 16);
+
+        memset(buf, 998 & 0xFF, 8);
+        memset(&buf[8], 0xEE, 8);
+        BOOST_CHECK(pread(fd, rbuf, sizeof(rbuf), 0) == 16);
+        BOOST_CHECK(memcmp(rbuf, buf, 16) == 0);
+
+        db_uring_release(uring);
+}
+
+BOOST_AUTO_TEST_CASE(db_uring_append_test)
+{
+        uint8_t rbuf[256];
+        uint64_t seq = 0;
+        int i = 0;
+        void *uring = db_uring_init(fd);
+        BOOST_REQUIRE(uring != NULL);
+
+        /* Adjacent writes, longer than one run */
+        for (i = 0; i < 256; i++)
+                seq = write_byte(uring, i, i, 1);
+        BOOST_CHECK(db_uring_wait(uring, seq) == 0);
+
+        BOOST_CHECK(pread(fd, rbuf, sizeof(rbuf), 0) == sizeof(rbuf));
+        for (i = 0; i < 256; i++)
+                BOOST_CHECK(rbuf[i] == i);
+
+        db_uring_release(uring);
+}
+
+BOOST_AUTO_TEST_CASE(db_uring_release_drains_test)
+{
+        uint8_t rbuf[4096];
+        uint8_t buf[4096];
+        int i = 0;
+        void *uring = db_uring_init(fd);
+        BOOST_REQUIRE(uring != NULL);
+
+        for (i = 0; i < 256; i++)
+                write_byte(uring, i * sizeof(buf), 0x5A, sizeof(buf));
+
+        db_uring_release(uring);
+
+        memset(buf, 0x5A, sizeof(buf));
+        BOOST_CHECK(pread(fd, rbuf, sizeof(rbuf), 255 * sizeof(buf)) ==
+                    sizeof(rbuf));
+        BOOST_CHECK(memcmp(rbuf, buf, sizeof(buf)) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_uring_error_test)
+{
+        int rd_fd = open(DB_URING_FILE_NAME, O_RDONLY);
+        void *uring = NULL;
+        uint64_t seq = 0;
+        BOOST_REQUIRE(rd_fd != -1);
+
+        uring = db_uring_init(rd_fd);
+        BOOST_REQUIRE(uring != NULL);
+
+        seq = write_byte(uring, 0, 0x11, 16);
+        BOOST_CHECK(db_uring_wait(uring, seq) == -1);
+        BOOST_CHECK(errno == EBADF);
+
+        /* Error is reported once */
+        BOOST_CHECK(db_uring_wait(uring, seq) == 0);
+
+        db_uring_release(uring);
+        close(rd_fd);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
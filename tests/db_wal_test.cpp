@@ -0,0 +1,224 @@
+#define BOOST_TEST_MODULE db_wal_test
+
+#ifdef DB_TEST_STATIC
+#include <boost/test/included/unit_test.hpp>
+#else
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "db_wal.h"
+
+#define DB_WAL_NAME "db_test_wal.txt"
+#define DB_WAL_THREADS 4
+#define DB_WAL_RECORDS 100
+
+struct db_wal_fixture {
+        db_wal_fixture()  { unlink(DB_WAL_NAME); }
+        ~db_wal_fixture() { unlink(DB_WAL_NAME); }
+};
+
+struct replay_result {
+        int count;
+        uint32_t type;
+        char key[32];
+        char val[32];
+};
+
+static void replay_handler(void *arg, uint32_t type,
+                           const uint8_t *key, uint32_t key_size,
+                           const uint8_t *val, uint32_t val_size)
+{
+        struct replay_result *res = (struct replay_result *)arg;
+
+        res->count++;
+        res->type = type;
+        memset(res->key, 0, sizeof(res->key));
+        memset(res->val, 0, sizeof(res->val));
+        memcpy(res->key, key, key_size);
+        if (val != NULL)
+                memcpy(res->val, val, val_size);
+}
+
+static long file_size(const char *name)
+{
+        struct stat st;
+
+        if (stat(name, &st) != 0)
+                return -1;
+
+        return st.st_size;
+}
+
+static void *writer_thread(void *arg)
+{
+        void *wal = arg;
+        uint64_t lsn = 0;
+        int i = 0;
+
+        for (i = 0; i < DB_WAL_RECORDS; i++) {
+                lsn = db_wal_append(wal, 1, (uint8_t *)"key", 3,
+                                    (uint8_t *)"value", 5);
+                BOOST_CHECK(lsn != 0);
+                BOOST_CHECK(db_wal_commit(wal, lsn) == 0);
+        }
+
+        return NULL;
+}
+
+BOOST_FIXTURE_TEST_SUITE(BOOST_TEST_MODULE, db_wal_fixture)
+
+BOOST_AUTO_TEST_CASE(db_wal_init_test)
+{
+        void *wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+        BOOST_CHECK(db_wal_get_size(wal) == 0);
+        db_wal_release(wal);
+
+        BOOST_CHECK(file_size(DB_WAL_NAME) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_replay_test)
+{
+        struct replay_result res;
+        void *wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+
+        memset(&res, 0, sizeof(res));
+
+        BOOST_CHECK(db_wal_append(wal, 0, (uint8_t *)"key1", 4,
+                                  (uint8_t *)"val1", 4) == 1);
+        BOOST_CHECK(db_wal_append(wal, 2, (uint8_t *)"key2", 4,
+                                  NULL, 0) == 2);
+        BOOST_CHECK(file_size(DB_WAL_NAME) == 0);
+        BOOST_CHECK(db_wal_get_size(wal) > 0);
+
+        BOOST_CHECK(db_wal_flush(wal) == 0);
+        BOOST_CHECK(file_size(DB_WAL_NAME) == (long)db_wal_get_size(wal));
+        db_wal_release(wal);
+
+        wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+        BOOST_CHECK(db_wal_replay(wal, replay_handler, &res) == 2);
+        BOOST_CHECK(res.count == 2);
+        BOOST_CHECK(res.type == 2);
+        BOOST_CHECK(strcmp(res.key, "key2") == 0);
+        BOOST_CHECK(res.val[0] == '\0');
+
+        BOOST_CHECK(db_wal_reset(wal) == 0);
+        BOOST_CHECK(file_size(DB_WAL_NAME) == 0);
+
+        memset(&res, 0, sizeof(res));
+        BOOST_CHECK(db_wal_replay(wal, replay_handler, &res) == 0);
+
+        db_wal_release(wal);
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_torn_tail_test)
+{
+        struct replay_result res;
+        void *wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+
+        memset(&res, 0, sizeof(res));
+
+        db_wal_append(wal, 0, (uint8_t *)"key1", 4, (uint8_t *)"val1", 4);
+        db_wal_append(wal, 0, (uint8_t *)"key2", 4, (uint8_t *)"val2", 4);
+        BOOST_CHECK(db_wal_flush(wal) == 0);
+        db_wal_release(wal);
+
+        BOOST_REQUIRE(truncate(DB_WAL_NAME, file_size(DB_WAL_NAME) - 1) == 0);
+
+        wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+        BOOST_CHECK(db_wal_replay(wal, replay_handler, &res) == 1);
+        BOOST_CHECK(strcmp(res.key, "key1") == 0);
+        BOOST_CHECK(strcmp(res.val, "val1") == 0);
+
+        db_wal_release(wal);
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_group_commit_test)
+{
+        pthread_t threads[DB_WAL_THREADS];
+        struct replay_result res;
+        int i = 0;
+        void *wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+
+        BOOST_REQUIRE(db_wal_start(wal, DB_WAL_SYNC, 1000,
+                                   UINT64_MAX, 0, NULL, NULL) == 0);
+
+        for (i = 0; i < DB_WAL_THREADS; i++)
+                BOOST_REQUIRE(pthread_create(&threads[i], NULL,
+                                             writer_thread, wal) == 0);
+
+        for (i = 0; i < DB_WAL_THREADS; i++)
+                pthread_join(threads[i], NULL);
+
+        /* All records are on the disk without flush */
+        memset(&res, 0, sizeof(res));
+        BOOST_CHECK(db_wal_replay(wal, replay_handler, &res) ==
+                    DB_WAL_THREADS * DB_WAL_RECORDS);
+
+        db_wal_release(wal);
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_interval_test)
+{
+        void *wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+
+        BOOST_REQUIRE(db_wal_start(wal, DB_WAL_INTERVAL, 1,
+                                   UINT64_MAX, 0, NULL, NULL) == 0);
+
+        db_wal_append(wal, 0, (uint8_t *)"key1", 4, (uint8_t *)"val1", 4);
+        usleep(100 * 1000);
+        BOOST_CHECK(file_size(DB_WAL_NAME) > 0);
+
+        db_wal_release(wal);
+}
+
+struct checkpoint_result {
+        void *wal;
+        int count;
+};
+
+static void checkpoint_handler(void *arg)
+{
+        struct checkpoint_result *res = (struct checkpoint_result *)arg;
+
+        db_wal_reset(res->wal);
+        res->count++;
+}
+
+BOOST_AUTO_TEST_CASE(db_wal_checkpoint_interval_test)
+{
+        struct checkpoint_result res;
+        void *wal = db_wal_init(DB_WAL_NAME);
+        BOOST_REQUIRE(wal != NULL);
+
+        res.wal = wal;
+        res.count = 0;
+        BOOST_REQUIRE(db_wal_start(wal, DB_WAL_INTERVAL, 1, UINT64_MAX, 50,
+                                   checkpoint_handler, &res) == 0);
+
+        /* Empty log is not checkpointed */
+        usleep(100 * 1000);
+        BOOST_CHECK(res.count == 0);
+
+        db_wal_append(wal, 0, (uint8_t *)"key1", 4, (uint8_t *)"val1", 4);
+        usleep(200 * 1000);
+        BOOST_CHECK(res.count == 1);
+        BOOST_CHECK(file_size(DB_WAL_NAME) == 0);
+
+        db_wal_release(wal);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
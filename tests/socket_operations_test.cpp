@@ -31,7 +31,7 @@ void *server_thread(void *args)
 
         sd = socket(AF_UNIX, SOCK_STREAM, 0);
         if (sd == -1) {
-                BOOST_MESSAGE("Create socket error");
+                BOOST_TEST_MESSAGE("Create socket error");
                 goto exit_on_fail;
         }
 
@@ -39,19 +39,19 @@ void *server_thread(void *args)
         addr.sun_family = AF_UNIX;
         strncpy(addr.sun_path, DB_SOCKET_NAME, sizeof(addr.sun_path)-1);
         if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-                BOOST_MESSAGE("Bind server socket error");
+                BOOST_TEST_MESSAGE("Bind server socket error");
                 goto exit_on_fail;
         }
 
         if (listen(sd, 1) != 0) {
-                BOOST_MESSAGE("Listen server socket error");
+                BOOST_TEST_MESSAGE("Listen server socket error");
                 goto exit_on_fail;
         }
 
         memset(&msg, 0, sizeof(msg));
         msg.sd = accept(sd, NULL, NULL);
         if (msg.sd == -1) {
-                BOOST_MESSAGE("Accept socket error");
+                BOOST_TEST_MESSAGE("Accept socket error");
                 goto exit_on_fail;
         }
 
@@ -74,7 +74,7 @@ void *client_thread(void *args)
 
         msg->sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
         if (msg->sd == -1) {
-                BOOST_MESSAGE("Opening stream socket error");
+                BOOST_TEST_MESSAGE("Opening stream socket error");
                 return NULL;
         }
 
@@ -83,7 +83,7 @@ void *client_thread(void *args)
         strcpy(server_addr_un.sun_path, DB_SOCKET_NAME);
 
         if (connect(msg->sd, server_addr, sizeof(struct sockaddr_un)) == -1) {
-                BOOST_MESSAGE("Connecting stream socket error");
+                BOOST_TEST_MESSAGE("Connecting stream socket error");
                 close(msg->sd);
                 return NULL;
         }
@@ -139,7 +139,7 @@ BOOST_AUTO_TEST_CASE(socket_small_data_test)
         pthread_join(client, NULL);
         pthread_join(server, NULL);
 
-        BOOST_MESSAGE("All thread joined.");
+        BOOST_TEST_MESSAGE("All thread joined.");
         BOOST_CHECK(client_msg.cmd.type == server_msg.cmd.type);
         BOOST_CHECK(client_msg.cmd.key_size == server_msg.cmd.key_size);
         BOOST_CHECK(client_msg.cmd.val_size == server_msg.cmd.val_size);
@@ -209,7 +209,7 @@ BOOST_AUTO_TEST_CASE(socket_big_data_test)
         pthread_join(client, NULL);
         pthread_join(server, NULL);
 
-        BOOST_MESSAGE("All thread joined.");
+        BOOST_TEST_MESSAGE("All thread joined.");
 
         BOOST_CHECK(client_msg.cmd.type == server_msg.cmd.type);
         BOOST_CHECK(client_msg.cmd.key_size == server_msg.cmd.key_size);